@@ -0,0 +1,179 @@
+// ラスタライザの速度を測るためのベンチマーク
+// python/objects/以下のメッシュを読み込み、解像度とバッチサイズを変えながら
+// forward_face_index_mapとbackward_silhouetteの実行時間を測定する
+// 結果は1行に1つのJSONとして標準出力に書き出す
+//
+// ./benchmark [--objects DIR] [--repeat N] [--num-threads N] [--simd scalar|avx2|avx512]
+#include "../core/projection.h"
+#include "../core/rasterize.h"
+#include "../core/rasterize_row.h"
+#include "../core/thread_pool.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct Mesh {
+    std::vector<float> vertices;
+    std::vector<int> faces;
+    int num_vertices;
+    int num_faces;
+};
+
+// objects.pyのloadと同じ形式
+Mesh load_mesh(const std::string& directory)
+{
+    Mesh mesh;
+    std::ifstream vertices_file(directory + "/vertices");
+    std::ifstream faces_file(directory + "/faces");
+    if (!vertices_file || !faces_file) {
+        throw std::runtime_error("could not open " + directory);
+    }
+    std::string line;
+    while (std::getline(vertices_file, line)) {
+        std::istringstream stream(line);
+        float x, y, z;
+        if (stream >> x >> y >> z) {
+            mesh.vertices.insert(mesh.vertices.end(), { x, y, z });
+        }
+    }
+    while (std::getline(faces_file, line)) {
+        std::istringstream stream(line);
+        float a, b, c;
+        if (stream >> a >> b >> c) {
+            mesh.faces.insert(mesh.faces.end(), { (int)a, (int)b, (int)c });
+        }
+    }
+    mesh.num_vertices = mesh.vertices.size() / 3;
+    mesh.num_faces = mesh.faces.size() / 3;
+    return mesh;
+}
+
+// 秒単位の測定値の中央値とp95
+void summarize(std::vector<double> seconds, double& median, double& p95)
+{
+    std::sort(seconds.begin(), seconds.end());
+    int n = seconds.size();
+    median = (n % 2 == 1) ? seconds[n / 2] : (seconds[n / 2 - 1] + seconds[n / 2]) / 2.0;
+    p95 = seconds[std::min(n - 1, (int)std::ceil(0.95 * n) - 1)];
+}
+
+void print_result(const std::string& name, const Mesh& mesh, const char* pass, int batch_size, int image_size, const std::vector<double>& seconds)
+{
+    double median, p95;
+    summarize(seconds, median, p95);
+    double num_pixels = (double)batch_size * image_size * image_size;
+    double num_faces = (double)batch_size * mesh.num_faces;
+    printf("{\"mesh\": \"%s\", \"num_faces\": %d, \"pass\": \"%s\", \"batch_size\": %d, \"image_size\": %d, \"num_threads\": %d, \"simd\": \"%s\", "
+           "\"repeat\": %d, \"median_ms\": %.4f, \"p95_ms\": %.4f, \"pixels_per_second\": %.1f, \"faces_per_second\": %.1f}\n",
+        name.c_str(), mesh.num_faces, pass, batch_size, image_size, gme::get_num_threads(), gme::get_simd_instruction_set().c_str(),
+        (int)seconds.size(), median * 1e3, p95 * 1e3, num_pixels / median, num_faces / median);
+    fflush(stdout);
+}
+
+double elapsed_seconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv)
+{
+    std::string objects_directory = "python/objects";
+    int num_repeats = 20;
+    int num_threads = 0;
+    std::string simd_instruction_set = "";
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--objects") == 0 && i + 1 < argc) {
+            objects_directory = argv[++i];
+        } else if (std::strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            num_repeats = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--num-threads") == 0 && i + 1 < argc) {
+            num_threads = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--simd") == 0 && i + 1 < argc) {
+            simd_instruction_set = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--objects DIR] [--repeat N] [--num-threads N] [--simd scalar|avx2|avx512]\n", argv[0]);
+            return 1;
+        }
+    }
+    gme::set_num_threads(num_threads);
+    try {
+        gme::set_simd_instruction_set(simd_instruction_set);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    const char* mesh_names[] = { "triangle", "cube", "polyhedron", "sphere", "teapot", "bunny" };
+    const int image_sizes[] = { 64, 128, 256, 512 };
+    const int batch_sizes[] = { 1, 4 };
+    // run.pyと同じ視点
+    gme::Projection projection = gme::compute_projection(2, -30, -45, 45, 5, 0);
+
+    for (const char* name : mesh_names) {
+        Mesh mesh = load_mesh(objects_directory + "/" + name + ".obj");
+        for (int batch_size : batch_sizes) {
+            std::vector<float> vertices;
+            std::vector<int> faces;
+            for (int batch_index = 0; batch_index < batch_size; batch_index++) {
+                vertices.insert(vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+                faces.insert(faces.end(), mesh.faces.begin(), mesh.faces.end());
+            }
+            std::vector<float> face_vertices(batch_size * mesh.num_faces * 9);
+            gme::forward_project_faces(vertices.data(), faces.data(), face_vertices.data(), batch_size, mesh.num_vertices, mesh.num_faces, projection);
+
+            for (int image_size : image_sizes) {
+                int num_pixels = batch_size * image_size * image_size;
+                std::vector<int> face_index_map(num_pixels);
+                std::vector<float> depth_map(num_pixels);
+                std::vector<int> silhouette_image(num_pixels);
+                std::vector<float> grad_silhouette(num_pixels);
+                std::vector<float> grad_vertices(vertices.size());
+                std::vector<float> debug_grad_map(num_pixels);
+
+                // 1回目は計測しない
+                std::vector<double> seconds;
+                for (int n = 0; n <= num_repeats; n++) {
+                    std::fill(face_index_map.begin(), face_index_map.end(), -1);
+                    std::fill(silhouette_image.begin(), silhouette_image.end(), 0);
+                    auto start = std::chrono::steady_clock::now();
+                    gme::forward_face_index_map(face_vertices.data(), face_index_map.data(), depth_map.data(), silhouette_image.data(),
+                        batch_size, mesh.num_faces, image_size, image_size);
+                    if (n > 0) {
+                        seconds.push_back(elapsed_seconds(start));
+                    }
+                }
+                print_result(name, mesh, "forward", batch_size, image_size, seconds);
+
+                // run.pyと同じ正方形の目標との差
+                for (int pixel_index = 0; pixel_index < num_pixels; pixel_index++) {
+                    int yi = (pixel_index / image_size) % image_size;
+                    int xi = pixel_index % image_size;
+                    bool inside = yi >= 30 * image_size / 256 && yi < 225 * image_size / 256 && xi >= 30 * image_size / 256 && xi < 225 * image_size / 256;
+                    grad_silhouette[pixel_index] = (silhouette_image[pixel_index] - (inside ? 255.0f : 0.0f)) / 255.0f;
+                }
+                seconds.clear();
+                for (int n = 0; n <= num_repeats; n++) {
+                    std::fill(grad_vertices.begin(), grad_vertices.end(), 0.0f);
+                    std::fill(debug_grad_map.begin(), debug_grad_map.end(), 0.0f);
+                    auto start = std::chrono::steady_clock::now();
+                    gme::backward_silhouette(faces.data(), face_vertices.data(), face_index_map.data(), silhouette_image.data(),
+                        grad_vertices.data(), grad_silhouette.data(), debug_grad_map.data(),
+                        batch_size, mesh.num_faces, mesh.num_vertices, image_size, image_size, false);
+                    if (n > 0) {
+                        seconds.push_back(elapsed_seconds(start));
+                    }
+                }
+                print_result(name, mesh, "backward", batch_size, image_size, seconds);
+            }
+        }
+    }
+    return 0;
+}
\ No newline at end of file
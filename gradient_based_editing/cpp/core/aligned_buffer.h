@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+
+namespace gme {
+// 先頭をAlignmentバイト境界に揃えた配列
+// 要素は初期化しないので使う側で埋める
+template <typename T, int Alignment = 64>
+class AlignedBuffer {
+private:
+    std::unique_ptr<char[]> _storage;
+    T* _data;
+    int _size;
+
+public:
+    AlignedBuffer()
+    {
+        _data = nullptr;
+        _size = 0;
+    }
+    void resize(int size)
+    {
+        _storage.reset(new char[sizeof(T) * size + Alignment]);
+        std::uintptr_t address = reinterpret_cast<std::uintptr_t>(_storage.get());
+        _data = reinterpret_cast<T*>((address + Alignment - 1) & ~(std::uintptr_t)(Alignment - 1));
+        _size = size;
+    }
+    T* data() const
+    {
+        return _data;
+    }
+    int size() const
+    {
+        return _size;
+    }
+};
+}
\ No newline at end of file
@@ -0,0 +1,67 @@
+#pragma once
+#include <cstddef>
+#include <sys/types.h>
+
+namespace gme {
+// 画像などの2次元配列への参照
+template <typename T>
+class ArrayView2 {
+private:
+    T* _data;
+    int _width;
+
+public:
+    ArrayView2(T* data, int width)
+    {
+        _data = data;
+        _width = width;
+    }
+    T& operator()(int y, int x) const
+    {
+        return _data[(ssize_t)y * _width + x];
+    }
+};
+
+// バッチなどの3次元配列への参照
+template <typename T>
+class ArrayView3 {
+private:
+    T* _data;
+    int _height;
+    int _width;
+
+public:
+    ArrayView3(T* data, int height, int width)
+    {
+        _data = data;
+        _height = height;
+        _width = width;
+    }
+    T& operator()(int b, int y, int x) const
+    {
+        return _data[((ssize_t)b * _height + y) * _width + x];
+    }
+};
+// 面の頂点などの4次元配列への参照
+template <typename T>
+class ArrayView4 {
+private:
+    T* _data;
+    int _dim_1;
+    int _dim_2;
+    int _dim_3;
+
+public:
+    ArrayView4(T* data, int dim_1, int dim_2, int dim_3)
+    {
+        _data = data;
+        _dim_1 = dim_1;
+        _dim_2 = dim_2;
+        _dim_3 = dim_3;
+    }
+    T& operator()(int i, int j, int k, int l) const
+    {
+        return _data[(((ssize_t)i * _dim_1 + j) * _dim_2 + k) * _dim_3 + l];
+    }
+};
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+
+namespace gme {
+// [0, size - 1] -> [-1, 1]
+inline float to_projected_coordinate(int p, int size)
+{
+    return 2.0 * (p / (float)(size - 1) - 0.5);
+}
+
+// [-1, 1] -> [0, size - 1]
+inline int to_image_coordinate(float p, int size)
+{
+    return std::min(std::max((int)std::round((p + 1.0f) * 0.5f * (size - 1)), 0), size - 1);
+}
+
+// [pf_min, pf_max] \in [-1, 1] を含む画素の範囲 [pi_start, pi_end] を求める
+// 丸め誤差で境界上の画素を取りこぼさないよう両側に1画素ずつ余裕を持たせる
+// NaNが含まれる場合は画像全体を返す
+inline void to_image_range(float pf_min, float pf_max, int size, int& pi_start, int& pi_end)
+{
+    float pi_min = std::floor((pf_min + 1.0f) * 0.5f * (size - 1)) - 1.0f;
+    float pi_max = std::ceil((pf_max + 1.0f) * 0.5f * (size - 1)) + 1.0f;
+    pi_start = (pi_min > 0.0f) ? (int)std::min(pi_min, (float)size) : 0;
+    pi_end = (pi_max < size - 1) ? (int)std::max(pi_max, -1.0f) : size - 1;
+}
+}
\ No newline at end of file
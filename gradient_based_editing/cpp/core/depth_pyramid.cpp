@@ -0,0 +1,131 @@
+#include "depth_pyramid.h"
+#include <algorithm>
+
+namespace gme {
+DepthPyramid::DepthPyramid()
+{
+    reset(0, 0, false);
+}
+void DepthPyramid::reset(int height, int width, bool adaptive)
+{
+    _height = height;
+    _width = width;
+    _num_blocks_y = (height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    _num_blocks_x = (width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    _block_max_depths.assign(_num_blocks_y * _num_blocks_x, 1.0f);
+    _block_dirty.assign(_num_blocks_y * _num_blocks_x, 0);
+    _dirty = false;
+    _max_depth = 1.0f;
+    _adaptive = adaptive;
+    _num_tests = 0;
+    _num_occluded = 0;
+    _num_skipped_faces = 0;
+}
+void DepthPyramid::update_block(const float* depth_map, int stride, int block_index)
+{
+    int xi_start = (block_index % _num_blocks_x) * BLOCK_SIZE;
+    int yi_start = (block_index / _num_blocks_x) * BLOCK_SIZE;
+    int xi_end = std::min(xi_start + BLOCK_SIZE, _width);
+    int yi_end = std::min(yi_start + BLOCK_SIZE, _height);
+    float max_depth = 0.0f;
+    if (xi_end - xi_start == BLOCK_SIZE) {
+        // 列ごとの最大値を求めてから集約するとSIMD命令になる
+        float column_max_depths[BLOCK_SIZE] = {};
+        for (int yi = yi_start; yi < yi_end; yi++) {
+            const float* depth_row = depth_map + yi * stride + xi_start;
+            for (int k = 0; k < BLOCK_SIZE; k++) {
+                column_max_depths[k] = std::max(column_max_depths[k], depth_row[k]);
+            }
+        }
+        for (int k = 0; k < BLOCK_SIZE; k++) {
+            max_depth = std::max(max_depth, column_max_depths[k]);
+        }
+    } else {
+        for (int yi = yi_start; yi < yi_end; yi++) {
+            const float* depth_row = depth_map + yi * stride;
+            for (int xi = xi_start; xi < xi_end; xi++) {
+                max_depth = std::max(max_depth, depth_row[xi]);
+            }
+        }
+    }
+    _block_max_depths[block_index] = max_depth;
+    _block_dirty[block_index] = 0;
+}
+bool DepthPyramid::occluded(const float* depth_map, int stride, int xi_start, int xi_end, int yi_start, int yi_end, float z)
+{
+    if (_num_skipped_faces > 0) {
+        _num_skipped_faces--;
+        if (_num_skipped_faces == 0) {
+            // 判定しない間に描画された範囲が分からないので全て求め直す
+            std::fill(_block_dirty.begin(), _block_dirty.end(), 1);
+            _dirty = true;
+        }
+        return false;
+    }
+    bool result = test(depth_map, stride, xi_start, xi_end, yi_start, yi_end, z);
+    if (_adaptive) {
+        _num_tests++;
+        _num_occluded += result ? 1 : 0;
+        if (_num_tests == NUM_SAMPLE_TESTS) {
+            // 省けた面が1/8未満ならしばらく判定しない
+            if (_num_occluded * 8 < _num_tests) {
+                _num_skipped_faces = NUM_SKIPPED_FACES;
+            }
+            _num_tests = 0;
+            _num_occluded = 0;
+        }
+    }
+    return result;
+}
+bool DepthPyramid::test(const float* depth_map, int stride, int xi_start, int xi_end, int yi_start, int yi_end, float z)
+{
+    // 領域全体で判定できる場合はブロックを見ない
+    if (z > _max_depth) {
+        return true;
+    }
+    // zが等しい場合は面番号の小さい面が優先されるので省けない
+    for (int by = yi_start / BLOCK_SIZE; by <= yi_end / BLOCK_SIZE; by++) {
+        for (int bx = xi_start / BLOCK_SIZE; bx <= xi_end / BLOCK_SIZE; bx++) {
+            int block_index = by * _num_blocks_x + bx;
+            if (z > _block_max_depths[block_index]) {
+                continue;
+            }
+            if (_block_dirty[block_index] == 0) {
+                return false;
+            }
+            update_block(depth_map, stride, block_index);
+            if (z > _block_max_depths[block_index]) {
+                continue;
+            }
+            return false;
+        }
+    }
+    return true;
+}
+void DepthPyramid::mark(int xi_start, int xi_end, int yi_start, int yi_end)
+{
+    if (_num_skipped_faces > 0) {
+        return;
+    }
+    for (int by = yi_start / BLOCK_SIZE; by <= yi_end / BLOCK_SIZE; by++) {
+        for (int bx = xi_start / BLOCK_SIZE; bx <= xi_end / BLOCK_SIZE; bx++) {
+            _block_dirty[by * _num_blocks_x + bx] = 1;
+        }
+    }
+    _dirty = true;
+}
+float DepthPyramid::max_depth(const float* depth_map, int stride)
+{
+    if (_dirty) {
+        _max_depth = 0.0f;
+        for (int block_index = 0; block_index < _num_blocks_y * _num_blocks_x; block_index++) {
+            if (_block_dirty[block_index] != 0) {
+                update_block(depth_map, stride, block_index);
+            }
+            _max_depth = std::max(_max_depth, _block_max_depths[block_index]);
+        }
+        _dirty = false;
+    }
+    return _max_depth;
+}
+}
\ No newline at end of file
@@ -0,0 +1,46 @@
+#pragma once
+#include <vector>
+
+namespace gme {
+// 深度バッファの矩形領域の粗い階層
+// 領域をBLOCK_SIZE x BLOCK_SIZE画素のブロックに分け、ブロックごとと領域全体の最も遠い深度を持つ
+// 面を描画する前に、面の最も手前のzがその矩形と重なるブロックの最も遠い深度より奥にあれば面ごと省ける
+// 深度は描画するたびに手前にしか変わらないので、描画した範囲は印を付けるだけにして必要になった時に求め直す
+// 古い値は実際の値以上なので、求め直す前の値で省いても結果は変わらない
+// 面がほとんど重ならないメッシュでは判定の分だけ遅くなるので、adaptive = trueなら
+// NUM_SAMPLE_TESTS回の判定で省けた面が少なければ、次のNUM_SKIPPED_FACES面は判定しない
+// 判定しない間は印も付けないが、全てのブロックを求め直す必要がある状態にしてから判定を再開する
+class DepthPyramid {
+private:
+    int _height;
+    int _width;
+    int _num_blocks_y;
+    int _num_blocks_x;
+    std::vector<float> _block_max_depths;
+    std::vector<char> _block_dirty;
+    bool _dirty;
+    float _max_depth;
+    bool _adaptive;
+    int _num_tests;
+    int _num_occluded;
+    int _num_skipped_faces;
+    void update_block(const float* depth_map, int stride, int block_index);
+    bool test(const float* depth_map, int stride, int xi_start, int xi_end, int yi_start, int yi_end, float z);
+
+public:
+    static const int BLOCK_SIZE = 8;
+    static const int NUM_SAMPLE_TESTS = 64;
+    static const int NUM_SKIPPED_FACES = 512;
+    DepthPyramid();
+    // height x widthの領域の深度を全て1にした状態にする
+    void reset(int height, int width, bool adaptive);
+    // 領域内の矩形[xi_start, xi_end] x [yi_start, yi_end]の全ての画素の深度がzより手前ならtrue
+    // 判定しない間は常にfalse
+    // depth_mapは領域の左上の画素を指し、strideは1行の画素数
+    bool occluded(const float* depth_map, int stride, int xi_start, int xi_end, int yi_start, int yi_end, float z);
+    // 矩形内の深度を書き換えたことを記録する
+    void mark(int xi_start, int xi_end, int yi_start, int yi_end);
+    // 領域全体の最も遠い深度
+    float max_depth(const float* depth_map, int stride);
+};
+}
\ No newline at end of file
@@ -0,0 +1,347 @@
+#include "face_bvh.h"
+#include "array_view.h"
+#include "coordinate.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+
+namespace gme {
+FaceBVH::FaceBVH(int batch_size, int num_faces, int image_height, int image_width)
+{
+    if (batch_size <= 0) {
+        throw std::runtime_error("(batch_size > 0) -> false");
+    }
+    if (num_faces <= 0) {
+        throw std::runtime_error("(num_faces > 0) -> false");
+    }
+    if (image_height <= 0) {
+        throw std::runtime_error("(image_height > 0) -> false");
+    }
+    if (image_width <= 0) {
+        throw std::runtime_error("(image_width > 0) -> false");
+    }
+    _batch_size = batch_size;
+    _num_faces = num_faces;
+    _image_height = image_height;
+    _image_width = image_width;
+    _built = false;
+    _nodes.resize(batch_size);
+    _face_indices.resize(batch_size);
+    _triangle_setups.resize(batch_size);
+    _leaf_triangle_setups.resize(batch_size);
+    // 各列のx座標
+    // xi \in [0, image_width] -> xf \in [-1, 1]
+    _xf_table.resize(image_width);
+    for (int xi = 0; xi < image_width; xi++) {
+        _xf_table[xi] = to_projected_coordinate(xi, image_width);
+    }
+}
+int FaceBVH::build_node(int batch_index, const std::vector<float>& centroids, int begin, int end)
+{
+    std::vector<Node>& nodes = _nodes[batch_index];
+    std::vector<int>& face_indices = _face_indices[batch_index];
+    int node_index = nodes.size();
+    nodes.push_back(Node());
+    if (end - begin <= MAX_FACES_PER_LEAF) {
+        nodes[node_index].first = begin;
+        nodes[node_index].count = end - begin;
+        return node_index;
+    }
+    // 重心の広がりが大きい方の軸について、重心の中央値で2つに分ける
+    float x_min = centroids[face_indices[begin] * 2 + 0];
+    float x_max = x_min;
+    float y_min = centroids[face_indices[begin] * 2 + 1];
+    float y_max = y_min;
+    for (int k = begin + 1; k < end; k++) {
+        x_min = std::min(x_min, centroids[face_indices[k] * 2 + 0]);
+        x_max = std::max(x_max, centroids[face_indices[k] * 2 + 0]);
+        y_min = std::min(y_min, centroids[face_indices[k] * 2 + 1]);
+        y_max = std::max(y_max, centroids[face_indices[k] * 2 + 1]);
+    }
+    int axis = (x_max - x_min >= y_max - y_min) ? 0 : 1;
+    int middle = (begin + end) / 2;
+    std::nth_element(face_indices.begin() + begin, face_indices.begin() + middle, face_indices.begin() + end, [&](int a, int b) {
+        return centroids[a * 2 + axis] < centroids[b * 2 + axis];
+    });
+    build_node(batch_index, centroids, begin, middle);
+    int right_node_index = build_node(batch_index, centroids, middle, end);
+    nodes[node_index].first = right_node_index;
+    nodes[node_index].count = 0;
+    return node_index;
+}
+void FaceBVH::refit_nodes(int batch_index)
+{
+    std::vector<Node>& nodes = _nodes[batch_index];
+    const TriangleSetupTable& setup = _leaf_triangle_setups[batch_index];
+    // 子は親より後ろにあるので逆順に求めれば子が先に決まる
+    for (int node_index = nodes.size() - 1; node_index >= 0; node_index--) {
+        Node& node = nodes[node_index];
+        // 空の矩形から始める
+        // z_nearは深度の最大値1より大きくしておけば、面のないノードはたどらない
+        node.xi_start = _image_width;
+        node.xi_end = -1;
+        node.yi_start = _image_height;
+        node.yi_end = -1;
+        node.z_near = 2.0f;
+        if (node.count > 0) {
+            for (int k = node.first; k < node.first + node.count; k++) {
+                // 裏面と画像の外にある面は矩形が空になっている
+                if (setup.visible(k) == false) {
+                    continue;
+                }
+                node.xi_start = std::min(node.xi_start, setup.xi_start(k));
+                node.xi_end = std::max(node.xi_end, setup.xi_end(k));
+                node.yi_start = std::min(node.yi_start, setup.yi_start(k));
+                node.yi_end = std::max(node.yi_end, setup.yi_end(k));
+                node.z_near = std::min(node.z_near, setup.z_near(k));
+            }
+            continue;
+        }
+        for (const Node* child : { &nodes[node_index + 1], &nodes[node.first] }) {
+            node.xi_start = std::min(node.xi_start, child->xi_start);
+            node.xi_end = std::max(node.xi_end, child->xi_end);
+            node.yi_start = std::min(node.yi_start, child->yi_start);
+            node.yi_end = std::max(node.yi_end, child->yi_end);
+            node.z_near = std::min(node.z_near, child->z_near);
+        }
+    }
+}
+void FaceBVH::query_pixel(int batch_index, int xi, int yi, int& face_index, float& depth) const
+{
+    const std::vector<Node>& nodes = _nodes[batch_index];
+    const std::vector<int>& face_indices = _face_indices[batch_index];
+    const TriangleSetupTable& setup = _leaf_triangle_setups[batch_index];
+    float xf = _xf_table[xi];
+    // yi \in [0, image_height] -> yf \in [-1, 1]
+    float yf = -to_projected_coordinate(yi, _image_height);
+    face_index = -1;
+    depth = 1.0f;
+
+    // 木の深さは面の数の対数程度なので固定長で足りる
+    int stack[64];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0) {
+        int node_index = stack[--stack_size];
+        const Node& node = nodes[node_index];
+        // 画素を含まないノードと、見つかった面より奥にしか面がないノードはたどらない
+        // zが等しい面は面番号によっては優先されるので、z_nearが深度と等しいノードはたどる
+        if (xi < node.xi_start || xi > node.xi_end || yi < node.yi_start || yi > node.yi_end || node.z_near > depth) {
+            continue;
+        }
+        if (node.count == 0) {
+            // z_nearが小さい方の子を先にたどる
+            int near_node_index = node_index + 1;
+            int far_node_index = node.first;
+            if (nodes[far_node_index].z_near < nodes[near_node_index].z_near) {
+                std::swap(near_node_index, far_node_index);
+            }
+            stack[stack_size++] = far_node_index;
+            stack[stack_size++] = near_node_index;
+            continue;
+        }
+        for (int k = node.first; k < node.first + node.count; k++) {
+            // ラスタライズする場合と同じく面を囲む矩形の内側の画素だけを判定する
+            if (xi < setup.xi_start(k) || xi > setup.xi_end(k) || yi < setup.yi_start(k) || yi > setup.yi_end(k)) {
+                continue;
+            }
+            FaceVertices face = setup.face(k);
+            // y座標が面の外部ならスキップ
+            if ((yf > face.yf_1 && yf > face.yf_2 && yf > face.yf_3) || (yf < face.yf_1 && yf < face.yf_2 && yf < face.yf_3)) {
+                continue;
+            }
+            float z_face;
+            if (compute_z_face(xf, yf, face, z_face) == false) {
+                continue;
+            }
+            // zが等しい場合は面番号が小さい方を優先する
+            int candidate_face_index = face_indices[k];
+            if (z_face < depth || (z_face == depth && depth < 1.0f && candidate_face_index < face_index)) {
+                depth = z_face;
+                face_index = candidate_face_index;
+            }
+        }
+    }
+}
+void FaceBVH::build(py::array_t<float, py::array::c_style> np_face_vertices)
+{
+    if (np_face_vertices.ndim() != 4) {
+        throw std::runtime_error("(np_face_vertices.ndim() != 4) -> false");
+    }
+    if (np_face_vertices.shape(0) != _batch_size || np_face_vertices.shape(1) != _num_faces || np_face_vertices.shape(2) != 3 || np_face_vertices.shape(3) != 3) {
+        throw std::runtime_error("`np_face_vertices.shape` must be equal to `(batch_size, num_faces, 3, 3)`.");
+    }
+    const float* face_vertices_data = np_face_vertices.data();
+
+    py::gil_scoped_release release;
+    build(face_vertices_data);
+}
+void FaceBVH::refit(py::array_t<float, py::array::c_style> np_face_vertices)
+{
+    if (np_face_vertices.ndim() != 4) {
+        throw std::runtime_error("(np_face_vertices.ndim() != 4) -> false");
+    }
+    if (np_face_vertices.shape(0) != _batch_size || np_face_vertices.shape(1) != _num_faces || np_face_vertices.shape(2) != 3 || np_face_vertices.shape(3) != 3) {
+        throw std::runtime_error("`np_face_vertices.shape` must be equal to `(batch_size, num_faces, 3, 3)`.");
+    }
+    const float* face_vertices_data = np_face_vertices.data();
+
+    py::gil_scoped_release release;
+    refit(face_vertices_data);
+}
+void FaceBVH::forward(
+    py::array_t<int, py::array::c_style> np_face_index_map,
+    py::array_t<float, py::array::c_style> np_depth_map,
+    py::array_t<int, py::array::c_style> np_silhouette_image)
+{
+    if (np_face_index_map.ndim() != 3) {
+        throw std::runtime_error("(np_face_index_map.ndim() != 3) -> false");
+    }
+    if (np_depth_map.ndim() != 3) {
+        throw std::runtime_error("(np_depth_map.ndim() != 3) -> false");
+    }
+    if (np_silhouette_image.ndim() != 3) {
+        throw std::runtime_error("(np_silhouette_image.ndim() != 3) -> false");
+    }
+    for (int dim = 0; dim < 3; dim++) {
+        int size = (dim == 0) ? _batch_size : (dim == 1) ? _image_height : _image_width;
+        if (np_face_index_map.shape(dim) != size || np_depth_map.shape(dim) != size || np_silhouette_image.shape(dim) != size) {
+            throw std::runtime_error("`np_face_index_map.shape`, `np_depth_map.shape` and `np_silhouette_image.shape` must be equal to `(batch_size, image_height, image_width)`.");
+        }
+    }
+    int* face_index_map_data = np_face_index_map.mutable_data();
+    float* depth_map_data = np_depth_map.mutable_data();
+    int* silhouette_image_data = np_silhouette_image.mutable_data();
+
+    py::gil_scoped_release release;
+    forward(face_index_map_data, depth_map_data, silhouette_image_data);
+}
+void FaceBVH::query(
+    py::array_t<int, py::array::c_style> np_pixel_indices,
+    py::array_t<int, py::array::c_style> np_face_indices,
+    py::array_t<float, py::array::c_style> np_depths)
+{
+    if (np_pixel_indices.ndim() != 2) {
+        throw std::runtime_error("(np_pixel_indices.ndim() != 2) -> false");
+    }
+    if (np_pixel_indices.shape(0) != _batch_size) {
+        throw std::runtime_error("`np_pixel_indices.shape[0]` must be equal to `batch_size`.");
+    }
+    int num_queries = np_pixel_indices.shape(1);
+    if (np_face_indices.ndim() != 2 || np_face_indices.shape(0) != _batch_size || np_face_indices.shape(1) != num_queries) {
+        throw std::runtime_error("`np_face_indices.shape` must be equal to `np_pixel_indices.shape`.");
+    }
+    if (np_depths.ndim() != 2 || np_depths.shape(0) != _batch_size || np_depths.shape(1) != num_queries) {
+        throw std::runtime_error("`np_depths.shape` must be equal to `np_pixel_indices.shape`.");
+    }
+    const int* pixel_indices_data = np_pixel_indices.data();
+    for (int k = 0; k < _batch_size * num_queries; k++) {
+        if (pixel_indices_data[k] < 0 || pixel_indices_data[k] >= _image_height * _image_width) {
+            throw std::runtime_error("`np_pixel_indices` must be in [0, image_height * image_width).");
+        }
+    }
+    int* face_indices_data = np_face_indices.mutable_data();
+    float* depths_data = np_depths.mutable_data();
+
+    py::gil_scoped_release release;
+    query(pixel_indices_data, num_queries, face_indices_data, depths_data);
+}
+void FaceBVH::build(const float* face_vertices)
+{
+    build_triangle_setups(face_vertices, _triangle_setups.data(), _batch_size, _num_faces, _image_height, _image_width, false);
+    get_thread_pool()->parallel_for(_batch_size, [&](int batch_index, int thread_index) {
+        // 分割に使う面の重心
+        // NaNがあると並べ替えられないので0にしておく
+        const float* vertices = face_vertices + batch_index * _num_faces * 9;
+        std::vector<float> centroids(_num_faces * 2);
+        for (int face_index = 0; face_index < _num_faces; face_index++) {
+            const float* v = vertices + face_index * 9;
+            float xf = (v[0] + v[3] + v[6]) / 3.0f;
+            float yf = (v[1] + v[4] + v[7]) / 3.0f;
+            centroids[face_index * 2 + 0] = std::isfinite(xf) ? xf : 0.0f;
+            centroids[face_index * 2 + 1] = std::isfinite(yf) ? yf : 0.0f;
+        }
+        // 裏面や画像の外にある面も、refitの後に見えるようになるかもしれないので木に含める
+        std::vector<int>& face_indices = _face_indices[batch_index];
+        face_indices.resize(_num_faces);
+        std::iota(face_indices.begin(), face_indices.end(), 0);
+        _nodes[batch_index].clear();
+        build_node(batch_index, centroids, 0, _num_faces);
+        _leaf_triangle_setups[batch_index].gather(_triangle_setups[batch_index], face_indices);
+        refit_nodes(batch_index);
+    });
+    _built = true;
+}
+void FaceBVH::refit(const float* face_vertices)
+{
+    if (_built == false) {
+        build(face_vertices);
+        return;
+    }
+    build_triangle_setups(face_vertices, _triangle_setups.data(), _batch_size, _num_faces, _image_height, _image_width, false);
+    get_thread_pool()->parallel_for(_batch_size, [&](int batch_index, int thread_index) {
+        _leaf_triangle_setups[batch_index].gather(_triangle_setups[batch_index], _face_indices[batch_index]);
+        refit_nodes(batch_index);
+    });
+}
+void FaceBVH::forward(int* face_index_map_data, float* depth_map_data, int* silhouette_image_data) const
+{
+    if (_built == false) {
+        throw std::runtime_error("build must be called before forward.");
+    }
+    ArrayView3<float> depth_map(depth_map_data, _image_height, _image_width);
+    ArrayView3<int> face_index_map(face_index_map_data, _image_height, _image_width);
+    ArrayView3<int> silhouette_image(silhouette_image_data, _image_height, _image_width);
+
+    // バッチと行の組ごとに並列に処理する
+    get_thread_pool()->parallel_for(_batch_size * _image_height, [&](int task_index, int thread_index) {
+        int batch_index = task_index / _image_height;
+        int yi = task_index % _image_height;
+        for (int xi = 0; xi < _image_width; xi++) {
+            int face_index;
+            float depth;
+            query_pixel(batch_index, xi, yi, face_index, depth);
+            depth_map(batch_index, yi, xi) = depth;
+            if (face_index != -1) {
+                face_index_map(batch_index, yi, xi) = face_index;
+                silhouette_image(batch_index, yi, xi) = 255;
+            }
+        }
+    });
+}
+void FaceBVH::query(const int* pixel_indices, int num_queries, int* face_indices, float* depths) const
+{
+    if (_built == false) {
+        throw std::runtime_error("build must be called before query.");
+    }
+    const int num_queries_per_task = 1024;
+    int num_tasks = std::max((num_queries + num_queries_per_task - 1) / num_queries_per_task, 1);
+    get_thread_pool()->parallel_for(_batch_size * num_tasks, [&](int task_index, int thread_index) {
+        int batch_index = task_index / num_tasks;
+        int query_start = (task_index % num_tasks) * num_queries_per_task;
+        int query_end = std::min(query_start + num_queries_per_task, num_queries);
+        for (int query_index = query_start; query_index < query_end; query_index++) {
+            int k = batch_index * num_queries + query_index;
+            query_pixel(batch_index, pixel_indices[k] % _image_width, pixel_indices[k] / _image_width, face_indices[k], depths[k]);
+        }
+    });
+}
+int FaceBVH::batch_size()
+{
+    return _batch_size;
+}
+int FaceBVH::num_faces()
+{
+    return _num_faces;
+}
+int FaceBVH::image_height()
+{
+    return _image_height;
+}
+int FaceBVH::image_width()
+{
+    return _image_width;
+}
+}
\ No newline at end of file
@@ -0,0 +1,75 @@
+#pragma once
+#include "triangle_setup.h"
+#include <pybind11/numpy.h>
+#include <vector>
+
+namespace gme {
+namespace py = pybind11;
+// 投影後の面を囲む画素の矩形についての2次元のBVH
+// 画素ごとに木をたどり、その画素を含む面だけを判定して最前面を求める
+// 面の数が多い場合や一部の画素だけを調べたい場合に、全ての面をラスタライズせずに済む
+// 各画素で判定する面と判定の式はforward_face_index_mapと同じなので、結果も完全に一致する
+class FaceBVH {
+private:
+    // count > 0なら葉で、葉の順に並べた面のうち[first, first + count)を持つ
+    // count == 0なら内部ノードで、子はこのノードの次とfirst
+    struct Node {
+        int xi_start;
+        int xi_end;
+        int yi_start;
+        int yi_end;
+        // 部分木の面のz_nearの最小値
+        float z_near;
+        int first;
+        int count;
+    };
+    static const int MAX_FACES_PER_LEAF = 4;
+    int _batch_size;
+    int _num_faces;
+    int _image_height;
+    int _image_width;
+    bool _built;
+    std::vector<std::vector<Node>> _nodes;
+    // 葉の順の面番号
+    std::vector<std::vector<int>> _face_indices;
+    // 面番号の順と葉の順の面ごとの前処理
+    std::vector<TriangleSetupTable> _triangle_setups;
+    std::vector<TriangleSetupTable> _leaf_triangle_setups;
+    std::vector<float> _xf_table;
+    int build_node(int batch_index, const std::vector<float>& centroids, int begin, int end);
+    void refit_nodes(int batch_index);
+    void query_pixel(int batch_index, int xi, int yi, int& face_index, float& depth) const;
+
+public:
+    FaceBVH(int batch_size, int num_faces, int image_height, int image_width);
+    // face_vertices: (batch_size, num_faces, 3, 3)
+    // 面の位置から木を作り直す
+    void build(py::array_t<float, py::array::c_style> np_face_vertices);
+    // 木の形はそのままで各ノードの矩形だけを求め直す
+    // 最適化の1ステップ程度で頂点が少し動いた場合は作り直すより速い
+    // 大きく動いた後は木の効率が落ちるのでbuildを呼ぶ（結果はどちらでも変わらない）
+    void refit(py::array_t<float, py::array::c_style> np_face_vertices);
+    // 全画素の最前面を求める
+    // face_index_map, silhouette_imageは面がある画素だけ書き換える
+    void forward(
+        py::array_t<int, py::array::c_style> np_face_index_map,
+        py::array_t<float, py::array::c_style> np_depth_map,
+        py::array_t<int, py::array::c_style> np_silhouette_image);
+    // pixel_indices: (batch_size, num_queries) で、各値は yi * image_width + xi
+    // 各画素の最前面の面番号（なければ-1）と深度（なければ1）をface_indices, depthsに入れる
+    void query(
+        py::array_t<int, py::array::c_style> np_pixel_indices,
+        py::array_t<int, py::array::c_style> np_face_indices,
+        py::array_t<float, py::array::c_style> np_depths);
+    // 連続したC配列を直接受け取る版
+    // GILは操作しないので呼び出し側で解放しておく
+    void build(const float* face_vertices);
+    void refit(const float* face_vertices);
+    void forward(int* face_index_map, float* depth_map, int* silhouette_image) const;
+    void query(const int* pixel_indices, int num_queries, int* face_indices, float* depths) const;
+    int batch_size();
+    int num_faces();
+    int image_height();
+    int image_width();
+};
+}
\ No newline at end of file
@@ -0,0 +1,78 @@
+#include "face_span.h"
+#include <algorithm>
+#include <cstdint>
+
+namespace gme {
+template <typename T>
+void FaceSpanTable::build(const ArrayView2<const T>& face_index_map, int num_faces, int image_height, int image_width, bool vertical)
+{
+    int num_lines = vertical ? image_width : image_height;
+    int line_length = vertical ? image_height : image_width;
+    auto pixel = [&](int line, int p) {
+        return (int)(vertical ? face_index_map(p, line) : face_index_map(line, p));
+    };
+
+    // 面と走査線の組の数を数える
+    _offsets.assign(num_faces + 1, 0);
+    _last_lines.assign(num_faces, -1);
+    for (int line = 0; line < num_lines; line++) {
+        for (int p = 0; p < line_length; p++) {
+            int face_index = pixel(line, p);
+            if (face_index < 0 || face_index >= num_faces) {
+                continue;
+            }
+            if (_last_lines[face_index] != line) {
+                _last_lines[face_index] = line;
+                _offsets[face_index + 1]++;
+            }
+        }
+    }
+    for (int face_index = 0; face_index < num_faces; face_index++) {
+        _offsets[face_index + 1] += _offsets[face_index];
+    }
+
+    // 走査線の順に区間を埋める
+    // 同じ走査線に同じ面が複数回現れる場合は最初と最後の区間を残す
+    _spans.resize(_offsets[num_faces]);
+    _cursors.assign(_offsets.begin(), _offsets.end() - 1);
+    for (int line = 0; line < num_lines; line++) {
+        int p = 0;
+        while (p < line_length) {
+            int face_index = pixel(line, p);
+            int start = p;
+            while (p < line_length && pixel(line, p) == face_index) {
+                p++;
+            }
+            int end = p - 1;
+            if (face_index < 0 || face_index >= num_faces) {
+                continue;
+            }
+            int& cursor = _cursors[face_index];
+            if (cursor > _offsets[face_index] && _spans[cursor - 1].line == line) {
+                _spans[cursor - 1].last_start = start;
+                _spans[cursor - 1].last_end = end;
+            } else {
+                _spans[cursor] = { line, start, end, start, end };
+                cursor++;
+            }
+        }
+    }
+}
+template void FaceSpanTable::build(const ArrayView2<const int>&, int, int, int, bool);
+template void FaceSpanTable::build(const ArrayView2<const uint16_t>&, int, int, int, bool);
+const FaceSpan* FaceSpanTable::find(int face_index, int line) const
+{
+    if (face_index < 0 || face_index + 1 >= (int)_offsets.size()) {
+        return nullptr;
+    }
+    auto begin = _spans.begin() + _offsets[face_index];
+    auto end = _spans.begin() + _offsets[face_index + 1];
+    auto it = std::lower_bound(begin, end, line, [](const FaceSpan& span, int line) {
+        return span.line < line;
+    });
+    if (it == end || it->line != line) {
+        return nullptr;
+    }
+    return &(*it);
+}
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include "array_view.h"
+#include <vector>
+
+namespace gme {
+// 1本の走査線上で面が最初に現れる区間と最後に現れる区間
+// 面は凸なので隠面がなければ両者は一致する
+struct FaceSpan {
+    int line; // 縦方向の走査線なら列番号、横方向なら行番号
+    int first_start;
+    int first_end;
+    int last_start;
+    int last_end;
+};
+// 面番号マップを走査線ごとに同じ面が続く区間（ランレングス）に分解し、面ごとに引けるようにしたもの
+// 勾配計算で走査線上の辺の位置を探す際に画素をたどる代わりに使う
+class FaceSpanTable {
+private:
+    std::vector<int> _offsets;
+    std::vector<FaceSpan> _spans;
+    // buildの途中で使う配列で、作り直すたびに確保しないように持っておく
+    std::vector<int> _last_lines;
+    std::vector<int> _cursors;
+
+public:
+    // vertical = trueなら列ごと、falseなら行ごとに区間を求める
+    // 面番号マップはintかuint16_tで、[0, num_faces)の外の値は面のない画素とみなす
+    template <typename T>
+    void build(const ArrayView2<const T>& face_index_map, int num_faces, int image_height, int image_width, bool vertical);
+    // 走査線lineに面face_indexが現れなければnullptrを返す
+    const FaceSpan* find(int face_index, int line) const;
+};
+}
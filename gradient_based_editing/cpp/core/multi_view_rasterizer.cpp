@@ -0,0 +1,168 @@
+#include "multi_view_rasterizer.h"
+#include "rasterize.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace gme {
+MultiViewRasterizer::MultiViewRasterizer(int num_views, int num_faces, int num_vertices, int image_height, int image_width)
+{
+    if (num_views <= 0) {
+        throw std::runtime_error("(num_views > 0) -> false");
+    }
+    if (num_faces <= 0) {
+        throw std::runtime_error("(num_faces > 0) -> false");
+    }
+    if (num_vertices <= 0) {
+        throw std::runtime_error("(num_vertices > 0) -> false");
+    }
+    if (image_height <= 0) {
+        throw std::runtime_error("(image_height > 0) -> false");
+    }
+    if (image_width <= 0) {
+        throw std::runtime_error("(image_width > 0) -> false");
+    }
+    _num_views = num_views;
+    _num_faces = num_faces;
+    _num_vertices = num_vertices;
+    _image_height = image_height;
+    _image_width = image_width;
+
+    int image_size = num_views * image_height * image_width;
+    _projections.resize(num_views);
+    _face_vertices.resize(num_views * num_faces * 9);
+    _face_index_map.resize(image_size);
+    _depth_map.resize(image_size);
+    _silhouette_image.resize(image_size);
+    _grad_projected_vertices.resize(num_views * num_vertices * 3);
+    _grad_vertices.resize(num_vertices * 3);
+    _debug_grad_map.resize(image_size);
+    _triangle_setups.resize(num_views);
+    _forwarded = false;
+    _faces.resize(num_faces * 3);
+    std::fill(_face_vertices.data(), _face_vertices.data() + _face_vertices.size(), 0.0f);
+    std::fill(_face_index_map.data(), _face_index_map.data() + image_size, -1);
+    std::fill(_depth_map.data(), _depth_map.data() + image_size, 1.0f);
+    std::fill(_silhouette_image.data(), _silhouette_image.data() + image_size, 0);
+    std::fill(_grad_vertices.data(), _grad_vertices.data() + _grad_vertices.size(), 0.0f);
+    std::fill(_debug_grad_map.data(), _debug_grad_map.data() + image_size, 0.0f);
+}
+void MultiViewRasterizer::forward(
+    py::array_t<float, py::array::c_style> np_vertices,
+    py::array_t<int, py::array::c_style> np_faces,
+    py::array_t<double, py::array::c_style> np_projections)
+{
+    if (np_vertices.ndim() != 2 || np_vertices.shape(0) != _num_vertices || np_vertices.shape(1) != 3) {
+        throw std::runtime_error("`np_vertices.shape` must be equal to `(num_vertices, 3)`.");
+    }
+    if (np_faces.ndim() != 2 || np_faces.shape(0) != _num_faces || np_faces.shape(1) != 3) {
+        throw std::runtime_error("`np_faces.shape` must be equal to `(num_faces, 3)`.");
+    }
+    if (np_projections.ndim() != 3 || np_projections.shape(0) != _num_views || np_projections.shape(1) != 3 || np_projections.shape(2) != 4) {
+        throw std::runtime_error("`np_projections.shape` must be equal to `(num_views, 3, 4)`.");
+    }
+    const float* vertices_data = np_vertices.data();
+    const int* faces_data = np_faces.data();
+    std::vector<Projection> projections(_num_views);
+    for (int view_index = 0; view_index < _num_views; view_index++) {
+        projections[view_index] = to_projection(np_projections.data() + view_index * 12);
+    }
+
+    py::gil_scoped_release release;
+    forward(vertices_data, faces_data, projections.data());
+}
+void MultiViewRasterizer::forward(const float* vertices_data, const int* faces_data, const Projection* projections)
+{
+    // 途中で失敗した場合に前回の視点や面と今回の前処理を組み合わせてbackwardしないよう、成功するまではforwardしていない状態にする
+    _forwarded = false;
+    check_vertex_indices(faces_data, 1, _num_faces, _num_vertices);
+    forward_project_faces_multi_view(vertices_data, faces_data, _face_vertices.data(), _num_views, _num_vertices, _num_faces, projections);
+    // 視点をバッチとしてまとめてラスタライズする
+    // 深度はforward_face_index_mapが初期化する
+    int image_size = _face_index_map.size();
+    std::fill(_face_index_map.data(), _face_index_map.data() + image_size, -1);
+    std::fill(_silhouette_image.data(), _silhouette_image.data() + image_size, 0);
+    forward_face_index_map(_face_vertices.data(), _face_index_map.data(), _depth_map.data(), _silhouette_image.data(),
+        _num_views, _num_faces, _image_height, _image_width, _triangle_setups.data());
+    std::copy(projections, projections + _num_views, _projections.begin());
+    std::copy(faces_data, faces_data + _num_faces * 3, _faces.begin());
+    _forwarded = true;
+}
+void MultiViewRasterizer::backward(
+    py::array_t<int, py::array::c_style> np_faces,
+    py::array_t<float, py::array::c_style> np_grad_silhouette,
+    bool deterministic)
+{
+    if (np_faces.ndim() != 2 || np_faces.shape(0) != _num_faces || np_faces.shape(1) != 3) {
+        throw std::runtime_error("`np_faces.shape` must be equal to `(num_faces, 3)`.");
+    }
+    if (np_grad_silhouette.ndim() != 3 || np_grad_silhouette.shape(0) != _num_views || np_grad_silhouette.shape(1) != _image_height || np_grad_silhouette.shape(2) != _image_width) {
+        throw std::runtime_error("`np_grad_silhouette.shape` must be equal to `(num_views, image_height, image_width)`.");
+    }
+    const int* faces_data = np_faces.data();
+    const float* grad_silhouette_data = np_grad_silhouette.data();
+
+    py::gil_scoped_release release;
+    backward(faces_data, grad_silhouette_data, deterministic);
+}
+void MultiViewRasterizer::backward(const int* faces_data, const float* grad_silhouette_data, bool deterministic)
+{
+    if (_forwarded == false) {
+        throw std::runtime_error("(forward has been called before backward) -> false");
+    }
+    if (std::equal(_faces.begin(), _faces.end(), faces_data) == false) {
+        throw std::runtime_error("(faces == faces used in forward) -> false");
+    }
+    std::fill(_grad_projected_vertices.data(), _grad_projected_vertices.data() + _grad_projected_vertices.size(), 0.0f);
+    std::fill(_debug_grad_map.data(), _debug_grad_map.data() + _debug_grad_map.size(), 0.0f);
+    // 面は全視点で共有し、面の座標は前処理の結果に含まれているので渡さない
+    // シルエットをそのまま画素値として使う
+    backward_silhouette(faces_data, nullptr, _face_index_map.data(), _silhouette_image.data(),
+        _grad_projected_vertices.data(), grad_silhouette_data, _debug_grad_map.data(),
+        _num_views, _num_faces, _num_vertices, _image_height, _image_width, deterministic, _triangle_setups.data(), true);
+    backward_project_vertices_multi_view(_grad_projected_vertices.data(), _grad_vertices.data(), _num_views, _num_vertices, _projections.data());
+}
+float* MultiViewRasterizer::face_vertices()
+{
+    return _face_vertices.data();
+}
+int* MultiViewRasterizer::face_index_map()
+{
+    return _face_index_map.data();
+}
+float* MultiViewRasterizer::depth_map()
+{
+    return _depth_map.data();
+}
+int* MultiViewRasterizer::silhouette_image()
+{
+    return _silhouette_image.data();
+}
+float* MultiViewRasterizer::grad_vertices()
+{
+    return _grad_vertices.data();
+}
+float* MultiViewRasterizer::debug_grad_map()
+{
+    return _debug_grad_map.data();
+}
+int MultiViewRasterizer::num_views()
+{
+    return _num_views;
+}
+int MultiViewRasterizer::num_faces()
+{
+    return _num_faces;
+}
+int MultiViewRasterizer::num_vertices()
+{
+    return _num_vertices;
+}
+int MultiViewRasterizer::image_height()
+{
+    return _image_height;
+}
+int MultiViewRasterizer::image_width()
+{
+    return _image_width;
+}
+}
\ No newline at end of file
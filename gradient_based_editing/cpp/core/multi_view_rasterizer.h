@@ -0,0 +1,69 @@
+#pragma once
+#include "aligned_buffer.h"
+#include "projection.h"
+#include "triangle_setup.h"
+#include <pybind11/numpy.h>
+#include <vector>
+
+namespace gme {
+namespace py = pybind11;
+// 1つのメッシュを複数の視点からまとめてラスタライズするためのクラス
+// 頂点と面は視点ごとに複製せず、投影と全視点のラスタライズを1回の呼び出しで行う
+// backwardは全視点の勾配を足し合わせた1つのgrad_verticesを求める
+// 各配列は次のforward/backwardで上書きされる
+class MultiViewRasterizer {
+private:
+    int _num_views;
+    int _num_faces;
+    int _num_vertices;
+    int _image_height;
+    int _image_width;
+    std::vector<Projection> _projections;
+    AlignedBuffer<float> _face_vertices;
+    AlignedBuffer<int> _face_index_map;
+    AlignedBuffer<float> _depth_map;
+    AlignedBuffer<int> _silhouette_image;
+    // 視点ごとの投影後の頂点についての勾配
+    AlignedBuffer<float> _grad_projected_vertices;
+    AlignedBuffer<float> _grad_vertices;
+    AlignedBuffer<float> _debug_grad_map;
+    // 直前のforwardで求めた面ごとの前処理
+    std::vector<TriangleSetupTable> _triangle_setups;
+    // 直前のforwardが成功したかと、その時の面
+    // backwardは前処理と投影を使うので、forwardの前や失敗した後、別の面では呼べない
+    bool _forwarded;
+    std::vector<int> _faces;
+
+public:
+    MultiViewRasterizer(int num_views, int num_faces, int num_vertices, int image_height, int image_width);
+    // vertices: (num_vertices, 3) ワールド座標系の頂点
+    // faces: (num_faces, 3)
+    // projections: (num_views, 3, 4) 視点ごとの変換[A | c]（compute_projection_matrixで作れる）
+    void forward(
+        py::array_t<float, py::array::c_style> np_vertices,
+        py::array_t<int, py::array::c_style> np_faces,
+        py::array_t<double, py::array::c_style> np_projections);
+    // faces: (num_faces, 3)
+    // grad_silhouette: (num_views, image_height, image_width)
+    // 直前のforwardの視点・面番号マップ・シルエットを使うので、facesはforwardと同じでなければならない
+    void backward(
+        py::array_t<int, py::array::c_style> np_faces,
+        py::array_t<float, py::array::c_style> np_grad_silhouette,
+        bool deterministic);
+    // 連続したC配列を直接受け取る版
+    // GILは操作しないので呼び出し側で解放しておく
+    void forward(const float* vertices, const int* faces, const Projection* projections);
+    void backward(const int* faces, const float* grad_silhouette, bool deterministic);
+    float* face_vertices();
+    int* face_index_map();
+    float* depth_map();
+    int* silhouette_image();
+    float* grad_vertices();
+    float* debug_grad_map();
+    int num_views();
+    int num_faces();
+    int num_vertices();
+    int image_height();
+    int image_width();
+};
+}
\ No newline at end of file
@@ -0,0 +1,68 @@
+#include "nonzero_pixel.h"
+#include <algorithm>
+
+namespace gme {
+void NonZeroPixelTable::build(const ArrayView2<const float>& image, int image_height, int image_width, bool vertical, int num_channels)
+{
+    auto nonzero = [&](int yi, int xi) {
+        if (num_channels == 1) {
+            return image(yi, xi) != 0;
+        }
+        for (int channel = 0; channel < num_channels; channel++) {
+            if (image(yi, xi * num_channels + channel) != 0) {
+                return true;
+            }
+        }
+        return false;
+    };
+    int num_lines = vertical ? image_width : image_height;
+    _offsets.assign(num_lines + 1, 0);
+    _positions.clear();
+    // 画素は行の順に読み、列ごとの場合は数えてから詰める
+    if (vertical) {
+        for (int yi = 0; yi < image_height; yi++) {
+            for (int xi = 0; xi < image_width; xi++) {
+                if (nonzero(yi, xi)) {
+                    _offsets[xi + 1]++;
+                }
+            }
+        }
+        for (int xi = 0; xi < image_width; xi++) {
+            _offsets[xi + 1] += _offsets[xi];
+        }
+        _positions.resize(_offsets[num_lines]);
+        _cursors.assign(_offsets.begin(), _offsets.end() - 1);
+        for (int yi = 0; yi < image_height; yi++) {
+            for (int xi = 0; xi < image_width; xi++) {
+                if (nonzero(yi, xi)) {
+                    _positions[_cursors[xi]++] = yi;
+                }
+            }
+        }
+    } else {
+        for (int yi = 0; yi < image_height; yi++) {
+            for (int xi = 0; xi < image_width; xi++) {
+                if (nonzero(yi, xi)) {
+                    _positions.push_back(xi);
+                }
+            }
+            _offsets[yi + 1] = _positions.size();
+        }
+    }
+}
+int NonZeroPixelTable::size() const
+{
+    return _positions.size();
+}
+int NonZeroPixelTable::count(int line) const
+{
+    return _offsets[line + 1] - _offsets[line];
+}
+void NonZeroPixelTable::range(int line, int p_start, int p_end, const int*& first, const int*& last) const
+{
+    const int* begin = _positions.data() + _offsets[line];
+    const int* end = _positions.data() + _offsets[line + 1];
+    first = std::lower_bound(begin, end, p_start);
+    last = std::upper_bound(first, end, p_end);
+}
+}
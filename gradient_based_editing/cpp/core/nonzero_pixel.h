@@ -0,0 +1,26 @@
+#pragma once
+#include "array_view.h"
+#include <vector>
+
+namespace gme {
+// 値が0でない画素の位置を走査線ごとに昇順に並べたもの
+// 勾配計算で誤差のない画素を読み飛ばすために使う
+class NonZeroPixelTable {
+private:
+    std::vector<int> _offsets;
+    std::vector<int> _positions;
+    // buildの途中で使う配列で、作り直すたびに確保しないように持っておく
+    std::vector<int> _cursors;
+
+public:
+    // vertical = trueなら列ごと、falseなら行ごとに位置を集める
+    // num_channels > 1の場合、imageは1画素あたりnum_channels個の値を並べたもので、いずれかが0でない画素を集める
+    void build(const ArrayView2<const float>& image, int image_height, int image_width, bool vertical, int num_channels = 1);
+    // 0でない画素の総数
+    int size() const;
+    // 走査線line上の0でない画素の数
+    int count(int line) const;
+    // 走査線line上で位置が[p_start, p_end]に含まれるものを[first, last)に入れる
+    void range(int line, int p_start, int p_end, const int*& first, const int*& last) const;
+};
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <cstdint>
+#include <sys/types.h>
+
+namespace gme {
+// 面番号マップの画素の型
+// FACE_INDEX_UINT16は面のない画素を65535で表すので、面の数が65535未満の場合だけ使える
+enum FaceIndexFormat {
+    FACE_INDEX_INT32,
+    FACE_INDEX_UINT16,
+};
+const int FACE_INDEX_UINT16_NONE = 65535;
+
+// いずれかの形式の面番号マップの1枚の画像への参照
+// 面がない画素は-1として読む
+class FaceIndexView {
+private:
+    const void* _data;
+    FaceIndexFormat _format;
+    int _image_width;
+
+public:
+    FaceIndexView(const void* data, FaceIndexFormat format, int image_width)
+    {
+        _data = data;
+        _format = format;
+        _image_width = image_width;
+    }
+    int operator()(int y, int x) const
+    {
+        if (_format == FACE_INDEX_UINT16) {
+            int face_index = static_cast<const uint16_t*>(_data)[(ssize_t)y * _image_width + x];
+            return face_index == FACE_INDEX_UINT16_NONE ? -1 : face_index;
+        }
+        return static_cast<const int*>(_data)[(ssize_t)y * _image_width + x];
+    }
+};
+
+// シルエットの画素の型
+// SILHOUETTE_BITSは各行を8画素ずつ1バイトに上位ビットから詰めたもので、numpy.packbits(axis=-1)と同じ並び
+// 1行は(image_width + 7) / 8バイトになる
+enum SilhouetteFormat {
+    SILHOUETTE_INT32,
+    SILHOUETTE_UINT8,
+    SILHOUETTE_BITS,
+};
+inline int silhouette_row_size(SilhouetteFormat format, int image_width)
+{
+    return format == SILHOUETTE_BITS ? (image_width + 7) / 8 : image_width;
+}
+
+// いずれかの形式のシルエットの1枚の画像への参照
+// ビットを詰めた形式の画素は0か255として読む
+class SilhouetteView {
+private:
+    const void* _data;
+    SilhouetteFormat _format;
+    int _row_size;
+
+public:
+    SilhouetteView(const void* data, SilhouetteFormat format, int image_width)
+    {
+        _data = data;
+        _format = format;
+        _row_size = silhouette_row_size(format, image_width);
+    }
+    int operator()(int y, int x) const
+    {
+        if (_format == SILHOUETTE_INT32) {
+            return static_cast<const int*>(_data)[(ssize_t)y * _row_size + x];
+        }
+        if (_format == SILHOUETTE_UINT8) {
+            return static_cast<const uint8_t*>(_data)[(ssize_t)y * _row_size + x];
+        }
+        uint8_t bits = static_cast<const uint8_t*>(_data)[(ssize_t)y * _row_size + x / 8];
+        return (bits >> (7 - x % 8)) & 1 ? 255 : 0;
+    }
+};
+}
\ No newline at end of file
@@ -0,0 +1,274 @@
+#include "projection.h"
+#include "array_view.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace gme {
+double angle_to_radian(double angle)
+{
+    return angle / 180.0 * M_PI;
+}
+Projection compute_projection(float distance_from_object, float angle_x, float angle_y, float viewing_angle, float z_max, float z_min)
+{
+    double rad_x = angle_to_radian(angle_x);
+    double rad_y = angle_to_radian(angle_y);
+    // カメラ座標系への回転 R = R_y R_x
+    double rotation_x[3][3] = {
+        { 1, 0, 0 },
+        { 0, std::cos(rad_x), -std::sin(rad_x) },
+        { 0, std::sin(rad_x), std::cos(rad_x) },
+    };
+    double rotation_y[3][3] = {
+        { std::cos(rad_y), 0, std::sin(rad_y) },
+        { 0, 1, 0 },
+        { -std::sin(rad_y), 0, std::cos(rad_y) },
+    };
+    // 鏡像変換と正規化の後に透視投影する P S
+    double scale = 1.0 / std::tan(angle_to_radian(viewing_angle / 2.0));
+    double z_a = z_max / (double)(z_max - z_min);
+    double z_b = (z_max * (double)z_min) / (z_min - z_max);
+    double projection_scale[3] = { scale / z_max, scale / z_max, -z_a / z_max };
+
+    Projection projection;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            double sum = 0;
+            for (int k = 0; k < 3; k++) {
+                sum += rotation_y[i][k] * rotation_x[k][j];
+            }
+            projection.a[i][j] = projection_scale[i] * sum;
+        }
+    }
+    // 平行移動 (0, 0, -distance_from_object) とz_b
+    projection.c[0] = 0;
+    projection.c[1] = 0;
+    projection.c[2] = projection_scale[2] * -distance_from_object + z_b;
+    return projection;
+}
+
+py::array_t<double, py::array::c_style> compute_projection_matrix(float distance_from_object, float angle_x, float angle_y, float viewing_angle, float z_max, float z_min)
+{
+    Projection projection = compute_projection(distance_from_object, angle_x, angle_y, viewing_angle, z_max, z_min);
+    py::array_t<double, py::array::c_style> np_matrix({ 3, 4 });
+    double* matrix = np_matrix.mutable_data();
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            matrix[i * 4 + j] = projection.a[i][j];
+        }
+        matrix[i * 4 + 3] = projection.c[i];
+    }
+    return np_matrix;
+}
+Projection to_projection(const double* matrix)
+{
+    Projection projection;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            projection.a[i][j] = matrix[i * 4 + j];
+        }
+        projection.c[i] = matrix[i * 4 + 3];
+    }
+    return projection;
+}
+
+// 頂点ごとに投影しながら面の頂点へ振り分ける
+// (batch_size, num_faces, 3, 3)の中間配列を作らずに出力へ直接書き込む
+// multi_viewの場合はverticesとfacesを全バッチで共有し、バッチごとにprojections[batch_index]で投影する
+// そうでなければバッチごとのverticesとfacesを全てprojections[0]で投影する
+void project_faces(
+    const float* vertices_data,
+    const int* faces_data,
+    float* face_vertices_data,
+    int batch_size,
+    int num_vertices,
+    int num_faces,
+    const Projection* projections,
+    bool multi_view)
+{
+    ArrayView3<const float> vertices(vertices_data, num_vertices, 3);
+    ArrayView3<const int> faces(faces_data, num_faces, 3);
+    ArrayView4<float> face_vertices(face_vertices_data, num_faces, 3, 3);
+
+    auto pool = get_thread_pool();
+    const int num_faces_per_task = 4096;
+    int num_chunks = (num_faces + num_faces_per_task - 1) / num_faces_per_task;
+    pool->parallel_for(batch_size * num_chunks, [&](int task_index, int thread_index) {
+        int batch_index = task_index / num_chunks;
+        int mesh_index = multi_view ? 0 : batch_index;
+        const Projection& projection = projections[multi_view ? batch_index : 0];
+        int face_index_start = (task_index % num_chunks) * num_faces_per_task;
+        int face_index_end = std::min(face_index_start + num_faces_per_task, num_faces);
+        for (int face_index = face_index_start; face_index < face_index_end; face_index++) {
+            for (int n = 0; n < 3; n++) {
+                int vertex_index = faces(mesh_index, face_index, n);
+                if (vertex_index < 0 || vertex_index >= num_vertices) {
+                    throw std::runtime_error("(0 <= vertex_index < num_vertices) -> false");
+                }
+                double x = vertices(mesh_index, vertex_index, 0);
+                double y = vertices(mesh_index, vertex_index, 1);
+                double z = vertices(mesh_index, vertex_index, 2);
+                for (int axis = 0; axis < 3; axis++) {
+                    const double* row = projection.a[axis];
+                    face_vertices(batch_index, face_index, n, axis) = row[0] * x + row[1] * y + row[2] * z + projection.c[axis];
+                }
+            }
+        }
+    });
+}
+
+void forward_project_faces(
+    const float* vertices_data,
+    const int* faces_data,
+    float* face_vertices_data,
+    int batch_size,
+    int num_vertices,
+    int num_faces,
+    const Projection& projection)
+{
+    project_faces(vertices_data, faces_data, face_vertices_data, batch_size, num_vertices, num_faces, &projection, false);
+}
+
+void forward_project_faces_multi_view(
+    const float* vertices_data,
+    const int* faces_data,
+    float* face_vertices_data,
+    int num_views,
+    int num_vertices,
+    int num_faces,
+    const Projection* projections)
+{
+    project_faces(vertices_data, faces_data, face_vertices_data, num_views, num_vertices, num_faces, projections, true);
+}
+
+void forward_project_faces(
+    py::array_t<float, py::array::c_style> np_vertices,
+    py::array_t<int, py::array::c_style> np_faces,
+    py::array_t<float, py::array::c_style> np_face_vertices,
+    float distance_from_object,
+    float angle_x,
+    float angle_y,
+    float viewing_angle,
+    float z_max,
+    float z_min)
+{
+    if (np_vertices.ndim() != 3 || np_vertices.shape(2) != 3) {
+        throw std::runtime_error("`np_vertices.shape` must be equal to `(batch_size, num_vertices, 3)`.");
+    }
+    if (np_faces.ndim() != 3 || np_faces.shape(2) != 3) {
+        throw std::runtime_error("`np_faces.shape` must be equal to `(batch_size, num_faces, 3)`.");
+    }
+    if (np_face_vertices.ndim() != 4 || np_face_vertices.shape(2) != 3 || np_face_vertices.shape(3) != 3) {
+        throw std::runtime_error("`np_face_vertices.shape` must be equal to `(batch_size, num_faces, 3, 3)`.");
+    }
+    if (np_faces.shape(0) != np_vertices.shape(0) || np_face_vertices.shape(0) != np_vertices.shape(0)) {
+        throw std::runtime_error("(np_faces.shape(0) == np_vertices.shape(0) == np_face_vertices.shape(0)) -> false");
+    }
+    if (np_face_vertices.shape(1) != np_faces.shape(1)) {
+        throw std::runtime_error("(np_face_vertices.shape(1) == np_faces.shape(1)) -> false");
+    }
+
+    int batch_size = np_vertices.shape(0);
+    int num_vertices = np_vertices.shape(1);
+    int num_faces = np_faces.shape(1);
+    const float* vertices_data = np_vertices.data();
+    const int* faces_data = np_faces.data();
+    float* face_vertices_data = np_face_vertices.mutable_data();
+    Projection projection = compute_projection(distance_from_object, angle_x, angle_y, viewing_angle, z_max, z_min);
+
+    py::gil_scoped_release release;
+    forward_project_faces(vertices_data, faces_data, face_vertices_data, batch_size, num_vertices, num_faces, projection);
+}
+
+// p = A v + c なので dL/dv = A^T dL/dp
+void backward_project_vertices(
+    const float* grad_projected_vertices_data,
+    float* grad_vertices_data,
+    int batch_size,
+    int num_vertices,
+    const Projection& projection)
+{
+    ArrayView3<const float> grad_projected_vertices(grad_projected_vertices_data, num_vertices, 3);
+    ArrayView3<float> grad_vertices(grad_vertices_data, num_vertices, 3);
+
+    auto pool = get_thread_pool();
+    const int num_vertices_per_task = 4096;
+    int num_chunks = (num_vertices + num_vertices_per_task - 1) / num_vertices_per_task;
+    pool->parallel_for(batch_size * num_chunks, [&](int task_index, int thread_index) {
+        int batch_index = task_index / num_chunks;
+        int vertex_index_start = (task_index % num_chunks) * num_vertices_per_task;
+        int vertex_index_end = std::min(vertex_index_start + num_vertices_per_task, num_vertices);
+        for (int vertex_index = vertex_index_start; vertex_index < vertex_index_end; vertex_index++) {
+            double grad_x = grad_projected_vertices(batch_index, vertex_index, 0);
+            double grad_y = grad_projected_vertices(batch_index, vertex_index, 1);
+            double grad_z = grad_projected_vertices(batch_index, vertex_index, 2);
+            for (int axis = 0; axis < 3; axis++) {
+                grad_vertices(batch_index, vertex_index, axis) = projection.a[0][axis] * grad_x + projection.a[1][axis] * grad_y + projection.a[2][axis] * grad_z;
+            }
+        }
+    });
+}
+
+// 各視点の勾配を視点の順に足し合わせるので、スレッド数によらず同じ結果になる
+void backward_project_vertices_multi_view(
+    const float* grad_projected_vertices_data,
+    float* grad_vertices_data,
+    int num_views,
+    int num_vertices,
+    const Projection* projections)
+{
+    ArrayView3<const float> grad_projected_vertices(grad_projected_vertices_data, num_vertices, 3);
+    ArrayView2<float> grad_vertices(grad_vertices_data, 3);
+
+    auto pool = get_thread_pool();
+    const int num_vertices_per_task = 4096;
+    int num_chunks = (num_vertices + num_vertices_per_task - 1) / num_vertices_per_task;
+    pool->parallel_for(num_chunks, [&](int chunk_index, int thread_index) {
+        int vertex_index_start = chunk_index * num_vertices_per_task;
+        int vertex_index_end = std::min(vertex_index_start + num_vertices_per_task, num_vertices);
+        for (int vertex_index = vertex_index_start; vertex_index < vertex_index_end; vertex_index++) {
+            double sum[3] = { 0, 0, 0 };
+            for (int view_index = 0; view_index < num_views; view_index++) {
+                const Projection& projection = projections[view_index];
+                double grad_x = grad_projected_vertices(view_index, vertex_index, 0);
+                double grad_y = grad_projected_vertices(view_index, vertex_index, 1);
+                double grad_z = grad_projected_vertices(view_index, vertex_index, 2);
+                for (int axis = 0; axis < 3; axis++) {
+                    sum[axis] += projection.a[0][axis] * grad_x + projection.a[1][axis] * grad_y + projection.a[2][axis] * grad_z;
+                }
+            }
+            for (int axis = 0; axis < 3; axis++) {
+                grad_vertices(vertex_index, axis) = sum[axis];
+            }
+        }
+    });
+}
+
+void backward_project_vertices(
+    py::array_t<float, py::array::c_style> np_grad_projected_vertices,
+    py::array_t<float, py::array::c_style> np_grad_vertices,
+    float distance_from_object,
+    float angle_x,
+    float angle_y,
+    float viewing_angle,
+    float z_max,
+    float z_min)
+{
+    if (np_grad_projected_vertices.ndim() != 3 || np_grad_projected_vertices.shape(2) != 3) {
+        throw std::runtime_error("`np_grad_projected_vertices.shape` must be equal to `(batch_size, num_vertices, 3)`.");
+    }
+    if (np_grad_vertices.ndim() != 3 || np_grad_vertices.shape(0) != np_grad_projected_vertices.shape(0) || np_grad_vertices.shape(1) != np_grad_projected_vertices.shape(1) || np_grad_vertices.shape(2) != 3) {
+        throw std::runtime_error("`np_grad_vertices.shape` must be equal to `np_grad_projected_vertices.shape`.");
+    }
+
+    int batch_size = np_grad_projected_vertices.shape(0);
+    int num_vertices = np_grad_projected_vertices.shape(1);
+    const float* grad_projected_vertices_data = np_grad_projected_vertices.data();
+    float* grad_vertices_data = np_grad_vertices.mutable_data();
+    Projection projection = compute_projection(distance_from_object, angle_x, angle_y, viewing_angle, z_max, z_min);
+
+    py::gil_scoped_release release;
+    backward_project_vertices(grad_projected_vertices_data, grad_vertices_data, batch_size, num_vertices, projection);
+}
+}
\ No newline at end of file
@@ -0,0 +1,87 @@
+#pragma once
+#include <pybind11/numpy.h>
+
+namespace gme {
+namespace py = pybind11;
+// カメラ座標系への変換と透視投影をまとめた変換 p = A v + c
+// vertices.pyのtransform_to_camera_coordinate_systemとproject_perspectiveを続けて適用したものに相当する
+// この透視投影はzで割らないので全体が1つのアフィン変換になる
+struct Projection {
+    double a[3][3];
+    double c[3];
+};
+// 角度の単位は度
+Projection compute_projection(float distance_from_object, float angle_x, float angle_y, float viewing_angle, float z_max, float z_min);
+// [A | c]を(3, 4)の行列として返す
+// 視点ごとの行列を並べた(num_views, 3, 4)の配列をMultiViewRasterizerに渡す
+py::array_t<double, py::array::c_style> compute_projection_matrix(float distance_from_object, float angle_x, float angle_y, float viewing_angle, float z_max, float z_min);
+// (3, 4)の行列[A | c]から変換を作る
+Projection to_projection(const double* matrix);
+
+// vertices: (batch_size, num_vertices, 3) ワールド座標系の頂点
+// faces: (batch_size, num_faces, 3)
+// face_vertices: (batch_size, num_faces, 3, 3) 投影後の各面の頂点を書き込む
+void forward_project_faces(
+    py::array_t<float, py::array::c_style> np_vertices,
+    py::array_t<int, py::array::c_style> np_faces,
+    py::array_t<float, py::array::c_style> np_face_vertices,
+    float distance_from_object,
+    float angle_x,
+    float angle_y,
+    float viewing_angle,
+    float z_max,
+    float z_min);
+
+// grad_projected_vertices: (batch_size, num_vertices, 3) 投影後の頂点についての勾配
+// grad_vertices: (batch_size, num_vertices, 3) ワールド座標系の頂点についての勾配で上書きする
+// 面への振り分けの逆はbackward_silhouetteが頂点ごとに足し合わせる時点で済んでいる
+void backward_project_vertices(
+    py::array_t<float, py::array::c_style> np_grad_projected_vertices,
+    py::array_t<float, py::array::c_style> np_grad_vertices,
+    float distance_from_object,
+    float angle_x,
+    float angle_y,
+    float viewing_angle,
+    float z_max,
+    float z_min);
+
+// 以下は連続したC配列を直接受け取る版
+// GILは操作しないので呼び出し側で解放しておく
+void forward_project_faces(
+    const float* vertices,
+    const int* faces,
+    float* face_vertices,
+    int batch_size,
+    int num_vertices,
+    int num_faces,
+    const Projection& projection);
+
+void backward_project_vertices(
+    const float* grad_projected_vertices,
+    float* grad_vertices,
+    int batch_size,
+    int num_vertices,
+    const Projection& projection);
+
+// 1つのメッシュを複数の視点から投影する
+// vertices: (num_vertices, 3), faces: (num_faces, 3) は全視点で共有する
+// face_vertices: (num_views, num_faces, 3, 3) 視点ごとに投影後の各面の頂点を書き込む
+// projections: num_views個の変換
+void forward_project_faces_multi_view(
+    const float* vertices,
+    const int* faces,
+    float* face_vertices,
+    int num_views,
+    int num_vertices,
+    int num_faces,
+    const Projection* projections);
+
+// grad_projected_vertices: (num_views, num_vertices, 3) 視点ごとの投影後の頂点についての勾配
+// grad_vertices: (num_vertices, 3) 全視点についての和で上書きする
+void backward_project_vertices_multi_view(
+    const float* grad_projected_vertices,
+    float* grad_vertices,
+    int num_views,
+    int num_vertices,
+    const Projection* projections);
+}
\ No newline at end of file
@@ -1,156 +1,921 @@
 #include "rasterize.h"
+#include "array_view.h"
+#include "coordinate.h"
+#include "depth_pyramid.h"
+#include "face_span.h"
+#include "nonzero_pixel.h"
+#include "pixel_format.h"
+#include "rasterize_row.h"
+#include "thread_pool.h"
+#include "triangle_setup.h"
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <functional>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
 
 namespace gme {
-float to_projected_coordinate(int p, int size)
+// 呼び出し側から面ごとの前処理のテーブルが渡されない場合に使うテーブル
+// 毎回確保し直すと大きな配列の確保と初期化が無視できないので、呼び出し元のスレッドごとに使い回す
+TriangleSetupTable* get_local_triangle_setups(int batch_size)
 {
-    return 2.0 * (p / (float)(size - 1) - 0.5);
+    thread_local std::vector<TriangleSetupTable> triangle_setups;
+    if ((int)triangle_setups.size() < batch_size) {
+        triangle_setups.resize(batch_size);
+    }
+    return triangle_setups.data();
 }
 
-// [-1, 1] -> [0, size - 1]
-int to_image_coordinate(float p, int size)
+// 最前面の面についての画素の重心座標をweights[0:3]に書き込む
+// 面がない画素（face_index == -1）は0にする
+void write_weights(const TriangleSetupTable& setup, int face_index, float xf, float yf, float* weights)
 {
-    return std::min(std::max((int)std::round((p + 1.0f) * 0.5f * (size - 1)), 0), size - 1);
+    if (face_index == -1) {
+        weights[0] = 0.0f;
+        weights[1] = 0.0f;
+        weights[2] = 0.0f;
+        return;
+    }
+    compute_barycentric_coordinates(xf, yf, setup.face(face_index), weights[0], weights[1], weights[2]);
 }
 
 // 各画素ごとに最前面を特定する
+// バッチと画像を横長の帯に分けたものを単位としてスレッドプールで並列に処理する
+// 各画素は必ず1つのタスクが面番号の昇順に処理するので結果はスレッド数に依存しない
+// 帯の深度の粗い階層を持ち、既に描画された面に完全に隠れる面は画素ごとの判定を省く
+// weight_mapを渡すと帯の最前面が決まった後に、各画素の最前面の重心座標を求める
+void forward_face_index_map(
+    const float* face_vertices_data,
+    int* face_index_map_data,
+    float* depth_map_data,
+    int* silhouette_image_data,
+    int batch_size,
+    int num_faces,
+    int image_height,
+    int image_width,
+    TriangleSetupTable* triangle_setups,
+    float* weight_map_data)
+{
+    ArrayView3<float> depth_map(depth_map_data, image_height, image_width);
+    ArrayView3<int> face_index_map(face_index_map_data, image_height, image_width);
+    ArrayView3<int> silhouette_image(silhouette_image_data, image_height, image_width);
+
+    // 各列のx座標
+    // xi \in [0, image_width] -> xf \in [-1, 1]
+    std::vector<float> xf_table(image_width);
+    for (int xi = 0; xi < image_width; xi++) {
+        xf_table[xi] = to_projected_coordinate(xi, image_width);
+    }
+    // 1行分の判定はCPUに合わせてSIMD命令で処理する
+    RasterizeRowFunction rasterize_row = get_rasterize_row_function();
+
+    // 面ごとの前処理は帯ごとに繰り返さず最初に1度だけ行う
+    // 結果を返す場合は逆伝播で使う頂点の画像座標も求めておく
+    bool image_coordinates = triangle_setups != nullptr;
+    if (triangle_setups == nullptr) {
+        triangle_setups = get_local_triangle_setups(batch_size);
+    }
+    build_triangle_setups(face_vertices_data, triangle_setups, batch_size, num_faces, image_height, image_width, image_coordinates);
+
+    auto pool = get_thread_pool();
+    int num_bands = std::max(std::min(pool->num_threads(), image_height), 1);
+    int band_height = (image_height + num_bands - 1) / num_bands;
+    // スレッドごとの帯の深度の粗い階層
+    std::vector<DepthPyramid> depth_pyramids(pool->num_threads());
+
+    pool->parallel_for(batch_size * num_bands, [&](int task_index, int thread_index) {
+        int batch_index = task_index / num_bands;
+        int band_yi_start = (task_index % num_bands) * band_height;
+        int band_yi_end = std::min(band_yi_start + band_height, image_height) - 1;
+        if (band_yi_start > band_yi_end) {
+            return;
+        }
+        const TriangleSetupTable& setup = triangle_setups[batch_index];
+        DepthPyramid& depth_pyramid = depth_pyramids[thread_index];
+        const float* band_depth_map = &depth_map(batch_index, band_yi_start, 0);
+
+        // 初期化
+        for (int yi = band_yi_start; yi <= band_yi_end; yi++) {
+            for (int xi = 0; xi < image_width; xi++) {
+                depth_map(batch_index, yi, xi) = 1.0; // 最も遠い位置に初期化
+            }
+        }
+        depth_pyramid.reset(band_yi_end - band_yi_start + 1, image_width, true);
+        for (int face_index = 0; face_index < num_faces; face_index++) {
+            // 裏面と画像の外にある面は矩形が空になっている
+            if (setup.visible(face_index) == false) {
+                continue;
+            }
+            // 面を囲む矩形の内側の画素についてのみループ
+            int yi_start = std::max(setup.yi_start(face_index), band_yi_start);
+            int yi_end = std::min(setup.yi_end(face_index), band_yi_end);
+            if (yi_start > yi_end) {
+                continue;
+            }
+            // 矩形内が全て面より手前の深度で埋まっていればスキップ
+            if (depth_pyramid.occluded(band_depth_map, image_width, setup.xi_start(face_index), setup.xi_end(face_index),
+                    yi_start - band_yi_start, yi_end - band_yi_start, setup.z_near(face_index))) {
+                continue;
+            }
+            depth_pyramid.mark(setup.xi_start(face_index), setup.xi_end(face_index), yi_start - band_yi_start, yi_end - band_yi_start);
+            FaceVertices face = setup.face(face_index);
+            for (int yi = yi_start; yi <= yi_end; yi++) {
+                // yi \in [0, image_height] -> yf \in [-1, 1]
+                float yf = -to_projected_coordinate(yi, image_height);
+                // y座標が面の外部ならスキップ
+                if ((yf > face.yf_1 && yf > face.yf_2 && yf > face.yf_3) || (yf < face.yf_1 && yf < face.yf_2 && yf < face.yf_3)) {
+                    continue;
+                }
+                rasterize_row(face, face_index, yf, xf_table.data(), setup.xi_start(face_index), setup.xi_end(face_index),
+                    &depth_map(batch_index, yi, 0), &face_index_map(batch_index, yi, 0), &silhouette_image(batch_index, yi, 0));
+            }
+        }
+
+        if (weight_map_data == nullptr) {
+            return;
+        }
+        // 面が描画されなかった画素の面番号は変更していないので、深度が1のままかどうかで判定する
+        for (int yi = band_yi_start; yi <= band_yi_end; yi++) {
+            float yf = -to_projected_coordinate(yi, image_height);
+            float* weight_row = weight_map_data + ((ssize_t)batch_index * image_height + yi) * image_width * 3;
+            for (int xi = 0; xi < image_width; xi++) {
+                int face_index = depth_map(batch_index, yi, xi) < 1.0f ? face_index_map(batch_index, yi, xi) : -1;
+                write_weights(setup, face_index, xf_table[xi], yf, weight_row + xi * 3);
+            }
+        }
+    });
+}
+
+// 頂点番号が範囲外の面があれば、並列の処理を始める前に例外を投げる
+void check_vertex_indices(const int* faces_data, int batch_size, int num_faces, int num_vertices)
+{
+    for (ssize_t index = 0; index < (ssize_t)batch_size * num_faces * 3; index++) {
+        if (faces_data[index] < 0 || faces_data[index] >= num_vertices) {
+            throw std::runtime_error("(0 <= vertex_index < num_vertices) -> false");
+        }
+    }
+}
+
+// weight_mapは(batch_size, image_height, image_width, 3)のfloat32かNone
+float* get_weight_map_data(py::object np_weight_map, int batch_size, int image_height, int image_width)
+{
+    if (np_weight_map.is_none()) {
+        return nullptr;
+    }
+    if (py::isinstance<py::array_t<float, py::array::c_style>>(np_weight_map) == false) {
+        throw std::runtime_error("`np_weight_map` must be a C-contiguous float32 array or None.");
+    }
+    py::array_t<float, py::array::c_style> np_weight_map_array = np_weight_map.cast<py::array_t<float, py::array::c_style>>();
+    if (np_weight_map_array.ndim() != 4 || np_weight_map_array.shape(0) != batch_size || np_weight_map_array.shape(1) != image_height
+        || np_weight_map_array.shape(2) != image_width || np_weight_map_array.shape(3) != 3) {
+        throw std::runtime_error("`np_weight_map.shape` must be equal to `(batch_size, image_height, image_width, 3)`.");
+    }
+    return np_weight_map_array.mutable_data();
+}
+
 void forward_face_index_map(
     py::array_t<float, py::array::c_style> np_face_vertices,
     py::array_t<int, py::array::c_style> np_face_index_map,
     py::array_t<float, py::array::c_style> np_depth_map,
-    py::array_t<int, py::array::c_style> np_silhouette_image)
+    py::array_t<int, py::array::c_style> np_silhouette_image,
+    py::object np_weight_map)
 {
     if (np_face_vertices.ndim() != 4) {
-        std::runtime_error("(np_face_vertices.ndim() != 4) -> false");
+        throw std::runtime_error("(np_face_vertices.ndim() != 4) -> false");
     }
     if (np_depth_map.ndim() != 3) {
-        std::runtime_error("(np_depth_map.ndim() != 3) -> false");
+        throw std::runtime_error("(np_depth_map.ndim() != 3) -> false");
     }
     if (np_face_index_map.ndim() != 3) {
-        std::runtime_error("(np_face_index_map.ndim() != 3) -> false");
+        throw std::runtime_error("(np_face_index_map.ndim() != 3) -> false");
     }
     if (np_silhouette_image.ndim() != 3) {
-        std::runtime_error("(np_silhouette_image.ndim() != 3) -> false");
+        throw std::runtime_error("(np_silhouette_image.ndim() != 3) -> false");
     }
 
-
     int batch_size = np_face_vertices.shape(0);
     int num_faces = np_face_vertices.shape(1);
     int image_height = np_silhouette_image.shape(1);
     int image_width = np_silhouette_image.shape(2);
+    if (np_face_vertices.shape(2) != 3 || np_face_vertices.shape(3) != 3) {
+        throw std::runtime_error("`np_face_vertices.shape` must be equal to `(batch_size, num_faces, 3, 3)`.");
+    }
+    if (np_silhouette_image.shape(0) != batch_size) {
+        throw std::runtime_error("`np_silhouette_image.shape` must be equal to `(batch_size, image_height, image_width)`.");
+    }
+    if (np_face_index_map.shape(0) != batch_size || np_face_index_map.shape(1) != image_height || np_face_index_map.shape(2) != image_width) {
+        throw std::runtime_error("`np_face_index_map.shape` must be equal to `np_silhouette_image.shape`.");
+    }
+    if (np_depth_map.shape(0) != batch_size || np_depth_map.shape(1) != image_height || np_depth_map.shape(2) != image_width) {
+        throw std::runtime_error("`np_depth_map.shape` must be equal to `np_silhouette_image.shape`.");
+    }
+    const float* face_vertices_data = np_face_vertices.data();
+    int* face_index_map_data = np_face_index_map.mutable_data();
+    float* depth_map_data = np_depth_map.mutable_data();
+    int* silhouette_image_data = np_silhouette_image.mutable_data();
+    float* weight_map_data = get_weight_map_data(np_weight_map, batch_size, image_height, image_width);
+
+    py::gil_scoped_release release;
+    forward_face_index_map(face_vertices_data, face_index_map_data, depth_map_data, silhouette_image_data,
+        batch_size, num_faces, image_height, image_width, nullptr, weight_map_data);
+}
 
-    auto face_vertices = np_face_vertices.mutable_unchecked<4>();
-    auto depth_map = np_depth_map.mutable_unchecked<3>();
-    auto face_index_map = np_face_index_map.mutable_unchecked<3>();
-    auto silhouette_image = np_silhouette_image.mutable_unchecked<3>();
+// 画面を一定の大きさのタイルに分割し、タイルごとに最前面を特定する
+// まず各面を重なるタイルに振り分け（ビニング）、その後タイルごとに小さな深度バッファで判定する
+// タイル内のバッファはL1キャッシュに収まるので全画面の深度バッファを何度も走査せずに済む
+// ビニングはバッチごとに、判定はバッチとタイルの組ごとにスレッドプールで並列に処理する
+// タイルの深度の粗い階層を持ち、既に描画された面に完全に隠れる面は画素ごとの判定を省く
+// front_to_back = trueなら各タイルの面を手前から順に処理するので隠れる面が多いほど省ける
+// 結果はforward_face_index_mapと完全に一致し、スレッド数や面の順序にも依存しない
+// 各タイルの結果はwrite_tileに渡し、出力の形式に合わせて書き込ませる
+// tile_depth_map, tile_face_index_mapは1行がtile_size画素のタイル内のバッファで、面がない画素の面番号は-1
+// setupは面番号の順の面ごとの前処理
+typedef std::function<void(int batch_index, int tile_xi_start, int tile_xi_end, int tile_yi_start, int tile_yi_end,
+    const float* tile_depth_map, const int* tile_face_index_map, const TriangleSetupTable& setup)>
+    WriteTileFunction;
+void rasterize_tiles(
+    const float* face_vertices_data,
+    int batch_size,
+    int num_faces,
+    int image_height,
+    int image_width,
+    int tile_size,
+    bool front_to_back,
+    const WriteTileFunction& write_tile)
+{
+    if (tile_size <= 0) {
+        throw std::runtime_error("(tile_size > 0) -> false");
+    }
+    int num_tiles_x = (image_width + tile_size - 1) / tile_size;
+    int num_tiles_y = (image_height + tile_size - 1) / tile_size;
+    int num_tiles = num_tiles_x * num_tiles_y;
 
-    for (int batch_index = 0; batch_index < batch_size; batch_index++) {
-        // 初期化
-        for (int yi = 0; yi < image_height; yi++) {
-            for (int xi = 0; xi < image_width; xi++) {
-                depth_map(batch_index, yi, xi) = 1.0; // 最も遠い位置に初期化
+    // 各列のx座標
+    // xi \in [0, image_width] -> xf \in [-1, 1]
+    std::vector<float> xf_table(image_width);
+    for (int xi = 0; xi < image_width; xi++) {
+        xf_table[xi] = to_projected_coordinate(xi, image_width);
+    }
+    // 1行分の判定はCPUに合わせてSIMD命令で処理する
+    RasterizeRowFunction rasterize_row = get_rasterize_row_function();
+
+    auto pool = get_thread_pool();
+
+    // 面ごとの前処理
+    // 裏面と画像の外にある面は矩形が空になっている
+    // front_to_back = trueなら後半のbatch_size個に並べ直したテーブルを入れる
+    TriangleSetupTable* triangle_setups = get_local_triangle_setups(front_to_back ? 2 * batch_size : batch_size);
+    build_triangle_setups(face_vertices_data, triangle_setups, batch_size, num_faces, image_height, image_width, false);
+    // バッチごとのタイルに振り分ける面のテーブルと、その各行の面番号
+    // front_to_back = trueなら見える面だけをz_nearの昇順に並べ直したテーブルを使う
+    // 手前から順に処理しても面のデータをメモリの順に読めるようにするため
+    std::vector<const TriangleSetupTable*> binned_setups(batch_size);
+    std::vector<std::vector<int>> binned_face_indices(batch_size);
+    // バッチごと・タイルごとの面のリスト
+    // tile_faces[b][tile_offsets[b][t]:tile_offsets[b][t + 1]]がタイルtと重なる面のbinned_setups[b]での行番号で、昇順に並ぶ
+    std::vector<std::vector<int>> tile_offsets(batch_size, std::vector<int>(num_tiles + 1));
+    std::vector<std::vector<int>> tile_faces(batch_size);
+    // スレッドごとのタイル内の深度と面番号
+    std::vector<std::vector<float>> tile_depth_maps(pool->num_threads(), std::vector<float>(tile_size * tile_size));
+    std::vector<std::vector<int>> tile_face_index_maps(pool->num_threads(), std::vector<int>(tile_size * tile_size));
+    std::vector<DepthPyramid> depth_pyramids(pool->num_threads());
+
+    // 各面を重なるタイルに振り分ける
+    pool->parallel_for(batch_size, [&](int batch_index, int thread_index) {
+        std::vector<int>& offsets = tile_offsets[batch_index];
+        std::vector<int>& face_indices = binned_face_indices[batch_index];
+        const TriangleSetupTable* setup = &triangle_setups[batch_index];
+        if (front_to_back) {
+            sort_visible_faces_by_z_near(*setup, face_indices);
+            triangle_setups[batch_size + batch_index].gather(*setup, face_indices);
+            setup = &triangle_setups[batch_size + batch_index];
+        } else {
+            face_indices.resize(num_faces);
+            std::iota(face_indices.begin(), face_indices.end(), 0);
+        }
+        binned_setups[batch_index] = setup;
+        for (int row = 0; row < setup->num_faces(); row++) {
+            if (setup->visible(row) == false) {
+                continue;
+            }
+            for (int ty = setup->yi_start(row) / tile_size; ty <= setup->yi_end(row) / tile_size; ty++) {
+                for (int tx = setup->xi_start(row) / tile_size; tx <= setup->xi_end(row) / tile_size; tx++) {
+                    offsets[ty * num_tiles_x + tx + 1]++;
+                }
             }
         }
-        for (int face_index = 0; face_index < num_faces; face_index++) {
-            float xf_1 = face_vertices(batch_index, face_index, 0, 0);
-            float yf_1 = face_vertices(batch_index, face_index, 0, 1);
-            float zf_1 = face_vertices(batch_index, face_index, 0, 2);
-            float xf_2 = face_vertices(batch_index, face_index, 1, 0);
-            float yf_2 = face_vertices(batch_index, face_index, 1, 1);
-            float zf_2 = face_vertices(batch_index, face_index, 1, 2);
-            float xf_3 = face_vertices(batch_index, face_index, 2, 0);
-            float yf_3 = face_vertices(batch_index, face_index, 2, 1);
-            float zf_3 = face_vertices(batch_index, face_index, 2, 2);
-
-            // カリングによる裏面のスキップ
-            // 面の頂点の並び（1 -> 2 -> 3）が時計回りの場合描画しない
-            if ((yf_1 - yf_3) * (xf_1 - xf_2) < (yf_1 - yf_2) * (xf_1 - xf_3)) {
+        for (int tile_index = 0; tile_index < num_tiles; tile_index++) {
+            offsets[tile_index + 1] += offsets[tile_index];
+        }
+        std::vector<int>& faces = tile_faces[batch_index];
+        faces.resize(offsets[num_tiles]);
+        std::vector<int> tile_cursors(offsets.begin(), offsets.end() - 1);
+        for (int row = 0; row < setup->num_faces(); row++) {
+            if (setup->visible(row) == false) {
                 continue;
             }
+            for (int ty = setup->yi_start(row) / tile_size; ty <= setup->yi_end(row) / tile_size; ty++) {
+                for (int tx = setup->xi_start(row) / tile_size; tx <= setup->xi_end(row) / tile_size; tx++) {
+                    faces[tile_cursors[ty * num_tiles_x + tx]++] = row;
+                }
+            }
+        }
+    });
 
-            // 全画素についてループ
-            for (int yi = 0; yi < image_height; yi++) {
+    // タイルごとに最前面を特定する
+    pool->parallel_for(batch_size * num_tiles, [&](int task_index, int thread_index) {
+        int batch_index = task_index / num_tiles;
+        int tile_index = task_index % num_tiles;
+        int tile_xi_start = (tile_index % num_tiles_x) * tile_size;
+        int tile_yi_start = (tile_index / num_tiles_x) * tile_size;
+        int tile_xi_end = std::min(tile_xi_start + tile_size, image_width) - 1;
+        int tile_yi_end = std::min(tile_yi_start + tile_size, image_height) - 1;
+        std::vector<float>& tile_depth_map = tile_depth_maps[thread_index];
+        std::vector<int>& tile_face_index_map = tile_face_index_maps[thread_index];
+        const std::vector<int>& offsets = tile_offsets[batch_index];
+        const std::vector<int>& faces = tile_faces[batch_index];
+        const TriangleSetupTable& setup = *binned_setups[batch_index];
+        const std::vector<int>& face_indices = binned_face_indices[batch_index];
+        DepthPyramid& depth_pyramid = depth_pyramids[thread_index];
+
+        // 初期化
+        std::fill(tile_depth_map.begin(), tile_depth_map.end(), 1.0f); // 最も遠い位置に初期化
+        std::fill(tile_face_index_map.begin(), tile_face_index_map.end(), -1);
+        // 手前から順に処理する場合は後の面ほど省けるので、最初の面だけで判定をやめない
+        depth_pyramid.reset(tile_yi_end - tile_yi_start + 1, tile_xi_end - tile_xi_start + 1, !front_to_back);
+
+        for (int k = offsets[tile_index]; k < offsets[tile_index + 1]; k++) {
+            int row = faces[k];
+            int face_index = face_indices[row];
+
+            // 面の矩形とタイルの共通部分だけを走査する
+            int xi_start = std::max(setup.xi_start(row), tile_xi_start);
+            int xi_end = std::min(setup.xi_end(row), tile_xi_end);
+            int yi_start = std::max(setup.yi_start(row), tile_yi_start);
+            int yi_end = std::min(setup.yi_end(row), tile_yi_end);
+            // 共通部分が全て面より手前の深度で埋まっていればスキップ
+            float z_near = setup.z_near(row);
+            if (depth_pyramid.occluded(tile_depth_map.data(), tile_size, xi_start - tile_xi_start, xi_end - tile_xi_start,
+                    yi_start - tile_yi_start, yi_end - tile_yi_start, z_near)) {
+                // 手前から順に処理している場合、タイル全体が面より手前で埋まっていれば以降の面も全て隠れる
+                if (front_to_back && z_near > depth_pyramid.max_depth(tile_depth_map.data(), tile_size)) {
+                    break;
+                }
+                continue;
+            }
+            depth_pyramid.mark(xi_start - tile_xi_start, xi_end - tile_xi_start, yi_start - tile_yi_start, yi_end - tile_yi_start);
+            FaceVertices face = setup.face(row);
+            for (int yi = yi_start; yi <= yi_end; yi++) {
                 // yi \in [0, image_height] -> yf \in [-1, 1]
                 float yf = -to_projected_coordinate(yi, image_height);
                 // y座標が面の外部ならスキップ
-                if ((yf > yf_1 && yf > yf_2 && yf > yf_3) || (yf < yf_1 && yf < yf_2 && yf < yf_3)) {
+                if ((yf > face.yf_1 && yf > face.yf_2 && yf > face.yf_3) || (yf < face.yf_1 && yf < face.yf_2 && yf < face.yf_3)) {
                     continue;
                 }
-                for (int xi = 0; xi < image_width; xi++) {
-                    // xi \in [0, image_width] -> xf \in [-1, 1]
-                    float xf = to_projected_coordinate(xi, image_width);
-
-                    // xyが面の外部ならスキップ
-                    // Edge Functionで3辺のいずれかの右側にあればスキップ
-                    // https://www.cs.drexel.edu/~david/Classes/Papers/comp175-06-pineda.pdf
-                    if ((yf - yf_1) * (xf_2 - xf_1) < (xf - xf_1) * (yf_2 - yf_1) || (yf - yf_2) * (xf_3 - xf_2) < (xf - xf_2) * (yf_3 - yf_2) || (yf - yf_3) * (xf_1 - xf_3) < (xf - xf_3) * (yf_1 - yf_3)) {
-                        continue;
-                    }
+                float* tile_depth_row = &tile_depth_map[(yi - tile_yi_start) * tile_size];
+                int* tile_face_index_row = &tile_face_index_map[(yi - tile_yi_start) * tile_size];
+                rasterize_row(face, face_index, yf, xf_table.data() + tile_xi_start, xi_start - tile_xi_start, xi_end - tile_xi_start,
+                    tile_depth_row, tile_face_index_row, nullptr);
+            }
+        }
 
-                    // 重心座標系の各係数を計算
-                    // http://zellij.hatenablog.com/entry/20131207/p1
-                    float lambda_1 = ((yf_2 - yf_3) * (xf - xf_3) + (xf_3 - xf_2) * (yf - yf_3)) / ((yf_2 - yf_3) * (xf_1 - xf_3) + (xf_3 - xf_2) * (yf_1 - yf_3));
-                    float lambda_2 = ((yf_3 - yf_1) * (xf - xf_3) + (xf_1 - xf_3) * (yf - yf_3)) / ((yf_2 - yf_3) * (xf_1 - xf_3) + (xf_3 - xf_2) * (yf_1 - yf_3));
-                    float lambda_3 = 1.0 - lambda_1 - lambda_2;
+        write_tile(batch_index, tile_xi_start, tile_xi_end, tile_yi_start, tile_yi_end, tile_depth_map.data(), tile_face_index_map.data(),
+            triangle_setups[batch_index]);
+    });
+}
 
-                    // 面f_nのxy座標に対応する点のz座標を求める
-                    // https://www.scratchapixel.com/lessons/3d-basic-rendering/rasterization-practical-implementation/visibility-problem-depth-buffer-depth-interpolation
-                    float z_face = 1.0 / (lambda_1 / zf_1 + lambda_2 / zf_2 + lambda_3 / zf_3);
+// タイルの各画素の最前面の重心座標をweight_mapに書き込む
+void write_tile_weights(
+    const TriangleSetupTable& setup,
+    const int* tile_face_index_map,
+    int tile_size,
+    int batch_index,
+    int tile_xi_start,
+    int tile_xi_end,
+    int tile_yi_start,
+    int tile_yi_end,
+    int image_height,
+    int image_width,
+    float* weight_map_data)
+{
+    for (int yi = tile_yi_start; yi <= tile_yi_end; yi++) {
+        float yf = -to_projected_coordinate(yi, image_height);
+        const int* tile_face_index_row = tile_face_index_map + (yi - tile_yi_start) * tile_size;
+        float* weight_row = weight_map_data + ((ssize_t)batch_index * image_height + yi) * image_width * 3;
+        for (int xi = tile_xi_start; xi <= tile_xi_end; xi++) {
+            float xf = to_projected_coordinate(xi, image_width);
+            write_weights(setup, tile_face_index_row[xi - tile_xi_start], xf, yf, weight_row + xi * 3);
+        }
+    }
+}
 
-                    if (z_face < 0.0 || z_face > 1.0) {
-                        continue;
-                    }
-                    // zは小さい方が手前
-                    float current_min_z = depth_map(batch_index, yi, xi);
-                    if (z_face < current_min_z) {
-                        // 現在の面の方が前面の場合
-                        depth_map(batch_index, yi, xi) = z_face;
+void forward_face_index_map_tiled(
+    const float* face_vertices_data,
+    int* face_index_map_data,
+    float* depth_map_data,
+    int* silhouette_image_data,
+    int batch_size,
+    int num_faces,
+    int image_height,
+    int image_width,
+    int tile_size,
+    bool front_to_back,
+    float* weight_map_data)
+{
+    ArrayView3<float> depth_map(depth_map_data, image_height, image_width);
+    ArrayView3<int> face_index_map(face_index_map_data, image_height, image_width);
+    ArrayView3<int> silhouette_image(silhouette_image_data, image_height, image_width);
+
+    rasterize_tiles(face_vertices_data, batch_size, num_faces, image_height, image_width, tile_size, front_to_back,
+        [&](int batch_index, int tile_xi_start, int tile_xi_end, int tile_yi_start, int tile_yi_end, const float* tile_depth_map, const int* tile_face_index_map,
+            const TriangleSetupTable& setup) {
+            // タイルの結果を書き戻す
+            // 面が描画されなかった画素の面番号とシルエットは変更しない
+            for (int yi = tile_yi_start; yi <= tile_yi_end; yi++) {
+                for (int xi = tile_xi_start; xi <= tile_xi_end; xi++) {
+                    int tile_pixel_index = (yi - tile_yi_start) * tile_size + (xi - tile_xi_start);
+                    depth_map(batch_index, yi, xi) = tile_depth_map[tile_pixel_index];
+                    int face_index = tile_face_index_map[tile_pixel_index];
+                    if (face_index != -1) {
                         face_index_map(batch_index, yi, xi) = face_index;
                         silhouette_image(batch_index, yi, xi) = 255;
                     }
                 }
             }
+            if (weight_map_data != nullptr) {
+                write_tile_weights(setup, tile_face_index_map, tile_size, batch_index, tile_xi_start, tile_xi_end, tile_yi_start, tile_yi_end,
+                    image_height, image_width, weight_map_data);
+            }
+        });
+}
+
+// 面番号マップ・深度・シルエットを指定した形式で書き込む
+// 全ての画素を書き込むので出力を初期化しておく必要はない
+void forward_face_index_map_compact(
+    const float* face_vertices_data,
+    void* face_index_map_data,
+    FaceIndexFormat face_index_format,
+    float* depth_map_data,
+    void* silhouette_image_data,
+    SilhouetteFormat silhouette_format,
+    int batch_size,
+    int num_faces,
+    int image_height,
+    int image_width,
+    int tile_size,
+    bool front_to_back,
+    float* weight_map_data)
+{
+    if (face_index_format == FACE_INDEX_UINT16 && num_faces >= FACE_INDEX_UINT16_NONE) {
+        throw std::runtime_error("(num_faces < 65535) -> false");
+    }
+    // 1バイトを複数のタイルから書き込まないようにする
+    if (silhouette_format == SILHOUETTE_BITS && tile_size % 8 != 0) {
+        throw std::runtime_error("(tile_size % 8 == 0) -> false");
+    }
+    int silhouette_row_bytes = silhouette_row_size(silhouette_format, image_width);
+
+    rasterize_tiles(face_vertices_data, batch_size, num_faces, image_height, image_width, tile_size, front_to_back,
+        [&](int batch_index, int tile_xi_start, int tile_xi_end, int tile_yi_start, int tile_yi_end, const float* tile_depth_map, const int* tile_face_index_map,
+            const TriangleSetupTable& setup) {
+            for (int yi = tile_yi_start; yi <= tile_yi_end; yi++) {
+                ssize_t row_index = (ssize_t)batch_index * image_height + yi;
+                const float* tile_depth_row = tile_depth_map + (yi - tile_yi_start) * tile_size;
+                const int* tile_face_index_row = tile_face_index_map + (yi - tile_yi_start) * tile_size;
+                if (depth_map_data != nullptr) {
+                    float* depth_row = depth_map_data + row_index * image_width;
+                    for (int xi = tile_xi_start; xi <= tile_xi_end; xi++) {
+                        depth_row[xi] = tile_depth_row[xi - tile_xi_start];
+                    }
+                }
+                if (face_index_map_data != nullptr) {
+                    if (face_index_format == FACE_INDEX_UINT16) {
+                        uint16_t* face_index_row = static_cast<uint16_t*>(face_index_map_data) + row_index * image_width;
+                        for (int xi = tile_xi_start; xi <= tile_xi_end; xi++) {
+                            face_index_row[xi] = (tile_face_index_row[xi - tile_xi_start] == -1) ? FACE_INDEX_UINT16_NONE : tile_face_index_row[xi - tile_xi_start];
+                        }
+                    } else {
+                        int* face_index_row = static_cast<int*>(face_index_map_data) + row_index * image_width;
+                        for (int xi = tile_xi_start; xi <= tile_xi_end; xi++) {
+                            face_index_row[xi] = tile_face_index_row[xi - tile_xi_start];
+                        }
+                    }
+                }
+                if (silhouette_image_data != nullptr) {
+                    if (silhouette_format == SILHOUETTE_BITS) {
+                        uint8_t* silhouette_row = static_cast<uint8_t*>(silhouette_image_data) + row_index * silhouette_row_bytes;
+                        for (int xi = tile_xi_start; xi <= tile_xi_end; xi += 8) {
+                            uint8_t bits = 0;
+                            for (int k = 0; k < 8 && xi + k <= tile_xi_end; k++) {
+                                if (tile_face_index_row[xi - tile_xi_start + k] != -1) {
+                                    bits |= 0x80 >> k;
+                                }
+                            }
+                            silhouette_row[xi / 8] = bits;
+                        }
+                    } else if (silhouette_format == SILHOUETTE_UINT8) {
+                        uint8_t* silhouette_row = static_cast<uint8_t*>(silhouette_image_data) + row_index * image_width;
+                        for (int xi = tile_xi_start; xi <= tile_xi_end; xi++) {
+                            silhouette_row[xi] = (tile_face_index_row[xi - tile_xi_start] == -1) ? 0 : 255;
+                        }
+                    } else {
+                        int* silhouette_row = static_cast<int*>(silhouette_image_data) + row_index * image_width;
+                        for (int xi = tile_xi_start; xi <= tile_xi_end; xi++) {
+                            silhouette_row[xi] = (tile_face_index_row[xi - tile_xi_start] == -1) ? 0 : 255;
+                        }
+                    }
+                }
+            }
+            if (weight_map_data != nullptr) {
+                write_tile_weights(setup, tile_face_index_map, tile_size, batch_index, tile_xi_start, tile_xi_end, tile_yi_start, tile_yi_end,
+                    image_height, image_width, weight_map_data);
+            }
+        });
+}
+
+// 各画素をsupersampling x supersampling個のサンプルに分けて面が覆う割合を求める
+// 画素の中心は-1から1まで(image_size - 1)等分した位置なので、サンプルもその画素の間隔の中に等間隔に置く
+// そのような位置は縦横supersampling倍の画像の画素の位置を原点を中心に縮めたものになるので、
+// 面の頂点を逆に広げて通常のタイルの処理で判定し、タイルの書き戻しで画素ごとに集計する
+// 広げた座標では丸め方が変わるので、面番号と深度は元の座標の画素の中心で別に求める
+void forward_face_index_map_supersampled(
+    const float* face_vertices_data,
+    int* face_index_map_data,
+    float* depth_map_data,
+    float* coverage_map_data,
+    int batch_size,
+    int num_faces,
+    int image_height,
+    int image_width,
+    int supersampling)
+{
+    if (supersampling <= 0) {
+        throw std::runtime_error("(supersampling > 0) -> false");
+    }
+    int sample_height = image_height * supersampling;
+    int sample_width = image_width * supersampling;
+    float scale_x = ((image_width - 1) * supersampling) / (float)(sample_width - 1);
+    float scale_y = ((image_height - 1) * supersampling) / (float)(sample_height - 1);
+    std::vector<float> sample_face_vertices(face_vertices_data, face_vertices_data + (ssize_t)batch_size * num_faces * 9);
+    for (ssize_t vertex_index = 0; vertex_index < (ssize_t)batch_size * num_faces * 3; vertex_index++) {
+        sample_face_vertices[vertex_index * 3 + 0] *= scale_x;
+        sample_face_vertices[vertex_index * 3 + 1] *= scale_y;
+    }
+    // 面番号と深度はforward_face_index_mapと同じ結果にする
+    forward_face_index_map_compact(face_vertices_data, face_index_map_data, FACE_INDEX_INT32, depth_map_data, nullptr, SILHOUETTE_INT32,
+        batch_size, num_faces, image_height, image_width, 32);
+    // 1つの画素のサンプルが複数のタイルにまたがらないようにする
+    int tile_size = supersampling * std::max(1, 32 / supersampling);
+    float sample_weight = 1.0f / (supersampling * supersampling);
+
+    rasterize_tiles(sample_face_vertices.data(), batch_size, num_faces, sample_height, sample_width, tile_size, false,
+        [&](int batch_index, int tile_xi_start, int tile_xi_end, int tile_yi_start, int tile_yi_end, const float* tile_depth_map, const int* tile_face_index_map,
+            const TriangleSetupTable& setup) {
+            for (int yi = tile_yi_start / supersampling; yi <= tile_yi_end / supersampling; yi++) {
+                ssize_t row_index = (ssize_t)batch_index * image_height + yi;
+                int tile_row_start = yi * supersampling - tile_yi_start;
+                for (int xi = tile_xi_start / supersampling; xi <= tile_xi_end / supersampling; xi++) {
+                    int tile_column_start = xi * supersampling - tile_xi_start;
+                    int num_covered_samples = 0;
+                    for (int sy = 0; sy < supersampling; sy++) {
+                        const int* tile_face_index_row = tile_face_index_map + (tile_row_start + sy) * tile_size + tile_column_start;
+                        for (int sx = 0; sx < supersampling; sx++) {
+                            if (tile_face_index_row[sx] != -1) {
+                                num_covered_samples++;
+                            }
+                        }
+                    }
+                    coverage_map_data[row_index * image_width + xi] = num_covered_samples * sample_weight;
+                }
+            }
+        });
+}
+
+void forward_face_index_map_tiled(
+    py::array_t<float, py::array::c_style> np_face_vertices,
+    py::array_t<int, py::array::c_style> np_face_index_map,
+    py::array_t<float, py::array::c_style> np_depth_map,
+    py::array_t<int, py::array::c_style> np_silhouette_image,
+    int tile_size,
+    bool front_to_back,
+    py::object np_weight_map)
+{
+    if (np_face_vertices.ndim() != 4) {
+        throw std::runtime_error("(np_face_vertices.ndim() != 4) -> false");
+    }
+    if (np_depth_map.ndim() != 3) {
+        throw std::runtime_error("(np_depth_map.ndim() != 3) -> false");
+    }
+    if (np_face_index_map.ndim() != 3) {
+        throw std::runtime_error("(np_face_index_map.ndim() != 3) -> false");
+    }
+    if (np_silhouette_image.ndim() != 3) {
+        throw std::runtime_error("(np_silhouette_image.ndim() != 3) -> false");
+    }
+
+    int batch_size = np_face_vertices.shape(0);
+    int num_faces = np_face_vertices.shape(1);
+    int image_height = np_silhouette_image.shape(1);
+    int image_width = np_silhouette_image.shape(2);
+    const float* face_vertices_data = np_face_vertices.data();
+    int* face_index_map_data = np_face_index_map.mutable_data();
+    float* depth_map_data = np_depth_map.mutable_data();
+    int* silhouette_image_data = np_silhouette_image.mutable_data();
+    float* weight_map_data = get_weight_map_data(np_weight_map, batch_size, image_height, image_width);
+
+    py::gil_scoped_release release;
+    forward_face_index_map_tiled(face_vertices_data, face_index_map_data, depth_map_data, silhouette_image_data,
+        batch_size, num_faces, image_height, image_width, tile_size, front_to_back, weight_map_data);
+}
+
+// numpy配列のdtypeから面番号マップの形式を決める
+FaceIndexFormat get_face_index_format(const py::array& np_face_index_map)
+{
+    if (py::isinstance<py::array_t<int, py::array::c_style>>(np_face_index_map)) {
+        return FACE_INDEX_INT32;
+    }
+    if (py::isinstance<py::array_t<uint16_t, py::array::c_style>>(np_face_index_map)) {
+        return FACE_INDEX_UINT16;
+    }
+    throw std::runtime_error("`np_face_index_map` must be a C-contiguous int32 or uint16 array.");
+}
+// numpy配列のdtypeからシルエットの形式を決める
+// packed = trueならビットを詰めたuint8の配列とみなす
+SilhouetteFormat get_silhouette_format(const py::array& np_silhouette_image, bool packed)
+{
+    if (py::isinstance<py::array_t<uint8_t, py::array::c_style>>(np_silhouette_image)) {
+        return packed ? SILHOUETTE_BITS : SILHOUETTE_UINT8;
+    }
+    if (packed == false && py::isinstance<py::array_t<int, py::array::c_style>>(np_silhouette_image)) {
+        return SILHOUETTE_INT32;
+    }
+    throw std::runtime_error(packed ? "`np_silhouette_image` must be a C-contiguous uint8 array."
+                                    : "`np_silhouette_image` must be a C-contiguous int32 or uint8 array.");
+}
+
+void forward_face_index_map_compact(
+    py::array_t<float, py::array::c_style> np_face_vertices,
+    py::array np_face_index_map,
+    py::object np_depth_map,
+    py::object np_silhouette_image,
+    bool packed_silhouette,
+    int tile_size,
+    bool front_to_back,
+    py::object np_weight_map)
+{
+    if (np_face_vertices.ndim() != 4) {
+        throw std::runtime_error("(np_face_vertices.ndim() != 4) -> false");
+    }
+    if (np_face_index_map.ndim() != 3) {
+        throw std::runtime_error("(np_face_index_map.ndim() != 3) -> false");
+    }
+    int batch_size = np_face_vertices.shape(0);
+    int num_faces = np_face_vertices.shape(1);
+    int image_height = np_face_index_map.shape(1);
+    int image_width = np_face_index_map.shape(2);
+    if (np_face_index_map.shape(0) != batch_size) {
+        throw std::runtime_error("(np_face_index_map.shape(0) == np_face_vertices.shape(0)) -> false");
+    }
+    FaceIndexFormat face_index_format = get_face_index_format(np_face_index_map);
+    void* face_index_map_data = np_face_index_map.mutable_data();
+
+    // 深度とシルエットはNoneなら書き込まない
+    float* depth_map_data = nullptr;
+    if (np_depth_map.is_none() == false) {
+        if (py::isinstance<py::array_t<float, py::array::c_style>>(np_depth_map) == false) {
+            throw std::runtime_error("`np_depth_map` must be a C-contiguous float32 array or None.");
+        }
+        py::array_t<float, py::array::c_style> np_depth_map_array = np_depth_map.cast<py::array_t<float, py::array::c_style>>();
+        if (np_depth_map_array.ndim() != 3 || np_depth_map_array.shape(0) != batch_size || np_depth_map_array.shape(1) != image_height || np_depth_map_array.shape(2) != image_width) {
+            throw std::runtime_error("`np_depth_map.shape` must be equal to `np_face_index_map.shape`.");
+        }
+        depth_map_data = np_depth_map_array.mutable_data();
+    }
+    SilhouetteFormat silhouette_format = SILHOUETTE_INT32;
+    void* silhouette_image_data = nullptr;
+    if (np_silhouette_image.is_none() == false) {
+        if (py::isinstance<py::array>(np_silhouette_image) == false) {
+            throw std::runtime_error("`np_silhouette_image` must be a numpy array or None.");
+        }
+        py::array np_silhouette_image_array = np_silhouette_image.cast<py::array>();
+        silhouette_format = get_silhouette_format(np_silhouette_image_array, packed_silhouette);
+        if (np_silhouette_image_array.ndim() != 3 || np_silhouette_image_array.shape(0) != batch_size || np_silhouette_image_array.shape(1) != image_height
+            || np_silhouette_image_array.shape(2) != silhouette_row_size(silhouette_format, image_width)) {
+            throw std::runtime_error(packed_silhouette ? "`np_silhouette_image.shape` must be equal to `(batch_size, image_height, (image_width + 7) // 8)`."
+                                                       : "`np_silhouette_image.shape` must be equal to `np_face_index_map.shape`.");
+        }
+        silhouette_image_data = np_silhouette_image_array.mutable_data();
+    }
+    float* weight_map_data = get_weight_map_data(np_weight_map, batch_size, image_height, image_width);
+    const float* face_vertices_data = np_face_vertices.data();
+
+    py::gil_scoped_release release;
+    forward_face_index_map_compact(face_vertices_data, face_index_map_data, face_index_format, depth_map_data, silhouette_image_data, silhouette_format,
+        batch_size, num_faces, image_height, image_width, tile_size, front_to_back, weight_map_data);
+}
+
+void forward_face_index_map_supersampled(
+    py::array_t<float, py::array::c_style> np_face_vertices,
+    py::array_t<int, py::array::c_style> np_face_index_map,
+    py::object np_depth_map,
+    py::array_t<float, py::array::c_style> np_coverage_map,
+    int supersampling)
+{
+    if (np_face_vertices.ndim() != 4 || np_face_vertices.shape(2) != 3 || np_face_vertices.shape(3) != 3) {
+        throw std::runtime_error("`np_face_vertices.shape` must be equal to `(batch_size, num_faces, 3, 3)`.");
+    }
+    if (np_face_index_map.ndim() != 3 || np_face_index_map.shape(0) != np_face_vertices.shape(0)) {
+        throw std::runtime_error("`np_face_index_map.shape` must be equal to `(batch_size, image_height, image_width)`.");
+    }
+    int batch_size = np_face_vertices.shape(0);
+    int num_faces = np_face_vertices.shape(1);
+    int image_height = np_face_index_map.shape(1);
+    int image_width = np_face_index_map.shape(2);
+    if (np_coverage_map.ndim() != 3 || np_coverage_map.shape(0) != batch_size || np_coverage_map.shape(1) != image_height || np_coverage_map.shape(2) != image_width) {
+        throw std::runtime_error("`np_coverage_map.shape` must be equal to `np_face_index_map.shape`.");
+    }
+    float* depth_map_data = nullptr;
+    if (np_depth_map.is_none() == false) {
+        if (py::isinstance<py::array_t<float, py::array::c_style>>(np_depth_map) == false) {
+            throw std::runtime_error("`np_depth_map` must be a C-contiguous float32 array or None.");
         }
+        py::array_t<float, py::array::c_style> np_depth_map_array = np_depth_map.cast<py::array_t<float, py::array::c_style>>();
+        if (np_depth_map_array.ndim() != 3 || np_depth_map_array.shape(0) != batch_size || np_depth_map_array.shape(1) != image_height || np_depth_map_array.shape(2) != image_width) {
+            throw std::runtime_error("`np_depth_map.shape` must be equal to `np_face_index_map.shape`.");
+        }
+        depth_map_data = np_depth_map_array.mutable_data();
+    }
+    const float* face_vertices_data = np_face_vertices.data();
+    int* face_index_map_data = np_face_index_map.mutable_data();
+    float* coverage_map_data = np_coverage_map.mutable_data();
+
+    py::gil_scoped_release release;
+    forward_face_index_map_supersampled(face_vertices_data, face_index_map_data, depth_map_data, coverage_map_data,
+        batch_size, num_faces, image_height, image_width, supersampling);
+}
+
+namespace {
+    std::atomic<bool> backward_per_pixel(false);
+}
+
+void set_backward_algorithm(const std::string& name)
+{
+    if (name != "accumulated" && name != "per_pixel") {
+        throw std::runtime_error("unknown backward algorithm: " + name);
     }
+    backward_per_pixel = (name == "per_pixel");
 }
+std::string get_backward_algorithm()
+{
+    return backward_per_pixel ? "per_pixel" : "accumulated";
+}
+
+// 勾配の計算で読む画素値と誤差
+// 画素値が辺の内側と外側で変わった分に誤差を掛けたものから勾配を求める
+// シルエットの画素値は0か255なので、勾配は255で割って画素値を[0, 1]にした場合に揃える
+class SilhouetteErrorImage {
+private:
+    SilhouetteView _pixel_map;
+    ArrayView2<const float> _grad_silhouette;
+
+public:
+    typedef int Pixel;
+    typedef float Error;
+    SilhouetteErrorImage(const SilhouetteView& pixel_map, const ArrayView2<const float>& grad_silhouette)
+        : _pixel_map(pixel_map)
+        , _grad_silhouette(grad_silhouette)
+    {
+    }
+    Pixel pixel(int y, int x) const
+    {
+        return _pixel_map(y, x);
+    }
+    Error error(int y, int x) const
+    {
+        return _grad_silhouette(y, x);
+    }
+    static bool is_zero(Error delta_pj)
+    {
+        return delta_pj == 0;
+    }
+    // 画素値の差pixel_a - pixel_bと誤差の積が負の場合だけその値を返し、それ以外は0を返す
+    static float product(Error delta_pj, Pixel pixel_a, Pixel pixel_b)
+    {
+        float delta_ij = pixel_a - pixel_b;
+        return (delta_pj * delta_ij >= 0) ? 0 : delta_pj * delta_ij;
+    }
+    static float scale()
+    {
+        return 255.0f;
+    }
+};
+
+// RGB画像の画素値と誤差
+// image, grad_imageは(image_height, image_width * 3)として参照し、チャネルごとの積を足し合わせる
+class ColorErrorImage {
+private:
+    ArrayView2<const float> _image;
+    ArrayView2<const float> _grad_image;
+
+public:
+    typedef const float* Pixel;
+    typedef const float* Error;
+    ColorErrorImage(const ArrayView2<const float>& image, const ArrayView2<const float>& grad_image)
+        : _image(image)
+        , _grad_image(grad_image)
+    {
+    }
+    Pixel pixel(int y, int x) const
+    {
+        return &_image(y, x * 3);
+    }
+    Error error(int y, int x) const
+    {
+        return &_grad_image(y, x * 3);
+    }
+    static bool is_zero(Error delta_pj)
+    {
+        return delta_pj[0] == 0 && delta_pj[1] == 0 && delta_pj[2] == 0;
+    }
+    static float product(Error delta_pj, Pixel pixel_a, Pixel pixel_b)
+    {
+        float sum = 0;
+        for (int channel = 0; channel < 3; channel++) {
+            float delta_ij = pixel_a[channel] - pixel_b[channel];
+            if (delta_pj[channel] * delta_ij < 0) {
+                sum += delta_pj[channel] * delta_ij;
+            }
+        }
+        return sum;
+    }
+    static float scale()
+    {
+        return 1.0f;
+    }
+};
 
+// 面が覆う割合を画素値とする画像
+// 割合は[0, 1]の小数なので、辺の内側と外側の画素値の差も小数になる
+class CoverageErrorImage {
+private:
+    ArrayView2<const float> _coverage_map;
+    ArrayView2<const float> _grad_coverage;
+
+public:
+    typedef float Pixel;
+    typedef float Error;
+    CoverageErrorImage(const ArrayView2<const float>& coverage_map, const ArrayView2<const float>& grad_coverage)
+        : _coverage_map(coverage_map)
+        , _grad_coverage(grad_coverage)
+    {
+    }
+    Pixel pixel(int y, int x) const
+    {
+        return _coverage_map(y, x);
+    }
+    Error error(int y, int x) const
+    {
+        return _grad_coverage(y, x);
+    }
+    static bool is_zero(Error delta_pj)
+    {
+        return delta_pj == 0;
+    }
+    static float product(Error delta_pj, Pixel pixel_a, Pixel pixel_b)
+    {
+        float delta_ij = pixel_a - pixel_b;
+        return (delta_pj * delta_ij >= 0) ? 0 : delta_pj * delta_ij;
+    }
+    static float scale()
+    {
+        return 1.0f;
+    }
+};
+
+template <typename ErrorImage>
 void compute_grad_y(
-    float xf_a,
-    float yf_a,
-    float xf_b,
-    float yf_b,
-    float xf_c,
-    float yf_c,
+    int xi_a,
+    int yi_a,
+    int xi_b,
+    int yi_b,
+    int xi_c,
+    int yi_c,
     int vertex_index_a,
     int vertex_index_b,
     int image_width,
     int image_height,
-    int num_vertices,
-    int target_batch_index,
     int target_face_index,
-    py::array_t<int, py::array::c_style>& np_face_index_map,
-    py::array_t<int, py::array::c_style>& np_pixel_map,
-    py::array_t<float, py::array::c_style>& np_grad_vertices,
-    py::array_t<float, py::array::c_style>& np_grad_silhouette,
-    py::array_t<float, py::array::c_style>& np_debug_grad_map)
-{
-    auto face_index_map = np_face_index_map.mutable_unchecked<3>();
-    auto pixel_map = np_pixel_map.mutable_unchecked<3>();
-    auto grad_vertices = np_grad_vertices.mutable_unchecked<3>();
-    auto grad_silhouette = np_grad_silhouette.mutable_unchecked<3>();
-    auto debug_grad_map = np_debug_grad_map.mutable_unchecked<3>();
-
-    // 画像座標系に変換
+    const ErrorImage& error_image,
+    const ArrayView2<float>& grad_face_vertices,
+    const ArrayView2<float>& debug_grad_map,
+    const FaceSpanTable& column_spans,
+    const NonZeroPixelTable& nonzero_columns)
+{
+    // 頂点の画像座標はTriangleSetupTableで変換済み
     // 左上が原点で右下が(image_width, image_height)になる
     // 画像配列に合わせるためそのような座標系になる
-    int xi_a = to_image_coordinate(xf_a, image_width);
-    int xi_b = to_image_coordinate(xf_b, image_width);
-    int xi_c = to_image_coordinate(xf_c, image_width);
-    // int yi_a = (image_height - 1) - to_image_coordinate(yf_a, image_height);
-    // int yi_b = (image_height - 1) - to_image_coordinate(yf_b, image_height);
-    // int yi_c = (image_height - 1) - to_image_coordinate(yf_c, image_height);
 
     // if (xi_a == xi_b) {
     //     return;
@@ -169,6 +934,15 @@ void compute_grad_y(
     // 辺上でx座標がpi_xの点を求める
     // 論文の図の点I_ijに相当（ここでは交点と呼ぶ）
     for (int xi_p = xi_p_start; xi_p <= xi_p_end; xi_p++) {
+        // この列に誤差のある画素がなければ勾配は0
+        if (nonzero_columns.count(xi_p) == 0) {
+            continue;
+        }
+        // この列に面が現れなければ辺に当たることはない
+        const FaceSpan* span = column_spans.find(target_face_index, xi_p);
+        if (span == nullptr) {
+            continue;
+        }
         // 辺に当たるまでy軸を走査
         // ここではスキャンラインと呼ぶことにする
         if (scan_direction == top_to_bottom) {
@@ -177,34 +951,27 @@ void compute_grad_y(
             int yi_s_end = image_height - 1; // 実際にはここに到達する前に辺に当たるはず
             int yi_s_edge = yi_s_start;
             // 最初から面の内部の場合はスキップ
-            int face_index = face_index_map(target_batch_index, yi_s_start, xi_p);
-            if (face_index == target_face_index) {
+            if (span->first_start == yi_s_start) {
                 continue;
             }
             // 外側の全ての画素から勾配を求める
             {
-                bool edge_found = false;
-                int pixel_value_inside = 0;
-                for (int yi_s = yi_s_start; yi_s <= yi_s_end; yi_s++) {
-                    int face_index = face_index_map(target_batch_index, yi_s, xi_p);
-                    if (face_index == target_face_index) {
-                        yi_s_edge = yi_s;
-                        pixel_value_inside = pixel_map(target_batch_index, yi_s, xi_p);
-                        edge_found = true;
-                        break;
-                    }
-                }
-                if (edge_found == false) {
-                    continue;
-                }
-                for (int yi_s = yi_s_start; yi_s < yi_s_edge; yi_s++) {
-                    int pixel_value_outside = pixel_map(target_batch_index, yi_s, xi_p);
-                    // 走査点と面の輝度値の差
-                    float delta_ij = pixel_value_inside - pixel_value_outside;
-                    float delta_pj = grad_silhouette(target_batch_index, yi_s, xi_p);
-                    if (delta_pj == 0) {
+                // スキャンライン上で最初に面に当たる画素
+                yi_s_edge = span->first_start;
+                typename ErrorImage::Pixel pixel_value_inside = error_image.pixel(yi_s_edge, xi_p);
+                // 0でない画素だけを走査する
+                const int* nonzero_first;
+                const int* nonzero_last;
+                nonzero_columns.range(xi_p, yi_s_start, yi_s_edge - 1, nonzero_first, nonzero_last);
+                for (const int* nonzero = nonzero_first; nonzero != nonzero_last; nonzero++) {
+                    int yi_s = *nonzero;
+                    typename ErrorImage::Pixel pixel_value_outside = error_image.pixel(yi_s, xi_p);
+                    typename ErrorImage::Error delta_pj = error_image.error(yi_s, xi_p);
+                    if (ErrorImage::is_zero(delta_pj)) {
                         continue;
                     }
+                    // 走査点と面の輝度値の差と誤差の積
+                    float delta_ij_pj = ErrorImage::product(delta_pj, pixel_value_inside, pixel_value_outside);
                     // 頂点の実際の移動量を求める
                     // スキャンライン上の移動距離ではない
                     // 相似な三角形なのでx方向の比率から求まる
@@ -213,9 +980,9 @@ void compute_grad_y(
                         if (xi_p - xi_p_start > 0) {
                             float moving_distance = (yi_s_edge - yi_s) / (float)(xi_p - xi_p_start) * (float)(xi_p_end - xi_p_start);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_a, 1) += grad;
-                                debug_grad_map(target_batch_index, yi_s, xi_p) += grad;
+                                float grad = delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_a, 1) += grad;
+                                debug_grad_map(yi_s, xi_p) += grad;
                             }
                         }
                     }
@@ -224,9 +991,9 @@ void compute_grad_y(
                         if (xi_p_end - xi_p > 0) {
                             float moving_distance = (yi_s_edge - yi_s) / (float)(xi_p_end - xi_p) * (float)(xi_p_end - xi_p_start);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_b, 1) += grad;
-                                debug_grad_map(target_batch_index, yi_s, xi_p) += grad;
+                                float grad = delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_b, 1) += grad;
+                                debug_grad_map(yi_s, xi_p) += grad;
                             }
                         }
                     }
@@ -234,32 +1001,28 @@ void compute_grad_y(
             }
             // 内側の全ての画素から勾配を求める
             {
-                int pixel_value_outside = pixel_map(target_batch_index, (yi_s_edge - 1), xi_p);
-                int yi_s_other_edge = image_height - 1;
-                int pixel_value_other_outside = 0;
-                bool edge_found = false;
-                // 反対側の辺の位置を特定する
-                for (int yi_s = yi_s_edge + 1; yi_s <= yi_s_end; yi_s++) {
-                    int face_index = face_index_map(target_batch_index, yi_s, xi_p);
-                    if (face_index != target_face_index) {
-                        yi_s_other_edge = yi_s - 1;
-                        pixel_value_other_outside = pixel_map(target_batch_index, yi_s, xi_p);
-                        edge_found = true;
-                        break;
-                    }
-                }
-                if (edge_found == false) {
+                typename ErrorImage::Pixel pixel_value_outside = error_image.pixel((yi_s_edge - 1), xi_p);
+                // 反対側の辺の位置は最初に面に当たった区間の終端
+                // 面が画像の端まで続いている場合はスキップ
+                if (span->first_end == yi_s_end) {
                     continue;
                 }
-                for (int yi_s = yi_s_edge; yi_s <= yi_s_other_edge; yi_s++) {
-                    int pixel_value_inside = pixel_map(target_batch_index, yi_s, xi_p);
-                    float delta_pj = grad_silhouette(target_batch_index, yi_s, xi_p);
-                    if (delta_pj == 0) {
+                int yi_s_other_edge = span->first_end;
+                typename ErrorImage::Pixel pixel_value_other_outside = error_image.pixel(yi_s_other_edge + 1, xi_p);
+                // 0でない画素だけを走査する
+                const int* nonzero_first;
+                const int* nonzero_last;
+                nonzero_columns.range(xi_p, yi_s_edge, yi_s_other_edge, nonzero_first, nonzero_last);
+                for (const int* nonzero = nonzero_first; nonzero != nonzero_last; nonzero++) {
+                    int yi_s = *nonzero;
+                    typename ErrorImage::Pixel pixel_value_inside = error_image.pixel(yi_s, xi_p);
+                    typename ErrorImage::Error delta_pj = error_image.error(yi_s, xi_p);
+                    if (ErrorImage::is_zero(delta_pj)) {
                         continue;
                     }
                     // 面の上側（頂点を下に動かしていって走査点が辺に当たる場合）
                     {
-                        float delta_ij = pixel_value_outside - pixel_value_inside;
+                        float delta_ij_pj = ErrorImage::product(delta_pj, pixel_value_outside, pixel_value_inside);
                         // 頂点Aについて
                         // 頂点の実際の移動量を求める
                         // スキャンライン上の移動距離ではない
@@ -267,9 +1030,9 @@ void compute_grad_y(
                         if (xi_p - xi_p_start > 0) {
                             float moving_distance = (yi_s - yi_s_edge) / (float)(xi_p - xi_p_start) * (float)(xi_p_end - xi_p_start);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : -delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_a, 1) += grad;
-                                debug_grad_map(target_batch_index, yi_s, xi_p) += grad;
+                                float grad = -delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_a, 1) += grad;
+                                debug_grad_map(yi_s, xi_p) += grad;
                             }
                         }
                         // 頂点Bについて
@@ -279,16 +1042,16 @@ void compute_grad_y(
                         if (xi_p_end - xi_p > 0) {
                             float moving_distance = (yi_s - yi_s_edge) / (float)(xi_p_end - xi_p) * (float)(xi_p_end - xi_p_start);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : -delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_b, 1) += grad;
-                                debug_grad_map(target_batch_index, yi_s, xi_p) += grad;
+                                float grad = -delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_b, 1) += grad;
+                                debug_grad_map(yi_s, xi_p) += grad;
                             }
                         }
                     }
 
                     // 面の下側（頂点を上に動かしていって走査点が辺に当たる場合）
                     {
-                        float delta_ij = pixel_value_other_outside - pixel_value_inside;
+                        float delta_ij_pj = ErrorImage::product(delta_pj, pixel_value_other_outside, pixel_value_inside);
                         // 頂点Aについて
                         // 頂点Cの位置によっては頂点Aをどれだけ移動させても辺が走査点に当たらないことがある
                         if (xi_p > xi_c) {
@@ -297,9 +1060,9 @@ void compute_grad_y(
                             // 相似な三角形なのでy方向の比率から求まる
                             float moving_distance = (yi_s_other_edge - yi_s) / (float)(xi_p - xi_c) * (float)(xi_p_end - xi_c);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_a, 1) += grad;
-                                debug_grad_map(target_batch_index, yi_s, xi_p) += grad;
+                                float grad = delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_a, 1) += grad;
+                                debug_grad_map(yi_s, xi_p) += grad;
                             }
                         }
                         // 頂点Bについて
@@ -309,9 +1072,9 @@ void compute_grad_y(
                             // 相似な三角形なのでy方向の比率から求まる
                             float moving_distance = (yi_s_other_edge - yi_s) / (float)(xi_c - xi_p) * (float)(xi_c - xi_p_start);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_b, 1) += grad;
-                                debug_grad_map(target_batch_index, yi_s, xi_p) += grad;
+                                float grad = delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_b, 1) += grad;
+                                debug_grad_map(yi_s, xi_p) += grad;
                             }
                         }
                     }
@@ -322,41 +1085,34 @@ void compute_grad_y(
             int yi_s_end = 0;
             int yi_s_edge = yi_s_start;
             // 最初から面の内部の場合はスキップ
-            int face_index = face_index_map(target_batch_index, yi_s_start, xi_p);
-            if (face_index == target_face_index) {
+            if (span->last_end == yi_s_start) {
                 continue;
             }
             // 外側の全ての画素から勾配を求める
             {
-                bool edge_found = false;
-                int pixel_value_inside = 0;
-                for (int yi_s = yi_s_start; yi_s >= yi_s_end; yi_s--) {
-                    int face_index = face_index_map(target_batch_index, yi_s, xi_p);
-                    if (face_index == target_face_index) {
-                        yi_s_edge = yi_s;
-                        pixel_value_inside = pixel_map(target_batch_index, yi_s, xi_p);
-                        edge_found = true;
-                        break;
-                    }
-                }
-                if (edge_found == false) {
-                    continue;
-                }
-                for (int yi_s = yi_s_start; yi_s > yi_s_edge; yi_s--) {
-                    int pixel_value_outside = pixel_map(target_batch_index, yi_s, xi_p);
-                    float delta_ij = pixel_value_inside - pixel_value_outside;
-                    float delta_pj = grad_silhouette(target_batch_index, yi_s, xi_p);
-                    if (delta_pj == 0) {
+                // スキャンライン上で最初に面に当たる画素
+                yi_s_edge = span->last_end;
+                typename ErrorImage::Pixel pixel_value_inside = error_image.pixel(yi_s_edge, xi_p);
+                // 0でない画素だけを走査する
+                const int* nonzero_first;
+                const int* nonzero_last;
+                nonzero_columns.range(xi_p, yi_s_edge + 1, yi_s_start, nonzero_first, nonzero_last);
+                for (const int* nonzero = nonzero_last; nonzero != nonzero_first;) {
+                    int yi_s = *--nonzero;
+                    typename ErrorImage::Pixel pixel_value_outside = error_image.pixel(yi_s, xi_p);
+                    typename ErrorImage::Error delta_pj = error_image.error(yi_s, xi_p);
+                    if (ErrorImage::is_zero(delta_pj)) {
                         continue;
                     }
+                    float delta_ij_pj = ErrorImage::product(delta_pj, pixel_value_inside, pixel_value_outside);
                     // 頂点Aについて
                     {
                         if (xi_p - xi_p_start > 0) {
                             float moving_distance = (yi_s - yi_s_edge) / (float)(xi_p - xi_p_start) * (float)(xi_p_end - xi_p_start);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : -delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_b, 1) += grad;
-                                debug_grad_map(target_batch_index, yi_s, xi_p) += grad;
+                                float grad = -delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_b, 1) += grad;
+                                debug_grad_map(yi_s, xi_p) += grad;
                             }
                         }
                     }
@@ -365,9 +1121,9 @@ void compute_grad_y(
                         if (xi_p_end - xi_p > 0) {
                             float moving_distance = (yi_s - yi_s_edge) / (float)(xi_p_end - xi_p) * (float)(xi_p_end - xi_p_start);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : -delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_a, 1) += grad;
-                                debug_grad_map(target_batch_index, yi_s, xi_p) += grad;
+                                float grad = -delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_a, 1) += grad;
+                                debug_grad_map(yi_s, xi_p) += grad;
                             }
                         }
                     }
@@ -375,32 +1131,28 @@ void compute_grad_y(
             }
             // 内側の全ての画素から勾配を求める
             {
-                int pixel_value_outside = pixel_map(target_batch_index, (yi_s_edge + 1), xi_p);
-                int yi_s_other_edge = 0;
-                int pixel_value_other_outside = 0;
-                bool edge_found = false;
-                // 反対側の辺の位置を特定する
-                for (int yi_s = yi_s_edge - 1; yi_s >= yi_s_end; yi_s--) {
-                    int face_index = face_index_map(target_batch_index, yi_s, xi_p);
-                    if (face_index != target_face_index) {
-                        yi_s_other_edge = yi_s + 1;
-                        pixel_value_other_outside = pixel_map(target_batch_index, yi_s, xi_p);
-                        edge_found = true;
-                        break;
-                    }
-                }
-                if (edge_found == false) {
+                typename ErrorImage::Pixel pixel_value_outside = error_image.pixel((yi_s_edge + 1), xi_p);
+                // 反対側の辺の位置は最初に面に当たった区間の終端
+                // 面が画像の端まで続いている場合はスキップ
+                if (span->last_start == yi_s_end) {
                     continue;
                 }
-                for (int yi_s = yi_s_edge; yi_s >= yi_s_other_edge; yi_s--) {
-                    int pixel_value_inside = pixel_map(target_batch_index, yi_s, xi_p);
-                    float delta_pj = grad_silhouette(target_batch_index, yi_s, xi_p);
-                    if (delta_pj == 0) {
+                int yi_s_other_edge = span->last_start;
+                typename ErrorImage::Pixel pixel_value_other_outside = error_image.pixel(yi_s_other_edge - 1, xi_p);
+                // 0でない画素だけを走査する
+                const int* nonzero_first;
+                const int* nonzero_last;
+                nonzero_columns.range(xi_p, yi_s_other_edge, yi_s_edge, nonzero_first, nonzero_last);
+                for (const int* nonzero = nonzero_last; nonzero != nonzero_first;) {
+                    int yi_s = *--nonzero;
+                    typename ErrorImage::Pixel pixel_value_inside = error_image.pixel(yi_s, xi_p);
+                    typename ErrorImage::Error delta_pj = error_image.error(yi_s, xi_p);
+                    if (ErrorImage::is_zero(delta_pj)) {
                         continue;
                     }
                     // 面の上側（頂点を下に動かしていって走査点が辺に当たる場合）
                     {
-                        float delta_ij = pixel_value_other_outside - pixel_value_inside;
+                        float delta_ij_pj = ErrorImage::product(delta_pj, pixel_value_other_outside, pixel_value_inside);
                         // 頂点Aについて
                         // 頂点Cの位置によっては頂点Aをどれだけ移動させても辺が走査点に当たらないことがある
                         if (xi_p < xi_c) {
@@ -409,9 +1161,9 @@ void compute_grad_y(
                             // 相似な三角形なのでy方向の比率から求まる
                             float moving_distance = (yi_s - yi_s_other_edge) / (float)(xi_c - xi_p) * (float)(xi_c - xi_p_start);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : -delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_a, 1) += grad;
-                                debug_grad_map(target_batch_index, yi_s, xi_p) += grad;
+                                float grad = -delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_a, 1) += grad;
+                                debug_grad_map(yi_s, xi_p) += grad;
                             }
                         }
                         // 頂点Bについて
@@ -421,15 +1173,15 @@ void compute_grad_y(
                             // 相似な三角形なのでy方向の比率から求まる
                             float moving_distance = (yi_s - yi_s_other_edge) / (float)(xi_p - xi_c) * (float)(xi_p_end - xi_c);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : -delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_b, 1) += grad;
-                                debug_grad_map(target_batch_index, yi_s, xi_p) += grad;
+                                float grad = -delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_b, 1) += grad;
+                                debug_grad_map(yi_s, xi_p) += grad;
                             }
                         }
                     }
                     // 面の下側（頂点を上に動かしていって走査点が辺に当たる場合）
                     {
-                        float delta_ij = pixel_value_outside - pixel_value_inside;
+                        float delta_ij_pj = ErrorImage::product(delta_pj, pixel_value_outside, pixel_value_inside);
                         // 頂点Aについて
                         if (xi_p_end - xi_p > 0) {
                             // 頂点の実際の移動量を求める
@@ -437,9 +1189,9 @@ void compute_grad_y(
                             // 相似な三角形なのでy方向の比率から求まる
                             float moving_distance = (yi_s_edge - yi_s) / (float)(xi_p_end - xi_p) * (float)(xi_p_end - xi_p_start);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_a, 1) += grad;
-                                debug_grad_map(target_batch_index, yi_s, xi_p) += grad;
+                                float grad = delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_a, 1) += grad;
+                                debug_grad_map(yi_s, xi_p) += grad;
                             }
                         }
                         // 頂点Bについて
@@ -449,9 +1201,9 @@ void compute_grad_y(
                             // 相似な三角形なのでy方向の比率から求まる
                             float moving_distance = (yi_s_edge - yi_s) / (float)(xi_p - xi_p_start) * (float)(xi_p_end - xi_p_start);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_b, 1) += grad;
-                                debug_grad_map(target_batch_index, yi_s, xi_p) += grad;
+                                float grad = delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_b, 1) += grad;
+                                debug_grad_map(yi_s, xi_p) += grad;
                             }
                         }
                     }
@@ -462,41 +1214,28 @@ void compute_grad_y(
     // y方向の各画素を走査
 }
 
+template <typename ErrorImage>
 void compute_grad_x(
-    float xf_a,
-    float yf_a,
-    float xf_b,
-    float yf_b,
-    float xf_c,
-    float yf_c,
+    int xi_a,
+    int yi_a,
+    int xi_b,
+    int yi_b,
+    int xi_c,
+    int yi_c,
     int vertex_index_a,
     int vertex_index_b,
     int image_width,
     int image_height,
-    int num_vertices,
-    int target_batch_index,
     int target_face_index,
-    py::array_t<int, py::array::c_style>& np_face_index_map,
-    py::array_t<int, py::array::c_style>& np_pixel_map,
-    py::array_t<float, py::array::c_style>& np_grad_vertices,
-    py::array_t<float, py::array::c_style>& np_grad_silhouette,
-    py::array_t<float, py::array::c_style>& np_debug_grad_map)
-{
-    auto face_index_map = np_face_index_map.mutable_unchecked<3>();
-    auto pixel_map = np_pixel_map.mutable_unchecked<3>();
-    auto grad_vertices = np_grad_vertices.mutable_unchecked<3>();
-    auto grad_silhouette = np_grad_silhouette.mutable_unchecked<3>();
-    auto debug_grad_map = np_debug_grad_map.mutable_unchecked<3>();
-
-    // 画像座標系に変換
+    const ErrorImage& error_image,
+    const ArrayView2<float>& grad_face_vertices,
+    const ArrayView2<float>& debug_grad_map,
+    const FaceSpanTable& row_spans,
+    const NonZeroPixelTable& nonzero_rows)
+{
+    // 頂点の画像座標はTriangleSetupTableで変換済み
     // 左上が原点で右下が(image_width, image_height)になる
     // 画像配列に合わせるためそのような座標系になる
-    // int xi_a = to_image_coordinate(xf_a, image_width);
-    // int xi_b = to_image_coordinate(xf_b, image_width);
-    // int xi_c = to_image_coordinate(xf_c, image_width);
-    int yi_a = (image_height - 1) - to_image_coordinate(yf_a, image_height);
-    int yi_b = (image_height - 1) - to_image_coordinate(yf_b, image_height);
-    int yi_c = (image_height - 1) - to_image_coordinate(yf_c, image_height);
 
     // if (yi_a == yi_b) {
     //     return;
@@ -516,6 +1255,15 @@ void compute_grad_x(
     // 辺上でy座標がyi_pの点を求める
     // 論文の図の点I_ijに相当（ここでは交点と呼ぶ）
     for (int yi_p = yi_p_start; yi_p <= yi_p_end; yi_p++) {
+        // この行に誤差のある画素がなければ勾配は0
+        if (nonzero_rows.count(yi_p) == 0) {
+            continue;
+        }
+        // この行に面が現れなければ辺に当たることはない
+        const FaceSpan* span = row_spans.find(target_face_index, yi_p);
+        if (span == nullptr) {
+            continue;
+        }
         // 辺に当たるまでx軸を走査
         // ここではスキャンラインと呼ぶことにする
         if (scan_direction == left_to_right) {
@@ -524,34 +1272,27 @@ void compute_grad_x(
             int si_x_end = image_width - 1; // 実際にはここに到達する前に辺に当たるはず
             int xi_s_edge = si_x_start;
             // 最初から面の内部の場合はスキップ
-            int face_index = face_index_map(target_batch_index, yi_p, si_x_start);
-            if (face_index == target_face_index) {
+            if (span->first_start == si_x_start) {
                 continue;
             }
             // 外側の全ての画素から勾配を求める
             {
-                bool edge_found = false;
-                int pixel_value_inside = 0;
-                for (int xi_s = si_x_start; xi_s <= si_x_end; xi_s++) {
-                    int face_index = face_index_map(target_batch_index, yi_p, xi_s);
-                    if (face_index == target_face_index) {
-                        xi_s_edge = xi_s;
-                        pixel_value_inside = pixel_map(target_batch_index, yi_p, xi_s);
-                        edge_found = true;
-                        break;
-                    }
-                }
-                if (edge_found == false) {
-                    continue;
-                }
-                for (int xi_s = si_x_start; xi_s < xi_s_edge; xi_s++) {
-                    int pixel_value_outside = pixel_map(target_batch_index, yi_p, xi_s);
-                    float delta_pj = grad_silhouette(target_batch_index, yi_p, xi_s);
-                    if (delta_pj == 0) {
+                // スキャンライン上で最初に面に当たる画素
+                xi_s_edge = span->first_start;
+                typename ErrorImage::Pixel pixel_value_inside = error_image.pixel(yi_p, xi_s_edge);
+                // 0でない画素だけを走査する
+                const int* nonzero_first;
+                const int* nonzero_last;
+                nonzero_rows.range(yi_p, si_x_start, xi_s_edge - 1, nonzero_first, nonzero_last);
+                for (const int* nonzero = nonzero_first; nonzero != nonzero_last; nonzero++) {
+                    int xi_s = *nonzero;
+                    typename ErrorImage::Pixel pixel_value_outside = error_image.pixel(yi_p, xi_s);
+                    typename ErrorImage::Error delta_pj = error_image.error(yi_p, xi_s);
+                    if (ErrorImage::is_zero(delta_pj)) {
                         continue;
                     }
-                    // 走査点と面の輝度値の差
-                    float delta_ij = pixel_value_inside - pixel_value_outside;
+                    // 走査点と面の輝度値の差と誤差の積
+                    float delta_ij_pj = ErrorImage::product(delta_pj, pixel_value_inside, pixel_value_outside);
                     // 頂点の実際の移動量を求める
                     // スキャンライン上の移動距離ではない
                     // 相似な三角形なのでy方向の比率から求まる
@@ -560,9 +1301,9 @@ void compute_grad_x(
                         float moving_distance = (xi_s_edge - xi_s) / (float)(yi_p_end - yi_p) * (float)(yi_p_end - yi_p_start);
                         if (moving_distance > 0) {
                             // 左側は勾配が逆向きになる
-                            float grad = (delta_pj * delta_ij >= 0) ? 0 : -delta_pj * delta_ij / moving_distance / 255.0f;
-                            grad_vertices(target_batch_index, vertex_index_a, 0) += grad;
-                            debug_grad_map(target_batch_index, yi_p, xi_s) += grad;
+                            float grad = -delta_ij_pj / moving_distance / ErrorImage::scale();
+                            grad_face_vertices(vertex_index_a, 0) += grad;
+                            debug_grad_map(yi_p, xi_s) += grad;
                         }
                     }
                     // 頂点Bについて
@@ -570,42 +1311,38 @@ void compute_grad_x(
                         float moving_distance = (xi_s_edge - xi_s) / (float)(yi_p - yi_p_start) * (float)(yi_p_end - yi_p_start);
                         if (moving_distance > 0) {
                             // 左側は勾配が逆向きになる
-                            float grad = (delta_pj * delta_ij >= 0) ? 0 : -delta_pj * delta_ij / moving_distance / 255.0f;
-                            grad_vertices(target_batch_index, vertex_index_b, 0) += grad;
-                            debug_grad_map(target_batch_index, yi_p, xi_s) += grad;
+                            float grad = -delta_ij_pj / moving_distance / ErrorImage::scale();
+                            grad_face_vertices(vertex_index_b, 0) += grad;
+                            debug_grad_map(yi_p, xi_s) += grad;
                         }
                     }
                 }
             }
             // 内側の全ての画素から勾配を求める
             {
-                int pixel_value_outside = pixel_map(target_batch_index, yi_p, xi_s_edge - 1);
-                int xi_s_other_edge = image_width - 1;
-                int pixel_value_other_outside = 0;
-                bool edge_found = false;
-                // 反対側の辺の位置を特定する
-                for (int xi_s = xi_s_edge + 1; xi_s <= si_x_end; xi_s++) {
-                    int face_index = face_index_map(target_batch_index, yi_p, xi_s);
-                    if (face_index != target_face_index) {
-                        xi_s_other_edge = xi_s - 1;
-                        pixel_value_other_outside = pixel_map(target_batch_index, yi_p, xi_s);
-                        edge_found = true;
-                        break;
-                    }
-                }
-                if (edge_found == false) {
+                typename ErrorImage::Pixel pixel_value_outside = error_image.pixel(yi_p, xi_s_edge - 1);
+                // 反対側の辺の位置は最初に面に当たった区間の終端
+                // 面が画像の端まで続いている場合はスキップ
+                if (span->first_end == si_x_end) {
                     continue;
                 }
-                for (int xi_s = xi_s_edge; xi_s <= xi_s_other_edge; xi_s++) {
-                    int pixel_value_inside = pixel_map(target_batch_index, yi_p, xi_s);
-                    float delta_pj = grad_silhouette(target_batch_index, yi_p, xi_s);
-                    if (delta_pj == 0) {
+                int xi_s_other_edge = span->first_end;
+                typename ErrorImage::Pixel pixel_value_other_outside = error_image.pixel(yi_p, xi_s_other_edge + 1);
+                // 0でない画素だけを走査する
+                const int* nonzero_first;
+                const int* nonzero_last;
+                nonzero_rows.range(yi_p, xi_s_edge, xi_s_other_edge, nonzero_first, nonzero_last);
+                for (const int* nonzero = nonzero_first; nonzero != nonzero_last; nonzero++) {
+                    int xi_s = *nonzero;
+                    typename ErrorImage::Pixel pixel_value_inside = error_image.pixel(yi_p, xi_s);
+                    typename ErrorImage::Error delta_pj = error_image.error(yi_p, xi_s);
+                    if (ErrorImage::is_zero(delta_pj)) {
                         continue;
                     }
                     // 面の左側（頂点を右に動かしていって辺に当たる場合）
                     // 論文のdelta_ij_bに対応
                     {
-                        float delta_ij = pixel_value_outside - pixel_value_inside;
+                        float delta_ij_pj = ErrorImage::product(delta_pj, pixel_value_outside, pixel_value_inside);
                         // 頂点Aについて
                         // 頂点の実際の移動量を求める
                         // スキャンライン上の移動距離ではない
@@ -613,9 +1350,9 @@ void compute_grad_x(
                         if (yi_p - yi_p_start > 0) {
                             float moving_distance = (xi_s - xi_s_edge) / (float)(yi_p_end - yi_p) * (float)(yi_p_end - yi_p_start);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_a, 0) += grad;
-                                debug_grad_map(target_batch_index, yi_p, xi_s) += grad;
+                                float grad = delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_a, 0) += grad;
+                                debug_grad_map(yi_p, xi_s) += grad;
                             }
                         }
                         // 頂点Bについて
@@ -625,9 +1362,9 @@ void compute_grad_x(
                         if (yi_p_end - yi_p > 0) {
                             float moving_distance = (xi_s - xi_s_edge) / (float)(yi_p - yi_p_start) * (float)(yi_p_end - yi_p_start);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_b, 0) += grad;
-                                debug_grad_map(target_batch_index, yi_p, xi_s) += grad;
+                                float grad = delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_b, 0) += grad;
+                                debug_grad_map(yi_p, xi_s) += grad;
                             }
                         }
                     }
@@ -635,7 +1372,7 @@ void compute_grad_x(
                     // 面の右側（頂点を左に動かしていって辺に当たる場合）
                     // 論文のdelta_ij_aに対応
                     {
-                        float delta_ij = pixel_value_other_outside - pixel_value_inside;
+                        float delta_ij_pj = ErrorImage::product(delta_pj, pixel_value_other_outside, pixel_value_inside);
                         // 頂点Aについて
                         // 頂点Cの位置によっては頂点Aをどれだけ移動させても辺が走査点に当たらないことがある
                         if (yi_p < yi_c) {
@@ -644,9 +1381,9 @@ void compute_grad_x(
                             // 相似な三角形なのでy方向の比率から求まる
                             float moving_distance = (xi_s_other_edge - xi_s) / (float)(yi_c - yi_p) * (float)(yi_c - yi_p_start);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : -delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_a, 0) += grad;
-                                debug_grad_map(target_batch_index, yi_p, xi_s) += grad;
+                                float grad = -delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_a, 0) += grad;
+                                debug_grad_map(yi_p, xi_s) += grad;
                             }
                         }
                         // 頂点Bについて
@@ -656,9 +1393,9 @@ void compute_grad_x(
                             // 相似な三角形なのでy方向の比率から求まる
                             float moving_distance = (xi_s_other_edge - xi_s) / (float)(yi_p - yi_c) * (float)(yi_p_end - yi_c);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : -delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_b, 0) += grad;
-                                debug_grad_map(target_batch_index, yi_p, xi_s) += grad;
+                                float grad = -delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_b, 0) += grad;
+                                debug_grad_map(yi_p, xi_s) += grad;
                             }
                         }
                     }
@@ -669,51 +1406,44 @@ void compute_grad_x(
             int si_x_end = 0;
             int xi_s_edge = si_x_start;
             // 最初から面の内部の場合はスキップ
-            int face_index = face_index_map(target_batch_index, yi_p, si_x_start);
-            if (face_index == target_face_index) {
+            if (span->last_end == si_x_start) {
                 continue;
             }
             // 外側の全ての画素から勾配を求める
             {
-                bool edge_found = false;
-                int pixel_value_inside = 0;
-                for (int xi_s = si_x_start; xi_s >= si_x_end; xi_s--) {
-                    int face_index = face_index_map(target_batch_index, yi_p, xi_s);
-                    if (face_index == target_face_index) {
-                        xi_s_edge = xi_s;
-                        pixel_value_inside = pixel_map(target_batch_index, yi_p, xi_s);
-                        edge_found = true;
-                        break;
-                    }
-                }
-                if (edge_found == false) {
-                    continue;
-                }
+                // スキャンライン上で最初に面に当たる画素
+                xi_s_edge = span->last_end;
+                typename ErrorImage::Pixel pixel_value_inside = error_image.pixel(yi_p, xi_s_edge);
                 if (xi_s_edge < si_x_start) {
-                    for (int xi_s = si_x_start; xi_s > xi_s_edge; xi_s--) {
-                        int pixel_value_outside = pixel_map(target_batch_index, yi_p, xi_s);
-                        float delta_ij = pixel_value_inside - pixel_value_outside;
-                        float delta_pj = grad_silhouette(target_batch_index, yi_p, xi_s);
-                        if (delta_pj == 0) {
+                    // 0でない画素だけを走査する
+                    const int* nonzero_first;
+                    const int* nonzero_last;
+                    nonzero_rows.range(yi_p, xi_s_edge + 1, si_x_start, nonzero_first, nonzero_last);
+                    for (const int* nonzero = nonzero_last; nonzero != nonzero_first;) {
+                        int xi_s = *--nonzero;
+                        typename ErrorImage::Pixel pixel_value_outside = error_image.pixel(yi_p, xi_s);
+                        typename ErrorImage::Error delta_pj = error_image.error(yi_p, xi_s);
+                        if (ErrorImage::is_zero(delta_pj)) {
                             continue;
                         }
+                        float delta_ij_pj = ErrorImage::product(delta_pj, pixel_value_inside, pixel_value_outside);
 
                         // 頂点Aについて
                         if (yi_p - yi_p_start > 0) {
                             float moving_distance = (xi_s - xi_s_edge) / (float)(yi_p - yi_p_start) * (float)(yi_p_end - yi_p_start);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_a, 0) += grad;
-                                debug_grad_map(target_batch_index, yi_p, xi_s) += grad;
+                                float grad = delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_a, 0) += grad;
+                                debug_grad_map(yi_p, xi_s) += grad;
                             }
                         }
                         // 頂点Bについて
                         if (yi_p_end - yi_p > 0) {
                             float moving_distance = (xi_s - xi_s_edge) / (float)(yi_p_end - yi_p) * (float)(yi_p_end - yi_p_start);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_b, 0) += grad;
-                                debug_grad_map(target_batch_index, yi_p, xi_s) += grad;
+                                float grad = delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_b, 0) += grad;
+                                debug_grad_map(yi_p, xi_s) += grad;
                             }
                         }
                     }
@@ -721,33 +1451,29 @@ void compute_grad_x(
             }
             // 内側の全ての画素から勾配を求める
             {
-                int pixel_value_outside = pixel_map(target_batch_index, yi_p, xi_s_edge + 1);
-                int xi_s_other_edge = 0;
-                int pixel_value_other_outside = 0;
-                bool edge_found = false;
-                // 反対側の辺の位置を特定する
-                for (int xi_s = xi_s_edge - 1; xi_s >= si_x_end; xi_s--) {
-                    int face_index = face_index_map(target_batch_index, yi_p, xi_s);
-                    if (face_index != target_face_index) {
-                        xi_s_other_edge = xi_s + 1;
-                        pixel_value_other_outside = pixel_map(target_batch_index, yi_p, xi_s);
-                        edge_found = true;
-                        break;
-                    }
-                }
-                if (edge_found == false) {
+                typename ErrorImage::Pixel pixel_value_outside = error_image.pixel(yi_p, xi_s_edge + 1);
+                // 反対側の辺の位置は最初に面に当たった区間の終端
+                // 面が画像の端まで続いている場合はスキップ
+                if (span->last_start == si_x_end) {
                     continue;
                 }
-                for (int xi_s = xi_s_edge; xi_s >= xi_s_other_edge; xi_s--) {
-                    int pixel_value_inside = pixel_map(target_batch_index, yi_p, xi_s);
-                    float delta_pj = grad_silhouette(target_batch_index, yi_p, xi_s);
-                    if (delta_pj == 0) {
+                int xi_s_other_edge = span->last_start;
+                typename ErrorImage::Pixel pixel_value_other_outside = error_image.pixel(yi_p, xi_s_other_edge - 1);
+                // 0でない画素だけを走査する
+                const int* nonzero_first;
+                const int* nonzero_last;
+                nonzero_rows.range(yi_p, xi_s_other_edge, xi_s_edge, nonzero_first, nonzero_last);
+                for (const int* nonzero = nonzero_last; nonzero != nonzero_first;) {
+                    int xi_s = *--nonzero;
+                    typename ErrorImage::Pixel pixel_value_inside = error_image.pixel(yi_p, xi_s);
+                    typename ErrorImage::Error delta_pj = error_image.error(yi_p, xi_s);
+                    if (ErrorImage::is_zero(delta_pj)) {
                         continue;
                     }
                     // 面の左側（頂点を右に動かしていって走査点が辺に当たる場合）
                     // 論文のdelta_ij_bに対応
                     {
-                        float delta_ij = pixel_value_other_outside - pixel_value_inside;
+                        float delta_ij_pj = ErrorImage::product(delta_pj, pixel_value_other_outside, pixel_value_inside);
                         // 頂点Aについて
                         // 頂点Cの位置によっては頂点Aをどれだけ移動させても辺が走査点に当たらないことがある
                         if (yi_p > yi_c) {
@@ -756,9 +1482,9 @@ void compute_grad_x(
                             // 相似な三角形なのでy方向の比率から求まる
                             float moving_distance = (xi_s - xi_s_other_edge) / (float)(yi_p - yi_c) * (float)(yi_p_end - yi_c);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_a, 0) += grad;
-                                debug_grad_map(target_batch_index, yi_p, xi_s) += grad;
+                                float grad = delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_a, 0) += grad;
+                                debug_grad_map(yi_p, xi_s) += grad;
                             }
                         }
                         // 頂点Bについて
@@ -768,16 +1494,16 @@ void compute_grad_x(
                             // 相似な三角形なのでy方向の比率から求まる
                             float moving_distance = (xi_s - xi_s_other_edge) / (float)(yi_p - yi_c) * (float)(yi_c - yi_p_start);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_b, 0) += grad;
-                                debug_grad_map(target_batch_index, yi_p, xi_s) += grad;
+                                float grad = delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_b, 0) += grad;
+                                debug_grad_map(yi_p, xi_s) += grad;
                             }
                         }
                     }
                     // 面の右側（頂点を左に動かしていって辺に当たる場合）
                     // 論文のdelta_ij_aに対応
                     {
-                        float delta_ij = pixel_value_outside - pixel_value_inside;
+                        float delta_ij_pj = ErrorImage::product(delta_pj, pixel_value_outside, pixel_value_inside);
                         // 頂点Aについて
                         // 頂点Cの位置によっては頂点Aをどれだけ移動させても辺が走査点に当たらないことがある
                         if (yi_p - yi_p_start > 0) {
@@ -786,9 +1512,9 @@ void compute_grad_x(
                             // 相似な三角形なのでy方向の比率から求まる
                             float moving_distance = (xi_s_edge - xi_s) / (float)(yi_p - yi_p_start) * (float)(yi_p_end - yi_p_start);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : -delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_a, 0) += grad;
-                                debug_grad_map(target_batch_index, yi_p, xi_s) += grad;
+                                float grad = -delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_a, 0) += grad;
+                                debug_grad_map(yi_p, xi_s) += grad;
                             }
                         }
                         // 頂点Bについて
@@ -798,9 +1524,9 @@ void compute_grad_x(
                             // 相似な三角形なのでy方向の比率から求まる
                             float moving_distance = (xi_s_edge - xi_s) / (float)(yi_p_end - yi_p) * (float)(yi_p_end - yi_p_start);
                             if (moving_distance > 0) {
-                                float grad = (delta_pj * delta_ij >= 0) ? 0 : -delta_pj * delta_ij / moving_distance / 255.0f;
-                                grad_vertices(target_batch_index, vertex_index_b, 0) += grad;
-                                debug_grad_map(target_batch_index, yi_p, xi_s) += grad;
+                                float grad = -delta_ij_pj / moving_distance / ErrorImage::scale();
+                                grad_face_vertices(vertex_index_b, 0) += grad;
+                                debug_grad_map(yi_p, xi_s) += grad;
                             }
                         }
                     }
@@ -811,71 +1537,716 @@ void compute_grad_x(
     // y方向の各画素を走査
 }
 
+// 頂点の移動量 distance / denominator * numerator が正になる場合の比率 denominator / numerator
+// conditionがfalseか移動量が正にならない場合は0を返す
+inline float moving_ratio(bool condition, int denominator, int numerator)
+{
+    if (condition == false) {
+        return 0;
+    }
+    if ((denominator > 0 && numerator > 0) || (denominator < 0 && numerator < 0)) {
+        return denominator / (float)numerator;
+    }
+    return 0;
+}
+
+// 走査線lineの誤差のある画素[nonzero_first, nonzero_last)について、画素値がpixel_value_referenceに変わる場合の勾配を求める
+// 各画素の勾配は product / |位置 - anchor| に頂点ごとの比率ratio_*を掛けたものなので、
+// 区間の和を1度求めてから比率を掛ける
+// verticalがtrueなら走査線は列で、位置はy座標になる
+template <typename ErrorImage>
+void accumulate_run(
+    const ErrorImage& error_image,
+    bool vertical,
+    int line,
+    const int* nonzero_first,
+    const int* nonzero_last,
+    typename ErrorImage::Pixel pixel_value_reference,
+    int anchor,
+    float sign,
+    int vertex_index_a,
+    float ratio_a,
+    int vertex_index_b,
+    float ratio_b,
+    int axis,
+    const float* inverse_distances,
+    const ArrayView2<float>& grad_face_vertices,
+    const ArrayView2<float>& debug_grad_map)
+{
+    if (ratio_a == 0 && ratio_b == 0) {
+        return;
+    }
+    float debug_factor = sign * (ratio_a + ratio_b) / ErrorImage::scale();
+    float sum = 0;
+    for (const int* nonzero = nonzero_first; nonzero != nonzero_last; nonzero++) {
+        int position = *nonzero;
+        int distance = (position > anchor) ? position - anchor : anchor - position;
+        if (distance == 0) {
+            continue;
+        }
+        int yi = vertical ? position : line;
+        int xi = vertical ? line : position;
+        typename ErrorImage::Error delta_pj = error_image.error(yi, xi);
+        if (ErrorImage::is_zero(delta_pj)) {
+            continue;
+        }
+        float delta_ij_pj = ErrorImage::product(delta_pj, pixel_value_reference, error_image.pixel(yi, xi));
+        float contribution = delta_ij_pj * inverse_distances[distance];
+        sum += contribution;
+        debug_grad_map(yi, xi) += contribution * debug_factor;
+    }
+    grad_face_vertices(vertex_index_a, axis) += sign * sum * ratio_a / ErrorImage::scale();
+    grad_face_vertices(vertex_index_b, axis) += sign * sum * ratio_b / ErrorImage::scale();
+}
+
+// compute_grad_yと同じ勾配を走査線上の区間ごとにまとめて求める
+// 頂点ごとの比率と向きはcompute_grad_yの各場合と同じで、画素ごとの加算順だけが異なる
+template <typename ErrorImage>
+void compute_grad_y_accumulated(
+    int xi_a,
+    int xi_b,
+    int xi_c,
+    int vertex_index_a,
+    int vertex_index_b,
+    int image_height,
+    int target_face_index,
+    const ErrorImage& error_image,
+    const ArrayView2<float>& grad_face_vertices,
+    const ArrayView2<float>& debug_grad_map,
+    const FaceSpanTable& column_spans,
+    const NonZeroPixelTable& nonzero_columns,
+    const float* inverse_distances)
+{
+    bool top_to_bottom = !(xi_a < xi_b);
+    int xi_p_start = std::min(xi_a, xi_b);
+    int xi_p_end = std::max(xi_a, xi_b);
+    for (int xi_p = xi_p_start; xi_p <= xi_p_end; xi_p++) {
+        if (nonzero_columns.count(xi_p) == 0) {
+            continue;
+        }
+        const FaceSpan* span = column_spans.find(target_face_index, xi_p);
+        if (span == nullptr) {
+            continue;
+        }
+        const int* nonzero_first;
+        const int* nonzero_last;
+        if (top_to_bottom) {
+            if (span->first_start == 0) {
+                continue;
+            }
+            int yi_s_edge = span->first_start;
+            // 外側
+            nonzero_columns.range(xi_p, 0, yi_s_edge - 1, nonzero_first, nonzero_last);
+            accumulate_run(error_image, true, xi_p, nonzero_first, nonzero_last, error_image.pixel(yi_s_edge, xi_p), yi_s_edge, 1.0f,
+                vertex_index_a, moving_ratio(xi_p - xi_p_start > 0, xi_p - xi_p_start, xi_p_end - xi_p_start),
+                vertex_index_b, moving_ratio(xi_p_end - xi_p > 0, xi_p_end - xi_p, xi_p_end - xi_p_start),
+                1, inverse_distances, grad_face_vertices, debug_grad_map);
+            if (span->first_end == image_height - 1) {
+                continue;
+            }
+            int yi_s_other_edge = span->first_end;
+            // 内側
+            nonzero_columns.range(xi_p, yi_s_edge, yi_s_other_edge, nonzero_first, nonzero_last);
+            accumulate_run(error_image, true, xi_p, nonzero_first, nonzero_last, error_image.pixel(yi_s_edge - 1, xi_p), yi_s_edge, -1.0f,
+                vertex_index_a, moving_ratio(xi_p - xi_p_start > 0, xi_p - xi_p_start, xi_p_end - xi_p_start),
+                vertex_index_b, moving_ratio(xi_p_end - xi_p > 0, xi_p_end - xi_p, xi_p_end - xi_p_start),
+                1, inverse_distances, grad_face_vertices, debug_grad_map);
+            accumulate_run(error_image, true, xi_p, nonzero_first, nonzero_last, error_image.pixel(yi_s_other_edge + 1, xi_p), yi_s_other_edge, 1.0f,
+                vertex_index_a, moving_ratio(xi_p > xi_c, xi_p - xi_c, xi_p_end - xi_c),
+                vertex_index_b, moving_ratio(xi_p < xi_c, xi_c - xi_p, xi_c - xi_p_start),
+                1, inverse_distances, grad_face_vertices, debug_grad_map);
+        } else {
+            if (span->last_end == image_height - 1) {
+                continue;
+            }
+            int yi_s_edge = span->last_end;
+            // 外側
+            nonzero_columns.range(xi_p, yi_s_edge + 1, image_height - 1, nonzero_first, nonzero_last);
+            accumulate_run(error_image, true, xi_p, nonzero_first, nonzero_last, error_image.pixel(yi_s_edge, xi_p), yi_s_edge, -1.0f,
+                vertex_index_b, moving_ratio(xi_p - xi_p_start > 0, xi_p - xi_p_start, xi_p_end - xi_p_start),
+                vertex_index_a, moving_ratio(xi_p_end - xi_p > 0, xi_p_end - xi_p, xi_p_end - xi_p_start),
+                1, inverse_distances, grad_face_vertices, debug_grad_map);
+            if (span->last_start == 0) {
+                continue;
+            }
+            int yi_s_other_edge = span->last_start;
+            // 内側
+            nonzero_columns.range(xi_p, yi_s_other_edge, yi_s_edge, nonzero_first, nonzero_last);
+            accumulate_run(error_image, true, xi_p, nonzero_first, nonzero_last, error_image.pixel(yi_s_other_edge - 1, xi_p), yi_s_other_edge, -1.0f,
+                vertex_index_a, moving_ratio(xi_p < xi_c, xi_c - xi_p, xi_c - xi_p_start),
+                vertex_index_b, moving_ratio(xi_p > xi_c, xi_p - xi_c, xi_p_end - xi_c),
+                1, inverse_distances, grad_face_vertices, debug_grad_map);
+            accumulate_run(error_image, true, xi_p, nonzero_first, nonzero_last, error_image.pixel(yi_s_edge + 1, xi_p), yi_s_edge, 1.0f,
+                vertex_index_a, moving_ratio(xi_p_end - xi_p > 0, xi_p_end - xi_p, xi_p_end - xi_p_start),
+                vertex_index_b, moving_ratio(xi_p - xi_p_start != 0, xi_p - xi_p_start, xi_p_end - xi_p_start),
+                1, inverse_distances, grad_face_vertices, debug_grad_map);
+        }
+    }
+}
+
+// compute_grad_xと同じ勾配を走査線上の区間ごとにまとめて求める
+template <typename ErrorImage>
+void compute_grad_x_accumulated(
+    int yi_a,
+    int yi_b,
+    int yi_c,
+    int vertex_index_a,
+    int vertex_index_b,
+    int image_width,
+    int target_face_index,
+    const ErrorImage& error_image,
+    const ArrayView2<float>& grad_face_vertices,
+    const ArrayView2<float>& debug_grad_map,
+    const FaceSpanTable& row_spans,
+    const NonZeroPixelTable& nonzero_rows,
+    const float* inverse_distances)
+{
+    bool left_to_right = yi_a < yi_b;
+    int yi_p_start = std::min(yi_a, yi_b);
+    int yi_p_end = std::max(yi_a, yi_b);
+    for (int yi_p = yi_p_start; yi_p <= yi_p_end; yi_p++) {
+        if (nonzero_rows.count(yi_p) == 0) {
+            continue;
+        }
+        const FaceSpan* span = row_spans.find(target_face_index, yi_p);
+        if (span == nullptr) {
+            continue;
+        }
+        const int* nonzero_first;
+        const int* nonzero_last;
+        if (left_to_right) {
+            if (span->first_start == 0) {
+                continue;
+            }
+            int xi_s_edge = span->first_start;
+            // 外側
+            nonzero_rows.range(yi_p, 0, xi_s_edge - 1, nonzero_first, nonzero_last);
+            accumulate_run(error_image, false, yi_p, nonzero_first, nonzero_last, error_image.pixel(yi_p, xi_s_edge), xi_s_edge, -1.0f,
+                vertex_index_a, moving_ratio(yi_p_end - yi_p > 0, yi_p_end - yi_p, yi_p_end - yi_p_start),
+                vertex_index_b, moving_ratio(yi_p - yi_p_start > 0, yi_p - yi_p_start, yi_p_end - yi_p_start),
+                0, inverse_distances, grad_face_vertices, debug_grad_map);
+            if (span->first_end == image_width - 1) {
+                continue;
+            }
+            int xi_s_other_edge = span->first_end;
+            // 内側
+            nonzero_rows.range(yi_p, xi_s_edge, xi_s_other_edge, nonzero_first, nonzero_last);
+            accumulate_run(error_image, false, yi_p, nonzero_first, nonzero_last, error_image.pixel(yi_p, xi_s_edge - 1), xi_s_edge, 1.0f,
+                vertex_index_a, moving_ratio(yi_p - yi_p_start > 0, yi_p_end - yi_p, yi_p_end - yi_p_start),
+                vertex_index_b, moving_ratio(yi_p_end - yi_p > 0, yi_p - yi_p_start, yi_p_end - yi_p_start),
+                0, inverse_distances, grad_face_vertices, debug_grad_map);
+            accumulate_run(error_image, false, yi_p, nonzero_first, nonzero_last, error_image.pixel(yi_p, xi_s_other_edge + 1), xi_s_other_edge, -1.0f,
+                vertex_index_a, moving_ratio(yi_p < yi_c, yi_c - yi_p, yi_c - yi_p_start),
+                vertex_index_b, moving_ratio(yi_p > yi_c, yi_p - yi_c, yi_p_end - yi_c),
+                0, inverse_distances, grad_face_vertices, debug_grad_map);
+        } else {
+            if (span->last_end == image_width - 1) {
+                continue;
+            }
+            int xi_s_edge = span->last_end;
+            // 外側
+            nonzero_rows.range(yi_p, xi_s_edge + 1, image_width - 1, nonzero_first, nonzero_last);
+            accumulate_run(error_image, false, yi_p, nonzero_first, nonzero_last, error_image.pixel(yi_p, xi_s_edge), xi_s_edge, 1.0f,
+                vertex_index_a, moving_ratio(yi_p - yi_p_start > 0, yi_p - yi_p_start, yi_p_end - yi_p_start),
+                vertex_index_b, moving_ratio(yi_p_end - yi_p > 0, yi_p_end - yi_p, yi_p_end - yi_p_start),
+                0, inverse_distances, grad_face_vertices, debug_grad_map);
+            if (span->last_start == 0) {
+                continue;
+            }
+            int xi_s_other_edge = span->last_start;
+            // 内側
+            nonzero_rows.range(yi_p, xi_s_other_edge, xi_s_edge, nonzero_first, nonzero_last);
+            accumulate_run(error_image, false, yi_p, nonzero_first, nonzero_last, error_image.pixel(yi_p, xi_s_other_edge - 1), xi_s_other_edge, 1.0f,
+                vertex_index_a, moving_ratio(yi_p > yi_c, yi_p - yi_c, yi_p_end - yi_c),
+                vertex_index_b, moving_ratio(yi_p < yi_c, yi_p - yi_c, yi_c - yi_p_start),
+                0, inverse_distances, grad_face_vertices, debug_grad_map);
+            accumulate_run(error_image, false, yi_p, nonzero_first, nonzero_last, error_image.pixel(yi_p, xi_s_edge + 1), xi_s_edge, -1.0f,
+                vertex_index_a, moving_ratio(yi_p - yi_p_start > 0, yi_p - yi_p_start, yi_p_end - yi_p_start),
+                vertex_index_b, moving_ratio(yi_p_end - yi_p != 0, yi_p_end - yi_p, yi_p_end - yi_p_start),
+                0, inverse_distances, grad_face_vertices, debug_grad_map);
+        }
+    }
+}
+
 // 点ABからなる辺の外側と内側の画素を網羅して勾配を計算する
-// *f_* \in [-1, 1]
+// vertex_index_*は面の中での頂点の番号（0, 1, 2）で、勾配はgrad_face_vertices(vertex_index_*, axis)に加算する
+// face_index_map等は対象のバッチの画像 (image_height, image_width) への参照
 // xi_* \in [0, image_width - 1]
 // yi_* \in [0, image_height - 1]
+// inverse_distancesに距離の逆数の表を渡すと区間ごとにまとめて求め、nullptrなら画素ごとに求める
+template <typename ErrorImage>
 void compute_grad(
-    float xf_a,
-    float yf_a,
-    float xf_b,
-    float yf_b,
-    float xf_c,
-    float yf_c,
+    int xi_a,
+    int yi_a,
+    int xi_b,
+    int yi_b,
+    int xi_c,
+    int yi_c,
     int vertex_index_a,
     int vertex_index_b,
     int image_width,
     int image_height,
-    int num_vertices,
-    int target_batch_index,
     int target_face_index,
-    py::array_t<int, py::array::c_style>& np_face_index_map,
-    py::array_t<int, py::array::c_style>& np_pixel_map,
-    py::array_t<float, py::array::c_style>& np_grad_vertices,
-    py::array_t<float, py::array::c_style>& np_grad_silhouette,
-    py::array_t<float, py::array::c_style>& np_debug_grad_map)
+    const ErrorImage& error_image,
+    const ArrayView2<float>& grad_face_vertices,
+    const ArrayView2<float>& debug_grad_map,
+    const FaceSpanTable& column_spans,
+    const FaceSpanTable& row_spans,
+    const NonZeroPixelTable& nonzero_columns,
+    const NonZeroPixelTable& nonzero_rows,
+    const float* inverse_distances)
 {
+    if (inverse_distances != nullptr) {
+        compute_grad_x_accumulated(yi_a, yi_b, yi_c, vertex_index_a, vertex_index_b, image_width, target_face_index,
+            error_image, grad_face_vertices, debug_grad_map, row_spans, nonzero_rows, inverse_distances);
+        compute_grad_y_accumulated(xi_a, xi_b, xi_c, vertex_index_a, vertex_index_b, image_height, target_face_index,
+            error_image, grad_face_vertices, debug_grad_map, column_spans, nonzero_columns, inverse_distances);
+        return;
+    }
     compute_grad_x(
-        xf_a,
-        yf_a,
-        xf_b,
-        yf_b,
-        xf_c,
-        yf_c,
+        xi_a,
+        yi_a,
+        xi_b,
+        yi_b,
+        xi_c,
+        yi_c,
         vertex_index_a,
         vertex_index_b,
         image_width,
         image_height,
-        num_vertices,
-        target_batch_index,
         target_face_index,
-        np_face_index_map,
-        np_pixel_map,
-        np_grad_vertices,
-        np_grad_silhouette,
-        np_debug_grad_map);
+        error_image,
+        grad_face_vertices,
+        debug_grad_map,
+        row_spans,
+        nonzero_rows);
     compute_grad_y(
-        xf_a,
-        yf_a,
-        xf_b,
-        yf_b,
-        xf_c,
-        yf_c,
+        xi_a,
+        yi_a,
+        xi_b,
+        yi_b,
+        xi_c,
+        yi_c,
         vertex_index_a,
         vertex_index_b,
         image_width,
         image_height,
-        num_vertices,
-        target_batch_index,
         target_face_index,
-        np_face_index_map,
-        np_pixel_map,
-        np_grad_vertices,
-        np_grad_silhouette,
-        np_debug_grad_map);
+        error_image,
+        grad_face_vertices,
+        debug_grad_map,
+        column_spans,
+        nonzero_columns);
+}
+
+// backward_edgesの作業領域
+// 毎ステップ確保し直すと大きな配列の確保と初期化が無視できないので、呼び出し元のスレッドごとに使い回す
+struct BackwardEdgesScratch {
+    std::vector<float> inverse_distances;
+    std::vector<float> grad_face_vertices;
+    std::vector<FaceSpanTable> column_span_tables;
+    std::vector<FaceSpanTable> row_span_tables;
+    std::vector<NonZeroPixelTable> nonzero_column_tables;
+    std::vector<NonZeroPixelTable> nonzero_row_tables;
+    // debug_grad_mapに足し合わせる時に0に戻すので、使っていない間は全て0になっている
+    std::vector<std::vector<float>> debug_grad_map_buffers;
+};
+BackwardEdgesScratch& get_local_backward_edges_scratch()
+{
+    thread_local BackwardEdgesScratch scratch;
+    return scratch;
+}
+
+// 画像の誤差から各頂点の勾配を求める
+// get_error_image(batch_index)は各バッチの画素値と誤差を読むSilhouetteErrorImageかColorErrorImageを返す
+// grad_imageは誤差が0でない画素を探すために使い、1画素あたりnum_channels個の値を持つ
+// 各バッチの面をいくつかの組に分け、バッチと組の対を単位としてスレッドプールで並列に処理する
+// 頂点の勾配は面ごとの作業領域に加算し、最後に面番号の順に足し合わせるので常に同じ結果になる
+// debug_grad_mapは組ごとの作業領域に加算して組の順に足し合わせるが、
+// 組の数はスレッド数で変わるため、加算順の違いで値がわずかに揺らぐ
+// deterministicを指定すると組の数を固定するので、debug_grad_mapもスレッド数によらず同じ結果になる
+// debug_grad_mapの作業領域はバッチ数によらずスレッド数程度の枚数に収め、他の作業領域と共に呼び出し元のスレッドごとに使い回す
+template <typename GetErrorImage>
+void backward_edges(
+    const int* faces_data,
+    const float* face_vertices_data,
+    const void* face_index_map_data,
+    FaceIndexFormat face_index_format,
+    const GetErrorImage& get_error_image,
+    const float* grad_image_data,
+    int num_channels,
+    float* grad_vertices_data,
+    float* debug_grad_map_data,
+    int batch_size,
+    int num_faces,
+    int num_vertices,
+    int image_height,
+    int image_width,
+    bool deterministic,
+    const TriangleSetupTable* triangle_setups,
+    bool shared_faces)
+{
+    int image_size = image_height * image_width;
+
+    ArrayView3<const int> faces(faces_data, num_faces, 3);
+    ArrayView3<float> grad_vertices(grad_vertices_data, num_vertices, 3);
+
+    auto pool = get_thread_pool();
+    BackwardEdgesScratch& scratch = get_local_backward_edges_scratch();
+
+    // 面ごとの前処理
+    // 順伝播の結果が渡されなければここで求める
+    if (triangle_setups == nullptr) {
+        TriangleSetupTable* local_triangle_setups = get_local_triangle_setups(batch_size);
+        build_triangle_setups(face_vertices_data, local_triangle_setups, batch_size, num_faces, image_height, image_width, true);
+        triangle_setups = local_triangle_setups;
+    }
+
+    // 区間ごとにまとめて求める場合の距離の逆数
+    // 画素ごとに割り算をする代わりに掛け算にする
+    const float* inverse_distances_data = nullptr;
+    if (get_backward_algorithm() == "accumulated") {
+        std::vector<float>& inverse_distances = scratch.inverse_distances;
+        int num_distances = std::max(image_height, image_width);
+        if ((int)inverse_distances.size() < num_distances) {
+            inverse_distances.resize(num_distances, 0.0f);
+            for (int distance = 1; distance < num_distances; distance++) {
+                inverse_distances[distance] = 1.0f / distance;
+            }
+        }
+        inverse_distances_data = inverse_distances.data();
+    }
+
+    // 面ごとの頂点の勾配 (batch_size, num_faces, 3, 3)
+    // 各面を処理するタスクが0に初期化する
+    if (scratch.grad_face_vertices.size() < (size_t)batch_size * num_faces * 9) {
+        scratch.grad_face_vertices.resize((size_t)batch_size * num_faces * 9);
+    }
+    float* grad_face_vertices_data = scratch.grad_face_vertices.data();
+
+    // 面をまとめてタスクにする
+    // 各バッチの面のまとまりをnum_slots_per_batch個の組に分け、各組を1つのタスクがまとまりの順に処理する
+    // deterministicの場合はまとまりの数を固定し、まとまりごとに組を作る
+    const int num_faces_per_chunk = 64;
+    const int num_deterministic_groups = 16;
+    int num_chunks = deterministic ? std::min(num_deterministic_groups, num_faces) : (num_faces + num_faces_per_chunk - 1) / num_faces_per_chunk;
+    num_chunks = std::max(num_chunks, 1);
+    int num_faces_per_task = (num_faces + num_chunks - 1) / num_chunks;
+    int num_slots_per_batch = deterministic ? num_chunks : std::min(pool->num_threads(), num_chunks);
+
+    // debug_grad_mapの作業領域
+    // 各バッチの最初の組はdebug_grad_mapに直接書き込み、残りの組は作業領域に書いてから組の順に足し合わせる
+    // 作業領域が全体でスレッド数程度の枚数に収まるように、一度に処理するバッチの数を決める
+    int num_batches_per_round = std::max(1, std::min(batch_size, pool->num_threads() / num_slots_per_batch));
+    int num_buffers_per_batch = num_slots_per_batch - 1;
+    if ((int)scratch.debug_grad_map_buffers.size() < num_batches_per_round * num_buffers_per_batch) {
+        scratch.debug_grad_map_buffers.resize(num_batches_per_round * num_buffers_per_batch);
+    }
+
+    // 面番号マップの列ごと・行ごとの区間
+    // 誤差が0でない画素の列ごと・行ごとの位置
+    // 収束に近づくとほとんどの画素の誤差が0になるので、それ以外を読み飛ばす
+    if ((int)scratch.column_span_tables.size() < batch_size) {
+        scratch.column_span_tables.resize(batch_size);
+        scratch.row_span_tables.resize(batch_size);
+        scratch.nonzero_column_tables.resize(batch_size);
+        scratch.nonzero_row_tables.resize(batch_size);
+    }
+    std::vector<FaceSpanTable>& column_span_tables = scratch.column_span_tables;
+    std::vector<FaceSpanTable>& row_span_tables = scratch.row_span_tables;
+    std::vector<NonZeroPixelTable>& nonzero_column_tables = scratch.nonzero_column_tables;
+    std::vector<NonZeroPixelTable>& nonzero_row_tables = scratch.nonzero_row_tables;
+
+    pool->parallel_for(batch_size * 2, [&](int task_index, int thread_index) {
+        int batch_index = task_index / 2;
+        ArrayView2<const float> grad_image(grad_image_data + (ssize_t)batch_index * image_size * num_channels, image_width * num_channels);
+        if (task_index % 2 == 0) {
+            nonzero_column_tables[batch_index].build(grad_image, image_height, image_width, true, num_channels);
+        } else {
+            nonzero_row_tables[batch_index].build(grad_image, image_height, image_width, false, num_channels);
+        }
+    });
+
+    pool->parallel_for(batch_size * 2, [&](int task_index, int thread_index) {
+        int batch_index = task_index / 2;
+        // 誤差のある画素がなければ勾配は0なので区間も不要
+        if (nonzero_row_tables[batch_index].size() == 0) {
+            return;
+        }
+        FaceSpanTable& span_table = (task_index % 2 == 0) ? column_span_tables[batch_index] : row_span_tables[batch_index];
+        bool vertical = task_index % 2 == 0;
+        if (face_index_format == FACE_INDEX_UINT16) {
+            ArrayView2<const uint16_t> face_index_map(static_cast<const uint16_t*>(face_index_map_data) + batch_index * image_size, image_width);
+            span_table.build(face_index_map, num_faces, image_height, image_width, vertical);
+        } else {
+            ArrayView2<const int> face_index_map(static_cast<const int*>(face_index_map_data) + batch_index * image_size, image_width);
+            span_table.build(face_index_map, num_faces, image_height, image_width, vertical);
+        }
+    });
+
+    int num_rows_per_task = std::max(1, 8192 / std::max(image_width, 1));
+    int num_row_blocks = (image_height + num_rows_per_task - 1) / num_rows_per_task;
+    for (int batch_index_start = 0; batch_index_start < batch_size; batch_index_start += num_batches_per_round) {
+        int num_batches = std::min(num_batches_per_round, batch_size - batch_index_start);
+        pool->parallel_for(num_batches * num_slots_per_batch, [&](int task_index, int thread_index) {
+            int round_batch_index = task_index / num_slots_per_batch;
+            int batch_index = batch_index_start + round_batch_index;
+            int slot_index = task_index % num_slots_per_batch;
+            if (nonzero_row_tables[batch_index].size() == 0) {
+                return;
+            }
+
+            float* debug_grad_map_slot_data = debug_grad_map_data + (ssize_t)batch_index * image_size;
+            if (slot_index > 0) {
+                std::vector<float>& buffer = scratch.debug_grad_map_buffers[round_batch_index * num_buffers_per_batch + slot_index - 1];
+                if ((int)buffer.size() != image_size) {
+                    buffer.assign(image_size, 0.0f);
+                }
+                debug_grad_map_slot_data = buffer.data();
+            }
+            auto error_image = get_error_image(batch_index);
+            ArrayView2<float> debug_grad_map(debug_grad_map_slot_data, image_width);
+            const FaceSpanTable& column_spans = column_span_tables[batch_index];
+            const FaceSpanTable& row_spans = row_span_tables[batch_index];
+            const NonZeroPixelTable& nonzero_columns = nonzero_column_tables[batch_index];
+            const NonZeroPixelTable& nonzero_rows = nonzero_row_tables[batch_index];
+            const TriangleSetupTable& setup = triangle_setups[batch_index];
+
+            for (int chunk_index = slot_index; chunk_index < num_chunks; chunk_index += num_slots_per_batch) {
+                int face_index_start = chunk_index * num_faces_per_task;
+                int face_index_end = std::min(face_index_start + num_faces_per_task, num_faces);
+                for (int face_index = face_index_start; face_index < face_index_end; face_index++) {
+                    float* grad_face_vertices_row = &grad_face_vertices_data[(batch_index * num_faces + face_index) * 9];
+                    std::fill(grad_face_vertices_row, grad_face_vertices_row + 9, 0.0f);
+                    // カリングによる裏面のスキップ
+                    if (setup.front_facing(face_index) == false) {
+                        continue;
+                    }
+                    int xi_1 = setup.xi(face_index, 0);
+                    int yi_1 = setup.yi(face_index, 0);
+                    int xi_2 = setup.xi(face_index, 1);
+                    int yi_2 = setup.yi(face_index, 1);
+                    int xi_3 = setup.xi(face_index, 2);
+                    int yi_3 = setup.yi(face_index, 2);
+
+                    ArrayView2<float> grad_face_vertices(grad_face_vertices_row, 3);
+
+                    // 3辺について
+                    compute_grad(
+                        xi_1,
+                        yi_1,
+                        xi_2,
+                        yi_2,
+                        xi_3,
+                        yi_3,
+                        0,
+                        1,
+                        image_width,
+                        image_height,
+                        face_index,
+                        error_image,
+                        grad_face_vertices,
+                        debug_grad_map,
+                        column_spans,
+                        row_spans,
+                        nonzero_columns,
+                        nonzero_rows,
+                        inverse_distances_data);
+                    compute_grad(
+                        xi_2,
+                        yi_2,
+                        xi_3,
+                        yi_3,
+                        xi_1,
+                        yi_1,
+                        1,
+                        2,
+                        image_width,
+                        image_height,
+                        face_index,
+                        error_image,
+                        grad_face_vertices,
+                        debug_grad_map,
+                        column_spans,
+                        row_spans,
+                        nonzero_columns,
+                        nonzero_rows,
+                        inverse_distances_data);
+                    compute_grad(
+                        xi_3,
+                        yi_3,
+                        xi_1,
+                        yi_1,
+                        xi_2,
+                        yi_2,
+                        2,
+                        0,
+                        image_width,
+                        image_height,
+                        face_index,
+                        error_image,
+                        grad_face_vertices,
+                        debug_grad_map,
+                        column_spans,
+                        row_spans,
+                        nonzero_columns,
+                        nonzero_rows,
+                        inverse_distances_data);
+                }
+            }
+        });
+
+        // 作業領域を組の順にdebug_grad_mapへ足し合わせ、次に使う時のために0に戻す
+        if (num_buffers_per_batch == 0) {
+            continue;
+        }
+        pool->parallel_for(num_batches * num_row_blocks, [&](int task_index, int thread_index) {
+            int round_batch_index = task_index / num_row_blocks;
+            int batch_index = batch_index_start + round_batch_index;
+            if (nonzero_row_tables[batch_index].size() == 0) {
+                return;
+            }
+            int pixel_index_start = (task_index % num_row_blocks) * num_rows_per_task * image_width;
+            int pixel_index_end = std::min(pixel_index_start + num_rows_per_task * image_width, image_size);
+            float* debug_grad_map = debug_grad_map_data + (ssize_t)batch_index * image_size;
+            for (int buffer_index = 0; buffer_index < num_buffers_per_batch; buffer_index++) {
+                float* buffer = scratch.debug_grad_map_buffers[round_batch_index * num_buffers_per_batch + buffer_index].data();
+                for (int pixel_index = pixel_index_start; pixel_index < pixel_index_end; pixel_index++) {
+                    debug_grad_map[pixel_index] += buffer[pixel_index];
+                    buffer[pixel_index] = 0.0f;
+                }
+            }
+        });
+    }
+
+    // 面ごとの勾配を面番号の順に頂点へ足し合わせる
+    // 誤差のないバッチの面は処理していないので読まない
+    pool->parallel_for(batch_size, [&](int batch_index, int thread_index) {
+        if (nonzero_row_tables[batch_index].size() == 0) {
+            return;
+        }
+        for (int face_index = 0; face_index < num_faces; face_index++) {
+            const float* grad_face_vertices = &grad_face_vertices_data[(batch_index * num_faces + face_index) * 9];
+            for (int n = 0; n < 3; n++) {
+                int vertex_index = faces(shared_faces ? 0 : batch_index, face_index, n);
+                for (int axis = 0; axis < 3; axis++) {
+                    grad_vertices(batch_index, vertex_index, axis) += grad_face_vertices[n * 3 + axis];
+                }
+            }
+        }
+    });
+}
+
+void backward_silhouette(
+    const int* faces_data,
+    const float* face_vertices_data,
+    const void* face_index_map_data,
+    FaceIndexFormat face_index_format,
+    const void* pixel_map_data,
+    SilhouetteFormat pixel_map_format,
+    float* grad_vertices_data,
+    const float* grad_silhouette_data,
+    float* debug_grad_map_data,
+    int batch_size,
+    int num_faces,
+    int num_vertices,
+    int image_height,
+    int image_width,
+    bool deterministic,
+    const TriangleSetupTable* triangle_setups,
+    bool shared_faces)
+{
+    int image_size = image_height * image_width;
+    int pixel_map_size = image_height * silhouette_row_size(pixel_map_format, image_width);
+    backward_edges(faces_data, face_vertices_data, face_index_map_data, face_index_format,
+        [&](int batch_index) {
+            const void* batch_pixel_map_data = pixel_map_format == SILHOUETTE_INT32
+                ? (const void*)(static_cast<const int*>(pixel_map_data) + batch_index * pixel_map_size)
+                : (const void*)(static_cast<const uint8_t*>(pixel_map_data) + batch_index * pixel_map_size);
+            return SilhouetteErrorImage(SilhouetteView(batch_pixel_map_data, pixel_map_format, image_width),
+                ArrayView2<const float>(grad_silhouette_data + batch_index * image_size, image_width));
+        },
+        grad_silhouette_data, 1, grad_vertices_data, debug_grad_map_data,
+        batch_size, num_faces, num_vertices, image_height, image_width, deterministic, triangle_setups, shared_faces);
+}
+
+void backward_color(
+    const int* faces_data,
+    const float* face_vertices_data,
+    const void* face_index_map_data,
+    FaceIndexFormat face_index_format,
+    const float* image_data,
+    float* grad_vertices_data,
+    const float* grad_image_data,
+    float* debug_grad_map_data,
+    int batch_size,
+    int num_faces,
+    int num_vertices,
+    int image_height,
+    int image_width,
+    bool deterministic,
+    const TriangleSetupTable* triangle_setups,
+    bool shared_faces)
+{
+    ssize_t image_size = (ssize_t)image_height * image_width * 3;
+    backward_edges(faces_data, face_vertices_data, face_index_map_data, face_index_format,
+        [&](int batch_index) {
+            return ColorErrorImage(ArrayView2<const float>(image_data + batch_index * image_size, image_width * 3),
+                ArrayView2<const float>(grad_image_data + batch_index * image_size, image_width * 3));
+        },
+        grad_image_data, 3, grad_vertices_data, debug_grad_map_data,
+        batch_size, num_faces, num_vertices, image_height, image_width, deterministic, triangle_setups, shared_faces);
+}
+
+void backward_silhouette_supersampled(
+    const int* faces_data,
+    const float* face_vertices_data,
+    const int* face_index_map_data,
+    const float* coverage_map_data,
+    float* grad_vertices_data,
+    const float* grad_coverage_data,
+    float* debug_grad_map_data,
+    int batch_size,
+    int num_faces,
+    int num_vertices,
+    int image_height,
+    int image_width,
+    bool deterministic,
+    const TriangleSetupTable* triangle_setups,
+    bool shared_faces)
+{
+    ssize_t image_size = (ssize_t)image_height * image_width;
+    backward_edges(faces_data, face_vertices_data, face_index_map_data, FACE_INDEX_INT32,
+        [&](int batch_index) {
+            return CoverageErrorImage(ArrayView2<const float>(coverage_map_data + batch_index * image_size, image_width),
+                ArrayView2<const float>(grad_coverage_data + batch_index * image_size, image_width));
+        },
+        grad_coverage_data, 1, grad_vertices_data, debug_grad_map_data,
+        batch_size, num_faces, num_vertices, image_height, image_width, deterministic, triangle_setups, shared_faces);
+}
+
+void backward_silhouette(
+    const int* faces_data,
+    const float* face_vertices_data,
+    const int* face_index_map_data,
+    const int* pixel_map_data,
+    float* grad_vertices_data,
+    const float* grad_silhouette_data,
+    float* debug_grad_map_data,
+    int batch_size,
+    int num_faces,
+    int num_vertices,
+    int image_height,
+    int image_width,
+    bool deterministic,
+    const TriangleSetupTable* triangle_setups,
+    bool shared_faces)
+{
+    backward_silhouette(faces_data, face_vertices_data, face_index_map_data, FACE_INDEX_INT32, pixel_map_data, SILHOUETTE_INT32,
+        grad_vertices_data, grad_silhouette_data, debug_grad_map_data,
+        batch_size, num_faces, num_vertices, image_height, image_width, deterministic, triangle_setups, shared_faces);
 }
 
-// シルエットの誤差から各頂点の勾配を求める
 void backward_silhouette(
     py::array_t<int, py::array::c_style> np_faces,
     py::array_t<float, py::array::c_style> np_face_vertices,
@@ -884,123 +2255,189 @@ void backward_silhouette(
     py::array_t<int, py::array::c_style> np_pixel_map,
     py::array_t<float, py::array::c_style> np_grad_vertices,
     py::array_t<float, py::array::c_style> np_grad_silhouette,
-    py::array_t<float, py::array::c_style> np_debug_grad_map)
+    py::array_t<float, py::array::c_style> np_debug_grad_map,
+    bool deterministic)
 {
     if (np_faces.ndim() != 3) {
-        std::runtime_error("(np_faces.ndim() != 3) -> false");
+        throw std::runtime_error("(np_faces.ndim() != 3) -> false");
     }
     if (np_face_vertices.ndim() != 4) {
-        std::runtime_error("(np_face_vertices.ndim() != 4) -> false");
+        throw std::runtime_error("(np_face_vertices.ndim() != 4) -> false");
     }
     if (np_vertices.ndim() != 3) {
-        std::runtime_error("(np_vertices.ndim() != 3) -> false");
+        throw std::runtime_error("(np_vertices.ndim() != 3) -> false");
     }
     if (np_face_index_map.ndim() != 3) {
-        std::runtime_error("(np_face_index_map.ndim() != 3) -> false");
+        throw std::runtime_error("(np_face_index_map.ndim() != 3) -> false");
     }
     if (np_pixel_map.ndim() != 3) {
-        std::runtime_error("(np_pixel_map.ndim() != 3) -> false");
+        throw std::runtime_error("(np_pixel_map.ndim() != 3) -> false");
     }
     if (np_grad_vertices.ndim() != 3) {
-        std::runtime_error("(np_grad_vertices.ndim() != 3) -> false");
+        throw std::runtime_error("(np_grad_vertices.ndim() != 3) -> false");
     }
     if (np_grad_silhouette.ndim() != 3) {
-        std::runtime_error("(np_grad_silhouette.ndim() != 3) -> false");
+        throw std::runtime_error("(np_grad_silhouette.ndim() != 3) -> false");
     }
     if (np_debug_grad_map.ndim() != 3) {
-        std::runtime_error("(np_debug_grad_map.ndim() != 3) -> false");
+        throw std::runtime_error("(np_debug_grad_map.ndim() != 3) -> false");
     }
 
     int batch_size = np_face_vertices.shape(0);
     int num_faces = np_face_vertices.shape(1);
-    int num_vertices = np_vertices.shape(1);
+    int num_vertices = np_grad_vertices.shape(1);
     int image_height = np_face_index_map.shape(1);
     int image_width = np_face_index_map.shape(2);
+    if (np_face_vertices.shape(2) != 3 || np_face_vertices.shape(3) != 3) {
+        throw std::runtime_error("`np_face_vertices.shape` must be equal to `(batch_size, num_faces, 3, 3)`.");
+    }
+    if (np_faces.shape(0) != batch_size || np_faces.shape(1) != num_faces || np_faces.shape(2) != 3) {
+        throw std::runtime_error("`np_faces.shape` must be equal to `(batch_size, num_faces, 3)`.");
+    }
+    if (np_grad_vertices.shape(0) != batch_size || np_grad_vertices.shape(2) != 3) {
+        throw std::runtime_error("`np_grad_vertices.shape` must be equal to `(batch_size, num_vertices, 3)`.");
+    }
+    if (np_vertices.shape(0) != batch_size || np_vertices.shape(1) != num_vertices || np_vertices.shape(2) != 3) {
+        throw std::runtime_error("`np_vertices.shape` must be equal to `np_grad_vertices.shape`.");
+    }
+    if (np_face_index_map.shape(0) != batch_size) {
+        throw std::runtime_error("`np_face_index_map.shape` must be equal to `(batch_size, image_height, image_width)`.");
+    }
+    if (np_pixel_map.shape(0) != batch_size || np_pixel_map.shape(1) != image_height || np_pixel_map.shape(2) != image_width) {
+        throw std::runtime_error("`np_pixel_map.shape` must be equal to `np_face_index_map.shape`.");
+    }
+    if (np_grad_silhouette.shape(0) != batch_size || np_grad_silhouette.shape(1) != image_height || np_grad_silhouette.shape(2) != image_width) {
+        throw std::runtime_error("`np_grad_silhouette.shape` must be equal to `np_face_index_map.shape`.");
+    }
+    if (np_debug_grad_map.shape(0) != batch_size || np_debug_grad_map.shape(1) != image_height || np_debug_grad_map.shape(2) != image_width) {
+        throw std::runtime_error("`np_debug_grad_map.shape` must be equal to `np_face_index_map.shape`.");
+    }
+    const int* faces_data = np_faces.data();
+    const float* face_vertices_data = np_face_vertices.data();
+    const int* face_index_map_data = np_face_index_map.data();
+    const int* pixel_map_data = np_pixel_map.data();
+    float* grad_vertices_data = np_grad_vertices.mutable_data();
+    const float* grad_silhouette_data = np_grad_silhouette.data();
+    float* debug_grad_map_data = np_debug_grad_map.mutable_data();
+    // 勾配は頂点番号の位置に書き込むので、GILを解放する前に範囲を調べる
+    check_vertex_indices(faces_data, batch_size, num_faces, num_vertices);
 
-    auto face_vertices = np_face_vertices.mutable_unchecked<4>();
-    auto faces = np_faces.mutable_unchecked<3>();
+    py::gil_scoped_release release;
+    backward_silhouette(faces_data, face_vertices_data, face_index_map_data, pixel_map_data,
+        grad_vertices_data, grad_silhouette_data, debug_grad_map_data,
+        batch_size, num_faces, num_vertices, image_height, image_width, deterministic);
+}
 
-    for (int batch_index = 0; batch_index < batch_size; batch_index++) {
-        for (int face_index = 0; face_index < num_faces; face_index++) {
-            float xf_1 = face_vertices(batch_index, face_index, 0, 0);
-            float yf_1 = face_vertices(batch_index, face_index, 0, 1);
-            // float zf_1 = face_vertices(batch_index, face_index, 0, 2);
-            float xf_2 = face_vertices(batch_index, face_index, 1, 0);
-            float yf_2 = face_vertices(batch_index, face_index, 1, 1);
-            // float zf_2 = face_vertices(batch_index, face_index, 0, 2);
-            float xf_3 = face_vertices(batch_index, face_index, 2, 0);
-            float yf_3 = face_vertices(batch_index, face_index, 2, 1);
-            // float zf_3 = face_vertices(batch_index, face_index, 0, 2);
-
-            int vertex_1_index = faces(batch_index, face_index, 0);
-            int vertex_2_index = faces(batch_index, face_index, 1);
-            int vertex_3_index = faces(batch_index, face_index, 2);
-
-            // カリングによる裏面のスキップ
-            // 面の頂点の並び（1 -> 2 -> 3）が時計回りの場合描画しない
-            if ((yf_1 - yf_3) * (xf_1 - xf_2) < (yf_1 - yf_2) * (xf_1 - xf_3)) {
-                continue;
-            }
+void backward_silhouette_compact(
+    py::array_t<int, py::array::c_style> np_faces,
+    py::array_t<float, py::array::c_style> np_face_vertices,
+    py::array np_face_index_map,
+    py::array np_pixel_map,
+    py::array_t<float, py::array::c_style> np_grad_vertices,
+    py::array_t<float, py::array::c_style> np_grad_silhouette,
+    py::array_t<float, py::array::c_style> np_debug_grad_map,
+    bool packed_pixel_map,
+    bool deterministic)
+{
+    if (np_faces.ndim() != 3 || np_faces.shape(2) != 3) {
+        throw std::runtime_error("`np_faces.shape` must be equal to `(batch_size, num_faces, 3)`.");
+    }
+    if (np_face_vertices.ndim() != 4 || np_face_vertices.shape(0) != np_faces.shape(0) || np_face_vertices.shape(1) != np_faces.shape(1)
+        || np_face_vertices.shape(2) != 3 || np_face_vertices.shape(3) != 3) {
+        throw std::runtime_error("`np_face_vertices.shape` must be equal to `(batch_size, num_faces, 3, 3)`.");
+    }
+    if (np_grad_vertices.ndim() != 3 || np_grad_vertices.shape(0) != np_faces.shape(0) || np_grad_vertices.shape(2) != 3) {
+        throw std::runtime_error("`np_grad_vertices.shape` must be equal to `(batch_size, num_vertices, 3)`.");
+    }
+    if (np_grad_silhouette.ndim() != 3 || np_grad_silhouette.shape(0) != np_faces.shape(0)) {
+        throw std::runtime_error("`np_grad_silhouette.shape` must be equal to `(batch_size, image_height, image_width)`.");
+    }
+    int batch_size = np_faces.shape(0);
+    int num_faces = np_faces.shape(1);
+    int num_vertices = np_grad_vertices.shape(1);
+    int image_height = np_grad_silhouette.shape(1);
+    int image_width = np_grad_silhouette.shape(2);
+    FaceIndexFormat face_index_format = get_face_index_format(np_face_index_map);
+    SilhouetteFormat pixel_map_format = get_silhouette_format(np_pixel_map, packed_pixel_map);
+    // uint16では65535が「面なし」なので、forwardと同じく面の数を制限する
+    if (face_index_format == FACE_INDEX_UINT16 && num_faces >= FACE_INDEX_UINT16_NONE) {
+        throw std::runtime_error("(num_faces < 65535) -> false");
+    }
+    if (np_face_index_map.ndim() != 3 || np_face_index_map.shape(0) != batch_size || np_face_index_map.shape(1) != image_height || np_face_index_map.shape(2) != image_width) {
+        throw std::runtime_error("`np_face_index_map.shape` must be equal to `np_grad_silhouette.shape`.");
+    }
+    if (np_pixel_map.ndim() != 3 || np_pixel_map.shape(0) != batch_size || np_pixel_map.shape(1) != image_height
+        || np_pixel_map.shape(2) != silhouette_row_size(pixel_map_format, image_width)) {
+        throw std::runtime_error(packed_pixel_map ? "`np_pixel_map.shape` must be equal to `(batch_size, image_height, (image_width + 7) // 8)`."
+                                                  : "`np_pixel_map.shape` must be equal to `np_grad_silhouette.shape`.");
+    }
+    if (np_debug_grad_map.ndim() != 3 || np_debug_grad_map.shape(0) != batch_size || np_debug_grad_map.shape(1) != image_height || np_debug_grad_map.shape(2) != image_width) {
+        throw std::runtime_error("`np_debug_grad_map.shape` must be equal to `np_grad_silhouette.shape`.");
+    }
+    const int* faces_data = np_faces.data();
+    const float* face_vertices_data = np_face_vertices.data();
+    const void* face_index_map_data = np_face_index_map.data();
+    const void* pixel_map_data = np_pixel_map.data();
+    float* grad_vertices_data = np_grad_vertices.mutable_data();
+    const float* grad_silhouette_data = np_grad_silhouette.data();
+    float* debug_grad_map_data = np_debug_grad_map.mutable_data();
+    check_vertex_indices(faces_data, batch_size, num_faces, num_vertices);
+
+    py::gil_scoped_release release;
+    backward_silhouette(faces_data, face_vertices_data, face_index_map_data, face_index_format, pixel_map_data, pixel_map_format,
+        grad_vertices_data, grad_silhouette_data, debug_grad_map_data,
+        batch_size, num_faces, num_vertices, image_height, image_width, deterministic);
+}
+
+void backward_silhouette_supersampled(
+    py::array_t<int, py::array::c_style> np_faces,
+    py::array_t<float, py::array::c_style> np_face_vertices,
+    py::array_t<int, py::array::c_style> np_face_index_map,
+    py::array_t<float, py::array::c_style> np_coverage_map,
+    py::array_t<float, py::array::c_style> np_grad_vertices,
+    py::array_t<float, py::array::c_style> np_grad_coverage,
+    py::array_t<float, py::array::c_style> np_debug_grad_map,
+    bool deterministic)
+{
+    if (np_faces.ndim() != 3 || np_faces.shape(2) != 3) {
+        throw std::runtime_error("`np_faces.shape` must be equal to `(batch_size, num_faces, 3)`.");
+    }
+    if (np_face_vertices.ndim() != 4 || np_face_vertices.shape(0) != np_faces.shape(0) || np_face_vertices.shape(1) != np_faces.shape(1)
+        || np_face_vertices.shape(2) != 3 || np_face_vertices.shape(3) != 3) {
+        throw std::runtime_error("`np_face_vertices.shape` must be equal to `(batch_size, num_faces, 3, 3)`.");
+    }
+    if (np_grad_vertices.ndim() != 3 || np_grad_vertices.shape(0) != np_faces.shape(0) || np_grad_vertices.shape(2) != 3) {
+        throw std::runtime_error("`np_grad_vertices.shape` must be equal to `(batch_size, num_vertices, 3)`.");
+    }
+    if (np_grad_coverage.ndim() != 3 || np_grad_coverage.shape(0) != np_faces.shape(0)) {
+        throw std::runtime_error("`np_grad_coverage.shape` must be equal to `(batch_size, image_height, image_width)`.");
+    }
+    int batch_size = np_faces.shape(0);
+    int num_faces = np_faces.shape(1);
+    int num_vertices = np_grad_vertices.shape(1);
+    int image_height = np_grad_coverage.shape(1);
+    int image_width = np_grad_coverage.shape(2);
+    if (np_face_index_map.ndim() != 3 || np_face_index_map.shape(0) != batch_size || np_face_index_map.shape(1) != image_height || np_face_index_map.shape(2) != image_width) {
+        throw std::runtime_error("`np_face_index_map.shape` must be equal to `np_grad_coverage.shape`.");
+    }
+    if (np_coverage_map.ndim() != 3 || np_coverage_map.shape(0) != batch_size || np_coverage_map.shape(1) != image_height || np_coverage_map.shape(2) != image_width) {
+        throw std::runtime_error("`np_coverage_map.shape` must be equal to `np_grad_coverage.shape`.");
+    }
+    if (np_debug_grad_map.ndim() != 3 || np_debug_grad_map.shape(0) != batch_size || np_debug_grad_map.shape(1) != image_height || np_debug_grad_map.shape(2) != image_width) {
+        throw std::runtime_error("`np_debug_grad_map.shape` must be equal to `np_grad_coverage.shape`.");
+    }
+    const int* faces_data = np_faces.data();
+    const float* face_vertices_data = np_face_vertices.data();
+    const int* face_index_map_data = np_face_index_map.data();
+    const float* coverage_map_data = np_coverage_map.data();
+    float* grad_vertices_data = np_grad_vertices.mutable_data();
+    const float* grad_coverage_data = np_grad_coverage.data();
+    float* debug_grad_map_data = np_debug_grad_map.mutable_data();
+    check_vertex_indices(faces_data, batch_size, num_faces, num_vertices);
 
-            // 3辺について
-            compute_grad(
-                xf_1,
-                yf_1,
-                xf_2,
-                yf_2,
-                xf_3,
-                yf_3,
-                vertex_1_index,
-                vertex_2_index,
-                image_width,
-                image_height,
-                num_vertices,
-                batch_index,
-                face_index,
-                np_face_index_map,
-                np_pixel_map,
-                np_grad_vertices,
-                np_grad_silhouette,
-                np_debug_grad_map);
-            compute_grad(
-                xf_2,
-                yf_2,
-                xf_3,
-                yf_3,
-                xf_1,
-                yf_1,
-                vertex_2_index,
-                vertex_3_index,
-                image_width,
-                image_height,
-                num_vertices,
-                batch_index,
-                face_index,
-                np_face_index_map,
-                np_pixel_map,
-                np_grad_vertices,
-                np_grad_silhouette,
-                np_debug_grad_map);
-            compute_grad(
-                xf_3,
-                yf_3,
-                xf_1,
-                yf_1,
-                xf_2,
-                yf_2,
-                vertex_3_index,
-                vertex_1_index,
-                image_width,
-                image_height,
-                num_vertices,
-                batch_index,
-                face_index,
-                np_face_index_map,
-                np_pixel_map,
-                np_grad_vertices,
-                np_grad_silhouette,
-                np_debug_grad_map);
-        }
-    }
-}
-}
\ No newline at end of file
+    py::gil_scoped_release release;
+    backward_silhouette_supersampled(faces_data, face_vertices_data, face_index_map_data, coverage_map_data,
+        grad_vertices_data, grad_coverage_data, debug_grad_map_data,
+        batch_size, num_faces, num_vertices, image_height, image_width, deterministic);
+}
+}
@@ -1,13 +1,88 @@
 #pragma once
+#include "pixel_format.h"
 #include <pybind11/numpy.h>
+#include <string>
 
 namespace gme {
 namespace py = pybind11;
+class TriangleSetupTable;
+// weight_mapに(batch_size, image_height, image_width, 3)のfloat32を渡すと、各画素の最前面の面についての重心座標を書き込む
+// 面の頂点の属性は sum_k weight_map[..., k] * attribute_k で画像上の線形補間になる
+// 透視補正する場合は weight_map[..., k] * depth_map / z_k を重みにする
+// 面がない画素は0になり、Noneなら求めない
 void forward_face_index_map(
     py::array_t<float, py::array::c_style> np_faces_vertices,
     py::array_t<int, py::array::c_style> np_face_index_map,
     py::array_t<float, py::array::c_style> np_depth_map,
-    py::array_t<int, py::array::c_style> np_silhouette_image);
+    py::array_t<int, py::array::c_style> np_silhouette_image,
+    py::object np_weight_map);
+
+void forward_face_index_map_tiled(
+    py::array_t<float, py::array::c_style> np_faces_vertices,
+    py::array_t<int, py::array::c_style> np_face_index_map,
+    py::array_t<float, py::array::c_style> np_depth_map,
+    py::array_t<int, py::array::c_style> np_silhouette_image,
+    int tile_size,
+    bool front_to_back,
+    py::object np_weight_map);
+
+// 面番号マップ・深度・シルエットを小さな型で書き込む
+// face_index_mapはint32かuint16（面がない画素は65535）
+// depth_mapはfloat32かNoneで、Noneなら書き込まない
+// silhouette_imageはint32かuint8かNoneで、packed_silhouette = trueなら(batch_size, image_height, (image_width + 7) // 8)のuint8に
+// numpy.packbits(axis=-1)と同じ並びでビットを詰める（tile_sizeは8の倍数にする）
+// タイルに分けて処理し、全ての画素を書き込むので出力を初期化しておく必要はない
+void forward_face_index_map_compact(
+    py::array_t<float, py::array::c_style> np_faces_vertices,
+    py::array np_face_index_map,
+    py::object np_depth_map,
+    py::object np_silhouette_image,
+    bool packed_silhouette,
+    int tile_size,
+    bool front_to_back,
+    py::object np_weight_map);
+
+// 各画素をsupersampling x supersampling個のサンプルに分け、面が覆うサンプルの割合を(batch_size, image_height, image_width)のcoverage_mapに書き込む
+// face_index_map, depth_mapは画素の中心で求め、supersamplingによらずforward_face_index_mapと同じになる
+// depth_mapはNoneなら書き込まない
+// 全ての画素を書き込むので出力を初期化しておく必要はない
+void forward_face_index_map_supersampled(
+    py::array_t<float, py::array::c_style> np_faces_vertices,
+    py::array_t<int, py::array::c_style> np_face_index_map,
+    py::object np_depth_map,
+    py::array_t<float, py::array::c_style> np_coverage_map,
+    int supersampling);
+
+// coverage_mapの誤差grad_coverageから各頂点の勾配を求める
+// 辺の走査はbackward_silhouetteと同じで、辺の内側と外側の画素値の差に覆う割合の差を使うので
+// 頂点が画素の中で動いた分も画素値の差に表れる
+// ただし辺は頂点を画素に丸めた位置で走査するので、画素より小さな動きは覆う割合の差を通してのみ勾配に表れる
+void backward_silhouette_supersampled(
+    py::array_t<int, py::array::c_style> np_faces,
+    py::array_t<float, py::array::c_style> np_face_vertices,
+    py::array_t<int, py::array::c_style> np_face_index_map,
+    py::array_t<float, py::array::c_style> np_coverage_map,
+    py::array_t<float, py::array::c_style> np_grad_vertices,
+    py::array_t<float, py::array::c_style> np_grad_coverage,
+    py::array_t<float, py::array::c_style> np_debug_grad_map,
+    bool deterministic);
+
+// 逆伝播で辺の外側と内側の画素から勾配を求める方法
+// "accumulated": 走査線上の区間ごとに 誤差 / 辺までの距離 の和を求めてから頂点ごとの比率を掛ける（デフォルト）
+// "per_pixel": 画素ごとに各頂点の移動量を求めて割る元の実装で、結果を検証するための基準として残している
+// どちらも同じ勾配になるが、加算の順序が異なるので値は丸め誤差の範囲で一致する
+// 差はgrad_verticesの最大の絶対値の1e-4倍以内（検証の許容差）で、値の小さな成分だけを見ると相対誤差はこれより大きくなりうる
+void set_backward_algorithm(const std::string& name);
+std::string get_backward_algorithm();
+
+// numpy配列の型から面番号マップの形式を求める
+// int32かuint16のC連続な配列でなければ例外を投げる
+FaceIndexFormat get_face_index_format(const py::array& np_face_index_map);
+// facesの頂点番号が全て[0, num_vertices)にあるか調べ、範囲外があれば例外を投げる
+// 逆伝播は頂点番号の位置に勾配を書き込むので、GILを解放して並列の処理を始める前に呼ぶ
+void check_vertex_indices(const int* faces_data, int batch_size, int num_faces, int num_vertices);
+// (batch_size, image_height, image_width, 3)のfloat32の配列の先頭を返し、Noneならnullptrを返す
+float* get_weight_map_data(py::object np_weight_map, int batch_size, int image_height, int image_width);
 
 void backward_silhouette(
     py::array_t<int, py::array::c_style> np_faces,
@@ -17,5 +92,151 @@ void backward_silhouette(
     py::array_t<int, py::array::c_style> np_pixel_map,
     py::array_t<float, py::array::c_style> np_grad_vertices,
     py::array_t<float, py::array::c_style> np_grad_silhouette,
-    py::array_t<float, py::array::c_style> np_debug_grad_map);
+    py::array_t<float, py::array::c_style> np_debug_grad_map,
+    bool deterministic);
+
+// forward_face_index_map_compactの出力をそのまま受け取る
+// face_index_mapはint32かuint16、pixel_mapはint32かuint8で、packed_pixel_map = trueならビットを詰めたuint8
+void backward_silhouette_compact(
+    py::array_t<int, py::array::c_style> np_faces,
+    py::array_t<float, py::array::c_style> np_face_vertices,
+    py::array np_face_index_map,
+    py::array np_pixel_map,
+    py::array_t<float, py::array::c_style> np_grad_vertices,
+    py::array_t<float, py::array::c_style> np_grad_silhouette,
+    py::array_t<float, py::array::c_style> np_debug_grad_map,
+    bool packed_pixel_map,
+    bool deterministic);
+
+// 以下は連続したC配列を直接受け取る版
+// numpy配列の検査と変換を行わず、GILも操作しないので、呼び出し側で解放しておく
+// triangle_setupsにbatch_size個のテーブルを渡すと面ごとの前処理の結果が入るので、同じface_verticesのbackward_silhouetteに渡して使い回せる
+// backward_silhouetteのshared_facesがtrueの場合、facesは(num_faces, 3)で全バッチに共通とする
+void forward_face_index_map(
+    const float* face_vertices,
+    int* face_index_map,
+    float* depth_map,
+    int* silhouette_image,
+    int batch_size,
+    int num_faces,
+    int image_height,
+    int image_width,
+    TriangleSetupTable* triangle_setups = nullptr,
+    float* weight_map = nullptr);
+
+void forward_face_index_map_tiled(
+    const float* face_vertices,
+    int* face_index_map,
+    float* depth_map,
+    int* silhouette_image,
+    int batch_size,
+    int num_faces,
+    int image_height,
+    int image_width,
+    int tile_size,
+    bool front_to_back = false,
+    float* weight_map = nullptr);
+
+// depth_map, silhouette_image, weight_mapはnullptrなら書き込まない
+void forward_face_index_map_compact(
+    const float* face_vertices,
+    void* face_index_map,
+    FaceIndexFormat face_index_format,
+    float* depth_map,
+    void* silhouette_image,
+    SilhouetteFormat silhouette_format,
+    int batch_size,
+    int num_faces,
+    int image_height,
+    int image_width,
+    int tile_size,
+    bool front_to_back = false,
+    float* weight_map = nullptr);
+
+// depth_mapはnullptrなら書き込まない
+void forward_face_index_map_supersampled(
+    const float* face_vertices,
+    int* face_index_map,
+    float* depth_map,
+    float* coverage_map,
+    int batch_size,
+    int num_faces,
+    int image_height,
+    int image_width,
+    int supersampling);
+
+void backward_silhouette(
+    const int* faces,
+    const float* face_vertices,
+    const int* face_index_map,
+    const int* pixel_map,
+    float* grad_vertices,
+    const float* grad_silhouette,
+    float* debug_grad_map,
+    int batch_size,
+    int num_faces,
+    int num_vertices,
+    int image_height,
+    int image_width,
+    bool deterministic,
+    const TriangleSetupTable* triangle_setups = nullptr,
+    bool shared_faces = false);
+
+// 面番号マップとpixel_mapを指定した形式で読む
+void backward_silhouette(
+    const int* faces,
+    const float* face_vertices,
+    const void* face_index_map,
+    FaceIndexFormat face_index_format,
+    const void* pixel_map,
+    SilhouetteFormat pixel_map_format,
+    float* grad_vertices,
+    const float* grad_silhouette,
+    float* debug_grad_map,
+    int batch_size,
+    int num_faces,
+    int num_vertices,
+    int image_height,
+    int image_width,
+    bool deterministic,
+    const TriangleSetupTable* triangle_setups = nullptr,
+    bool shared_faces = false);
+
+void backward_silhouette_supersampled(
+    const int* faces,
+    const float* face_vertices,
+    const int* face_index_map,
+    const float* coverage_map,
+    float* grad_vertices,
+    const float* grad_coverage,
+    float* debug_grad_map,
+    int batch_size,
+    int num_faces,
+    int num_vertices,
+    int image_height,
+    int image_width,
+    bool deterministic,
+    const TriangleSetupTable* triangle_setups = nullptr,
+    bool shared_faces = false);
+
+// 画素値がRGBの画像の誤差から各頂点の勾配を求める
+// image, grad_imageは(batch_size, image_height, image_width, 3)で、画素値は[0, 1]とする
+// 辺の内側と外側の画素値の差はチャネルごとにbackward_silhouetteと同じ近似で勾配にし、足し合わせる
+void backward_color(
+    const int* faces,
+    const float* face_vertices,
+    const void* face_index_map,
+    FaceIndexFormat face_index_format,
+    const float* image,
+    float* grad_vertices,
+    const float* grad_image,
+    float* debug_grad_map,
+    int batch_size,
+    int num_faces,
+    int num_vertices,
+    int image_height,
+    int image_width,
+    bool deterministic,
+    const TriangleSetupTable* triangle_setups = nullptr,
+    bool shared_faces = false);
 }
\ No newline at end of file
@@ -0,0 +1,318 @@
+#include "rasterize_row.h"
+#include <mutex>
+#include <stdexcept>
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define GME_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace gme {
+void rasterize_row_scalar(
+    const FaceVertices& face,
+    int face_index,
+    float yf,
+    const float* xf,
+    int i_start,
+    int i_end,
+    float* depth_row,
+    int* face_index_row,
+    int* silhouette_row)
+{
+    for (int i = i_start; i <= i_end; i++) {
+        float z_face;
+        if (compute_z_face(xf[i], yf, face, z_face) == false) {
+            continue;
+        }
+        // zは小さい方が手前
+        // zが等しい場合は面番号が小さい方を優先する
+        if (z_face < depth_row[i] || (z_face == depth_row[i] && depth_row[i] < 1.0f && face_index < face_index_row[i])) {
+            // 現在の面の方が前面の場合
+            depth_row[i] = z_face;
+            face_index_row[i] = face_index;
+            if (silhouette_row != nullptr) {
+                silhouette_row[i] = 255;
+            }
+        }
+    }
+}
+
+#ifdef GME_X86_SIMD
+// compute_z_faceと同じ式のうち行内で変わらない部分
+// 積和の順序と精度を変えると結果が一致しなくなるので、FMAは使わない
+struct RowConstants {
+    float edge_1; // (yf - yf_1) * (xf_2 - xf_1)
+    float edge_2;
+    float edge_3;
+    float lambda_1_a; // yf_2 - yf_3
+    float lambda_1_b; // (xf_3 - xf_2) * (yf - yf_3)
+    float lambda_2_a; // yf_3 - yf_1
+    float lambda_2_b; // (xf_1 - xf_3) * (yf - yf_3)
+    float denominator;
+};
+RowConstants compute_row_constants(const FaceVertices& face, float yf)
+{
+    RowConstants c;
+    c.edge_1 = (yf - face.yf_1) * (face.xf_2 - face.xf_1);
+    c.edge_2 = (yf - face.yf_2) * (face.xf_3 - face.xf_2);
+    c.edge_3 = (yf - face.yf_3) * (face.xf_1 - face.xf_3);
+    c.lambda_1_a = face.yf_2 - face.yf_3;
+    c.lambda_1_b = (face.xf_3 - face.xf_2) * (yf - face.yf_3);
+    c.lambda_2_a = face.yf_3 - face.yf_1;
+    c.lambda_2_b = (face.xf_1 - face.xf_3) * (yf - face.yf_3);
+    c.denominator = (face.yf_2 - face.yf_3) * (face.xf_1 - face.xf_3) + (face.xf_3 - face.xf_2) * (face.yf_1 - face.yf_3);
+    return c;
+}
+
+// 8画素ずつ処理し、端数は1画素ずつ処理する
+__attribute__((target("avx2"))) void rasterize_row_avx2(
+    const FaceVertices& face,
+    int face_index,
+    float yf,
+    const float* xf,
+    int i_start,
+    int i_end,
+    float* depth_row,
+    int* face_index_row,
+    int* silhouette_row)
+{
+    RowConstants c = compute_row_constants(face, yf);
+    const __m256 edge_1 = _mm256_set1_ps(c.edge_1);
+    const __m256 edge_2 = _mm256_set1_ps(c.edge_2);
+    const __m256 edge_3 = _mm256_set1_ps(c.edge_3);
+    const __m256 xf_1 = _mm256_set1_ps(face.xf_1);
+    const __m256 xf_2 = _mm256_set1_ps(face.xf_2);
+    const __m256 xf_3 = _mm256_set1_ps(face.xf_3);
+    const __m256 slope_1 = _mm256_set1_ps(face.yf_2 - face.yf_1);
+    const __m256 slope_2 = _mm256_set1_ps(face.yf_3 - face.yf_2);
+    const __m256 slope_3 = _mm256_set1_ps(face.yf_1 - face.yf_3);
+    const __m256 lambda_1_a = _mm256_set1_ps(c.lambda_1_a);
+    const __m256 lambda_1_b = _mm256_set1_ps(c.lambda_1_b);
+    const __m256 lambda_2_a = _mm256_set1_ps(c.lambda_2_a);
+    const __m256 lambda_2_b = _mm256_set1_ps(c.lambda_2_b);
+    const __m256 denominator = _mm256_set1_ps(c.denominator);
+    const __m256 zf_1 = _mm256_set1_ps(face.zf_1);
+    const __m256 zf_2 = _mm256_set1_ps(face.zf_2);
+    const __m256 zf_3 = _mm256_set1_ps(face.zf_3);
+    const __m256d one_pd = _mm256_set1_pd(1.0);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256i face_index_vec = _mm256_set1_epi32(face_index);
+    const __m256i silhouette_vec = _mm256_set1_epi32(255);
+
+    int i = i_start;
+    for (; i + 7 <= i_end; i += 8) {
+        __m256 x = _mm256_loadu_ps(xf + i);
+        // 3辺のいずれかの右側にある画素
+        __m256 outside = _mm256_cmp_ps(edge_1, _mm256_mul_ps(_mm256_sub_ps(x, xf_1), slope_1), _CMP_LT_OQ);
+        outside = _mm256_or_ps(outside, _mm256_cmp_ps(edge_2, _mm256_mul_ps(_mm256_sub_ps(x, xf_2), slope_2), _CMP_LT_OQ));
+        outside = _mm256_or_ps(outside, _mm256_cmp_ps(edge_3, _mm256_mul_ps(_mm256_sub_ps(x, xf_3), slope_3), _CMP_LT_OQ));
+        if (_mm256_movemask_ps(outside) == 0xff) {
+            continue;
+        }
+        __m256 dx = _mm256_sub_ps(x, xf_3);
+        __m256 lambda_1 = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(lambda_1_a, dx), lambda_1_b), denominator);
+        __m256 lambda_2 = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(lambda_2_a, dx), lambda_2_b), denominator);
+        // lambda_3 = 1.0 - lambda_1 - lambda_2 はスカラー版と同じく倍精度で計算する
+        __m256d lambda_1_lo = _mm256_cvtps_pd(_mm256_castps256_ps128(lambda_1));
+        __m256d lambda_1_hi = _mm256_cvtps_pd(_mm256_extractf128_ps(lambda_1, 1));
+        __m256d lambda_2_lo = _mm256_cvtps_pd(_mm256_castps256_ps128(lambda_2));
+        __m256d lambda_2_hi = _mm256_cvtps_pd(_mm256_extractf128_ps(lambda_2, 1));
+        __m128 lambda_3_lo = _mm256_cvtpd_ps(_mm256_sub_pd(_mm256_sub_pd(one_pd, lambda_1_lo), lambda_2_lo));
+        __m128 lambda_3_hi = _mm256_cvtpd_ps(_mm256_sub_pd(_mm256_sub_pd(one_pd, lambda_1_hi), lambda_2_hi));
+        __m256 lambda_3 = _mm256_insertf128_ps(_mm256_castps128_ps256(lambda_3_lo), lambda_3_hi, 1);
+        __m256 sum = _mm256_add_ps(_mm256_add_ps(_mm256_div_ps(lambda_1, zf_1), _mm256_div_ps(lambda_2, zf_2)), _mm256_div_ps(lambda_3, zf_3));
+        // z_face = 1.0 / sum も倍精度
+        __m128 z_lo = _mm256_cvtpd_ps(_mm256_div_pd(one_pd, _mm256_cvtps_pd(_mm256_castps256_ps128(sum))));
+        __m128 z_hi = _mm256_cvtpd_ps(_mm256_div_pd(one_pd, _mm256_cvtps_pd(_mm256_extractf128_ps(sum, 1))));
+        __m256 z_face = _mm256_insertf128_ps(_mm256_castps128_ps256(z_lo), z_hi, 1);
+
+        // 面の内部で、z_face \in [0, 1]で、現在より手前の画素だけ書き込む
+        __m256 depth = _mm256_loadu_ps(depth_row + i);
+        __m256 nearer = _mm256_cmp_ps(z_face, depth, _CMP_LT_OQ);
+        // zが等しい画素がある場合だけ面番号を読んで比べる
+        __m256 tie = _mm256_andnot_ps(outside, _mm256_and_ps(_mm256_cmp_ps(z_face, depth, _CMP_EQ_OQ), _mm256_cmp_ps(depth, one, _CMP_LT_OQ)));
+        if (_mm256_movemask_ps(tie) != 0) {
+            __m256i current = _mm256_loadu_si256((const __m256i*)(face_index_row + i));
+            nearer = _mm256_or_ps(nearer, _mm256_and_ps(tie, _mm256_castsi256_ps(_mm256_cmpgt_epi32(current, face_index_vec))));
+        }
+        __m256 write = _mm256_andnot_ps(outside, nearer);
+        write = _mm256_and_ps(write, _mm256_cmp_ps(z_face, zero, _CMP_NLT_UQ));
+        write = _mm256_and_ps(write, _mm256_cmp_ps(z_face, one, _CMP_NGT_UQ));
+        __m256i mask = _mm256_castps_si256(write);
+        _mm256_maskstore_ps(depth_row + i, mask, z_face);
+        _mm256_maskstore_epi32(face_index_row + i, mask, face_index_vec);
+        if (silhouette_row != nullptr) {
+            _mm256_maskstore_epi32(silhouette_row + i, mask, silhouette_vec);
+        }
+    }
+    rasterize_row_scalar(face, face_index, yf, xf, i, i_end, depth_row, face_index_row, silhouette_row);
+}
+
+// GCCのAVX-512の組み込み関数は内部の_mm512_undefined_*で未初期化変数の誤った警告を出すので抑制する
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f"))) inline __m512 convert_to_ps512(__m256 lo, __m256 hi)
+{
+    return _mm512_castpd_ps(_mm512_insertf64x4(_mm512_castps_pd(_mm512_castps256_ps512(lo)), _mm256_castps_pd(hi), 1));
+}
+__attribute__((target("avx512f"))) inline __m256 extract_hi_ps256(__m512 v)
+{
+    return _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1));
+}
+
+// 16画素ずつ処理し、端数はマスク付きの読み書きで処理する
+__attribute__((target("avx512f"))) void rasterize_row_avx512(
+    const FaceVertices& face,
+    int face_index,
+    float yf,
+    const float* xf,
+    int i_start,
+    int i_end,
+    float* depth_row,
+    int* face_index_row,
+    int* silhouette_row)
+{
+    RowConstants c = compute_row_constants(face, yf);
+    const __m512 edge_1 = _mm512_set1_ps(c.edge_1);
+    const __m512 edge_2 = _mm512_set1_ps(c.edge_2);
+    const __m512 edge_3 = _mm512_set1_ps(c.edge_3);
+    const __m512 xf_1 = _mm512_set1_ps(face.xf_1);
+    const __m512 xf_2 = _mm512_set1_ps(face.xf_2);
+    const __m512 xf_3 = _mm512_set1_ps(face.xf_3);
+    const __m512 slope_1 = _mm512_set1_ps(face.yf_2 - face.yf_1);
+    const __m512 slope_2 = _mm512_set1_ps(face.yf_3 - face.yf_2);
+    const __m512 slope_3 = _mm512_set1_ps(face.yf_1 - face.yf_3);
+    const __m512 lambda_1_a = _mm512_set1_ps(c.lambda_1_a);
+    const __m512 lambda_1_b = _mm512_set1_ps(c.lambda_1_b);
+    const __m512 lambda_2_a = _mm512_set1_ps(c.lambda_2_a);
+    const __m512 lambda_2_b = _mm512_set1_ps(c.lambda_2_b);
+    const __m512 denominator = _mm512_set1_ps(c.denominator);
+    const __m512 zf_1 = _mm512_set1_ps(face.zf_1);
+    const __m512 zf_2 = _mm512_set1_ps(face.zf_2);
+    const __m512 zf_3 = _mm512_set1_ps(face.zf_3);
+    const __m512d one_pd = _mm512_set1_pd(1.0);
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512i face_index_vec = _mm512_set1_epi32(face_index);
+    const __m512i silhouette_vec = _mm512_set1_epi32(255);
+
+    for (int i = i_start; i <= i_end; i += 16) {
+        int num_lanes = i_end - i + 1;
+        __mmask16 lanes = (num_lanes >= 16) ? (__mmask16)0xffff : (__mmask16)((1u << num_lanes) - 1);
+        __m512 x = _mm512_maskz_loadu_ps(lanes, xf + i);
+        // 3辺のいずれの右側にもない画素
+        __mmask16 inside = lanes;
+        inside &= ~_mm512_cmp_ps_mask(edge_1, _mm512_mul_ps(_mm512_sub_ps(x, xf_1), slope_1), _CMP_LT_OQ);
+        inside &= ~_mm512_cmp_ps_mask(edge_2, _mm512_mul_ps(_mm512_sub_ps(x, xf_2), slope_2), _CMP_LT_OQ);
+        inside &= ~_mm512_cmp_ps_mask(edge_3, _mm512_mul_ps(_mm512_sub_ps(x, xf_3), slope_3), _CMP_LT_OQ);
+        if (inside == 0) {
+            continue;
+        }
+        __m512 dx = _mm512_sub_ps(x, xf_3);
+        __m512 lambda_1 = _mm512_div_ps(_mm512_add_ps(_mm512_mul_ps(lambda_1_a, dx), lambda_1_b), denominator);
+        __m512 lambda_2 = _mm512_div_ps(_mm512_add_ps(_mm512_mul_ps(lambda_2_a, dx), lambda_2_b), denominator);
+        // lambda_3 = 1.0 - lambda_1 - lambda_2 はスカラー版と同じく倍精度で計算する
+        __m512d lambda_1_lo = _mm512_cvtps_pd(_mm512_castps512_ps256(lambda_1));
+        __m512d lambda_1_hi = _mm512_cvtps_pd(extract_hi_ps256(lambda_1));
+        __m512d lambda_2_lo = _mm512_cvtps_pd(_mm512_castps512_ps256(lambda_2));
+        __m512d lambda_2_hi = _mm512_cvtps_pd(extract_hi_ps256(lambda_2));
+        __m512 lambda_3 = convert_to_ps512(
+            _mm512_cvtpd_ps(_mm512_sub_pd(_mm512_sub_pd(one_pd, lambda_1_lo), lambda_2_lo)),
+            _mm512_cvtpd_ps(_mm512_sub_pd(_mm512_sub_pd(one_pd, lambda_1_hi), lambda_2_hi)));
+        __m512 sum = _mm512_add_ps(_mm512_add_ps(_mm512_div_ps(lambda_1, zf_1), _mm512_div_ps(lambda_2, zf_2)), _mm512_div_ps(lambda_3, zf_3));
+        // z_face = 1.0 / sum も倍精度
+        __m512 z_face = convert_to_ps512(
+            _mm512_cvtpd_ps(_mm512_div_pd(one_pd, _mm512_cvtps_pd(_mm512_castps512_ps256(sum)))),
+            _mm512_cvtpd_ps(_mm512_div_pd(one_pd, _mm512_cvtps_pd(extract_hi_ps256(sum)))));
+
+        // 面の内部で、z_face \in [0, 1]で、現在より手前の画素だけ書き込む
+        __m512 depth = _mm512_maskz_loadu_ps(lanes, depth_row + i);
+        __mmask16 nearer = _mm512_cmp_ps_mask(z_face, depth, _CMP_LT_OQ);
+        // zが等しい画素がある場合だけ面番号を読んで比べる
+        __mmask16 tie = inside & _mm512_cmp_ps_mask(z_face, depth, _CMP_EQ_OQ) & _mm512_cmp_ps_mask(depth, one, _CMP_LT_OQ);
+        if (tie != 0) {
+            __m512i current = _mm512_maskz_loadu_epi32(tie, face_index_row + i);
+            nearer |= _mm512_mask_cmpgt_epi32_mask(tie, current, face_index_vec);
+        }
+        __mmask16 write = inside & nearer;
+        write &= _mm512_cmp_ps_mask(z_face, zero, _CMP_NLT_UQ);
+        write &= _mm512_cmp_ps_mask(z_face, one, _CMP_NGT_UQ);
+        _mm512_mask_storeu_ps(depth_row + i, write, z_face);
+        _mm512_mask_storeu_epi32(face_index_row + i, write, face_index_vec);
+        if (silhouette_row != nullptr) {
+            _mm512_mask_storeu_epi32(silhouette_row + i, write, silhouette_vec);
+        }
+    }
+}
+#pragma GCC diagnostic pop
+#endif
+
+namespace {
+    std::mutex rasterize_row_mutex;
+    RasterizeRowFunction rasterize_row_function = nullptr;
+    std::string rasterize_row_name;
+
+    bool cpu_supports(const std::string& name)
+    {
+        if (name == "scalar") {
+            return true;
+        }
+#ifdef GME_X86_SIMD
+        __builtin_cpu_init();
+        if (name == "avx2") {
+            return __builtin_cpu_supports("avx2");
+        }
+        if (name == "avx512") {
+            return __builtin_cpu_supports("avx512f");
+        }
+#endif
+        return false;
+    }
+}
+
+void set_simd_instruction_set(const std::string& name)
+{
+    if (name.empty()) {
+        for (const char* candidate : { "avx512", "avx2", "scalar" }) {
+            if (cpu_supports(candidate)) {
+                set_simd_instruction_set(candidate);
+                return;
+            }
+        }
+    }
+    if (name != "scalar" && name != "avx2" && name != "avx512") {
+        throw std::runtime_error("unknown instruction set: " + name);
+    }
+    if (cpu_supports(name) == false) {
+        throw std::runtime_error("this CPU does not support " + name);
+    }
+    std::lock_guard<std::mutex> lock(rasterize_row_mutex);
+    rasterize_row_name = name;
+    rasterize_row_function = rasterize_row_scalar;
+#ifdef GME_X86_SIMD
+    if (name == "avx2") {
+        rasterize_row_function = rasterize_row_avx2;
+    }
+    if (name == "avx512") {
+        rasterize_row_function = rasterize_row_avx512;
+    }
+#endif
+}
+std::string get_simd_instruction_set()
+{
+    get_rasterize_row_function();
+    std::lock_guard<std::mutex> lock(rasterize_row_mutex);
+    return rasterize_row_name;
+}
+RasterizeRowFunction get_rasterize_row_function()
+{
+    {
+        std::lock_guard<std::mutex> lock(rasterize_row_mutex);
+        if (rasterize_row_function != nullptr) {
+            return rasterize_row_function;
+        }
+    }
+    set_simd_instruction_set("");
+    return get_rasterize_row_function();
+}
+}
\ No newline at end of file
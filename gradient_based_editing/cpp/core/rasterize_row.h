@@ -0,0 +1,95 @@
+#pragma once
+#include <string>
+
+namespace gme {
+// 投影後の面の3頂点
+struct FaceVertices {
+    float xf_1;
+    float yf_1;
+    float zf_1;
+    float xf_2;
+    float yf_2;
+    float zf_2;
+    float xf_3;
+    float yf_3;
+    float zf_3;
+};
+
+// 点(xf, yf)の面についての重心座標（画像上での各頂点の重み）を求める
+// http://zellij.hatenablog.com/entry/20131207/p1
+inline void compute_barycentric_coordinates(float xf, float yf, const FaceVertices& face, float& lambda_1, float& lambda_2, float& lambda_3)
+{
+    float xf_1 = face.xf_1;
+    float yf_1 = face.yf_1;
+    float xf_2 = face.xf_2;
+    float yf_2 = face.yf_2;
+    float xf_3 = face.xf_3;
+    float yf_3 = face.yf_3;
+    lambda_1 = ((yf_2 - yf_3) * (xf - xf_3) + (xf_3 - xf_2) * (yf - yf_3)) / ((yf_2 - yf_3) * (xf_1 - xf_3) + (xf_3 - xf_2) * (yf_1 - yf_3));
+    lambda_2 = ((yf_3 - yf_1) * (xf - xf_3) + (xf_1 - xf_3) * (yf - yf_3)) / ((yf_2 - yf_3) * (xf_1 - xf_3) + (xf_3 - xf_2) * (yf_1 - yf_3));
+    lambda_3 = 1.0 - lambda_1 - lambda_2;
+}
+
+// 点(xf, yf)が面の内部にあればその点のz座標をz_faceに入れてtrueを返す
+// 全てのエンジンで同じ結果になるよう画素ごとの判定はここにまとめる
+// SIMD版も同じ演算を同じ順序・同じ精度で行うので結果は完全に一致する
+inline bool compute_z_face(float xf, float yf, const FaceVertices& face, float& z_face)
+{
+    float xf_1 = face.xf_1;
+    float yf_1 = face.yf_1;
+    float zf_1 = face.zf_1;
+    float xf_2 = face.xf_2;
+    float yf_2 = face.yf_2;
+    float zf_2 = face.zf_2;
+    float xf_3 = face.xf_3;
+    float yf_3 = face.yf_3;
+    float zf_3 = face.zf_3;
+
+    // xyが面の外部ならスキップ
+    // Edge Functionで3辺のいずれかの右側にあればスキップ
+    // https://www.cs.drexel.edu/~david/Classes/Papers/comp175-06-pineda.pdf
+    if ((yf - yf_1) * (xf_2 - xf_1) < (xf - xf_1) * (yf_2 - yf_1) || (yf - yf_2) * (xf_3 - xf_2) < (xf - xf_2) * (yf_3 - yf_2) || (yf - yf_3) * (xf_1 - xf_3) < (xf - xf_3) * (yf_1 - yf_3)) {
+        return false;
+    }
+
+    // 重心座標系の各係数を計算
+    float lambda_1;
+    float lambda_2;
+    float lambda_3;
+    compute_barycentric_coordinates(xf, yf, face, lambda_1, lambda_2, lambda_3);
+
+    // 面f_nのxy座標に対応する点のz座標を求める
+    // https://www.scratchapixel.com/lessons/3d-basic-rendering/rasterization-practical-implementation/visibility-problem-depth-buffer-depth-interpolation
+    z_face = 1.0 / (lambda_1 / zf_1 + lambda_2 / zf_2 + lambda_3 / zf_3);
+
+    if (z_face < 0.0 || z_face > 1.0) {
+        return false;
+    }
+    return true;
+}
+
+// 1行のうちi \in [i_start, i_end]の画素について面を判定し、現在より手前ならdepth_row[i], face_index_row[i]を更新して
+// silhouette_row[i]を255にする
+// xf[i]は各画素のx座標で、silhouette_rowはnullptrでもよい
+// zが等しい場合は既に描画された面（depth_row[i] < 1）より面番号が小さい場合だけ更新する
+// 深度を1で初期化しておけば、面を処理する順序によらず面番号の昇順に処理した場合と同じ結果になる
+typedef void (*RasterizeRowFunction)(
+    const FaceVertices& face,
+    int face_index,
+    float yf,
+    const float* xf,
+    int i_start,
+    int i_end,
+    float* depth_row,
+    int* face_index_row,
+    int* silhouette_row);
+
+// CPUが対応している中で最も幅の広い命令セットの実装を返す
+// x86-64以外や対応する命令がない場合は1画素ずつ処理する実装になる
+RasterizeRowFunction get_rasterize_row_function();
+// "scalar", "avx2", "avx512"のいずれか
+// 空文字列を指定すると自動で選ぶ
+// CPUが対応していない命令セットを指定すると例外を投げる
+void set_simd_instruction_set(const std::string& name);
+std::string get_simd_instruction_set();
+}
\ No newline at end of file
@@ -0,0 +1,155 @@
+#include "rasterizer.h"
+#include "rasterize.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace gme {
+Rasterizer::Rasterizer(int batch_size, int num_faces, int num_vertices, int image_height, int image_width)
+{
+    if (batch_size <= 0) {
+        throw std::runtime_error("(batch_size > 0) -> false");
+    }
+    if (num_faces <= 0) {
+        throw std::runtime_error("(num_faces > 0) -> false");
+    }
+    if (num_vertices <= 0) {
+        throw std::runtime_error("(num_vertices > 0) -> false");
+    }
+    if (image_height <= 0) {
+        throw std::runtime_error("(image_height > 0) -> false");
+    }
+    if (image_width <= 0) {
+        throw std::runtime_error("(image_width > 0) -> false");
+    }
+    _batch_size = batch_size;
+    _num_faces = num_faces;
+    _num_vertices = num_vertices;
+    _image_height = image_height;
+    _image_width = image_width;
+
+    int image_size = batch_size * image_height * image_width;
+    _face_index_map.resize(image_size);
+    _depth_map.resize(image_size);
+    _silhouette_image.resize(image_size);
+    _grad_vertices.resize(batch_size * num_vertices * 3);
+    _debug_grad_map.resize(image_size);
+    _triangle_setups.resize(batch_size);
+    std::fill(_face_index_map.data(), _face_index_map.data() + image_size, -1);
+    std::fill(_depth_map.data(), _depth_map.data() + image_size, 1.0f);
+    std::fill(_silhouette_image.data(), _silhouette_image.data() + image_size, 0);
+    std::fill(_grad_vertices.data(), _grad_vertices.data() + _grad_vertices.size(), 0.0f);
+    std::fill(_debug_grad_map.data(), _debug_grad_map.data() + image_size, 0.0f);
+}
+void Rasterizer::forward(py::array_t<float, py::array::c_style> np_face_vertices)
+{
+    if (np_face_vertices.ndim() != 4) {
+        throw std::runtime_error("(np_face_vertices.ndim() != 4) -> false");
+    }
+    if (np_face_vertices.shape(0) != _batch_size || np_face_vertices.shape(1) != _num_faces || np_face_vertices.shape(2) != 3 || np_face_vertices.shape(3) != 3) {
+        throw std::runtime_error("`np_face_vertices.shape` must be equal to `(batch_size, num_faces, 3, 3)`.");
+    }
+    const float* face_vertices_data = np_face_vertices.data();
+
+    py::gil_scoped_release release;
+    forward(face_vertices_data);
+}
+void Rasterizer::forward(const float* face_vertices_data)
+{
+    // 深度はforward_face_index_mapが初期化する
+    int image_size = _face_index_map.size();
+    std::fill(_face_index_map.data(), _face_index_map.data() + image_size, -1);
+    std::fill(_silhouette_image.data(), _silhouette_image.data() + image_size, 0);
+    forward_face_index_map(face_vertices_data, _face_index_map.data(), _depth_map.data(), _silhouette_image.data(),
+        _batch_size, _num_faces, _image_height, _image_width, _triangle_setups.data());
+}
+void Rasterizer::backward(
+    py::array_t<int, py::array::c_style> np_faces,
+    py::array_t<float, py::array::c_style> np_face_vertices,
+    py::array_t<float, py::array::c_style> np_grad_silhouette,
+    bool deterministic)
+{
+    if (np_faces.ndim() != 3) {
+        throw std::runtime_error("(np_faces.ndim() != 3) -> false");
+    }
+    if (np_face_vertices.ndim() != 4) {
+        throw std::runtime_error("(np_face_vertices.ndim() != 4) -> false");
+    }
+    if (np_grad_silhouette.ndim() != 3) {
+        throw std::runtime_error("(np_grad_silhouette.ndim() != 3) -> false");
+    }
+    if (np_faces.shape(0) != _batch_size || np_faces.shape(1) != _num_faces || np_faces.shape(2) != 3) {
+        throw std::runtime_error("`np_faces.shape` must be equal to `(batch_size, num_faces, 3)`.");
+    }
+    if (np_face_vertices.shape(0) != _batch_size || np_face_vertices.shape(1) != _num_faces || np_face_vertices.shape(2) != 3 || np_face_vertices.shape(3) != 3) {
+        throw std::runtime_error("`np_face_vertices.shape` must be equal to `(batch_size, num_faces, 3, 3)`.");
+    }
+    if (np_grad_silhouette.shape(0) != _batch_size || np_grad_silhouette.shape(1) != _image_height || np_grad_silhouette.shape(2) != _image_width) {
+        throw std::runtime_error("`np_grad_silhouette.shape` must be equal to `(batch_size, image_height, image_width)`.");
+    }
+    const int* faces_data = np_faces.data();
+    const float* face_vertices_data = np_face_vertices.data();
+    const float* grad_silhouette_data = np_grad_silhouette.data();
+    check_vertex_indices(faces_data, _batch_size, _num_faces, _num_vertices);
+
+    py::gil_scoped_release release;
+    backward(faces_data, face_vertices_data, grad_silhouette_data, deterministic);
+}
+void Rasterizer::backward(const int* faces_data, const float* face_vertices_data, const float* grad_silhouette_data, bool deterministic)
+{
+    std::fill(_grad_vertices.data(), _grad_vertices.data() + _grad_vertices.size(), 0.0f);
+    std::fill(_debug_grad_map.data(), _debug_grad_map.data() + _debug_grad_map.size(), 0.0f);
+    // シルエットをそのまま画素値として使う
+    backward_silhouette(faces_data, face_vertices_data, _face_index_map.data(), _silhouette_image.data(),
+        _grad_vertices.data(), grad_silhouette_data, _debug_grad_map.data(),
+        _batch_size, _num_faces, _num_vertices, _image_height, _image_width, deterministic);
+}
+void Rasterizer::backward(const int* faces_data, const float* grad_silhouette_data, bool deterministic)
+{
+    std::fill(_grad_vertices.data(), _grad_vertices.data() + _grad_vertices.size(), 0.0f);
+    std::fill(_debug_grad_map.data(), _debug_grad_map.data() + _debug_grad_map.size(), 0.0f);
+    // 面の座標は前処理の結果に含まれているので渡さない
+    backward_silhouette(faces_data, nullptr, _face_index_map.data(), _silhouette_image.data(),
+        _grad_vertices.data(), grad_silhouette_data, _debug_grad_map.data(),
+        _batch_size, _num_faces, _num_vertices, _image_height, _image_width, deterministic, _triangle_setups.data());
+}
+int* Rasterizer::face_index_map()
+{
+    return _face_index_map.data();
+}
+float* Rasterizer::depth_map()
+{
+    return _depth_map.data();
+}
+int* Rasterizer::silhouette_image()
+{
+    return _silhouette_image.data();
+}
+float* Rasterizer::grad_vertices()
+{
+    return _grad_vertices.data();
+}
+float* Rasterizer::debug_grad_map()
+{
+    return _debug_grad_map.data();
+}
+int Rasterizer::batch_size()
+{
+    return _batch_size;
+}
+int Rasterizer::num_faces()
+{
+    return _num_faces;
+}
+int Rasterizer::num_vertices()
+{
+    return _num_vertices;
+}
+int Rasterizer::image_height()
+{
+    return _image_height;
+}
+int Rasterizer::image_width()
+{
+    return _image_width;
+}
+}
\ No newline at end of file
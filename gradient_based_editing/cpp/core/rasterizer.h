@@ -0,0 +1,55 @@
+#pragma once
+#include "aligned_buffer.h"
+#include "triangle_setup.h"
+#include <pybind11/numpy.h>
+
+namespace gme {
+namespace py = pybind11;
+// 同じ大きさの入力を繰り返しラスタライズするためのクラス
+// 出力用の配列を最初に確保して毎回使い回す
+// 各配列は次のforward/backwardで上書きされる
+class Rasterizer {
+private:
+    int _batch_size;
+    int _num_faces;
+    int _num_vertices;
+    int _image_height;
+    int _image_width;
+    AlignedBuffer<int> _face_index_map;
+    AlignedBuffer<float> _depth_map;
+    AlignedBuffer<int> _silhouette_image;
+    AlignedBuffer<float> _grad_vertices;
+    AlignedBuffer<float> _debug_grad_map;
+    // 直前のforwardで求めた面ごとの前処理
+    std::vector<TriangleSetupTable> _triangle_setups;
+
+public:
+    Rasterizer(int batch_size, int num_faces, int num_vertices, int image_height, int image_width);
+    // face_vertices: (batch_size, num_faces, 3, 3)
+    void forward(py::array_t<float, py::array::c_style> np_face_vertices);
+    // faces: (batch_size, num_faces, 3)
+    // grad_silhouette: (batch_size, image_height, image_width)
+    // 直前のforwardの面番号マップとシルエットを使う
+    void backward(
+        py::array_t<int, py::array::c_style> np_faces,
+        py::array_t<float, py::array::c_style> np_face_vertices,
+        py::array_t<float, py::array::c_style> np_grad_silhouette,
+        bool deterministic);
+    // 連続したC配列を直接受け取る版
+    // GILは操作しないので呼び出し側で解放しておく
+    void forward(const float* face_vertices);
+    void backward(const int* faces, const float* face_vertices, const float* grad_silhouette, bool deterministic);
+    // 直前のforwardと同じface_verticesについて逆伝播する場合は面ごとの前処理を使い回せる
+    void backward(const int* faces, const float* grad_silhouette, bool deterministic);
+    int* face_index_map();
+    float* depth_map();
+    int* silhouette_image();
+    float* grad_vertices();
+    float* debug_grad_map();
+    int batch_size();
+    int num_faces();
+    int num_vertices();
+    int image_height();
+    int image_width();
+};
+}
\ No newline at end of file
@@ -0,0 +1,382 @@
+#include "shading.h"
+#include "array_view.h"
+#include "rasterize.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+namespace gme {
+void compute_face_intensities(
+    const int* faces_data,
+    const float* vertices_data,
+    const float* light_direction,
+    float ambient,
+    float* face_intensities,
+    int batch_size,
+    int num_faces,
+    int num_vertices)
+{
+    check_vertex_indices(faces_data, batch_size, num_faces, num_vertices);
+    ArrayView3<const int> faces(faces_data, num_faces, 3);
+    ArrayView3<const float> vertices(vertices_data, num_vertices, 3);
+
+    // 面に向かう光の向き
+    float light_norm = std::sqrt(light_direction[0] * light_direction[0] + light_direction[1] * light_direction[1] + light_direction[2] * light_direction[2]);
+    float light[3] = { 0, 0, 0 };
+    if (light_norm > 0) {
+        for (int axis = 0; axis < 3; axis++) {
+            light[axis] = -light_direction[axis] / light_norm;
+        }
+    }
+
+    get_thread_pool()->parallel_for(batch_size, [&](int batch_index, int thread_index) {
+        for (int face_index = 0; face_index < num_faces; face_index++) {
+            int vertex_index_1 = faces(batch_index, face_index, 0);
+            int vertex_index_2 = faces(batch_index, face_index, 1);
+            int vertex_index_3 = faces(batch_index, face_index, 2);
+            float edge_a[3];
+            float edge_b[3];
+            for (int axis = 0; axis < 3; axis++) {
+                edge_a[axis] = vertices(batch_index, vertex_index_2, axis) - vertices(batch_index, vertex_index_1, axis);
+                edge_b[axis] = vertices(batch_index, vertex_index_3, axis) - vertices(batch_index, vertex_index_1, axis);
+            }
+            float normal[3] = {
+                edge_a[1] * edge_b[2] - edge_a[2] * edge_b[1],
+                edge_a[2] * edge_b[0] - edge_a[0] * edge_b[2],
+                edge_a[0] * edge_b[1] - edge_a[1] * edge_b[0],
+            };
+            float normal_norm = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+            // 面積が0の面は法線が決まらないので最も暗くする
+            float power = 0;
+            if (normal_norm > 0) {
+                power = (normal[0] * light[0] + normal[1] * light[1] + normal[2] * light[2]) / normal_norm;
+            }
+            face_intensities[batch_index * num_faces + face_index] = std::min(std::max(power, ambient), 1.0f);
+        }
+    });
+}
+
+void forward_shading(
+    const int* faces_data,
+    const float* vertices_data,
+    const void* face_index_map_data,
+    FaceIndexFormat face_index_format,
+    const float* weight_map_data,
+    const float* colors_data,
+    const float* light_direction,
+    float* image_data,
+    bool per_vertex_colors,
+    float ambient,
+    int batch_size,
+    int num_faces,
+    int num_vertices,
+    int image_height,
+    int image_width)
+{
+    std::vector<float> face_intensities(batch_size * num_faces);
+    compute_face_intensities(faces_data, vertices_data, light_direction, ambient, face_intensities.data(), batch_size, num_faces, num_vertices);
+
+    ArrayView3<const int> faces(faces_data, num_faces, 3);
+    ArrayView3<const float> colors(colors_data, per_vertex_colors ? num_vertices : num_faces, 3);
+    int face_index_map_pixel_size = face_index_format == FACE_INDEX_UINT16 ? sizeof(uint16_t) : sizeof(int);
+
+    // 画素ごとに独立なので行をまとめたものを単位に並列に処理する
+    int num_rows_per_task = std::max(1, 8192 / std::max(image_width, 1));
+    int num_row_blocks = (image_height + num_rows_per_task - 1) / num_rows_per_task;
+    get_thread_pool()->parallel_for(batch_size * num_row_blocks, [&](int task_index, int thread_index) {
+        int batch_index = task_index / num_row_blocks;
+        int yi_start = (task_index % num_row_blocks) * num_rows_per_task;
+        int yi_end = std::min(yi_start + num_rows_per_task, image_height) - 1;
+        FaceIndexView face_index_map(static_cast<const char*>(face_index_map_data) + (ssize_t)batch_index * image_height * image_width * face_index_map_pixel_size,
+            face_index_format, image_width);
+        for (int yi = yi_start; yi <= yi_end; yi++) {
+            ssize_t row_index = (ssize_t)batch_index * image_height + yi;
+            float* image_row = image_data + row_index * image_width * 3;
+            for (int xi = 0; xi < image_width; xi++) {
+                float* pixel = image_row + xi * 3;
+                int face_index = face_index_map(yi, xi);
+                // 古い面番号マップなどで範囲外の面番号は面がないものとして扱う
+                if (face_index < 0 || face_index >= num_faces) {
+                    pixel[0] = 0;
+                    pixel[1] = 0;
+                    pixel[2] = 0;
+                    continue;
+                }
+                float intensity = face_intensities[batch_index * num_faces + face_index];
+                if (per_vertex_colors) {
+                    const float* weights = weight_map_data + (row_index * image_width + xi) * 3;
+                    const float* color_1 = &colors(batch_index, faces(batch_index, face_index, 0), 0);
+                    const float* color_2 = &colors(batch_index, faces(batch_index, face_index, 1), 0);
+                    const float* color_3 = &colors(batch_index, faces(batch_index, face_index, 2), 0);
+                    for (int channel = 0; channel < 3; channel++) {
+                        pixel[channel] = intensity * (weights[0] * color_1[channel] + weights[1] * color_2[channel] + weights[2] * color_3[channel]);
+                    }
+                } else {
+                    for (int channel = 0; channel < 3; channel++) {
+                        pixel[channel] = intensity * colors(batch_index, face_index, channel);
+                    }
+                }
+            }
+        }
+    });
+}
+
+void backward_shading(
+    const int* faces_data,
+    const float* face_vertices_data,
+    const float* vertices_data,
+    const void* face_index_map_data,
+    FaceIndexFormat face_index_format,
+    const float* weight_map_data,
+    const float* light_direction,
+    const float* image_data,
+    const float* grad_image_data,
+    float* grad_vertices_data,
+    float* grad_colors_data,
+    float* debug_grad_map_data,
+    bool per_vertex_colors,
+    float ambient,
+    int batch_size,
+    int num_faces,
+    int num_vertices,
+    int image_height,
+    int image_width,
+    bool deterministic)
+{
+    check_vertex_indices(faces_data, batch_size, num_faces, num_vertices);
+    // 頂点の勾配は辺の外側と内側の画素値の差から求める
+    backward_color(faces_data, face_vertices_data, face_index_map_data, face_index_format, image_data,
+        grad_vertices_data, grad_image_data, debug_grad_map_data,
+        batch_size, num_faces, num_vertices, image_height, image_width, deterministic);
+
+    std::vector<float> face_intensities(batch_size * num_faces);
+    compute_face_intensities(faces_data, vertices_data, light_direction, ambient, face_intensities.data(), batch_size, num_faces, num_vertices);
+
+    ArrayView3<const int> faces(faces_data, num_faces, 3);
+    ArrayView3<float> grad_colors(grad_colors_data, per_vertex_colors ? num_vertices : num_faces, 3);
+    int image_size = image_height * image_width;
+    int face_index_map_pixel_size = face_index_format == FACE_INDEX_UINT16 ? sizeof(uint16_t) : sizeof(int);
+    auto pool = get_thread_pool();
+
+    // 色の勾配は各画素の誤差を最前面の面に集めたもの
+    // 面ごとに画素の位置を画素の順に並べ、面ごとに足し合わせるので並列に処理しても常に同じ結果になる
+    std::vector<std::vector<int>> pixel_offsets(batch_size);
+    std::vector<std::vector<int>> pixel_indices(batch_size);
+    pool->parallel_for(batch_size, [&](int batch_index, int thread_index) {
+        FaceIndexView face_index_map(static_cast<const char*>(face_index_map_data) + (ssize_t)batch_index * image_size * face_index_map_pixel_size,
+            face_index_format, image_width);
+        std::vector<int>& offsets = pixel_offsets[batch_index];
+        std::vector<int>& indices = pixel_indices[batch_index];
+        offsets.assign(num_faces + 1, 0);
+        for (int yi = 0; yi < image_height; yi++) {
+            for (int xi = 0; xi < image_width; xi++) {
+                int face_index = face_index_map(yi, xi);
+                if (face_index >= 0 && face_index < num_faces) {
+                    offsets[face_index + 1]++;
+                }
+            }
+        }
+        for (int face_index = 0; face_index < num_faces; face_index++) {
+            offsets[face_index + 1] += offsets[face_index];
+        }
+        indices.resize(offsets[num_faces]);
+        std::vector<int> cursors(offsets.begin(), offsets.end() - 1);
+        for (int yi = 0; yi < image_height; yi++) {
+            for (int xi = 0; xi < image_width; xi++) {
+                int face_index = face_index_map(yi, xi);
+                if (face_index >= 0 && face_index < num_faces) {
+                    indices[cursors[face_index]++] = yi * image_width + xi;
+                }
+            }
+        }
+    });
+
+    // 面ごとの色の勾配 (batch_size, num_faces, 3, 3)
+    // 面の色の場合は各面の先頭の3つだけを使う
+    std::vector<float> grad_face_colors_data(batch_size * num_faces * 9, 0.0f);
+    const int num_faces_per_task = 256;
+    int num_chunks = std::max(1, (num_faces + num_faces_per_task - 1) / num_faces_per_task);
+    pool->parallel_for(batch_size * num_chunks, [&](int task_index, int thread_index) {
+        int batch_index = task_index / num_chunks;
+        int face_index_start = (task_index % num_chunks) * num_faces_per_task;
+        int face_index_end = std::min(face_index_start + num_faces_per_task, num_faces);
+        const std::vector<int>& offsets = pixel_offsets[batch_index];
+        const std::vector<int>& indices = pixel_indices[batch_index];
+        const float* grad_image = grad_image_data + (ssize_t)batch_index * image_size * 3;
+        const float* weight_map = per_vertex_colors ? weight_map_data + (ssize_t)batch_index * image_size * 3 : nullptr;
+        for (int face_index = face_index_start; face_index < face_index_end; face_index++) {
+            if (offsets[face_index] == offsets[face_index + 1]) {
+                continue;
+            }
+            float* grad_face_colors = &grad_face_colors_data[(batch_index * num_faces + face_index) * 9];
+            float intensity = face_intensities[batch_index * num_faces + face_index];
+            for (int k = offsets[face_index]; k < offsets[face_index + 1]; k++) {
+                int pixel_index = indices[k];
+                const float* grad_pixel = grad_image + pixel_index * 3;
+                if (per_vertex_colors) {
+                    // 画素値は intensity * sum_n weight_n * color_n なので、頂点nの色の勾配は intensity * weight_n * grad
+                    const float* weights = weight_map + pixel_index * 3;
+                    for (int n = 0; n < 3; n++) {
+                        for (int channel = 0; channel < 3; channel++) {
+                            grad_face_colors[n * 3 + channel] += weights[n] * grad_pixel[channel];
+                        }
+                    }
+                } else {
+                    for (int channel = 0; channel < 3; channel++) {
+                        grad_face_colors[channel] += grad_pixel[channel];
+                    }
+                }
+            }
+            for (int i = 0; i < 9; i++) {
+                grad_face_colors[i] *= intensity;
+            }
+        }
+    });
+
+    // 面ごとの勾配を面番号の順に足し合わせる
+    pool->parallel_for(batch_size, [&](int batch_index, int thread_index) {
+        for (int face_index = 0; face_index < num_faces; face_index++) {
+            const float* grad_face_colors = &grad_face_colors_data[(batch_index * num_faces + face_index) * 9];
+            if (per_vertex_colors) {
+                for (int n = 0; n < 3; n++) {
+                    int vertex_index = faces(batch_index, face_index, n);
+                    for (int channel = 0; channel < 3; channel++) {
+                        grad_colors(batch_index, vertex_index, channel) += grad_face_colors[n * 3 + channel];
+                    }
+                }
+            } else {
+                for (int channel = 0; channel < 3; channel++) {
+                    grad_colors(batch_index, face_index, channel) += grad_face_colors[channel];
+                }
+            }
+        }
+    });
+}
+
+// 形の検査を共通化する
+void check_shading_arrays(
+    const py::array_t<int, py::array::c_style>& np_faces,
+    const py::array_t<float, py::array::c_style>& np_vertices,
+    const py::array& np_face_index_map,
+    const py::array_t<float, py::array::c_style>& np_colors,
+    const py::array_t<float, py::array::c_style>& np_light_direction,
+    const py::array_t<float, py::array::c_style>& np_image,
+    bool per_vertex_colors)
+{
+    if (np_faces.ndim() != 3 || np_faces.shape(2) != 3) {
+        throw std::runtime_error("`np_faces.shape` must be equal to `(batch_size, num_faces, 3)`.");
+    }
+    if (np_vertices.ndim() != 3 || np_vertices.shape(0) != np_faces.shape(0) || np_vertices.shape(2) != 3) {
+        throw std::runtime_error("`np_vertices.shape` must be equal to `(batch_size, num_vertices, 3)`.");
+    }
+    if (np_face_index_map.ndim() != 3 || np_face_index_map.shape(0) != np_faces.shape(0)) {
+        throw std::runtime_error("`np_face_index_map.shape` must be equal to `(batch_size, image_height, image_width)`.");
+    }
+    if (np_colors.ndim() != 3 || np_colors.shape(0) != np_faces.shape(0) || np_colors.shape(2) != 3
+        || np_colors.shape(1) != (per_vertex_colors ? np_vertices.shape(1) : np_faces.shape(1))) {
+        throw std::runtime_error(per_vertex_colors ? "`np_colors.shape` must be equal to `(batch_size, num_vertices, 3)`."
+                                                   : "`np_colors.shape` must be equal to `(batch_size, num_faces, 3)`.");
+    }
+    if (np_light_direction.size() != 3) {
+        throw std::runtime_error("`np_light_direction.shape` must be equal to `(3,)`.");
+    }
+    if (np_image.ndim() != 4 || np_image.shape(0) != np_faces.shape(0) || np_image.shape(1) != np_face_index_map.shape(1)
+        || np_image.shape(2) != np_face_index_map.shape(2) || np_image.shape(3) != 3) {
+        throw std::runtime_error("`np_image.shape` must be equal to `(batch_size, image_height, image_width, 3)`.");
+    }
+}
+
+void forward_shading(
+    py::array_t<int, py::array::c_style> np_faces,
+    py::array_t<float, py::array::c_style> np_vertices,
+    py::array np_face_index_map,
+    py::object np_weight_map,
+    py::array_t<float, py::array::c_style> np_colors,
+    py::array_t<float, py::array::c_style> np_light_direction,
+    py::array_t<float, py::array::c_style> np_image,
+    bool per_vertex_colors,
+    float ambient)
+{
+    check_shading_arrays(np_faces, np_vertices, np_face_index_map, np_colors, np_light_direction, np_image, per_vertex_colors);
+    int batch_size = np_faces.shape(0);
+    int num_faces = np_faces.shape(1);
+    int num_vertices = np_vertices.shape(1);
+    int image_height = np_face_index_map.shape(1);
+    int image_width = np_face_index_map.shape(2);
+    FaceIndexFormat face_index_format = get_face_index_format(np_face_index_map);
+    const float* weight_map_data = get_weight_map_data(np_weight_map, batch_size, image_height, image_width);
+    if (per_vertex_colors && weight_map_data == nullptr) {
+        throw std::runtime_error("`np_weight_map` is required for per-vertex colors.");
+    }
+    const int* faces_data = np_faces.data();
+    const float* vertices_data = np_vertices.data();
+    const void* face_index_map_data = np_face_index_map.data();
+    const float* colors_data = np_colors.data();
+    const float* light_direction = np_light_direction.data();
+    float* image_data = np_image.mutable_data();
+
+    py::gil_scoped_release release;
+    forward_shading(faces_data, vertices_data, face_index_map_data, face_index_format, weight_map_data, colors_data, light_direction, image_data,
+        per_vertex_colors, ambient, batch_size, num_faces, num_vertices, image_height, image_width);
+}
+
+void backward_shading(
+    py::array_t<int, py::array::c_style> np_faces,
+    py::array_t<float, py::array::c_style> np_face_vertices,
+    py::array_t<float, py::array::c_style> np_vertices,
+    py::array np_face_index_map,
+    py::object np_weight_map,
+    py::array_t<float, py::array::c_style> np_light_direction,
+    py::array_t<float, py::array::c_style> np_image,
+    py::array_t<float, py::array::c_style> np_grad_image,
+    py::array_t<float, py::array::c_style> np_grad_vertices,
+    py::array_t<float, py::array::c_style> np_grad_colors,
+    py::array_t<float, py::array::c_style> np_debug_grad_map,
+    bool per_vertex_colors,
+    float ambient,
+    bool deterministic)
+{
+    check_shading_arrays(np_faces, np_vertices, np_face_index_map, np_grad_colors, np_light_direction, np_image, per_vertex_colors);
+    int batch_size = np_faces.shape(0);
+    int num_faces = np_faces.shape(1);
+    int num_vertices = np_vertices.shape(1);
+    int image_height = np_face_index_map.shape(1);
+    int image_width = np_face_index_map.shape(2);
+    if (np_face_vertices.ndim() != 4 || np_face_vertices.shape(0) != batch_size || np_face_vertices.shape(1) != num_faces
+        || np_face_vertices.shape(2) != 3 || np_face_vertices.shape(3) != 3) {
+        throw std::runtime_error("`np_face_vertices.shape` must be equal to `(batch_size, num_faces, 3, 3)`.");
+    }
+    if (np_grad_image.ndim() != 4 || np_grad_image.shape(0) != batch_size || np_grad_image.shape(1) != image_height
+        || np_grad_image.shape(2) != image_width || np_grad_image.shape(3) != 3) {
+        throw std::runtime_error("`np_grad_image.shape` must be equal to `np_image.shape`.");
+    }
+    if (np_grad_vertices.ndim() != 3 || np_grad_vertices.shape(0) != batch_size || np_grad_vertices.shape(1) != num_vertices || np_grad_vertices.shape(2) != 3) {
+        throw std::runtime_error("`np_grad_vertices.shape` must be equal to `np_vertices.shape`.");
+    }
+    if (np_debug_grad_map.ndim() != 3 || np_debug_grad_map.shape(0) != batch_size || np_debug_grad_map.shape(1) != image_height || np_debug_grad_map.shape(2) != image_width) {
+        throw std::runtime_error("`np_debug_grad_map.shape` must be equal to `np_face_index_map.shape`.");
+    }
+    FaceIndexFormat face_index_format = get_face_index_format(np_face_index_map);
+    const float* weight_map_data = get_weight_map_data(np_weight_map, batch_size, image_height, image_width);
+    if (per_vertex_colors && weight_map_data == nullptr) {
+        throw std::runtime_error("`np_weight_map` is required for per-vertex colors.");
+    }
+    const int* faces_data = np_faces.data();
+    const float* face_vertices_data = np_face_vertices.data();
+    const float* vertices_data = np_vertices.data();
+    const void* face_index_map_data = np_face_index_map.data();
+    const float* light_direction = np_light_direction.data();
+    const float* image_data = np_image.data();
+    const float* grad_image_data = np_grad_image.data();
+    float* grad_vertices_data = np_grad_vertices.mutable_data();
+    float* grad_colors_data = np_grad_colors.mutable_data();
+    float* debug_grad_map_data = np_debug_grad_map.mutable_data();
+
+    py::gil_scoped_release release;
+    backward_shading(faces_data, face_vertices_data, vertices_data, face_index_map_data, face_index_format, weight_map_data, light_direction,
+        image_data, grad_image_data, grad_vertices_data, grad_colors_data, debug_grad_map_data,
+        per_vertex_colors, ambient, batch_size, num_faces, num_vertices, image_height, image_width, deterministic);
+}
+}
\ No newline at end of file
@@ -0,0 +1,105 @@
+#pragma once
+#include "pixel_format.h"
+#include <pybind11/numpy.h>
+
+namespace gme {
+namespace py = pybind11;
+// 面番号マップから色を付けたRGB画像を作る
+// ビューワのObjectRendererと同じく平行光源で面ごとに一様な明るさにする
+// 面の明るさは clamp(dot(n, -normalize(light_direction)), ambient, 1) で、nは (v_2 - v_1) x (v_3 - v_1) を正規化した面の法線
+// 画素値は 明るさ * 色 で、面がない画素は0になる
+// faces: (batch_size, num_faces, 3) 範囲外の頂点番号があればruntime_errorを投げる
+// vertices: (batch_size, num_vertices, 3) 法線を求めるための頂点で、light_directionと同じ座標系にする
+// face_index_map: (batch_size, image_height, image_width) int32かuint16 範囲外の面番号の画素は面がないものとして扱う
+// weight_map: forward_face_index_mapで求めた(batch_size, image_height, image_width, 3)の重心座標
+// colors: per_vertex_colors = trueなら(batch_size, num_vertices, 3)の頂点の色で、画素ではweight_mapで補間する
+//         falseなら(batch_size, num_faces, 3)の面の色で、weight_mapはNoneでよい
+// light_direction: (3,) 光の進む向き
+// image: (batch_size, image_height, image_width, 3) float32
+void forward_shading(
+    py::array_t<int, py::array::c_style> np_faces,
+    py::array_t<float, py::array::c_style> np_vertices,
+    py::array np_face_index_map,
+    py::object np_weight_map,
+    py::array_t<float, py::array::c_style> np_colors,
+    py::array_t<float, py::array::c_style> np_light_direction,
+    py::array_t<float, py::array::c_style> np_image,
+    bool per_vertex_colors,
+    float ambient);
+
+// forward_shadingの画像の誤差から勾配を求める
+// grad_colors: colorsと同じ形で、色についての勾配を加算する
+// grad_vertices: (batch_size, num_vertices, 3) 投影後の頂点についての勾配をbackward_silhouetteと同じ辺の近似で加算する
+// 画素値はimageの値をそのまま使うので、0と255以外の値の画素でも勾配が求まる
+// 面の明るさを通した法線の勾配は求めない
+void backward_shading(
+    py::array_t<int, py::array::c_style> np_faces,
+    py::array_t<float, py::array::c_style> np_face_vertices,
+    py::array_t<float, py::array::c_style> np_vertices,
+    py::array np_face_index_map,
+    py::object np_weight_map,
+    py::array_t<float, py::array::c_style> np_light_direction,
+    py::array_t<float, py::array::c_style> np_image,
+    py::array_t<float, py::array::c_style> np_grad_image,
+    py::array_t<float, py::array::c_style> np_grad_vertices,
+    py::array_t<float, py::array::c_style> np_grad_colors,
+    py::array_t<float, py::array::c_style> np_debug_grad_map,
+    bool per_vertex_colors,
+    float ambient,
+    bool deterministic);
+
+// 以下は連続したC配列を直接受け取る版
+// GILは操作しないので呼び出し側で解放しておく
+// face_intensities: (batch_size, num_faces) 面の明るさを書き込む
+void compute_face_intensities(
+    const int* faces,
+    const float* vertices,
+    const float* light_direction,
+    float ambient,
+    float* face_intensities,
+    int batch_size,
+    int num_faces,
+    int num_vertices);
+
+// weight_mapはper_vertex_colors = falseならnullptrでよい
+void forward_shading(
+    const int* faces,
+    const float* vertices,
+    const void* face_index_map,
+    FaceIndexFormat face_index_format,
+    const float* weight_map,
+    const float* colors,
+    const float* light_direction,
+    float* image,
+    bool per_vertex_colors,
+    float ambient,
+    int batch_size,
+    int num_faces,
+    int num_vertices,
+    int image_height,
+    int image_width);
+
+// 色の勾配は面ごとに画素の順に足し合わせるので、スレッド数によらず同じ結果になる
+// deterministicはbackward_silhouetteと同じくdebug_grad_mapの加算順を固定する
+void backward_shading(
+    const int* faces,
+    const float* face_vertices,
+    const float* vertices,
+    const void* face_index_map,
+    FaceIndexFormat face_index_format,
+    const float* weight_map,
+    const float* light_direction,
+    const float* image,
+    const float* grad_image,
+    float* grad_vertices,
+    float* grad_colors,
+    float* debug_grad_map,
+    bool per_vertex_colors,
+    float ambient,
+    int batch_size,
+    int num_faces,
+    int num_vertices,
+    int image_height,
+    int image_width,
+    bool deterministic);
+}
\ No newline at end of file
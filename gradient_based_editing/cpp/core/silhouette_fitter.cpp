@@ -0,0 +1,156 @@
+#include "silhouette_fitter.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace gme {
+SilhouetteFitter::SilhouetteFitter(
+    py::array_t<float, py::array::c_style> np_vertices,
+    py::array_t<int, py::array::c_style> np_faces,
+    py::array_t<float, py::array::c_style> np_target_silhouette,
+    float distance_from_object,
+    float angle_x,
+    float angle_y,
+    float viewing_angle,
+    float z_max,
+    float z_min,
+    float learning_rate)
+{
+    if (np_vertices.ndim() != 3 || np_vertices.shape(2) != 3) {
+        throw std::runtime_error("`np_vertices.shape` must be equal to `(batch_size, num_vertices, 3)`.");
+    }
+    if (np_faces.ndim() != 3 || np_faces.shape(0) != np_vertices.shape(0) || np_faces.shape(2) != 3) {
+        throw std::runtime_error("`np_faces.shape` must be equal to `(batch_size, num_faces, 3)`.");
+    }
+    if (np_target_silhouette.ndim() != 3 || np_target_silhouette.shape(0) != np_vertices.shape(0)) {
+        throw std::runtime_error("`np_target_silhouette.shape` must be equal to `(batch_size, image_height, image_width)`.");
+    }
+    _batch_size = np_vertices.shape(0);
+    _num_vertices = np_vertices.shape(1);
+    _num_faces = np_faces.shape(1);
+    _image_height = np_target_silhouette.shape(1);
+    _image_width = np_target_silhouette.shape(2);
+    _projection = compute_projection(distance_from_object, angle_x, angle_y, viewing_angle, z_max, z_min);
+    _learning_rate = learning_rate;
+    _iteration = 0;
+    _loss = 0;
+    _rasterizer = std::make_unique<Rasterizer>(_batch_size, _num_faces, _num_vertices, _image_height, _image_width);
+
+    int image_size = _batch_size * _image_height * _image_width;
+    _vertices.resize(np_vertices.size());
+    _faces.resize(np_faces.size());
+    _target_silhouette.resize(image_size);
+    _face_vertices.resize(_batch_size * _num_faces * 9);
+    _grad_silhouette.resize(image_size);
+    _grad_vertices.resize(np_vertices.size());
+    std::memcpy(_vertices.data(), np_vertices.data(), sizeof(float) * _vertices.size());
+    std::memcpy(_faces.data(), np_faces.data(), sizeof(int) * _faces.size());
+    std::memcpy(_target_silhouette.data(), np_target_silhouette.data(), sizeof(float) * image_size);
+    std::fill(_face_vertices.data(), _face_vertices.data() + _face_vertices.size(), 0.0f);
+    std::fill(_grad_silhouette.data(), _grad_silhouette.data() + image_size, 0.0f);
+    std::fill(_grad_vertices.data(), _grad_vertices.data() + _grad_vertices.size(), 0.0f);
+}
+void SilhouetteFitter::step()
+{
+    forward_project_faces(_vertices.data(), _faces.data(), _face_vertices.data(), _batch_size, _num_vertices, _num_faces, _projection);
+    _rasterizer->forward(_face_vertices.data());
+
+    // 誤差とシルエットについての勾配
+    const int* silhouette_image = _rasterizer->silhouette_image();
+    const float* target_silhouette = _target_silhouette.data();
+    float* grad_silhouette = _grad_silhouette.data();
+    double loss = 0;
+    for (int pixel_index = 0; pixel_index < _grad_silhouette.size(); pixel_index++) {
+        double delta = (silhouette_image[pixel_index] - (double)target_silhouette[pixel_index]) / 255.0;
+        grad_silhouette[pixel_index] = delta;
+        loss += delta * delta;
+    }
+    _loss = loss / 2.0;
+
+    // 面の前処理は直前のforwardのものを使い回す
+    _rasterizer->backward(_faces.data(), grad_silhouette, false);
+    backward_project_vertices(_rasterizer->grad_vertices(), _grad_vertices.data(), _batch_size, _num_vertices, _projection);
+
+    float* vertices = _vertices.data();
+    const float* grad_vertices = _grad_vertices.data();
+    for (int k = 0; k < _vertices.size(); k++) {
+        vertices[k] -= _learning_rate * grad_vertices[k];
+    }
+    _iteration++;
+}
+int SilhouetteFitter::fit(int num_iterations, py::object callback, int callback_interval)
+{
+    if (callback_interval <= 0) {
+        throw std::runtime_error("(callback_interval > 0) -> false");
+    }
+    py::gil_scoped_release release;
+    for (int n = 1; n <= num_iterations; n++) {
+        step();
+        if (n % callback_interval != 0 || callback.is_none()) {
+            continue;
+        }
+        py::gil_scoped_acquire acquire;
+        py::object result = callback(_iteration);
+        if (result.is_none() == false && result.cast<bool>() == false) {
+            return n;
+        }
+    }
+    return num_iterations;
+}
+float* SilhouetteFitter::vertices()
+{
+    return _vertices.data();
+}
+float* SilhouetteFitter::face_vertices()
+{
+    return _face_vertices.data();
+}
+float* SilhouetteFitter::grad_silhouette()
+{
+    return _grad_silhouette.data();
+}
+float* SilhouetteFitter::grad_vertices()
+{
+    return _grad_vertices.data();
+}
+Rasterizer& SilhouetteFitter::rasterizer()
+{
+    return *_rasterizer;
+}
+int SilhouetteFitter::batch_size()
+{
+    return _batch_size;
+}
+int SilhouetteFitter::num_vertices()
+{
+    return _num_vertices;
+}
+int SilhouetteFitter::num_faces()
+{
+    return _num_faces;
+}
+int SilhouetteFitter::image_height()
+{
+    return _image_height;
+}
+int SilhouetteFitter::image_width()
+{
+    return _image_width;
+}
+int SilhouetteFitter::iteration()
+{
+    return _iteration;
+}
+float SilhouetteFitter::loss()
+{
+    return _loss;
+}
+float SilhouetteFitter::learning_rate()
+{
+    return _learning_rate;
+}
+void SilhouetteFitter::set_learning_rate(float learning_rate)
+{
+    _learning_rate = learning_rate;
+}
+}
\ No newline at end of file
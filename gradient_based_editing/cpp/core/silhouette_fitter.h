@@ -0,0 +1,70 @@
+#pragma once
+#include "aligned_buffer.h"
+#include "projection.h"
+#include "rasterizer.h"
+#include <memory>
+#include <pybind11/pybind11.h>
+
+namespace gme {
+namespace py = pybind11;
+// 目標のシルエットに合うように頂点を勾配法で動かす
+// 投影・ラスタライズ・誤差・勾配・更新の全てをGILを解放したまま行い、
+// 指定した間隔でのみPythonのコールバックを呼ぶ
+class SilhouetteFitter {
+private:
+    int _batch_size;
+    int _num_vertices;
+    int _num_faces;
+    int _image_height;
+    int _image_width;
+    Projection _projection;
+    float _learning_rate;
+    int _iteration;
+    float _loss;
+    AlignedBuffer<float> _vertices;
+    AlignedBuffer<int> _faces;
+    AlignedBuffer<float> _target_silhouette;
+    AlignedBuffer<float> _face_vertices;
+    AlignedBuffer<float> _grad_silhouette;
+    AlignedBuffer<float> _grad_vertices;
+    std::unique_ptr<Rasterizer> _rasterizer;
+
+public:
+    // vertices: (batch_size, num_vertices, 3) ワールド座標系の頂点の初期値
+    // faces: (batch_size, num_faces, 3)
+    // target_silhouette: (batch_size, image_height, image_width) 値は0か255
+    SilhouetteFitter(
+        py::array_t<float, py::array::c_style> np_vertices,
+        py::array_t<int, py::array::c_style> np_faces,
+        py::array_t<float, py::array::c_style> np_target_silhouette,
+        float distance_from_object,
+        float angle_x,
+        float angle_y,
+        float viewing_angle,
+        float z_max,
+        float z_min,
+        float learning_rate);
+    // 1回更新する
+    // GILは操作しないので呼び出し側で解放しておく
+    void step();
+    // num_iterations回更新し、callback_interval回ごとにcallback(iteration)を呼ぶ
+    // callbackがFalseを返したらそこで打ち切る
+    // 実際に更新した回数を返す
+    int fit(int num_iterations, py::object callback, int callback_interval);
+    float* vertices();
+    float* face_vertices();
+    float* grad_silhouette();
+    float* grad_vertices();
+    Rasterizer& rasterizer();
+    int batch_size();
+    int num_vertices();
+    int num_faces();
+    int image_height();
+    int image_width();
+    int iteration();
+    // 直前の更新時点での誤差 sum((silhouette - target)^2) / 2 / 255^2
+    float loss();
+    float learning_rate();
+    void set_learning_rate(float learning_rate);
+};
+}
\ No newline at end of file
@@ -0,0 +1,139 @@
+#include "thread_pool.h"
+#include <algorithm>
+
+namespace gme {
+ThreadPool::ThreadPool(int num_threads)
+{
+    _num_threads = std::max(num_threads, 1);
+    _num_tasks = 0;
+    _num_active_workers = 0;
+    _generation = 0;
+    _stopped = false;
+    _next_task_index = 0;
+    for (int thread_index = 1; thread_index < _num_threads; thread_index++) {
+        _workers.emplace_back(&ThreadPool::_work, this, thread_index);
+    }
+}
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopped = true;
+    }
+    _job_posted.notify_all();
+    for (auto& worker : _workers) {
+        worker.join();
+    }
+}
+int ThreadPool::num_threads()
+{
+    return _num_threads;
+}
+void ThreadPool::_run_tasks(int thread_index)
+{
+    while (true) {
+        int task_index = _next_task_index++;
+        if (task_index >= _num_tasks) {
+            return;
+        }
+        try {
+            _func(task_index, thread_index);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_exception) {
+                _exception = std::current_exception();
+            }
+            // 残りのタスクは実行しない
+            _next_task_index = _num_tasks;
+        }
+    }
+}
+void ThreadPool::_work(int thread_index)
+{
+    unsigned long generation = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _job_posted.wait(lock, [&] { return _stopped || _generation != generation; });
+            if (_stopped) {
+                return;
+            }
+            generation = _generation;
+        }
+        _run_tasks(thread_index);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _num_active_workers--;
+        }
+        _job_finished.notify_one();
+    }
+}
+void ThreadPool::parallel_for(int num_tasks, std::function<void(int, int)> func)
+{
+    if (num_tasks <= 0) {
+        return;
+    }
+    // タスクが1つしかない場合はスレッドを起こさない
+    if (_num_threads == 1 || num_tasks == 1) {
+        for (int task_index = 0; task_index < num_tasks; task_index++) {
+            func(task_index, 0);
+        }
+        return;
+    }
+    // 複数のスレッドから同時に呼ばれた場合は順番に処理する
+    std::lock_guard<std::mutex> dispatch_lock(_dispatch_mutex);
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _func = func;
+        _num_tasks = num_tasks;
+        _next_task_index = 0;
+        _exception = nullptr;
+        _num_active_workers = _num_threads - 1;
+        _generation++;
+    }
+    _job_posted.notify_all();
+    _run_tasks(0);
+    std::exception_ptr exception;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _job_finished.wait(lock, [&] { return _num_active_workers == 0; });
+        _func = nullptr;
+        exception = _exception;
+    }
+    if (exception) {
+        std::rethrow_exception(exception);
+    }
+}
+
+namespace {
+    std::mutex thread_pool_mutex;
+    std::shared_ptr<ThreadPool> thread_pool;
+}
+
+void set_num_threads(int num_threads)
+{
+    if (num_threads <= 0) {
+        num_threads = std::thread::hardware_concurrency();
+    }
+    std::lock_guard<std::mutex> lock(thread_pool_mutex);
+    if (thread_pool && thread_pool->num_threads() == std::max(num_threads, 1)) {
+        return;
+    }
+    thread_pool = std::make_shared<ThreadPool>(num_threads);
+}
+int get_num_threads()
+{
+    return get_thread_pool()->num_threads();
+}
+std::shared_ptr<ThreadPool> get_thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(thread_pool_mutex);
+        if (thread_pool) {
+            return thread_pool;
+        }
+    }
+    set_num_threads(0);
+    return get_thread_pool();
+}
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace gme {
+// 常駐するワーカースレッドでタスクを並列に処理する
+// 呼び出し元のスレッドもワーカーの1つとして働く
+class ThreadPool {
+private:
+    int _num_threads;
+    std::vector<std::thread> _workers;
+    std::mutex _mutex;
+    std::mutex _dispatch_mutex;
+    std::condition_variable _job_posted;
+    std::condition_variable _job_finished;
+    std::function<void(int, int)> _func;
+    std::atomic<int> _next_task_index;
+    std::exception_ptr _exception;
+    int _num_tasks;
+    int _num_active_workers;
+    unsigned long _generation;
+    bool _stopped;
+    void _work(int thread_index);
+    void _run_tasks(int thread_index);
+
+public:
+    ThreadPool(int num_threads);
+    ~ThreadPool();
+    int num_threads();
+    // func(task_index, thread_index)を全てのtask_index \in [0, num_tasks)について実行する
+    // thread_index \in [0, num_threads)はスレッドごとの作業領域を使い分けるためのもの
+    // どのタスクがどのスレッドで実行されるかは不定なので、結果がそれに依存しないようにすること
+    void parallel_for(int num_tasks, std::function<void(int, int)> func);
+};
+// 0以下を指定するとハードウェアスレッド数になる
+void set_num_threads(int num_threads);
+int get_num_threads();
+// set_num_threadsで作り直されても実行中の処理が終わるまでは破棄されない
+std::shared_ptr<ThreadPool> get_thread_pool();
+}
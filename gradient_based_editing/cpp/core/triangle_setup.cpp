@@ -0,0 +1,189 @@
+#include "triangle_setup.h"
+#include "coordinate.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace gme {
+// compute_z_faceが面の内部の画素について返すz_faceの下限を求める
+// 真の値は頂点のzの最小値以上だが、重心座標の丸め誤差で下回ることがあるので面の形に応じた余裕を持たせる
+// 重心座標の誤差がdelta以下なら z_face >= z_min / (1 + 2 * delta) となる
+// 誤差を見積もれない面は0を返し、深度による判定で省かれないようにする
+float compute_z_near(const float* vertices)
+{
+    float z_min = std::min(std::min(vertices[2], vertices[5]), vertices[8]);
+    if (!(z_min > 0.0f)) {
+        return 0.0f;
+    }
+    float xf_1 = vertices[0];
+    float yf_1 = vertices[1];
+    float xf_2 = vertices[3];
+    float yf_2 = vertices[4];
+    float xf_3 = vertices[6];
+    float yf_3 = vertices[7];
+    float scale = std::max(std::max(std::max(std::fabs(xf_1), std::fabs(yf_1)), std::max(std::fabs(xf_2), std::fabs(yf_2))),
+        std::max(std::max(std::fabs(xf_3), std::fabs(yf_3)), 1.0f));
+    // 重心座標の分母（面積の2倍）
+    float denominator = std::fabs((yf_2 - yf_3) * (xf_1 - xf_3) + (xf_3 - xf_2) * (yf_1 - yf_3));
+    // 分子・分母の各項は高々(2 * scale)^2なので、それぞれの丸め誤差を十分大きめに見積もる
+    float delta = (256.0f * FLT_EPSILON) * scale * scale / denominator;
+    if (!(delta < 0.25f)) {
+        return 0.0f;
+    }
+    return z_min / (1.0f + 2.0f * delta) * (1.0f - 16.0f * FLT_EPSILON);
+}
+
+TriangleSetupTable::TriangleSetupTable()
+{
+    _num_faces = 0;
+    _stride = 0;
+}
+void TriangleSetupTable::resize(int num_faces)
+{
+    _num_faces = num_faces;
+    _stride = (num_faces + 15) / 16 * 16 + 16;
+    _float_values.resize(NUM_FLOAT_FIELDS * _stride);
+    _int_values.resize(NUM_INT_FIELDS * _stride);
+}
+void TriangleSetupTable::build(const float* face_vertices, int face_index_start, int face_index_end, int image_height, int image_width, bool image_coordinates)
+{
+    for (int face_index = face_index_start; face_index < face_index_end; face_index++) {
+        const float* vertices = face_vertices + face_index * 9;
+        float xf_1 = vertices[0];
+        float yf_1 = vertices[1];
+        float xf_2 = vertices[3];
+        float yf_2 = vertices[4];
+        float xf_3 = vertices[6];
+        float yf_3 = vertices[7];
+        for (int k = 0; k < 3; k++) {
+            float_value(XF_1 + k, face_index) = vertices[k * 3 + 0];
+            float_value(YF_1 + k, face_index) = vertices[k * 3 + 1];
+            float_value(ZF_1 + k, face_index) = vertices[k * 3 + 2];
+        }
+        if (image_coordinates) {
+            for (int k = 0; k < 3; k++) {
+                // yi \in [0, image_height] は yf \in [1, -1] に対応するので上下が反転する
+                int_value(XI_1 + k, face_index) = to_image_coordinate(vertices[k * 3 + 0], image_width);
+                int_value(YI_1 + k, face_index) = (image_height - 1) - to_image_coordinate(vertices[k * 3 + 1], image_height);
+            }
+        }
+
+        // カリングによる裏面のスキップ
+        // 面の頂点の並び（1 -> 2 -> 3）が時計回りの場合描画しない
+        bool front_facing = !((yf_1 - yf_3) * (xf_1 - xf_2) < (yf_1 - yf_2) * (xf_1 - xf_3));
+        int_value(FRONT_FACING, face_index) = front_facing ? 1 : 0;
+        int_value(XI_START, face_index) = 0;
+        int_value(XI_END, face_index) = -1;
+        int_value(YI_START, face_index) = 0;
+        int_value(YI_END, face_index) = -1;
+        float_value(Z_NEAR, face_index) = 0.0f;
+        if (front_facing == false) {
+            continue;
+        }
+
+        // 面を囲む矩形
+        int xi_start, xi_end, yi_start, yi_end;
+        to_image_range(std::min({ xf_1, xf_2, xf_3 }), std::max({ xf_1, xf_2, xf_3 }), image_width, xi_start, xi_end);
+        to_image_range(-std::max({ yf_1, yf_2, yf_3 }), -std::min({ yf_1, yf_2, yf_3 }), image_height, yi_start, yi_end);
+        if (xi_start > xi_end || yi_start > yi_end) {
+            continue;
+        }
+        int_value(XI_START, face_index) = xi_start;
+        int_value(XI_END, face_index) = xi_end;
+        int_value(YI_START, face_index) = yi_start;
+        int_value(YI_END, face_index) = yi_end;
+        float_value(Z_NEAR, face_index) = compute_z_near(vertices);
+    }
+}
+FaceVertices TriangleSetupTable::face(int face_index) const
+{
+    FaceVertices face;
+    face.xf_1 = float_value(XF_1, face_index);
+    face.yf_1 = float_value(YF_1, face_index);
+    face.zf_1 = float_value(ZF_1, face_index);
+    face.xf_2 = float_value(XF_1 + 1, face_index);
+    face.yf_2 = float_value(YF_1 + 1, face_index);
+    face.zf_2 = float_value(ZF_1 + 1, face_index);
+    face.xf_3 = float_value(XF_1 + 2, face_index);
+    face.yf_3 = float_value(YF_1 + 2, face_index);
+    face.zf_3 = float_value(ZF_1 + 2, face_index);
+    return face;
+}
+void TriangleSetupTable::gather(const TriangleSetupTable& source, const std::vector<int>& face_indices)
+{
+    resize(face_indices.size());
+    for (int field = 0; field < NUM_FLOAT_FIELDS; field++) {
+        for (int face_index = 0; face_index < _num_faces; face_index++) {
+            float_value(field, face_index) = source.float_value(field, face_indices[face_index]);
+        }
+    }
+    for (int field = 0; field < NUM_INT_FIELDS; field++) {
+        for (int face_index = 0; face_index < _num_faces; face_index++) {
+            int_value(field, face_index) = source.int_value(field, face_indices[face_index]);
+        }
+    }
+}
+void build_triangle_setups(
+    const float* face_vertices,
+    TriangleSetupTable* triangle_setups,
+    int batch_size,
+    int num_faces,
+    int image_height,
+    int image_width,
+    bool image_coordinates)
+{
+    const int num_faces_per_chunk = 4096;
+    int num_chunks = std::max((num_faces + num_faces_per_chunk - 1) / num_faces_per_chunk, 1);
+    for (int batch_index = 0; batch_index < batch_size; batch_index++) {
+        triangle_setups[batch_index].resize(num_faces);
+    }
+    get_thread_pool()->parallel_for(batch_size * num_chunks, [&](int task_index, int thread_index) {
+        int batch_index = task_index / num_chunks;
+        int face_index_start = (task_index % num_chunks) * num_faces_per_chunk;
+        int face_index_end = std::min(face_index_start + num_faces_per_chunk, num_faces);
+        triangle_setups[batch_index].build(face_vertices + batch_index * num_faces * 9, face_index_start, face_index_end, image_height, image_width, image_coordinates);
+    });
+}
+void sort_visible_faces_by_z_near(const TriangleSetupTable& setup, std::vector<int>& face_indices)
+{
+    // z_nearは0以上なので、floatのビット列を符号なし整数として比べても大小関係は変わらない
+    // 11ビットずつ3回の安定な基数ソートで並べる
+    const int num_bits = 11;
+    const int num_buckets = 1 << num_bits;
+    std::vector<uint32_t> keys;
+    face_indices.clear();
+    for (int face_index = 0; face_index < setup.num_faces(); face_index++) {
+        if (setup.visible(face_index) == false) {
+            continue;
+        }
+        float z_near = setup.z_near(face_index);
+        uint32_t key;
+        std::memcpy(&key, &z_near, sizeof(key));
+        keys.push_back(key);
+        face_indices.push_back(face_index);
+    }
+    int num_visible_faces = face_indices.size();
+    std::vector<uint32_t> sorted_keys(num_visible_faces);
+    std::vector<int> sorted_face_indices(num_visible_faces);
+    std::vector<int> offsets(num_buckets + 1);
+    for (int shift = 0; shift < 32; shift += num_bits) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        for (int k = 0; k < num_visible_faces; k++) {
+            offsets[((keys[k] >> shift) & (num_buckets - 1)) + 1]++;
+        }
+        for (int bucket = 0; bucket < num_buckets; bucket++) {
+            offsets[bucket + 1] += offsets[bucket];
+        }
+        for (int k = 0; k < num_visible_faces; k++) {
+            int destination = offsets[(keys[k] >> shift) & (num_buckets - 1)]++;
+            sorted_keys[destination] = keys[k];
+            sorted_face_indices[destination] = face_indices[k];
+        }
+        keys.swap(sorted_keys);
+        face_indices.swap(sorted_face_indices);
+    }
+}
+}
\ No newline at end of file
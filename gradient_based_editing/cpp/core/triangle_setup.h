@@ -0,0 +1,127 @@
+#pragma once
+#include "rasterize_row.h"
+#include <vector>
+
+namespace gme {
+// バッチ1つ分の面ごとの前処理の結果
+// 裏面の判定・画素の矩形・頂点の画像座標などを面ごとに1度だけ求め、順伝播と逆伝播の両方で使う
+// 同じ種類の値を面番号の順に連続して並べる（SoA）
+class TriangleSetupTable {
+private:
+    // _float_values[field * _stride + face_index]
+    enum FloatField {
+        // 各頂点の座標
+        XF_1 = 0, // XF_1, XF_2, XF_3
+        YF_1 = 3,
+        ZF_1 = 6,
+        // 面の内部の画素で求まるz_faceの下限
+        Z_NEAR = 9,
+        NUM_FLOAT_FIELDS = 10,
+    };
+    // _int_values[field * _stride + face_index]
+    enum IntField {
+        // 面の頂点の並び（1 -> 2 -> 3）が反時計回りなら1
+        FRONT_FACING = 0,
+        // 面を囲む画素の矩形 [xi_start, xi_end, yi_start, yi_end]
+        // 裏面や画像の外にある面はxi_start > xi_endにして空にしておく
+        XI_START = 1,
+        XI_END = 2,
+        YI_START = 3,
+        YI_END = 4,
+        // 各頂点の画像座標
+        // 逆伝播でのみ使うのでbuildでimage_coordinates = trueの場合だけ求める
+        XI_1 = 5, // XI_1, XI_2, XI_3
+        YI_1 = 8,
+        NUM_INT_FIELDS = 11,
+    };
+    int _num_faces;
+    // 同じ種類の値の並びの間隔
+    // 面の数が2の累乗などの場合に各並びの先頭が同じキャッシュのセットに重ならないよう少しずらす
+    int _stride;
+    std::vector<float> _float_values;
+    std::vector<int> _int_values;
+    float& float_value(int field, int face_index)
+    {
+        return _float_values[field * _stride + face_index];
+    }
+    float float_value(int field, int face_index) const
+    {
+        return _float_values[field * _stride + face_index];
+    }
+    int& int_value(int field, int face_index)
+    {
+        return _int_values[field * _stride + face_index];
+    }
+    int int_value(int field, int face_index) const
+    {
+        return _int_values[field * _stride + face_index];
+    }
+
+public:
+    TriangleSetupTable();
+    void resize(int num_faces);
+    // face_verticesはこのバッチの (num_faces, 3, 3) で、面番号が[face_index_start, face_index_end)の面を前処理する
+    // 面ごとに独立しているので範囲を分けて並列に呼んでよい
+    void build(const float* face_vertices, int face_index_start, int face_index_end, int image_height, int image_width, bool image_coordinates);
+    int num_faces() const
+    {
+        return _num_faces;
+    }
+    bool front_facing(int face_index) const
+    {
+        return int_value(FRONT_FACING, face_index) != 0;
+    }
+    // 画像内に描画される可能性がある場合true
+    bool visible(int face_index) const
+    {
+        return int_value(XI_START, face_index) <= int_value(XI_END, face_index);
+    }
+    int xi_start(int face_index) const
+    {
+        return int_value(XI_START, face_index);
+    }
+    int xi_end(int face_index) const
+    {
+        return int_value(XI_END, face_index);
+    }
+    int yi_start(int face_index) const
+    {
+        return int_value(YI_START, face_index);
+    }
+    int yi_end(int face_index) const
+    {
+        return int_value(YI_END, face_index);
+    }
+    // 面のどの画素のz_faceもこの値以上になる
+    // 深度バッファの領域の最も遠い深度がこれより手前なら、その領域には面が描画されない
+    float z_near(int face_index) const
+    {
+        return float_value(Z_NEAR, face_index);
+    }
+    int xi(int face_index, int vertex_index) const
+    {
+        return int_value(XI_1 + vertex_index, face_index);
+    }
+    int yi(int face_index, int vertex_index) const
+    {
+        return int_value(YI_1 + vertex_index, face_index);
+    }
+    FaceVertices face(int face_index) const;
+    // sourceの面face_indices[k]の前処理の結果をk番目の面に並べ直す
+    void gather(const TriangleSetupTable& source, const std::vector<int>& face_indices);
+};
+// batch_size個のテーブルtriangle_setupsに各バッチの面を前処理した結果を入れる
+// face_verticesは (batch_size, num_faces, 3, 3) で、バッチと面の範囲の組ごとにスレッドプールで並列に処理する
+// image_coordinates = trueなら逆伝播で使う頂点の画像座標も求める
+void build_triangle_setups(
+    const float* face_vertices,
+    TriangleSetupTable* triangle_setups,
+    int batch_size,
+    int num_faces,
+    int image_height,
+    int image_width,
+    bool image_coordinates);
+// 画像内に描画される可能性がある面の面番号をz_nearの昇順（手前から順）に並べてface_indicesに入れる
+// z_nearが等しい面は面番号の昇順になる
+void sort_visible_faces_by_z_near(const TriangleSetupTable& setup, std::vector<int>& face_indices);
+}
\ No newline at end of file
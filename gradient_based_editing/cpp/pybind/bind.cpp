@@ -1,9 +1,187 @@
+#include "../core/face_bvh.h"
+#include "../core/multi_view_rasterizer.h"
+#include "../core/projection.h"
 #include "../core/rasterize.h"
+#include "../core/rasterize_row.h"
+#include "../core/rasterizer.h"
+#include "../core/shading.h"
+#include "../core/silhouette_fitter.h"
+#include "../core/thread_pool.h"
 #include <pybind11/pybind11.h>
+#include <vector>
 namespace py = pybind11;
 
+// Rasterizerが持つ配列を複製せずにnumpy配列として見せる
+// baseにRasterizerを渡し、配列が参照されている間は解放されないようにする
+template <typename T>
+py::array_t<T> to_array_view(T* data, std::vector<ssize_t> shape, py::handle base)
+{
+    return py::array_t<T>(shape, data, base);
+}
+
 PYBIND11_MODULE(rasterize_cpu, module)
 {
-    module.def("forward_face_index_map", &gme::forward_face_index_map);
-    module.def("backward_silhouette", &gme::backward_silhouette);
+    module.def("set_num_threads", &gme::set_num_threads, py::arg("num_threads"));
+    module.def("get_num_threads", &gme::get_num_threads);
+    module.def("set_simd_instruction_set", &gme::set_simd_instruction_set, py::arg("name"));
+    module.def("get_simd_instruction_set", &gme::get_simd_instruction_set);
+    module.def("set_backward_algorithm", &gme::set_backward_algorithm, py::arg("name"));
+    module.def("get_backward_algorithm", &gme::get_backward_algorithm);
+    module.def("forward_face_index_map",
+        (void (*)(py::array_t<float, py::array::c_style>, py::array_t<int, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array_t<int, py::array::c_style>, py::object)) & gme::forward_face_index_map,
+        py::arg("face_vertices"), py::arg("face_index_map"), py::arg("depth_map"), py::arg("silhouette_image"), py::arg("weight_map") = py::none());
+    module.def("forward_face_index_map_tiled",
+        (void (*)(py::array_t<float, py::array::c_style>, py::array_t<int, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array_t<int, py::array::c_style>, int, bool, py::object)) & gme::forward_face_index_map_tiled,
+        py::arg("face_vertices"), py::arg("face_index_map"), py::arg("depth_map"), py::arg("silhouette_image"), py::arg("tile_size") = 32,
+        py::arg("front_to_back") = false, py::arg("weight_map") = py::none());
+    module.def("forward_face_index_map_compact",
+        (void (*)(py::array_t<float, py::array::c_style>, py::array, py::object, py::object, bool, int, bool, py::object)) & gme::forward_face_index_map_compact,
+        py::arg("face_vertices"), py::arg("face_index_map"), py::arg("depth_map") = py::none(), py::arg("silhouette_image") = py::none(),
+        py::arg("packed_silhouette") = false, py::arg("tile_size") = 32, py::arg("front_to_back") = false, py::arg("weight_map") = py::none());
+    module.def("forward_face_index_map_supersampled",
+        (void (*)(py::array_t<float, py::array::c_style>, py::array_t<int, py::array::c_style>, py::object, py::array_t<float, py::array::c_style>, int)) & gme::forward_face_index_map_supersampled,
+        py::arg("face_vertices"), py::arg("face_index_map"), py::arg("depth_map"), py::arg("coverage_map"), py::arg("supersampling") = 3);
+    module.def("backward_silhouette",
+        (void (*)(py::array_t<int, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array_t<int, py::array::c_style>, py::array_t<int, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array_t<float, py::array::c_style>, bool)) & gme::backward_silhouette,
+        py::arg("faces"), py::arg("face_vertices"), py::arg("vertices"), py::arg("face_index_map"), py::arg("pixel_map"),
+        py::arg("grad_vertices"), py::arg("grad_silhouette"), py::arg("debug_grad_map"), py::arg("deterministic") = false);
+    module.def("backward_silhouette_compact",
+        (void (*)(py::array_t<int, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array, py::array, py::array_t<float, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array_t<float, py::array::c_style>, bool, bool)) & gme::backward_silhouette_compact,
+        py::arg("faces"), py::arg("face_vertices"), py::arg("face_index_map"), py::arg("pixel_map"),
+        py::arg("grad_vertices"), py::arg("grad_silhouette"), py::arg("debug_grad_map"), py::arg("packed_pixel_map") = false, py::arg("deterministic") = false);
+    module.def("backward_silhouette_supersampled",
+        (void (*)(py::array_t<int, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array_t<int, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array_t<float, py::array::c_style>, bool)) & gme::backward_silhouette_supersampled,
+        py::arg("faces"), py::arg("face_vertices"), py::arg("face_index_map"), py::arg("coverage_map"),
+        py::arg("grad_vertices"), py::arg("grad_coverage"), py::arg("debug_grad_map"), py::arg("deterministic") = false);
+    module.def("forward_shading",
+        (void (*)(py::array_t<int, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array, py::object, py::array_t<float, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array_t<float, py::array::c_style>, bool, float)) & gme::forward_shading,
+        py::arg("faces"), py::arg("vertices"), py::arg("face_index_map"), py::arg("weight_map"), py::arg("colors"), py::arg("light_direction"), py::arg("image"),
+        py::arg("per_vertex_colors") = true, py::arg("ambient") = 0.1);
+    module.def("backward_shading",
+        (void (*)(py::array_t<int, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array, py::object, py::array_t<float, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array_t<float, py::array::c_style>, bool, float, bool)) & gme::backward_shading,
+        py::arg("faces"), py::arg("face_vertices"), py::arg("vertices"), py::arg("face_index_map"), py::arg("weight_map"), py::arg("light_direction"), py::arg("image"),
+        py::arg("grad_image"), py::arg("grad_vertices"), py::arg("grad_colors"), py::arg("debug_grad_map"), py::arg("per_vertex_colors") = true, py::arg("ambient") = 0.1,
+        py::arg("deterministic") = false);
+    module.def("forward_project_faces",
+        (void (*)(py::array_t<float, py::array::c_style>, py::array_t<int, py::array::c_style>, py::array_t<float, py::array::c_style>, float, float, float, float, float, float)) & gme::forward_project_faces,
+        py::arg("vertices"), py::arg("faces"), py::arg("face_vertices"), py::arg("distance_from_object"), py::arg("angle_x"), py::arg("angle_y"),
+        py::arg("viewing_angle"), py::arg("z_max") = 5, py::arg("z_min") = 0);
+    module.def("backward_project_vertices",
+        (void (*)(py::array_t<float, py::array::c_style>, py::array_t<float, py::array::c_style>, float, float, float, float, float, float)) & gme::backward_project_vertices,
+        py::arg("grad_projected_vertices"), py::arg("grad_vertices"), py::arg("distance_from_object"), py::arg("angle_x"), py::arg("angle_y"),
+        py::arg("viewing_angle"), py::arg("z_max") = 5, py::arg("z_min") = 0);
+    module.def("compute_projection_matrix", &gme::compute_projection_matrix,
+        py::arg("distance_from_object"), py::arg("angle_x"), py::arg("angle_y"), py::arg("viewing_angle"), py::arg("z_max") = 5, py::arg("z_min") = 0);
+
+    py::class_<gme::Rasterizer>(module, "Rasterizer")
+        .def(py::init<int, int, int, int, int>(), py::arg("batch_size"), py::arg("num_faces"), py::arg("num_vertices"), py::arg("image_height"), py::arg("image_width"))
+        .def("forward", (void (gme::Rasterizer::*)(py::array_t<float, py::array::c_style>)) & gme::Rasterizer::forward, py::arg("face_vertices"))
+        .def("backward", (void (gme::Rasterizer::*)(py::array_t<int, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array_t<float, py::array::c_style>, bool)) & gme::Rasterizer::backward,
+            py::arg("faces"), py::arg("face_vertices"), py::arg("grad_silhouette"), py::arg("deterministic") = false)
+        .def_property_readonly("face_index_map", [](py::object self) {
+            gme::Rasterizer& rasterizer = self.cast<gme::Rasterizer&>();
+            return to_array_view(rasterizer.face_index_map(), { rasterizer.batch_size(), rasterizer.image_height(), rasterizer.image_width() }, self);
+        })
+        .def_property_readonly("depth_map", [](py::object self) {
+            gme::Rasterizer& rasterizer = self.cast<gme::Rasterizer&>();
+            return to_array_view(rasterizer.depth_map(), { rasterizer.batch_size(), rasterizer.image_height(), rasterizer.image_width() }, self);
+        })
+        .def_property_readonly("silhouette_image", [](py::object self) {
+            gme::Rasterizer& rasterizer = self.cast<gme::Rasterizer&>();
+            return to_array_view(rasterizer.silhouette_image(), { rasterizer.batch_size(), rasterizer.image_height(), rasterizer.image_width() }, self);
+        })
+        .def_property_readonly("grad_vertices", [](py::object self) {
+            gme::Rasterizer& rasterizer = self.cast<gme::Rasterizer&>();
+            return to_array_view(rasterizer.grad_vertices(), { rasterizer.batch_size(), rasterizer.num_vertices(), 3 }, self);
+        })
+        .def_property_readonly("debug_grad_map", [](py::object self) {
+            gme::Rasterizer& rasterizer = self.cast<gme::Rasterizer&>();
+            return to_array_view(rasterizer.debug_grad_map(), { rasterizer.batch_size(), rasterizer.image_height(), rasterizer.image_width() }, self);
+        });
+
+    py::class_<gme::MultiViewRasterizer>(module, "MultiViewRasterizer")
+        .def(py::init<int, int, int, int, int>(), py::arg("num_views"), py::arg("num_faces"), py::arg("num_vertices"), py::arg("image_height"), py::arg("image_width"))
+        .def("forward", (void (gme::MultiViewRasterizer::*)(py::array_t<float, py::array::c_style>, py::array_t<int, py::array::c_style>, py::array_t<double, py::array::c_style>)) & gme::MultiViewRasterizer::forward,
+            py::arg("vertices"), py::arg("faces"), py::arg("projections"))
+        .def("backward", (void (gme::MultiViewRasterizer::*)(py::array_t<int, py::array::c_style>, py::array_t<float, py::array::c_style>, bool)) & gme::MultiViewRasterizer::backward,
+            py::arg("faces"), py::arg("grad_silhouette"), py::arg("deterministic") = false)
+        .def_property_readonly("face_vertices", [](py::object self) {
+            gme::MultiViewRasterizer& rasterizer = self.cast<gme::MultiViewRasterizer&>();
+            return to_array_view(rasterizer.face_vertices(), { rasterizer.num_views(), rasterizer.num_faces(), 3, 3 }, self);
+        })
+        .def_property_readonly("face_index_map", [](py::object self) {
+            gme::MultiViewRasterizer& rasterizer = self.cast<gme::MultiViewRasterizer&>();
+            return to_array_view(rasterizer.face_index_map(), { rasterizer.num_views(), rasterizer.image_height(), rasterizer.image_width() }, self);
+        })
+        .def_property_readonly("depth_map", [](py::object self) {
+            gme::MultiViewRasterizer& rasterizer = self.cast<gme::MultiViewRasterizer&>();
+            return to_array_view(rasterizer.depth_map(), { rasterizer.num_views(), rasterizer.image_height(), rasterizer.image_width() }, self);
+        })
+        .def_property_readonly("silhouette_image", [](py::object self) {
+            gme::MultiViewRasterizer& rasterizer = self.cast<gme::MultiViewRasterizer&>();
+            return to_array_view(rasterizer.silhouette_image(), { rasterizer.num_views(), rasterizer.image_height(), rasterizer.image_width() }, self);
+        })
+        .def_property_readonly("grad_vertices", [](py::object self) {
+            gme::MultiViewRasterizer& rasterizer = self.cast<gme::MultiViewRasterizer&>();
+            return to_array_view(rasterizer.grad_vertices(), { rasterizer.num_vertices(), 3 }, self);
+        })
+        .def_property_readonly("debug_grad_map", [](py::object self) {
+            gme::MultiViewRasterizer& rasterizer = self.cast<gme::MultiViewRasterizer&>();
+            return to_array_view(rasterizer.debug_grad_map(), { rasterizer.num_views(), rasterizer.image_height(), rasterizer.image_width() }, self);
+        });
+
+    py::class_<gme::SilhouetteFitter>(module, "SilhouetteFitter")
+        .def(py::init<py::array_t<float, py::array::c_style>, py::array_t<int, py::array::c_style>, py::array_t<float, py::array::c_style>, float, float, float, float, float, float, float>(),
+            py::arg("vertices"), py::arg("faces"), py::arg("target_silhouette"), py::arg("distance_from_object"), py::arg("angle_x"), py::arg("angle_y"),
+            py::arg("viewing_angle"), py::arg("z_max") = 5, py::arg("z_min") = 0, py::arg("learning_rate") = 0.00005)
+        .def("fit", &gme::SilhouetteFitter::fit, py::arg("num_iterations"), py::arg("callback") = py::none(), py::arg("callback_interval") = 1)
+        .def("step", &gme::SilhouetteFitter::step, py::call_guard<py::gil_scoped_release>())
+        .def_property_readonly("iteration", &gme::SilhouetteFitter::iteration)
+        .def_property_readonly("loss", &gme::SilhouetteFitter::loss)
+        .def_property("learning_rate", &gme::SilhouetteFitter::learning_rate, &gme::SilhouetteFitter::set_learning_rate)
+        .def_property_readonly("vertices", [](py::object self) {
+            gme::SilhouetteFitter& fitter = self.cast<gme::SilhouetteFitter&>();
+            return to_array_view(fitter.vertices(), { fitter.batch_size(), fitter.num_vertices(), 3 }, self);
+        })
+        .def_property_readonly("face_vertices", [](py::object self) {
+            gme::SilhouetteFitter& fitter = self.cast<gme::SilhouetteFitter&>();
+            return to_array_view(fitter.face_vertices(), { fitter.batch_size(), fitter.num_faces(), 3, 3 }, self);
+        })
+        .def_property_readonly("grad_silhouette", [](py::object self) {
+            gme::SilhouetteFitter& fitter = self.cast<gme::SilhouetteFitter&>();
+            return to_array_view(fitter.grad_silhouette(), { fitter.batch_size(), fitter.image_height(), fitter.image_width() }, self);
+        })
+        .def_property_readonly("grad_vertices", [](py::object self) {
+            gme::SilhouetteFitter& fitter = self.cast<gme::SilhouetteFitter&>();
+            return to_array_view(fitter.grad_vertices(), { fitter.batch_size(), fitter.num_vertices(), 3 }, self);
+        })
+        .def_property_readonly("face_index_map", [](py::object self) {
+            gme::SilhouetteFitter& fitter = self.cast<gme::SilhouetteFitter&>();
+            return to_array_view(fitter.rasterizer().face_index_map(), { fitter.batch_size(), fitter.image_height(), fitter.image_width() }, self);
+        })
+        .def_property_readonly("depth_map", [](py::object self) {
+            gme::SilhouetteFitter& fitter = self.cast<gme::SilhouetteFitter&>();
+            return to_array_view(fitter.rasterizer().depth_map(), { fitter.batch_size(), fitter.image_height(), fitter.image_width() }, self);
+        })
+        .def_property_readonly("silhouette_image", [](py::object self) {
+            gme::SilhouetteFitter& fitter = self.cast<gme::SilhouetteFitter&>();
+            return to_array_view(fitter.rasterizer().silhouette_image(), { fitter.batch_size(), fitter.image_height(), fitter.image_width() }, self);
+        })
+        .def_property_readonly("debug_grad_map", [](py::object self) {
+            gme::SilhouetteFitter& fitter = self.cast<gme::SilhouetteFitter&>();
+            return to_array_view(fitter.rasterizer().debug_grad_map(), { fitter.batch_size(), fitter.image_height(), fitter.image_width() }, self);
+        });
+
+    py::class_<gme::FaceBVH>(module, "FaceBVH")
+        .def(py::init<int, int, int, int>(), py::arg("batch_size"), py::arg("num_faces"), py::arg("image_height"), py::arg("image_width"))
+        .def("build", (void (gme::FaceBVH::*)(py::array_t<float, py::array::c_style>)) & gme::FaceBVH::build, py::arg("face_vertices"))
+        .def("refit", (void (gme::FaceBVH::*)(py::array_t<float, py::array::c_style>)) & gme::FaceBVH::refit, py::arg("face_vertices"))
+        .def("forward", (void (gme::FaceBVH::*)(py::array_t<int, py::array::c_style>, py::array_t<float, py::array::c_style>, py::array_t<int, py::array::c_style>)) & gme::FaceBVH::forward,
+            py::arg("face_index_map"), py::arg("depth_map"), py::arg("silhouette_image"))
+        .def("query", (void (gme::FaceBVH::*)(py::array_t<int, py::array::c_style>, py::array_t<int, py::array::c_style>, py::array_t<float, py::array::c_style>)) & gme::FaceBVH::query,
+            py::arg("pixel_indices"), py::arg("face_indices"), py::arg("depths"))
+        .def_property_readonly("batch_size", &gme::FaceBVH::batch_size)
+        .def_property_readonly("num_faces", &gme::FaceBVH::num_faces)
+        .def_property_readonly("image_height", &gme::FaceBVH::image_height)
+        .def_property_readonly("image_width", &gme::FaceBVH::image_width);
 }
\ No newline at end of file
@@ -1,5 +1,12 @@
 import chainer
-from .cpu import forward_face_index_map_cpu, backward_silhouette_cpu
+from .cpu import set_num_threads, get_num_threads, set_simd_instruction_set, get_simd_instruction_set
+from .cpu import set_backward_algorithm, get_backward_algorithm
+from .cpu import Rasterizer, SilhouetteFitter, FaceBVH, MultiViewRasterizer
+from .cpu import forward_face_index_map_cpu, forward_face_index_map_tiled_cpu, backward_silhouette_cpu
+from .cpu import forward_face_index_map_compact_cpu, backward_silhouette_compact_cpu
+from .cpu import forward_shading_cpu, backward_shading_cpu
+from .cpu import forward_face_index_map_supersampled_cpu, backward_silhouette_supersampled_cpu
+from .cpu import project_faces_cpu, backward_project_vertices_cpu, compute_projection_matrix
 
 class Rasterize(chainer.Function):
     def __init__(self, image_size, z_min, z_max):
@@ -1,15 +1,258 @@
+import numpy as np
 from . import rasterize_cpu
 
 
-def forward_face_index_map_cpu(face_vertices, face_index_map, depth_map,
-                               silhouette_image):
+# 0以下を指定するとハードウェアスレッド数になる
+# 結果はスレッド数に依存しない
+def set_num_threads(num_threads):
+    rasterize_cpu.set_num_threads(num_threads)
+
+
+def get_num_threads():
+    return rasterize_cpu.get_num_threads()
+
+
+# "scalar", "avx2", "avx512"のいずれかを指定する
+# 空文字列を指定するとCPUが対応している中で最も幅の広いものを選ぶ
+# 結果は命令セットに依存しない
+def set_simd_instruction_set(name=""):
+    rasterize_cpu.set_simd_instruction_set(name)
+
+
+def get_simd_instruction_set():
+    return rasterize_cpu.get_simd_instruction_set()
+
+
+# 逆伝播の方法を"accumulated", "per_pixel"のいずれかで指定する
+# "accumulated"（デフォルト）は辺の外側と内側の画素を走査線上の区間ごとにまとめて計算する
+# "per_pixel"は画素ごとに計算する元の実装で、結果の検証に使う
+# 両者の差はgrad_verticesの最大の絶対値の1e-4倍以内で、値の小さな成分の相対誤差はこれより大きくなりうる
+# 勾配は加算順の違いによる丸め誤差の範囲で一致する
+def set_backward_algorithm(name="accumulated"):
+    rasterize_cpu.set_backward_algorithm(name)
+
+
+def get_backward_algorithm():
+    return rasterize_cpu.get_backward_algorithm()
+
+
+# weight_mapに(batch_size, height, width, 3)のfloat32を渡すと各画素の最前面の面についての重心座標が入る
+# 面がない画素は0になる
+# 画像上の線形補間の重みなので、透視補正する場合はweight_map[..., k] * depth_map / z_kを使う
+def forward_face_index_map_cpu(face_vertices,
+                               face_index_map,
+                               depth_map,
+                               silhouette_image,
+                               weight_map=None):
     rasterize_cpu.forward_face_index_map(face_vertices, face_index_map,
-                                         depth_map, silhouette_image)
+                                         depth_map, silhouette_image,
+                                         weight_map)
+
+
+# front_to_back=Trueの場合は各タイルの面を手前から順に処理し、隠れた面の判定を省く
+# 重なりの多いメッシュほど速くなり、結果はFalseの場合と同じになる
+def forward_face_index_map_tiled_cpu(face_vertices,
+                                     face_index_map,
+                                     depth_map,
+                                     silhouette_image,
+                                     tile_size=32,
+                                     front_to_back=False,
+                                     weight_map=None):
+    rasterize_cpu.forward_face_index_map_tiled(
+        face_vertices, face_index_map, depth_map, silhouette_image, tile_size,
+        front_to_back, weight_map)
+
+
+# 出力を小さな型で書き込む
+# face_index_mapはint32かuint16で、uint16の場合は面がない画素が65535になる（面の数は65535未満）
+# depth_map, silhouette_imageはNoneなら書き込まない
+# silhouette_imageはint32かuint8で、packed_silhouette=Trueの場合は
+# (batch_size, height, (width + 7) // 8)のuint8にnumpy.packbits(axis=-1)と同じ並びで詰める
+# 全ての画素を書き込むので出力を初期化しておく必要はない
+def forward_face_index_map_compact_cpu(face_vertices,
+                                       face_index_map,
+                                       depth_map=None,
+                                       silhouette_image=None,
+                                       packed_silhouette=False,
+                                       tile_size=32,
+                                       front_to_back=False,
+                                       weight_map=None):
+    rasterize_cpu.forward_face_index_map_compact(
+        face_vertices, face_index_map, depth_map, silhouette_image,
+        packed_silhouette, tile_size, front_to_back, weight_map)
+
+
+# 各画素をsupersampling x supersampling個のサンプルに分け、面が覆う割合を[0, 1]でcoverage_mapに書き込む
+# 高い解像度で描画して縮小するのと同じ結果を、元の解像度の配列だけで求める
+# face_index_map, depth_mapは画素の中心で求め、supersamplingによらず
+# forward_face_index_map_cpuと同じになる（depth_mapはNoneでよい）
+def forward_face_index_map_supersampled_cpu(face_vertices,
+                                            face_index_map,
+                                            depth_map,
+                                            coverage_map,
+                                            supersampling=3):
+    rasterize_cpu.forward_face_index_map_supersampled(
+        face_vertices, face_index_map, depth_map, coverage_map, supersampling)
+
+
+# forward_face_index_map_supersampled_cpuのcoverage_mapの誤差grad_coverageから頂点の勾配を求める
+# 辺の内側と外側の画素値の差に覆う割合の差を使うので、画素より小さな頂点の動きも勾配に表れる
+# ただし辺は頂点を画素に丸めた位置で走査するので、その動きが表れるのは覆う割合の差を通してだけになる
+def backward_silhouette_supersampled_cpu(faces,
+                                         face_vertices,
+                                         face_index_map,
+                                         coverage_map,
+                                         grad_vertices,
+                                         grad_coverage,
+                                         debug_grad_map,
+                                         deterministic=False):
+    rasterize_cpu.backward_silhouette_supersampled(
+        faces, face_vertices, face_index_map, coverage_map, grad_vertices,
+        grad_coverage, debug_grad_map, deterministic)
+
+
+# deterministic=Trueの場合はスレッド数や実行ごとの違いによらずdebug_grad_mapも同じ結果になる
+# grad_verticesは常に同じ結果になる
+def backward_silhouette_cpu(faces,
+                            face_vertices,
+                            vertices,
+                            face_index_map,
+                            pixel_map,
+                            grad_vertices,
+                            grad_silhouette,
+                            debug_grad_map,
+                            deterministic=False):
+    rasterize_cpu.backward_silhouette(
+        faces, face_vertices, vertices, face_index_map, pixel_map,
+        grad_vertices, grad_silhouette, debug_grad_map, deterministic)
+
+
+# forward_face_index_map_compact_cpuの出力をそのまま使う
+# packed_pixel_map=Trueの場合はpixel_mapをビットを詰めたuint8として読む
+def backward_silhouette_compact_cpu(faces,
+                                    face_vertices,
+                                    face_index_map,
+                                    pixel_map,
+                                    grad_vertices,
+                                    grad_silhouette,
+                                    debug_grad_map,
+                                    packed_pixel_map=False,
+                                    deterministic=False):
+    rasterize_cpu.backward_silhouette_compact(
+        faces, face_vertices, face_index_map, pixel_map, grad_vertices,
+        grad_silhouette, debug_grad_map, packed_pixel_map, deterministic)
+
+
+# 面番号マップから平行光源で陰影を付けたRGB画像を(batch_size, height, width, 3)のimageに書き込む
+# 面の明るさはビューワと同じく clamp(dot(n, -light_direction), ambient, 1) で面ごとに一様
+# per_vertex_colors=Trueの場合、colorsは(batch_size, num_vertices, 3)で、
+# forward_face_index_map_cpuで求めたweight_mapで補間する
+# Falseの場合、colorsは(batch_size, num_faces, 3)で、weight_mapはNoneでよい
+def forward_shading_cpu(faces,
+                        vertices,
+                        face_index_map,
+                        weight_map,
+                        colors,
+                        image,
+                        light_direction=(0, -1, -1),
+                        per_vertex_colors=True,
+                        ambient=0.1):
+    light_direction = np.asarray(light_direction, dtype=np.float32)
+    rasterize_cpu.forward_shading(faces, vertices, face_index_map, weight_map,
+                                  colors, light_direction, image,
+                                  per_vertex_colors, ambient)
+
+
+# forward_shading_cpuの画像の誤差grad_imageから勾配を求める
+# grad_colorsには色についての勾配、grad_verticesには投影後の頂点についての勾配を加算する
+# 頂点の勾配はbackward_silhouette_cpuと同じ辺の近似で、imageの画素値の差から求める
+def backward_shading_cpu(faces,
+                         face_vertices,
+                         vertices,
+                         face_index_map,
+                         weight_map,
+                         image,
+                         grad_image,
+                         grad_vertices,
+                         grad_colors,
+                         debug_grad_map,
+                         light_direction=(0, -1, -1),
+                         per_vertex_colors=True,
+                         ambient=0.1,
+                         deterministic=False):
+    light_direction = np.asarray(light_direction, dtype=np.float32)
+    rasterize_cpu.backward_shading(
+        faces, face_vertices, vertices, face_index_map, weight_map,
+        light_direction, image, grad_image, grad_vertices, grad_colors,
+        debug_grad_map, per_vertex_colors, ambient, deterministic)
+
+
+# カメラ座標系への変換・透視投影・面への振り分けをまとめて行い、face_verticesに書き込む
+# gme.verticesのtransform_to_camera_coordinate_system, project_perspective,
+# convert_to_face_representationを続けて呼ぶのと同じ結果になる
+def project_faces_cpu(vertices,
+                      faces,
+                      face_vertices,
+                      distance_from_object,
+                      angle_x,
+                      angle_y,
+                      viewing_angle,
+                      z_max=5,
+                      z_min=0):
+    rasterize_cpu.forward_project_faces(
+        vertices, faces, face_vertices, distance_from_object, angle_x,
+        angle_y, viewing_angle, z_max, z_min)
+
+
+# 投影後の頂点の勾配をワールド座標系の頂点の勾配に変換してgrad_verticesを上書きする
+# grad_projected_verticesと同じ配列を渡してもよい
+def backward_project_vertices_cpu(grad_projected_vertices,
+                                  grad_vertices,
+                                  distance_from_object,
+                                  angle_x,
+                                  angle_y,
+                                  viewing_angle,
+                                  z_max=5,
+                                  z_min=0):
+    rasterize_cpu.backward_project_vertices(
+        grad_projected_vertices, grad_vertices, distance_from_object, angle_x,
+        angle_y, viewing_angle, z_max, z_min)
+
+# カメラ座標系への変換と透視投影をまとめた(3, 4)の行列[A | c]を返す
+# 投影後の頂点は A v + c で、project_faces_cpuと同じ変換になる
+def compute_projection_matrix(distance_from_object,
+                              angle_x,
+                              angle_y,
+                              viewing_angle,
+                              z_max=5,
+                              z_min=0):
+    return rasterize_cpu.compute_projection_matrix(
+        distance_from_object, angle_x, angle_y, viewing_angle, z_max, z_min)
+
+
+# 同じ大きさの入力を繰り返し処理する場合に使う
+# face_index_map, depth_map, silhouette_image, grad_vertices, debug_grad_mapは
+# 内部の配列を複製せずに参照するので、次のforward/backwardで上書きされる
+# backwardは直前のforwardのシルエットを画素値として使う
+Rasterizer = rasterize_cpu.Rasterizer
+
+
+# 投影・ラスタライズ・誤差・勾配・頂点の更新をまとめてC++側で繰り返す
+# fit(num_iterations, callback, callback_interval)はcallback_interval回ごとにcallback(iteration)を呼び、
+# callbackがFalseを返すとそこで打ち切る
+# vertices, silhouette_image, debug_grad_map等は内部の配列を複製せずに参照する
+SilhouetteFitter = rasterize_cpu.SilhouetteFitter
 
+# 1つのメッシュを複数の視点からまとめてラスタライズする
+# forward(vertices, faces, projections)はverticesが(num_vertices, 3)、facesが(num_faces, 3)で、
+# projectionsはcompute_projection_matrixの結果を視点ごとに並べた(num_views, 3, 4)の配列
+# face_index_map等は(num_views, image_height, image_width)で、
+# backward(faces, grad_silhouette)は全視点の勾配の和を(num_vertices, 3)のgrad_verticesに入れる
+MultiViewRasterizer = rasterize_cpu.MultiViewRasterizer
 
-def backward_silhouette_cpu(faces, face_vertices, vertices, face_index_map,
-                            pixel_map, grad_vertices, grad_silhouette,
-                            debug_grad_map):
-    rasterize_cpu.backward_silhouette(faces, face_vertices, vertices,
-                                      face_index_map, pixel_map, grad_vertices,
-                                      grad_silhouette, debug_grad_map)
\ No newline at end of file
+# 投影後の面についての2次元のBVH
+# build(face_vertices)で木を作り、頂点が少し動いた後はrefit(face_vertices)で矩形だけを求め直す
+# forward(face_index_map, depth_map, silhouette_image)は全画素、
+# query(pixel_indices, face_indices, depths)はyi * image_width + xiで指定した画素だけの最前面を求める
+# 結果はforward_face_index_map_cpuと同じになる
+FaceBVH = rasterize_cpu.FaceBVH
\ No newline at end of file
@@ -29,7 +29,11 @@ def main():
     figure.add(axis_target, 0.75, 0.5, 0.25, 0.5)
     figure.add(axis_object, 0.25, 0, 0.5, 1)
 
-    window = gme.viewer.Window(figure)
+    if args.record is None:
+        window = gme.viewer.Window(figure)
+    else:
+        window = gme.viewer.OffscreenWindow(
+            figure, args.record, format=args.record_format)
     window.show()
 
     # オブジェクトを適当に回転させる
@@ -43,73 +47,54 @@ def main():
     vertices_batch = gme.vertices.rotate_y(vertices_batch, angle_y)
     vertices_batch = gme.vertices.rotate_z(vertices_batch, angle_z)
 
-    for _ in range(10000):
-        # カメラ座標系に変換
-        perspective_vertices_batch = gme.vertices.transform_to_camera_coordinate_system(
-            vertices_batch, distance_from_object=2, angle_x=0, angle_y=0)
-
-        # 透視投影
-        perspective_vertices_batch = gme.vertices.project_perspective(
-            perspective_vertices_batch, viewing_angle=45, z_max=5, z_min=0)
-
-        #################
-        face_vertices_batch = gme.vertices.convert_to_face_representation(
-            perspective_vertices_batch, faces_batch)
-        # print(face_vertices_batch.shape)
-        batch_size = face_vertices_batch.shape[0]
-        face_index_map_batch = np.full(
-            (batch_size, ) + silhouette_size, -1, dtype=np.int32)
-        depth_map = np.zeros(
-            (batch_size, ) + silhouette_size, dtype=np.float32)
-        object_silhouette_batch = np.zeros(
-            (batch_size, ) + silhouette_size, dtype=np.int32)
-        gme.rasterizer.forward_face_index_map_cpu(
-            face_vertices_batch, face_index_map_batch, depth_map,
-            object_silhouette_batch)
+    target_silhouette_batch = np.zeros(
+        (vertices_batch.shape[0], ) + silhouette_size, dtype=np.float32)
+    target_silhouette_batch[:, 30:225, 30:225] = 255
+
+    # 最適化のループはC++側で回し、表示の更新の時だけPythonに戻る
+    fitter = gme.rasterizer.SilhouetteFitter(
+        vertices_batch,
+        faces_batch,
+        target_silhouette_batch,
+        distance_from_object=2,
+        angle_x=0,
+        angle_y=0,
+        viewing_angle=45,
+        z_max=5,
+        z_min=0,
+        learning_rate=0.00005)
+
+    def callback(iteration):
         depth_map_image = np.ascontiguousarray(
-            (1.0 - depth_map[0]) * 255).astype(np.uint8)
-        #################
-
-        #################
-        target_silhouette_batch = np.zeros_like(
-            object_silhouette_batch, dtype=np.float32)
-        target_silhouette_batch[:, 30:225, 30:225] = 255
-        grad_vertices_batch = np.zeros_like(vertices_batch, dtype=np.float32)
-        object_silhouette_batch = np.copy(
-            (1.0 - depth_map) * 255, order="c").astype(np.int32)
-        object_silhouette_batch[object_silhouette_batch > 0] = 255
-        grad_silhouette_batch = -(
-            (target_silhouette_batch - object_silhouette_batch) / 255).astype(
-                np.float32)
-
-        debug_grad_map = np.zeros_like(
-            object_silhouette_batch, dtype=np.float32)
-        gme.rasterizer.backward_silhouette_cpu(
-            faces_batch, face_vertices_batch, perspective_vertices_batch,
-            face_index_map_batch, object_silhouette_batch, grad_vertices_batch,
-            grad_silhouette_batch, debug_grad_map)
-
-        debug_grad_map = np.abs(debug_grad_map)
-        debug_grad_map /= np.amax(debug_grad_map)
+            (1.0 - fitter.depth_map[0]) * 255).astype(np.uint8)
+
+        debug_grad_map = np.abs(fitter.debug_grad_map)
+        debug_grad_map /= max(np.amax(debug_grad_map), 1e-12)
         debug_grad_map *= 255
 
-        vertices_batch -= 0.00005 * grad_vertices_batch
-        grad_image = np.copy(grad_silhouette_batch[0]) * 255
+        grad_image = np.copy(fitter.grad_silhouette[0]) * 255
         grad_image[grad_image > 0] = 255
         grad_image[grad_image < 0] = 64
-        #################
 
         axis_sign.update(np.uint8(grad_image))
         axis_silhouette.update(depth_map_image)
         axis_gradient.update(np.uint8(debug_grad_map[0]))
         axis_target.update(np.uint8(target_silhouette_batch[0]))
-        axis_object.update_vertices(vertices_batch[0])
+        axis_object.update_vertices(fitter.vertices[0])
+        if args.record is not None:
+            window.capture()
+
+        return not window.closed()
 
-        if window.closed():
-            return
+    fitter.fit(10000, callback, args.callback_interval)
 
+    if args.record is not None:
+        window.close()
 
 if __name__ == "__main__":
     parser = argparse.ArgumentParser()
+    parser.add_argument("--callback-interval", type=int, default=1)
+    parser.add_argument("--record", type=str, default=None)
+    parser.add_argument("--record-format", type=str, default="png")
     args = parser.parse_args()
     main()
\ No newline at end of file
@@ -28,31 +28,29 @@ def run_test(vertices_batch,
             perspective_vertices_batch, faces_batch)
         # print(face_vertices_batch.shape)
         batch_size = face_vertices_batch.shape[0]
-        face_index_map_batch = np.full(
-            (batch_size, ) + silhouette_size, -1, dtype=np.int32)
-        depth_map = np.zeros(
+        # 面番号マップとシルエットは小さな型で受け取り、そのまま逆伝播に渡す
+        face_index_map_batch = np.empty(
+            (batch_size, ) + silhouette_size, dtype=np.uint16)
+        depth_map = np.empty(
             (batch_size, ) + silhouette_size, dtype=np.float32)
-        object_silhouette_batch = np.zeros(
-            (batch_size, ) + silhouette_size, dtype=np.int32)
-        gme.rasterizer.forward_face_index_map_cpu(
+        object_silhouette_batch = np.empty(
+            (batch_size, ) + silhouette_size, dtype=np.uint8)
+        gme.rasterizer.forward_face_index_map_compact_cpu(
             face_vertices_batch, face_index_map_batch, depth_map,
             object_silhouette_batch)
         depth_map_image = np.ascontiguousarray(
             (1.0 - depth_map[0]) * 255).astype(np.uint8)
 
         grad_vertices_batch = np.zeros_like(vertices_batch, dtype=np.float32)
-        object_silhouette_batch = np.copy(
-            (1.0 - depth_map) * 255, order="c").astype(np.int32)
-        object_silhouette_batch[object_silhouette_batch > 0] = 255
         grad_silhouette_batch = -(
             (target_silhouette_batch - object_silhouette_batch) / 255).astype(
                 np.float32)
 
         debug_grad_map = np.zeros_like(
             object_silhouette_batch, dtype=np.float32)
-        gme.rasterizer.backward_silhouette_cpu(
-            faces_batch, face_vertices_batch, perspective_vertices_batch,
-            face_index_map_batch, object_silhouette_batch, grad_vertices_batch,
+        gme.rasterizer.backward_silhouette_compact_cpu(
+            faces_batch, face_vertices_batch, face_index_map_batch,
+            object_silhouette_batch, grad_vertices_batch,
             grad_silhouette_batch, debug_grad_map)
 
         debug_grad_map = np.abs(debug_grad_map)
@@ -16,11 +16,19 @@ namespace data {
         _height = height;
         _width = width;
         _num_channels = num_channels;
-        _data = std::make_unique<GLubyte[]>(height * width * 3);
+        for (int k = 0; k < 3; k++) {
+            ImageFrame& frame = _frames.buffer(k);
+            frame.height = height;
+            frame.width = width;
+            frame.data.resize(height * width * 3);
+        }
     }
+    // 描画スレッドが読んでいるフレームには触れず、次のupdateから新しい大きさで書き込む
     void ImageData::resize(int height, int width, int num_channels)
     {
-        _data = std::make_unique<GLubyte[]>(height * width * 3);
+        _height = height;
+        _width = width;
+        _num_channels = num_channels;
     }
     void ImageData::update(pybind11::array_t<GLubyte> data)
     {
@@ -37,15 +45,20 @@ namespace data {
         if (data.ndim() == 3 && _num_channels != 3) {
             std::runtime_error("(data.ndim() == 3 && _num_channels != 3) -> false");
         }
+        // 描画スレッドが読んでいないバッファに1フレーム分を書いてから公開する
+        ImageFrame& frame = _frames.back();
+        frame.height = _height;
+        frame.width = _width;
+        frame.data.resize(_height * _width * 3);
         if (data.ndim() == 2) {
             auto ptr = data.mutable_unchecked<2>();
             for (ssize_t h = 0; h < data.shape(0); h++) {
                 for (ssize_t w = 0; w < data.shape(1); w++) {
                     ssize_t index = h * _width + w;
                     GLubyte intensity = ptr(h, w);
-                    _data[index * 3 + 0] = intensity;
-                    _data[index * 3 + 1] = intensity;
-                    _data[index * 3 + 2] = intensity;
+                    frame.data[index * 3 + 0] = intensity;
+                    frame.data[index * 3 + 1] = intensity;
+                    frame.data[index * 3 + 2] = intensity;
                 }
             }
         } else {
@@ -54,30 +67,28 @@ namespace data {
                 for (ssize_t w = 0; w < data.shape(1); w++) {
                     for (ssize_t c = 0; c < data.shape(2); c++) {
                         ssize_t index = h * _width * _num_channels + w * _num_channels + c;
-                        _data[index] = ptr(h, w, c);
+                        frame.data[index] = ptr(h, w, c);
                     }
                 }
             }
         }
-        _updated = true;
+        _frames.publish();
     }
-    bool ImageData::updated()
+    bool ImageData::fetch()
     {
-        bool ret = _updated;
-        _updated = false;
-        return ret;
+        return _frames.fetch();
     }
     GLubyte* ImageData::raw()
     {
-        return _data.get();
+        return _frames.front().data.data();
     }
     int ImageData::height()
     {
-        return _height;
+        return _frames.front().height;
     }
     int ImageData::width()
     {
-        return _width;
+        return _frames.front().width;
     }
 }
 }
@@ -1,23 +1,33 @@
 #pragma once
+#include "triple_buffer.h"
 #include <gl3w/gl3w.h>
 #include <memory>
 #include <pybind11/numpy.h>
+#include <vector>
 
 namespace viewer {
 namespace data {
+    // 描画スレッドに渡す1フレーム分のRGB画像
+    struct ImageFrame {
+        int height;
+        int width;
+        std::vector<GLubyte> data;
+    };
+    // resizeとupdateはPythonのスレッドから、fetch以降は描画スレッドから呼ぶ
     class ImageData {
     private:
         int _height;
         int _width;
         int _num_channels;
-        bool _updated;
-        std::unique_ptr<GLubyte[]> _data;
+        TripleBuffer<ImageFrame> _frames;
 
     public:
         ImageData(int height, int width, int num_channels);
         void resize(int height, int width, int num_channels);
         void update(pybind11::array_t<GLubyte> data);
-        bool updated();
+        // 新しいフレームがあれば受け取ってtrueを返す
+        // 以下はfetchで受け取ったフレームを返す
+        bool fetch();
         GLubyte* raw();
         int height();
         int width();
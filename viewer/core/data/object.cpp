@@ -1,5 +1,6 @@
 #include "object.h"
-#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 
 namespace viewer {
@@ -8,19 +9,26 @@ namespace data {
     {
         _num_vertices = num_vertices;
         _num_faces = num_faces;
+        _faces_version = 0;
         _vertices = std::make_unique<GLfloat[]>(num_vertices * 3);
         _faces = std::make_unique<GLuint[]>(num_faces * 3);
-        _vertices_normal_vectors = std::make_unique<GLfloat[]>(num_faces * 9);
-        _extracted_vertices = std::make_unique<GLfloat[]>(num_faces * 9);
+        for (int k = 0; k < 3; k++) {
+            ObjectFrame& frame = _frames.buffer(k);
+            frame.vertices = std::make_unique<GLfloat[]>(num_vertices * 3);
+            frame.faces = std::make_unique<GLuint[]>(num_faces * 3);
+            frame.faces_version = -1;
+            frame.serial = -1;
+        }
         _update(vertices, faces);
     }
     void ObjectData::_update(pybind11::array_t<GLfloat> vertices, pybind11::array_t<GLuint> faces)
     {
         _update_faces(faces);
-        _update_vertices(vertices);
-        _update_normal_vectors();
+        _update_vertices(vertices, 0);
+        _publish();
     }
-    void ObjectData::_update_vertices(pybind11::array_t<GLfloat> vertices)
+    // 頂点を書き換えた範囲を_historyに記録し、書き換えた頂点があればtrueを返す
+    bool ObjectData::_update_vertices(pybind11::array_t<GLfloat> vertices, GLfloat threshold)
     {
         auto size = vertices.size();
         if (size != _num_vertices * 3) {
@@ -30,20 +38,30 @@ namespace data {
             std::runtime_error("(vertices.ndim() != 2) -> false");
         }
         auto ptr = vertices.mutable_unchecked<2>();
+        int first = 0;
+        int last = -1;
         for (int n = 0; n < vertices.shape(0); n++) {
-            _vertices[n * 3 + 0] = ptr(n, 0);
-            _vertices[n * 3 + 1] = ptr(n, 1);
-            _vertices[n * 3 + 2] = ptr(n, 2);
-        }
-        for (int n = 0; n < _num_faces; n++) {
-            for (int f = 0; f < 3; f++) {
-                int face_index = _faces[n * 3 + f];
-                for (int v = 0; v < 3; v++) {
-                    _extracted_vertices[n * 9 + f * 3 + v] = _vertices[face_index * 3 + v];
-                }
+            GLfloat x = ptr(n, 0);
+            GLfloat y = ptr(n, 1);
+            GLfloat z = ptr(n, 2);
+            if (std::abs(x - _vertices[n * 3 + 0]) <= threshold
+                && std::abs(y - _vertices[n * 3 + 1]) <= threshold
+                && std::abs(z - _vertices[n * 3 + 2]) <= threshold) {
+                continue;
             }
+            _vertices[n * 3 + 0] = x;
+            _vertices[n * 3 + 1] = y;
+            _vertices[n * 3 + 2] = z;
+            if (first > last) {
+                first = n;
+            }
+            last = n;
+        }
+        if (first > last) {
+            return false;
         }
-        _vertices_updated = true;
+        _history.push(first, last);
+        return true;
     }
     void ObjectData::_update_faces(pybind11::array_t<GLuint> faces)
     {
@@ -60,90 +78,79 @@ namespace data {
             _faces[n * 3 + 1] = ptr(n, 1);
             _faces[n * 3 + 2] = ptr(n, 2);
         }
-        _faces_updated = true;
-    }
-    void ObjectData::_update_normal_vectors()
-    {
-        std::unique_ptr<glm::vec3> face_normal_vectors;
-        for (int n = 0; n < _num_faces; n++) {
-            int fa = _faces[n * 3 + 0];
-            int fb = _faces[n * 3 + 1];
-            int fc = _faces[n * 3 + 2];
-            glm::vec3 va = glm::vec3(_vertices[fa * 3 + 0], _vertices[fa * 3 + 1], _vertices[fa * 3 + 2]);
-            glm::vec3 vb = glm::vec3(_vertices[fb * 3 + 0], _vertices[fb * 3 + 1], _vertices[fb * 3 + 2]);
-            glm::vec3 vc = glm::vec3(_vertices[fc * 3 + 0], _vertices[fc * 3 + 1], _vertices[fc * 3 + 2]);
-            glm::vec3 vba = vb - va;
-            glm::vec3 vca = vc - va;
-            glm::vec3 normal = glm::normalize(glm::cross(vba, vca));
-            for (int face = 0; face < 3; face++) {
-                _vertices_normal_vectors[n * 9 + face * 3 + 0] = normal.x;
-                _vertices_normal_vectors[n * 9 + face * 3 + 1] = normal.y;
-                _vertices_normal_vectors[n * 9 + face * 3 + 2] = normal.z;
-            }
+        _faces_version++;
+    }
+    // 現在の頂点と面から1フレーム分を作って描画スレッドに公開する
+    // 書き込み先は描画スレッドが読んでいないバッファなので、描画の途中でメッシュが書き換わることはない
+    void ObjectData::_publish()
+    {
+        ObjectFrame& frame = _frames.back();
+        // このバッファに前回書いた時点から変わった頂点だけを写す
+        int first, last;
+        if (_history.union_since(frame.serial, first, last) == false) {
+            first = 0;
+            last = _num_vertices - 1;
+        }
+        if (first <= last) {
+            std::copy(_vertices.get() + first * 3, _vertices.get() + (last + 1) * 3, frame.vertices.get() + first * 3);
+        }
+        frame.serial = _history.serial();
+        frame.history = _history;
+        if (frame.faces_version != _faces_version) {
+            std::copy(_faces.get(), _faces.get() + _num_faces * 3, frame.faces.get());
+            frame.faces_version = _faces_version;
         }
-        _normal_vector_updated = true;
+        _frames.publish();
     }
-    void ObjectData::update_vertices(pybind11::array_t<GLfloat> vertices)
+    void ObjectData::update_vertices(pybind11::array_t<GLfloat> vertices, GLfloat threshold)
     {
-        _update_vertices(vertices);
-        _update_normal_vectors();
+        if (_update_vertices(vertices, threshold)) {
+            _publish();
+        }
     }
     void ObjectData::update_faces(pybind11::array_t<GLuint> faces)
     {
+        _history.push(0, -1);
         _update_faces(faces);
-        _update_normal_vectors();
+        _publish();
     }
     void ObjectData::update(pybind11::array_t<GLfloat> vertices, pybind11::array_t<GLuint> faces)
     {
-        _update_vertices(vertices);
+        _update_vertices(vertices, 0);
         _update_faces(faces);
-        _update_normal_vectors();
+        _publish();
     }
     int ObjectData::num_vertices()
     {
         return _num_vertices;
     }
-    int ObjectData::num_extracted_vertices()
-    {
-        return _num_faces * 3;
-    }
     int ObjectData::num_faces()
     {
         return _num_faces;
     }
-    bool ObjectData::vertices_updated()
+    bool ObjectData::fetch()
     {
-        bool ret = _vertices_updated;
-        _vertices_updated = false;
-        return ret;
+        return _frames.fetch();
     }
-    bool ObjectData::faces_updated()
+    int ObjectData::faces_version()
     {
-        bool ret = _faces_updated;
-        _faces_updated = false;
-        return ret;
+        return _frames.front().faces_version;
     }
-    bool ObjectData::normal_vector_updated()
+    int ObjectData::serial()
     {
-        bool ret = _normal_vector_updated;
-        _normal_vector_updated = false;
-        return ret;
+        return _frames.front().serial;
     }
-    GLfloat* ObjectData::vertices()
+    bool ObjectData::changed_vertices(int serial, int& first, int& last)
     {
-        return _vertices.get();
+        return _frames.front().history.union_since(serial, first, last);
     }
-    GLfloat* ObjectData::extracted_vertices()
-    {
-        return _extracted_vertices.get();
-    }
-    GLfloat* ObjectData::normal_vectors()
+    GLfloat* ObjectData::vertices()
     {
-        return _vertices_normal_vectors.get();
+        return _frames.front().vertices.get();
     }
     GLuint* ObjectData::faces()
     {
-        return _faces.get();
+        return _frames.front().faces.get();
     }
 }
 }
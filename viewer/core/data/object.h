@@ -1,40 +1,58 @@
 #pragma once
+#include "../dirty_span.h"
+#include "triple_buffer.h"
 #include <gl3w/gl3w.h>
 #include <memory>
 #include <pybind11/numpy.h>
 
 namespace viewer {
 namespace data {
+    // 描画スレッドに渡す1フレーム分のメッシュ
+    // 頂点は共有したまま面の番号で描画し、法線は描画側のシェーダで求める
+    struct ObjectFrame {
+        std::unique_ptr<GLfloat[]> vertices;
+        std::unique_ptr<GLuint[]> faces;
+        // facesを書き換えるたびに増える番号で、描画側は変わった場合だけ転送する
+        int faces_version;
+        // verticesがどの更新の時点の内容かと、その時点までに書き換えた頂点の範囲
+        // 描画側は前回転送した時点から変わった範囲だけを転送する
+        int serial;
+        DirtySpanHistory history;
+    };
+    // update_*はPythonのスレッドから、fetch以降は描画スレッドから呼ぶ
+    // 更新はTripleBufferで受け渡すので、どちらのスレッドも相手を待たず、描画中のメッシュが途中で書き換わることもない
     class ObjectData {
     private:
         int _num_vertices;
         int _num_faces;
-        bool _vertices_updated;
-        bool _faces_updated;
-        bool _normal_vector_updated;
+        int _faces_version;
         std::unique_ptr<GLfloat[]> _vertices;
-        std::unique_ptr<GLfloat[]> _extracted_vertices;
-        std::unique_ptr<GLfloat[]> _vertices_normal_vectors;
         std::unique_ptr<GLuint[]> _faces;
+        DirtySpanHistory _history;
+        TripleBuffer<ObjectFrame> _frames;
         void _update_faces(pybind11::array_t<GLuint> faces);
-        void _update_vertices(pybind11::array_t<GLfloat> vertices);
+        bool _update_vertices(pybind11::array_t<GLfloat> vertices, GLfloat threshold);
         void _update(pybind11::array_t<GLfloat> vertices, pybind11::array_t<GLuint> faces);
-        void _update_normal_vectors();
+        void _publish();
 
     public:
         ObjectData(pybind11::array_t<GLfloat> vertices, int num_vertices, pybind11::array_t<GLuint> faces, int num_faces);
         void update_faces(pybind11::array_t<GLuint> faces);
-        void update_vertices(pybind11::array_t<GLfloat> vertices);
+        // 各座標の変化がthreshold以下の頂点は前の位置のままにし、変わった頂点がなければ描画側に何も渡さない
+        // 頂点の比較以外の処理と描画側への転送は、位置を変えた頂点の範囲の大きさに比例する
+        void update_vertices(pybind11::array_t<GLfloat> vertices, GLfloat threshold = 0);
         void update(pybind11::array_t<GLfloat> vertices, pybind11::array_t<GLuint> faces);
-        bool vertices_updated();
-        bool faces_updated();
-        bool normal_vector_updated();
         int num_vertices();
-        int num_extracted_vertices();
         int num_faces();
+        // 新しいフレームがあれば受け取ってtrueを返す
+        // 以下はfetchで受け取ったフレームを返す
+        bool fetch();
+        int faces_version();
+        int serial();
+        // serialの時点の頂点から変わった範囲を返す
+        // 範囲が分からない場合はfalseを返すので、全体を転送する
+        bool changed_vertices(int serial, int& first, int& last);
         GLfloat* vertices();
-        GLfloat* extracted_vertices();
-        GLfloat* normal_vectors();
         GLuint* faces();
     };
 }
@@ -0,0 +1,59 @@
+#pragma once
+#include <atomic>
+
+namespace viewer {
+namespace data {
+    // 1つの書き込み側スレッドと1つの読み込み側スレッドの間でフレームを受け渡す
+    // 書き込み側はback()に1フレーム分を書いてからpublish()で公開し、読み込み側はfetch()で最新のフレームをfront()に受け取る
+    // 3つのバッファの役割を入れ替えるだけなので、どちらの側も相手を待つことはなく、
+    // 読み込み側は常に書き終わったフレームだけを読む
+    template <typename T>
+    class TripleBuffer {
+    private:
+        // 下位2ビットが書き込み側と読み込み側の間にあるバッファの番号で、
+        // new_frame_bitが立っていればまだ読み込み側が受け取っていないフレーム
+        static const int new_frame_bit = 4;
+        T _buffers[3];
+        std::atomic<int> _middle;
+        int _back;
+        int _front;
+
+    public:
+        TripleBuffer()
+            : _middle(1)
+            , _back(0)
+            , _front(2)
+        {
+        }
+        // 受け渡しを始める前に3つのバッファを初期化するために使う
+        T& buffer(int index)
+        {
+            return _buffers[index];
+        }
+        // 書き込み側
+        // back()の内容は以前に公開した古いフレームのものなので、全体を書き直してから公開する
+        T& back()
+        {
+            return _buffers[_back];
+        }
+        void publish()
+        {
+            _back = _middle.exchange(_back | new_frame_bit, std::memory_order_acq_rel) & 3;
+        }
+        // 読み込み側
+        // 新しいフレームがあればfront()をそのフレームに切り替えてtrueを返す
+        bool fetch()
+        {
+            if ((_middle.load(std::memory_order_relaxed) & new_frame_bit) == 0) {
+                return false;
+            }
+            _front = _middle.exchange(_front, std::memory_order_acq_rel) & 3;
+            return true;
+        }
+        T& front()
+        {
+            return _buffers[_front];
+        }
+    };
+}
+}
\ No newline at end of file
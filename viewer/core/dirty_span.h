@@ -0,0 +1,57 @@
+#pragma once
+#include <algorithm>
+
+namespace viewer {
+// 更新ごとに書き換えた要素の範囲[first, last]を直近capacity回分だけ覚えておく
+// 更新のたびにserialが1つ増え、あるserialの時点の内容から最新の内容にするには
+// union_sinceで求めた範囲だけを写せばよい
+class DirtySpanHistory {
+private:
+    static const int capacity = 8;
+    int _serial;
+    int _first[capacity];
+    int _last[capacity];
+
+public:
+    DirtySpanHistory()
+        : _serial(0)
+    {
+    }
+    int serial() const
+    {
+        return _serial;
+    }
+    // 何も書き換えなかった更新はfirst > lastで表す
+    void push(int first, int last)
+    {
+        _serial++;
+        _first[_serial % capacity] = first;
+        _last[_serial % capacity] = last;
+    }
+    // serialがsinceより後の更新で書き換えた範囲をまとめて返す
+    // sinceが負（一度も写していない）か古すぎて覚えていない場合はfalseを返すので、全体を写す
+    bool union_since(int since, int& first, int& last) const
+    {
+        if (since < 0 || since > _serial || _serial - since > capacity) {
+            return false;
+        }
+        first = 0;
+        last = -1;
+        for (int serial = since + 1; serial <= _serial; serial++) {
+            int span_first = _first[serial % capacity];
+            int span_last = _last[serial % capacity];
+            if (span_first > span_last) {
+                continue;
+            }
+            if (first > last) {
+                first = span_first;
+                last = span_last;
+            } else {
+                first = std::min(first, span_first);
+                last = std::max(last, span_last);
+            }
+        }
+        return true;
+    }
+};
+}
\ No newline at end of file
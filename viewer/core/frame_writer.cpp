@@ -0,0 +1,239 @@
+#include "frame_writer.h"
+#include <stdexcept>
+#include <zlib.h>
+
+namespace viewer {
+namespace {
+    void append_uint32(std::vector<GLubyte>& buffer, uLong value)
+    {
+        buffer.push_back((value >> 24) & 0xff);
+        buffer.push_back((value >> 16) & 0xff);
+        buffer.push_back((value >> 8) & 0xff);
+        buffer.push_back(value & 0xff);
+    }
+    // 長さ、種類、データ、CRCの順に1つのチャンクを書く
+    void append_chunk(std::vector<GLubyte>& buffer, const char* type, const GLubyte* data, size_t size)
+    {
+        append_uint32(buffer, size);
+        size_t start = buffer.size();
+        buffer.insert(buffer.end(), type, type + 4);
+        buffer.insert(buffer.end(), data, data + size);
+        uLong crc = crc32(0L, Z_NULL, 0);
+        crc = crc32(crc, buffer.data() + start, size + 4);
+        append_uint32(buffer, crc);
+    }
+}
+FrameWriter::FrameWriter(std::string path, std::string format, int width, int height)
+{
+    if (format != "png" && format != "raw") {
+        throw std::runtime_error("`format` must be \"png\" or \"raw\".");
+    }
+    if (width <= 0 || height <= 0) {
+        throw std::runtime_error("(width > 0 && height > 0) -> false");
+    }
+    _path = path;
+    _format = format;
+    _width = width;
+    _height = height;
+    _number_width = 0;
+    _zero_padded = false;
+    _num_written = 0;
+    _file = nullptr;
+    _closing = false;
+    if (format == "png") {
+        _parse_pattern(path);
+    } else {
+        _file = std::fopen(path.c_str(), "wb");
+        if (_file == nullptr) {
+            throw std::runtime_error("could not open " + path);
+        }
+    }
+    _thread = std::thread(&FrameWriter::_run, this);
+}
+FrameWriter::~FrameWriter()
+{
+    close();
+}
+// pathはprintfの書式としては使わず、フレーム番号の前後と桁数に分けておく
+void FrameWriter::_parse_pattern(const std::string& path)
+{
+    const std::string message = "`path` must contain exactly one frame number pattern (\"%d\", \"%0Nd\" or \"%Nd\") when `format` is \"png\". Write other '%' as \"%%\".";
+    bool found = false;
+    std::string* text = &_filename_prefix;
+    for (size_t i = 0; i < path.size(); i++) {
+        if (path[i] != '%') {
+            text->push_back(path[i]);
+            continue;
+        }
+        i++;
+        if (i < path.size() && path[i] == '%') {
+            text->push_back('%');
+            continue;
+        }
+        if (found) {
+            throw std::runtime_error(message);
+        }
+        if (i < path.size() && path[i] == '0') {
+            _zero_padded = true;
+            i++;
+        }
+        while (i < path.size() && '0' <= path[i] && path[i] <= '9') {
+            _number_width = _number_width * 10 + (path[i] - '0');
+            if (_number_width > 64) {
+                throw std::runtime_error(message);
+            }
+            i++;
+        }
+        if (i == path.size() || path[i] != 'd') {
+            throw std::runtime_error(message);
+        }
+        found = true;
+        text = &_filename_suffix;
+    }
+    if (found == false) {
+        throw std::runtime_error(message);
+    }
+}
+std::string FrameWriter::_filename(int frame_index)
+{
+    std::string number = std::to_string(frame_index);
+    if ((int)number.size() < _number_width) {
+        number.insert(0, _number_width - number.size(), _zero_padded ? '0' : ' ');
+    }
+    return _filename_prefix + number + _filename_suffix;
+}
+// 書き込みに失敗したら最初の理由だけを残す
+void FrameWriter::_set_error(const std::string& error)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_error.empty()) {
+        _error = error;
+    }
+}
+std::string FrameWriter::error()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _error;
+}
+void FrameWriter::push(std::vector<GLubyte> rgba)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _condition.wait(lock, [this] { return (int)_queue.size() < max_queued_frames || _error.empty() == false; });
+    // 失敗した後のフレームは書けないので捨てる
+    if (_error.empty() == false) {
+        return;
+    }
+    _queue.push_back(std::move(rgba));
+    _condition.notify_all();
+}
+void FrameWriter::close()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closing = true;
+    }
+    _condition.notify_all();
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+    if (_file != nullptr) {
+        if (std::fclose(_file) != 0) {
+            _set_error("Failed to close " + _path);
+        }
+        _file = nullptr;
+    }
+}
+void FrameWriter::_run()
+{
+    while (true) {
+        std::vector<GLubyte> rgba;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _condition.wait(lock, [this] { return _queue.empty() == false || _closing; });
+            if (_queue.empty()) {
+                return;
+            }
+            rgba = std::move(_queue.front());
+            _queue.pop_front();
+            if (_error.empty() == false) {
+                _queue.clear();
+                continue;
+            }
+        }
+        _condition.notify_all();
+        _write(rgba);
+    }
+}
+// OpenGLの画素は下の行からなので、上下を反転しながらRGBにする
+void FrameWriter::_write(const std::vector<GLubyte>& rgba)
+{
+    std::vector<GLubyte> rgb(_width * _height * 3);
+    for (int h = 0; h < _height; h++) {
+        const GLubyte* src = rgba.data() + (_height - h - 1) * _width * 4;
+        GLubyte* dst = rgb.data() + h * _width * 3;
+        for (int w = 0; w < _width; w++) {
+            dst[w * 3 + 0] = src[w * 4 + 0];
+            dst[w * 3 + 1] = src[w * 4 + 1];
+            dst[w * 3 + 2] = src[w * 4 + 2];
+        }
+    }
+    bool written = _format == "png" ? _write_png(rgb) : _write_raw(rgb);
+    if (written == false) {
+        // pushが待っていれば起こす
+        _condition.notify_all();
+        return;
+    }
+    _num_written++;
+}
+bool FrameWriter::_write_png(const std::vector<GLubyte>& rgb)
+{
+    // 各行の先頭にフィルタの種類（0: なし）を置いてから圧縮する
+    // 大量のジョブで書き出すので圧縮率より速さを優先する
+    size_t row_size = _width * 3 + 1;
+    std::vector<GLubyte> rows(row_size * _height);
+    for (int h = 0; h < _height; h++) {
+        rows[h * row_size] = 0;
+        std::copy(rgb.begin() + h * _width * 3, rgb.begin() + (h + 1) * _width * 3, rows.begin() + h * row_size + 1);
+    }
+    uLongf compressed_size = compressBound(rows.size());
+    std::vector<GLubyte> compressed(compressed_size);
+    if (compress2(compressed.data(), &compressed_size, rows.data(), rows.size(), Z_BEST_SPEED) != Z_OK) {
+        _set_error("Failed to compress frame " + std::to_string(_num_written));
+        return false;
+    }
+
+    std::vector<GLubyte> png = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    std::vector<GLubyte> header;
+    append_uint32(header, _width);
+    append_uint32(header, _height);
+    header.push_back(8); // 1チャンネルあたりのビット数
+    header.push_back(2); // RGB
+    header.push_back(0);
+    header.push_back(0);
+    header.push_back(0);
+    append_chunk(png, "IHDR", header.data(), header.size());
+    append_chunk(png, "IDAT", compressed.data(), compressed_size);
+    append_chunk(png, "IEND", nullptr, 0);
+
+    std::string filename = _filename(_num_written);
+    std::FILE* file = std::fopen(filename.c_str(), "wb");
+    if (file == nullptr) {
+        _set_error("Could not open " + filename);
+        return false;
+    }
+    size_t size = std::fwrite(png.data(), 1, png.size(), file);
+    if (std::fclose(file) != 0 || size != png.size()) {
+        _set_error("Failed to write " + filename);
+        return false;
+    }
+    return true;
+}
+bool FrameWriter::_write_raw(const std::vector<GLubyte>& rgb)
+{
+    if (std::fwrite(rgb.data(), 1, rgb.size(), _file) != rgb.size()) {
+        _set_error("Failed to write frame " + std::to_string(_num_written) + " to " + _path);
+        return false;
+    }
+    return true;
+}
+}
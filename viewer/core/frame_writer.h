@@ -0,0 +1,56 @@
+#pragma once
+#include <gl3w/gl3w.h>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace viewer {
+// 読み出したフレームを別スレッドでファイルに書き出す
+// formatが"png"の場合、pathはフレーム番号を埋め込むパターン（例: "frames/%06d.png"）で、1フレームごとにPNGを書く
+// パターンには%d, %0Nd, %Ndのいずれかをちょうど1つ含め、それ以外の%は%%と書く
+// formatが"raw"の場合、pathの1つのファイルにRGB24の画素を上の行から順にフレームごとに追記する
+// 書き込みに失敗した場合は以降のフレームを捨て、errorで理由を返す
+class FrameWriter {
+protected:
+    std::string _path;
+    std::string _format;
+    // pathをフレーム番号の前後に分けたもの
+    std::string _filename_prefix;
+    std::string _filename_suffix;
+    int _number_width;
+    bool _zero_padded;
+    int _width;
+    int _height;
+    int _num_written;
+    std::FILE* _file;
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    std::deque<std::vector<GLubyte>> _queue;
+    bool _closing;
+    std::string _error;
+    void _parse_pattern(const std::string& path);
+    std::string _filename(int frame_index);
+    void _run();
+    void _write(const std::vector<GLubyte>& rgba);
+    bool _write_png(const std::vector<GLubyte>& rgb);
+    bool _write_raw(const std::vector<GLubyte>& rgb);
+    void _set_error(const std::string& error);
+
+public:
+    // 書き出しが追いつかない場合はこの数を超えたところでpushが待つ
+    static const int max_queued_frames = 8;
+    FrameWriter(std::string path, std::string format, int width, int height);
+    ~FrameWriter();
+    // glReadPixelsで読んだRGBAの画素（下の行から順）を渡す
+    void push(std::vector<GLubyte> rgba);
+    // 溜まっているフレームを全て書き出してから終了する
+    void close();
+    // 書き込みに失敗していればその理由を、なければ空文字列を返す
+    std::string error();
+};
+}
\ No newline at end of file
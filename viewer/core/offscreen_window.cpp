@@ -0,0 +1,374 @@
+#include "offscreen_window.h"
+#ifdef __linux__
+#include <EGL/eglext.h>
+#include <cstring>
+#include <sstream>
+
+namespace viewer {
+OffscreenWindow::OffscreenWindow(Figure* figure, std::string path, int width, int height, std::string format)
+    : _writer(path, format, width, height)
+{
+    _figure = figure;
+    _width = width;
+    _height = height;
+    _display = EGL_NO_DISPLAY;
+    _surface = EGL_NO_SURFACE;
+    _context = EGL_NO_CONTEXT;
+    _num_requested = 0;
+    _num_rendered = 0;
+    _num_read = 0;
+    _closing = false;
+    _closed = false;
+}
+OffscreenWindow::~OffscreenWindow()
+{
+    _close();
+}
+// ディスプレイがあってもなくても動くように、既定のディスプレイが使えなければMesaのsurfacelessプラットフォームを使う
+bool OffscreenWindow::_create_context()
+{
+    EGLint major, minor;
+    _display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (_display == EGL_NO_DISPLAY || eglInitialize(_display, &major, &minor) == EGL_FALSE) {
+        auto get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (get_platform_display == nullptr) {
+            return false;
+        }
+        _display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+        if (_display == EGL_NO_DISPLAY || eglInitialize(_display, &major, &minor) == EGL_FALSE) {
+            return false;
+        }
+    }
+    if (eglBindAPI(EGL_OPENGL_API) == EGL_FALSE) {
+        return false;
+    }
+    // 描画先はフレームバッファなので、サーフェスは作れる場合だけ1x1で作る
+    EGLint config_attributes[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config = EGL_NO_CONFIG_KHR;
+    EGLint num_configs = 0;
+    if (eglChooseConfig(_display, config_attributes, &config, 1, &num_configs) == EGL_FALSE || num_configs == 0) {
+        config = EGL_NO_CONFIG_KHR;
+    } else {
+        EGLint surface_attributes[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+        _surface = eglCreatePbufferSurface(_display, config, surface_attributes);
+    }
+    EGLint context_attributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 2,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    _context = eglCreateContext(_display, config, EGL_NO_CONTEXT, context_attributes);
+    if (_context == EGL_NO_CONTEXT) {
+        return false;
+    }
+    if (eglMakeCurrent(_display, _surface, _surface, _context) == EGL_FALSE) {
+        return false;
+    }
+    return true;
+}
+// ディスプレイは同じプロセスの他のコンテキストも使っている可能性があるので終了しない
+void OffscreenWindow::_release_context()
+{
+    if (_display == EGL_NO_DISPLAY) {
+        return;
+    }
+    eglMakeCurrent(_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (_context != EGL_NO_CONTEXT) {
+        eglDestroyContext(_display, _context);
+    }
+    if (_surface != EGL_NO_SURFACE) {
+        eglDestroySurface(_display, _surface);
+    }
+    eglReleaseThread();
+}
+void OffscreenWindow::_create_buffers()
+{
+    glGenFramebuffers(1, &_fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, _fbo);
+    glGenRenderbuffers(1, &_color_buffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, _color_buffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, _width, _height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, _color_buffer);
+    glGenRenderbuffers(1, &_depth_buffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, _depth_buffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, _width, _height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, _depth_buffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenBuffers(num_pixel_buffers, _pixel_buffers);
+    for (int k = 0; k < num_pixel_buffers; k++) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, _pixel_buffers[k]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, 4 * (GLsizeiptr)_width * _height, nullptr, GL_STREAM_READ);
+        _pixel_buffer_fences[k] = nullptr;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+void OffscreenWindow::_release_buffers()
+{
+    for (int k = 0; k < num_pixel_buffers; k++) {
+        if (_pixel_buffer_fences[k] != nullptr) {
+            glDeleteSync(_pixel_buffer_fences[k]);
+            _pixel_buffer_fences[k] = nullptr;
+        }
+    }
+    glDeleteBuffers(num_pixel_buffers, _pixel_buffers);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteRenderbuffers(1, &_color_buffer);
+    glDeleteRenderbuffers(1, &_depth_buffer);
+    glDeleteFramebuffers(1, &_fbo);
+}
+void OffscreenWindow::_run()
+{
+    if (_create_context() == false) {
+        std::stringstream message;
+        message << "Failed to create an EGL context (error 0x" << std::hex << eglGetError() << ").";
+        _fail(message.str());
+        _release_context();
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _closed = true;
+        }
+        _condition.notify_all();
+        return;
+    }
+    // gl3wInitはGLXから関数を取ってくるので、EGLのコンテキストではeglGetProcAddressを使う
+    if (gl3wInit2((GL3WGetProcAddressProc)eglGetProcAddress) != GL3W_OK || gl3wIsSupported(3, 2) == 0) {
+        _fail("Failed to load OpenGL 3.2 functions.");
+        _release_context();
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _closed = true;
+        }
+        _condition.notify_all();
+        return;
+    }
+    _create_buffers();
+
+    glEnable(GL_BLEND);
+    glEnable(GL_CULL_FACE);
+    glEnable(GL_DEPTH_TEST);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+    for (const auto& frame : _figure->_images) {
+        data::ImageData* data = std::get<0>(frame);
+        double x = std::get<1>(frame);
+        double y = std::get<2>(frame);
+        double width = std::get<3>(frame);
+        double height = std::get<4>(frame);
+        _images.emplace_back(std::make_unique<view::ImageView>(data, x, y, width, height));
+    }
+
+    for (const auto& frame : _figure->_objects) {
+        data::ObjectData* data = std::get<0>(frame);
+        double x = std::get<1>(frame);
+        double y = std::get<2>(frame);
+        double width = std::get<3>(frame);
+        double height = std::get<4>(frame);
+        _objects.emplace_back(std::make_unique<view::ObjectView>(data, x, y, width, height));
+    }
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _condition.wait(lock, [this] { return _num_rendered < _num_requested || _closing; });
+            if (_num_rendered == _num_requested || _error.empty() == false) {
+                break;
+            }
+        }
+        _render();
+        _read_pixels(_num_rendered);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _num_rendered++;
+        }
+        _condition.notify_all();
+        // 読み出しの終わったフレームがあれば書き出しに回す
+        while (_write_pixels(false)) {
+        }
+        // 書き出しに失敗していれば以降のフレームは描画しない
+        std::string error = _writer.error();
+        if (error.empty() == false) {
+            _fail(error);
+        }
+    }
+    while (_get_error().empty() && _write_pixels(true)) {
+    }
+
+    // ビューの持つバッファもコンテキストがあるうちに削除する
+    _images.clear();
+    _objects.clear();
+    _release_buffers();
+    _release_context();
+    _writer.close();
+    std::string error = _writer.error();
+    if (error.empty() == false) {
+        _fail(error);
+    }
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closed = true;
+    }
+    _condition.notify_all();
+}
+void OffscreenWindow::_fail(const std::string& error)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_error.empty()) {
+        _error = error;
+    }
+}
+std::string OffscreenWindow::_get_error()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _error;
+}
+void OffscreenWindow::_render()
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, _fbo);
+    glClearColor(0.9, 0.9, 0.9, 1.0);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    for (const auto& view : _images) {
+        _render_view(view.get());
+    }
+
+    for (const auto& view : _objects) {
+        _render_view(view.get());
+    }
+}
+void OffscreenWindow::_render_view(View* view)
+{
+    int x = _width * view->x();
+    int y = _height * view->y();
+    int width = _width * view->width();
+    int height = _height * view->height();
+    glViewport(x, _height - y - height, width, height);
+    double aspect_ratio = (double)height / (double)width;
+    view->render(aspect_ratio);
+}
+// 画素をPBOへ読み出す命令だけを出して、完了は待たない
+void OffscreenWindow::_read_pixels(int frame_index)
+{
+    // 全てのPBOが読み出し中なら、一番古いフレームを書き出して空ける
+    if (frame_index - _num_read >= num_pixel_buffers) {
+        _write_pixels(true);
+    }
+    int buffer_index = frame_index % num_pixel_buffers;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, _pixel_buffers[buffer_index]);
+    glReadPixels(0, 0, _width, _height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    _pixel_buffer_fences[buffer_index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+}
+// 読み出し中で一番古いフレームをFrameWriterに渡す
+// waitがfalseの場合は読み出しが終わっていなければ何もせずfalseを返す
+// 画素を読めなかった場合は黒いフレームを渡さずに失敗を記録してfalseを返す
+bool OffscreenWindow::_write_pixels(bool wait)
+{
+    if (_num_read == _num_rendered) {
+        return false;
+    }
+    int buffer_index = _num_read % num_pixel_buffers;
+    GLsync fence = _pixel_buffer_fences[buffer_index];
+    if (wait) {
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+        }
+    } else if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+        return false;
+    }
+    glDeleteSync(fence);
+    _pixel_buffer_fences[buffer_index] = nullptr;
+
+    GLsizeiptr size = 4 * (GLsizeiptr)_width * _height;
+    std::vector<GLubyte> rgba(size);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, _pixel_buffers[buffer_index]);
+    void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+    if (pixels == nullptr) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        _num_read++;
+        std::stringstream message;
+        message << "Failed to map the pixel buffer of frame " << _num_read - 1 << " (error 0x" << std::hex << glGetError() << ").";
+        _fail(message.str());
+        return false;
+    }
+    std::memcpy(rgba.data(), pixels, size);
+    bool unmapped = glUnmapBuffer(GL_PIXEL_PACK_BUFFER) == GL_TRUE;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    _num_read++;
+    // 読んでいる間にデータが壊れた場合もそのフレームは渡さない
+    if (unmapped == false) {
+        std::stringstream message;
+        message << "The pixel buffer of frame " << _num_read - 1 << " was corrupted while it was mapped.";
+        _fail(message.str());
+        return false;
+    }
+    _writer.push(std::move(rgba));
+    return true;
+}
+void OffscreenWindow::show()
+{
+    try {
+        _thread = std::thread(&OffscreenWindow::_run, this);
+    } catch (const std::system_error& e) {
+        throw std::runtime_error(e.what());
+    }
+}
+void OffscreenWindow::capture()
+{
+    if (_thread.joinable() == false) {
+        throw std::runtime_error("Call `show` before `capture`.");
+    }
+    std::string error = _writer.error();
+    if (error.empty() == false) {
+        throw std::runtime_error(error);
+    }
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_error.empty() == false) {
+        throw std::runtime_error(_error);
+    }
+    if (_closing || _closed) {
+        throw std::runtime_error("The window has already been closed.");
+    }
+    int frame_index = ++_num_requested;
+    _condition.notify_all();
+    // 描画スレッドがこのフレームを描画し終えればデータを受け取っているので、呼び出し元はすぐに次のデータを書き込める
+    _condition.wait(lock, [this, frame_index] { return _num_rendered >= frame_index || _closed; });
+    if (_num_rendered < frame_index) {
+        throw std::runtime_error(_error.empty() ? "The window was closed before the frame was rendered." : _error);
+    }
+}
+void OffscreenWindow::_close()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closing = true;
+    }
+    _condition.notify_all();
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+    _writer.close();
+}
+void OffscreenWindow::close()
+{
+    _close();
+    std::string error = _get_error();
+    if (error.empty()) {
+        error = _writer.error();
+    }
+    if (error.empty() == false) {
+        throw std::runtime_error(error);
+    }
+}
+bool OffscreenWindow::closed()
+{
+    return _closed;
+}
+}
+#endif
@@ -0,0 +1,79 @@
+#pragma once
+// EGLで描画するのでLinuxでのみビルドする
+#ifdef __linux__
+#include "figure.h"
+#include "frame_writer.h"
+#include "view/image.h"
+#include "view/object.h"
+#include <gl3w/gl3w.h>
+#include <EGL/egl.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace viewer {
+// ディスプレイのないマシンでFigureをWindowと同じ配置でフレームバッファに描画し、ファイルに書き出す
+// コンテキストはEGLで作るのでX11などは要らない
+// captureを呼ぶたびに1フレーム描画し、画素はPBOで非同期に読み出してから書き出すので、読み出しの完了を待たずに次のフレームを描画できる
+class OffscreenWindow {
+protected:
+    // 読み出し中のフレームをいくつまで持つか
+    static const int num_pixel_buffers = 3;
+    std::thread _thread;
+    Figure* _figure;
+    int _width;
+    int _height;
+    FrameWriter _writer;
+    EGLDisplay _display;
+    EGLSurface _surface;
+    EGLContext _context;
+    GLuint _fbo;
+    GLuint _color_buffer;
+    GLuint _depth_buffer;
+    GLuint _pixel_buffers[num_pixel_buffers];
+    GLsync _pixel_buffer_fences[num_pixel_buffers];
+    std::vector<std::unique_ptr<view::ImageView>> _images;
+    std::vector<std::unique_ptr<view::ObjectView>> _objects;
+    // 以下の3つは_mutexで守る
+    int _num_requested;
+    int _num_rendered;
+    bool _closing;
+    // 描画スレッドだけが触る
+    int _num_read;
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    std::atomic<bool> _closed;
+    // 描画スレッドが失敗した理由（_mutexで守る）
+    std::string _error;
+    bool _create_context();
+    void _release_context();
+    void _create_buffers();
+    void _release_buffers();
+    void _run();
+    void _render();
+    void _render_view(View* view);
+    void _read_pixels(int frame_index);
+    bool _write_pixels(bool wait);
+    void _fail(const std::string& error);
+    std::string _get_error();
+    void _close();
+
+public:
+    OffscreenWindow(Figure* figure, std::string path, int width, int height, std::string format);
+    ~OffscreenWindow();
+    void show();
+    // その時点のデータで1フレーム描画するよう要求し、描画スレッドがデータを受け取るまで待つ
+    // 読み出しとファイルへの書き出しは待たない
+    // 描画スレッドやファイルへの書き出しが失敗している場合、閉じた後に呼んだ場合は例外を投げる
+    void capture();
+    // 要求したフレームを全て書き出してから描画スレッドを終了する
+    // 途中で失敗していれば例外を投げる
+    void close();
+    bool closed();
+};
+}
+#endif
\ No newline at end of file
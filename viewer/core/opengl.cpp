@@ -74,6 +74,37 @@ namespace opengl {
         validate_program(program);
         glUseProgram(program);
 
+        return program;
+    }
+    GLuint create_program(const char* vertex_shader, const char* geometry_shader, const char* fragment_shader)
+    {
+        GLuint vobj = glCreateShader(GL_VERTEX_SHADER);
+        glShaderSource(vobj, 1, &vertex_shader, NULL);
+        glCompileShader(vobj);
+        validate_shader(vobj, "vertex shader");
+
+        GLuint gobj = glCreateShader(GL_GEOMETRY_SHADER);
+        glShaderSource(gobj, 1, &geometry_shader, NULL);
+        glCompileShader(gobj);
+        validate_shader(gobj, "geometry shader");
+
+        GLuint fobj = glCreateShader(GL_FRAGMENT_SHADER);
+        glShaderSource(fobj, 1, &fragment_shader, NULL);
+        glCompileShader(fobj);
+        validate_shader(fobj, "fragment shader");
+
+        GLuint program = glCreateProgram();
+        glAttachShader(program, vobj);
+        glDeleteShader(vobj);
+        glAttachShader(program, gobj);
+        glDeleteShader(gobj);
+        glAttachShader(program, fobj);
+        glDeleteShader(fobj);
+
+        glLinkProgram(program);
+        validate_program(program);
+        glUseProgram(program);
+
         return program;
     }
 }
@@ -5,6 +5,8 @@ namespace viewer {
 namespace opengl {
     GLboolean print_shader_info_log(GLuint shader, const char* str);
     GLuint create_program(const char* vertex_shader, const char* fragment_shader);
+    // ジオメトリシェーダを挟む場合
+    GLuint create_program(const char* vertex_shader, const char* geometry_shader, const char* fragment_shader);
     GLboolean print_program_info_log(GLuint program);
 }
 }
\ No newline at end of file
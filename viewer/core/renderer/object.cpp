@@ -1,12 +1,45 @@
 #include "object.h"
 #include "../opengl.h"
+#include <cstring>
 #include <glm/gtc/matrix_transform.hpp>
 #include <iostream>
 
 namespace viewer {
 namespace renderer {
-    ObjectRenderer::ObjectRenderer(GLfloat* vertices, int num_vertices, GLuint* faces, int num_faces)
+    namespace {
+        bool buffer_storage_supported()
+        {
+            if (gl3wIsSupported(4, 4)) {
+                return true;
+            }
+            GLint num_extensions = 0;
+            glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions);
+            for (GLint i = 0; i < num_extensions; i++) {
+                const char* name = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
+                if (name != nullptr && std::strcmp(name, "GL_ARB_buffer_storage") == 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    }
+
+    ObjectRenderer::ObjectRenderer(GLfloat* vertices, int num_vertices, GLuint* faces, int num_faces, VertexUploadMode upload_mode)
     {
+        if (upload_mode == VERTEX_UPLOAD_AUTO) {
+            upload_mode = buffer_storage_supported() ? VERTEX_UPLOAD_PERSISTENT : VERTEX_UPLOAD_ORPHAN;
+        }
+        _upload_mode = upload_mode;
+        _mapped_vertices = nullptr;
+        for (int k = 0; k < num_vertex_regions; k++) {
+            _region_fences[k] = nullptr;
+            _region_serials[k] = -1;
+        }
+        _region_index = 0;
+        _num_vertices = 0;
+        for (int k = 0; k < num_vertex_regions; k++) {
+            _vbo_vertices[k] = 0;
+        }
         _num_faces = num_faces;
         _camera_location = glm::vec3(0.0, 0.0, 3.0);
         _model_mat = glm::mat4(1.0);
@@ -17,20 +50,38 @@ namespace renderer {
             glm::vec3(0.0, 0.0, 0.0),
             glm::vec3(0.0, 1.0, 0.0));
 
+        // 頂点ごとの座標だけを受け取り、面の法線はジオメトリシェーダで3頂点から求める
+        // 法線は面ごとに一様なので、頂点を共有したままフラットシェーディングになる
         const GLchar vertex_shader[] = R"(
 #version 410
 in vec3 position;
-in vec3 normal_vector;
 uniform mat4 pvm_mat;
+out vec3 object_position;
+void main(void)
+{
+    gl_Position = pvm_mat * vec4(position, 1.0);
+    object_position = position;
+}
+)";
+
+        const GLchar geometry_shader[] = R"(
+#version 410
+layout(triangles) in;
+layout(triangle_strip, max_vertices = 3) out;
+in vec3 object_position[];
 uniform mat4 light_mat;
 flat out float power;
 void main(void)
 {
-    gl_Position = pvm_mat * vec4(position, 1.0);
+    vec3 normal_vector = normalize(cross(object_position[1] - object_position[0], object_position[2] - object_position[0]));
     vec4 light_direction = light_mat * vec4(0.0, -1.0, -1.0, 1.0);
-    // vec3 normal = normalize((vec4(normal_vector, 0.0) * pvm_mat).xyz);
-    power = dot(normal_vector, -normalize(light_direction.xyz));
-    power = clamp(power, 0.1, 1.0);
+    float face_power = clamp(dot(normal_vector, -normalize(light_direction.xyz)), 0.1, 1.0);
+    for (int i = 0; i < 3; i++) {
+        gl_Position = gl_in[i].gl_Position;
+        power = face_power;
+        EmitVertex();
+    }
+    EndPrimitive();
 }
 )";
 
@@ -43,10 +94,9 @@ void main(){
 }
 )";
 
-        _program = opengl::create_program(vertex_shader, fragment_shader);
+        _program = opengl::create_program(vertex_shader, geometry_shader, fragment_shader);
 
         _attribute_position = glGetAttribLocation(_program, "position");
-        _attribute_normal_vector = glGetAttribLocation(_program, "normal_vector");
         _uniform_pvm_mat = glGetUniformLocation(_program, "pvm_mat");
         _uniform_light_mat = glGetUniformLocation(_program, "light_mat");
 
@@ -55,16 +105,6 @@ void main(){
 
         glGenBuffers(1, &_vbo_faces);
 
-        glGenBuffers(1, &_vbo_vertices);
-        glBindBuffer(GL_ARRAY_BUFFER, _vbo_vertices);
-        glVertexAttribPointer(_attribute_position, 3, GL_FLOAT, GL_FALSE, 0, 0);
-        glEnableVertexAttribArray(_attribute_position);
-
-        glGenBuffers(1, &_vbo_normal_vectors);
-        glBindBuffer(GL_ARRAY_BUFFER, _vbo_normal_vectors);
-        glVertexAttribPointer(_attribute_normal_vector, 3, GL_FLOAT, GL_FALSE, 0, 0);
-        glEnableVertexAttribArray(_attribute_normal_vector);
-
         glBindVertexArray(0);
 
         update_faces(faces, num_faces);
@@ -73,14 +113,61 @@ void main(){
 
     ObjectRenderer::~ObjectRenderer()
     {
+        _release_vertices();
         glDeleteBuffers(1, &_vbo_faces);
-        glDeleteBuffers(1, &_vbo_normal_vectors);
         glDeleteBuffers(1, &_vbo_uv);
-        glDeleteBuffers(1, &_vbo_vertices);
         glDeleteVertexArrays(1, &_vao);
     }
+    // num_vertices個の頂点を書き込めるバッファを作り、VAOの頂点属性に結び付ける
+    // 永続的にマップする領域は大きさを変えられないので、頂点数が変わった場合はバッファごと作り直す
+    void ObjectRenderer::_allocate_vertices(int num_vertices)
+    {
+        _release_vertices();
+        _num_vertices = num_vertices;
+        glBindVertexArray(_vao);
+        if (_upload_mode == VERTEX_UPLOAD_PERSISTENT) {
+            glGenBuffers(1, &_vbo_vertices[0]);
+            glBindBuffer(GL_ARRAY_BUFFER, _vbo_vertices[0]);
+            GLsizeiptr size = num_vertex_regions * 3 * (GLsizeiptr)num_vertices * sizeof(GLfloat);
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_ARRAY_BUFFER, size, nullptr, flags);
+            _mapped_vertices = static_cast<GLfloat*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags));
+        } else {
+            glGenBuffers(num_vertex_regions, _vbo_vertices);
+            for (int k = num_vertex_regions - 1; k >= 0; k--) {
+                glBindBuffer(GL_ARRAY_BUFFER, _vbo_vertices[k]);
+                glBufferData(GL_ARRAY_BUFFER, 3 * (GLsizeiptr)num_vertices * sizeof(GLfloat), nullptr, GL_STREAM_DRAW);
+            }
+        }
+        glVertexAttribPointer(_attribute_position, 3, GL_FLOAT, GL_FALSE, 0, 0);
+        glEnableVertexAttribArray(_attribute_position);
+        glBindVertexArray(0);
+    }
+    void ObjectRenderer::_release_vertices()
+    {
+        for (int k = 0; k < num_vertex_regions; k++) {
+            if (_region_fences[k] != nullptr) {
+                glDeleteSync(_region_fences[k]);
+                _region_fences[k] = nullptr;
+            }
+            _region_serials[k] = -1;
+        }
+        if (_mapped_vertices != nullptr) {
+            glBindBuffer(GL_ARRAY_BUFFER, _vbo_vertices[0]);
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+            _mapped_vertices = nullptr;
+        }
+        for (int k = 0; k < num_vertex_regions; k++) {
+            if (_vbo_vertices[k] != 0) {
+                glDeleteBuffers(1, &_vbo_vertices[k]);
+                _vbo_vertices[k] = 0;
+            }
+        }
+        _region_index = 0;
+    }
     void ObjectRenderer::update_faces(GLuint* faces, int num_faces)
     {
+        _num_faces = num_faces;
         glBindVertexArray(_vao);
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _vbo_faces);
         glBufferData(GL_ELEMENT_ARRAY_BUFFER, 3 * num_faces * sizeof(GLuint), faces, GL_STATIC_DRAW);
@@ -88,17 +175,54 @@ void main(){
     }
     void ObjectRenderer::update_vertices(GLfloat* vertices, int num_vertices)
     {
-        glBindVertexArray(_vao);
-        glBindBuffer(GL_ARRAY_BUFFER, _vbo_vertices);
-        glBufferData(GL_ARRAY_BUFFER, 3 * num_vertices * sizeof(GLfloat), vertices, GL_STATIC_DRAW);
-        glBindVertexArray(0);
+        update_vertices(vertices, num_vertices, 0, num_vertices - 1);
     }
-    void ObjectRenderer::update_normal_vectors(GLfloat* normal_vectors, int num_vertices)
+    void ObjectRenderer::update_vertices(GLfloat* vertices, int num_vertices, int first, int last)
     {
-        glBindVertexArray(_vao);
-        glBindBuffer(GL_ARRAY_BUFFER, _vbo_normal_vectors);
-        glBufferData(GL_ARRAY_BUFFER, 3 * num_vertices * sizeof(GLfloat), normal_vectors, GL_STATIC_DRAW);
-        glBindVertexArray(0);
+        if (_vbo_vertices[0] == 0 || num_vertices != _num_vertices) {
+            _allocate_vertices(num_vertices);
+        }
+        _vertex_history.push(first, last);
+        // 領域は3つあるので、次の領域を最後に使ったのは2回前の更新の後の描画で、通常は既に終わっている
+        int region_index = (_region_index + 1) % num_vertex_regions;
+        bool in_flight = false;
+        GLsync fence = _region_fences[region_index];
+        if (fence != nullptr) {
+            if (_upload_mode == VERTEX_UPLOAD_PERSISTENT) {
+                // 確保し直せないので終わるまで待つ
+                while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+                }
+            } else {
+                // 終わっていなければ待たずに確保し直すので、古い領域への描画は続けられる
+                in_flight = glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED;
+            }
+            glDeleteSync(fence);
+            _region_fences[region_index] = nullptr;
+        }
+        // 領域に前回書き込んだ時点から変わった範囲
+        int changed_first, changed_last;
+        bool partial = in_flight == false && _vertex_history.union_since(_region_serials[region_index], changed_first, changed_last);
+        if (partial == false) {
+            changed_first = 0;
+            changed_last = num_vertices - 1;
+        }
+        _region_serials[region_index] = _vertex_history.serial();
+        _region_index = region_index;
+        if (changed_first > changed_last) {
+            return;
+        }
+        GLintptr offset = 3 * (GLintptr)changed_first * sizeof(GLfloat);
+        GLsizeiptr size = 3 * (GLsizeiptr)(changed_last - changed_first + 1) * sizeof(GLfloat);
+        if (_upload_mode == VERTEX_UPLOAD_PERSISTENT) {
+            std::memcpy(_mapped_vertices + region_index * 3 * (size_t)num_vertices + 3 * (size_t)changed_first, vertices + 3 * (size_t)changed_first, size);
+            return;
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, _vbo_vertices[region_index]);
+        if (partial == false) {
+            glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_STREAM_DRAW);
+        }
+        glBufferSubData(GL_ARRAY_BUFFER, offset, size, vertices + 3 * (size_t)changed_first);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
     }
     void ObjectRenderer::render(GLfloat aspect_ratio)
     {
@@ -115,12 +239,27 @@ void main(){
         glUniformMatrix4fv(_uniform_pvm_mat, 1, GL_FALSE, &pvm[0][0]);
         glUniformMatrix4fv(_uniform_light_mat, 1, GL_FALSE, &_light_mat[0][0]);
 
-        // glDrawElements(GL_TRIANGLES, 3 * _num_faces, GL_UNSIGNED_INT, 0);
-        glDrawArrays(GL_TRIANGLES, 0, 3 * _num_faces);
+        // 最後に書き込んだ領域の頂点を使う
+        if (_upload_mode == VERTEX_UPLOAD_PERSISTENT) {
+            glDrawElementsBaseVertex(GL_TRIANGLES, 3 * _num_faces, GL_UNSIGNED_INT, 0, _region_index * _num_vertices);
+        } else {
+            glBindBuffer(GL_ARRAY_BUFFER, _vbo_vertices[_region_index]);
+            glVertexAttribPointer(_attribute_position, 3, GL_FLOAT, GL_FALSE, 0, 0);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            glDrawElements(GL_TRIANGLES, 3 * _num_faces, GL_UNSIGNED_INT, 0);
+        }
+        if (_region_fences[_region_index] != nullptr) {
+            glDeleteSync(_region_fences[_region_index]);
+        }
+        _region_fences[_region_index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 
         glBindVertexArray(0);
         glUseProgram(0);
     }
+    VertexUploadMode ObjectRenderer::upload_mode()
+    {
+        return _upload_mode;
+    }
     void ObjectRenderer::zoom_in()
     {
         _camera_location = _camera_location + glm::vec3(0.0, 0.0, 0.1);
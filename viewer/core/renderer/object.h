@@ -1,4 +1,5 @@
 #pragma once
+#include "../dirty_span.h"
 #include <gl3w/gl3w.h>
 #include <glfw/glfw3.h>
 #include <glm/glm.hpp>
@@ -6,31 +7,57 @@
 
 namespace viewer {
 namespace renderer {
+    // 頂点の転送方法
+    // VERTEX_UPLOAD_ORPHAN: 3つのバッファを順に使い、glBufferSubDataで書き込む
+    //                       書き込むバッファを最後に使った描画がフェンスで終わっていれば変わった範囲だけを書き込み、
+    //                       終わっていなければGL_STREAM_DRAWの領域を確保し直して（orphaning）全体を書き込む
+    //                       どちらの場合も描画中の領域には書き込まないので、描画の完了を待たない
+    // VERTEX_UPLOAD_PERSISTENT: 3つ分の領域を持つバッファを永続的にマップし、順に書き込む
+    //                           書き込む領域を最後に使った描画はフェンスで完了を確認する（GL 4.4かGL_ARB_buffer_storageが必要）
+    // VERTEX_UPLOAD_AUTO: 使えればVERTEX_UPLOAD_PERSISTENT、なければVERTEX_UPLOAD_ORPHAN
+    enum VertexUploadMode {
+        VERTEX_UPLOAD_AUTO,
+        VERTEX_UPLOAD_ORPHAN,
+        VERTEX_UPLOAD_PERSISTENT,
+    };
     class ObjectRenderer {
     private:
+        static const int num_vertex_regions = 3;
         GLuint _program;
         GLuint _attribute_position;
-        GLuint _attribute_normal_vector;
         GLuint _uniform_pvm_mat;
         GLuint _uniform_light_mat;
         GLuint _vao;
-        GLuint _vbo_vertices;
-        GLuint _vbo_normal_vectors;
+        // VERTEX_UPLOAD_PERSISTENTでは先頭の1つに全ての領域を置き、VERTEX_UPLOAD_ORPHANでは領域ごとに1つ使う
+        GLuint _vbo_vertices[num_vertex_regions];
         GLuint _vbo_faces;
         GLuint _vbo_uv;
+        VertexUploadMode _upload_mode;
+        GLfloat* _mapped_vertices;
+        GLsync _region_fences[num_vertex_regions];
+        // 各領域がどの更新の時点の頂点を持っているか（一度も書いていなければ-1）
+        int _region_serials[num_vertex_regions];
+        int _region_index;
+        DirtySpanHistory _vertex_history;
+        int _num_vertices;
         int _num_faces;
         glm::mat4 _view_mat;
         glm::mat4 _model_mat;
         glm::mat4 _light_mat;
         glm::vec3 _camera_location;
+        void _allocate_vertices(int num_vertices);
+        void _release_vertices();
 
     public:
-        ObjectRenderer(GLfloat* vertices, int num_vertices, GLuint* faces, int num_faces);
+        ObjectRenderer(GLfloat* vertices, int num_vertices, GLuint* faces, int num_faces, VertexUploadMode upload_mode = VERTEX_UPLOAD_AUTO);
         ~ObjectRenderer();
         void update_faces(GLuint* faces, int num_faces);
         void update_vertices(GLfloat* vertices, int num_vertices);
-        void update_normal_vectors(GLfloat* normal_vectors, int num_vertices);
+        // 前回の更新から変わった頂点が[first, last]の範囲だけの場合
+        // 転送は書き込む領域に前回書き込んだ時点からの範囲だけになる
+        void update_vertices(GLfloat* vertices, int num_vertices, int first, int last);
         void render(GLfloat aspect_ratio);
+        VertexUploadMode upload_mode();
         void zoom_in();
         void zoom_out();
         void rotate_camera(double diff_x, double diff_y);
@@ -17,7 +17,7 @@ namespace view {
     }
     void ImageView::render(double aspect_ratio)
     {
-        if (_data->updated()) {
+        if (_data->fetch()) {
             _bind_data();
         }
         _renderer->render(aspect_ratio);
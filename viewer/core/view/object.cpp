@@ -9,30 +9,36 @@ namespace view {
         : View(x, y, width, height)
     {
         _data = data;
-        _renderer = std::make_unique<renderer::ObjectRenderer>(data->extracted_vertices(), data->num_extracted_vertices(), data->faces(), data->num_faces());
+        _data->fetch();
+        _renderer = std::make_unique<renderer::ObjectRenderer>(data->vertices(), data->num_vertices(), data->faces(), data->num_faces());
+        _faces_version = data->faces_version();
+        _serial = data->serial();
     }
+    // 前回転送した時点から変わった頂点だけを転送する
     void ObjectView::_bind_vertices()
     {
-        _renderer->update_vertices(_data->extracted_vertices(), _data->num_extracted_vertices());
+        int first, last;
+        if (_data->changed_vertices(_serial, first, last)) {
+            _renderer->update_vertices(_data->vertices(), _data->num_vertices(), first, last);
+        } else {
+            _renderer->update_vertices(_data->vertices(), _data->num_vertices());
+        }
+        _serial = _data->serial();
     }
     void ObjectView::_bind_faces()
     {
         _renderer->update_faces(_data->faces(), _data->num_faces());
-    }
-    void ObjectView::_bind_normal_vectors()
-    {
-        _renderer->update_normal_vectors(_data->normal_vectors(), _data->num_extracted_vertices());
+        _faces_version = _data->faces_version();
     }
     void ObjectView::render(double aspect_ratio)
     {
-        if (_data->vertices_updated()) {
+        // 受け取ったフレームは全体が書き終わっているので、変わった頂点をまとめて転送する
+        // 面は変わった場合だけ転送する
+        if (_data->fetch()) {
             _bind_vertices();
-        }
-        if (_data->faces_updated()) {
-            _bind_faces();
-        }
-        if (_data->normal_vector_updated()) {
-            _bind_normal_vectors();
+            if (_data->faces_version() != _faces_version) {
+                _bind_faces();
+            }
         }
         _renderer->render(aspect_ratio);
     }
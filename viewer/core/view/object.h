@@ -13,9 +13,10 @@ namespace view {
     private:
         data::ObjectData* _data;
         std::unique_ptr<renderer::ObjectRenderer> _renderer;
+        int _faces_version;
+        int _serial;
         void _bind_vertices();
         void _bind_faces();
-        void _bind_normal_vectors();
 
     public:
         ObjectView(data::ObjectData* data, double x, double y, double width, double height);
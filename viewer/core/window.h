@@ -3,6 +3,7 @@
 #include "view/image.h"
 #include "view/object.h"
 #include <gl3w/gl3w.h>
+#include <atomic>
 #include <glfw/glfw3.h>
 #include <iostream>
 #include <thread>
@@ -22,7 +23,7 @@ protected:
     Figure* _figure;
     std::vector<std::unique_ptr<view::ImageView>> _images;
     std::vector<std::unique_ptr<view::ObjectView>> _objects;
-    bool _closed;
+    std::atomic<bool> _closed;
     Mouse _mouse;
     void _run();
     void _render_view(View* view);
@@ -1,6 +1,7 @@
 #include "../core/data/image.h"
 #include "../core/data/object.h"
 #include "../core/figure.h"
+#include "../core/offscreen_window.h"
 #include "../core/view/image.h"
 #include "../core/window.h"
 #include <pybind11/pybind11.h>
@@ -16,7 +17,7 @@ PYBIND11_MODULE(viewer, module)
 
     py::class_<data::ObjectData>(module, "ObjectData")
         .def(py::init<pybind11::array_t<GLfloat>, int, pybind11::array_t<GLuint>, int>(), py::arg("vertices"), py::arg("num_vertices"), py::arg("faces"), py::arg("num_faces"))
-        .def("update_vertices", &data::ObjectData::update_vertices)
+        .def("update_vertices", &data::ObjectData::update_vertices, py::arg("vertices"), py::arg("threshold") = 0.0f)
         .def("update_faces", &data::ObjectData::update_faces);
 
     py::class_<Figure>(module, "Figure")
@@ -28,4 +29,13 @@ PYBIND11_MODULE(viewer, module)
         .def(py::init<Figure*>())
         .def("closed", &Window::closed)
         .def("show", &Window::show);
+
+#ifdef __linux__
+    py::class_<OffscreenWindow>(module, "OffscreenWindow")
+        .def(py::init<Figure*, std::string, int, int, std::string>(), py::arg("figure"), py::arg("path"), py::arg("width") = 1920, py::arg("height") = 800, py::arg("format") = "png")
+        .def("closed", &OffscreenWindow::closed)
+        .def("show", &OffscreenWindow::show)
+        .def("capture", &OffscreenWindow::capture, py::call_guard<py::gil_scoped_release>())
+        .def("close", &OffscreenWindow::close, py::call_guard<py::gil_scoped_release>());
+#endif
 }
\ No newline at end of file